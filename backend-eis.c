@@ -0,0 +1,976 @@
+/*
+ * backend-eis.c — KWin EIS backend
+ *
+ * Connects to org.kde.KWin.EIS.RemoteDesktop on D-Bus, gets a libei fd,
+ * negotiates a keyboard device and sends evdev key events through it.
+ * With $LIBEI_SOCKET set (ei-type --socket) it connects to that EIS
+ * socket instead and leaves D-Bus alone, e.g. for tools/ei-soak.
+ *
+ * Every event sent stays in a log until a pong shows the server has
+ * processed it. While the device is paused (screen lock, a secure input
+ * field) new events only go to the log; on resume, and after reconnecting
+ * when the server drops us, the log is replayed from the last
+ * acknowledged position, so nothing typed in between is lost.
+ *
+ * Each key event goes out with a ping of its own, so nothing is typed
+ * twice either: the server handles messages in order and pauses between
+ * them, so the pong of every key it took before pausing arrives ahead of
+ * the pause, and the replay starts right after the last one. A frame may
+ * be sent twice, which types nothing. With MAX_PINGS out the log waits
+ * for pongs, a replay too. After a disconnect the server's state is gone
+ * with it: the key events it had not answered, at most MAX_PINGS, may
+ * come twice.
+ *
+ * Reconnecting retries with exponential backoff, so a KWin restart is
+ * ridden out. With base.standby a second connection is set up while
+ * idle and kept resumed but not emulating; when the first one drops, it
+ * takes over without a round of connectToEIS and negotiation. Its
+ * connectToEIS reply and negotiation come in through get_fd() like the
+ * main connection's events, so the daemon never waits on it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include <libei.h>
+#ifdef MINI_DBUS
+#include "dbus-mini.h"
+#else
+#include <systemd/sd-bus.h>
+#endif
+
+#include "backend.h"
+#include "flight.h"
+#include "metrics.h"
+#include "probes.h"
+
+/* libei device capabilities (bitmask, matches enum ei_device_capability) */
+#define CAP_POINTER          (1 << 0)
+#define CAP_POINTER_ABSOLUTE (1 << 1)
+#define CAP_KEYBOARD         (1 << 2)
+#define CAP_TOUCH            (1 << 3)
+#define CAP_SCROLL           (1 << 4)
+#define CAP_BUTTON           (1 << 5)
+#define CAP_ALL (CAP_POINTER | CAP_POINTER_ABSOLUTE | CAP_KEYBOARD | CAP_TOUCH | CAP_SCROLL | CAP_BUTTON)
+
+/* Log entries: an evdev code with LOG_PRESS, or LOG_FRAME */
+#define LOG_PRESS (1u << 16)
+#define LOG_FRAME (1u << 17)
+
+/* flush() stops the typing loop once this many entries are not yet
+ * acknowledged, until pongs come back or, while paused, the device does */
+#define LOG_MAX (1u << 20)
+
+/* Pings in flight: one per key event plus every eitype_sync(). With as
+ * many out, the log is not sent on until a pong comes. */
+#define MAX_PINGS 512
+
+/* How long the server may take to give us a resumed keyboard */
+#define NEGOTIATE_TIMEOUT_MS 5000
+
+/* Reconnecting: the first retry comes after RECONNECT_MIN_MS, and the
+ * wait doubles up to RECONNECT_MAX_MS. Unless told otherwise we give up
+ * after RECONNECT_TIMEOUT_MS, a KWin restart takes a few seconds. */
+#define RECONNECT_MIN_MS     100
+#define RECONNECT_MAX_MS     5000
+#define RECONNECT_TIMEOUT_MS 30000
+
+struct eis_ping {
+    struct ei_ping *ping;
+    uint64_t pos;       /* log position the pong acknowledges */
+    uint64_t cookie;    /* on_sync() cookie, 0 for a trim ping */
+    bool     stale;     /* sent before a pause: the events may have been dropped */
+};
+
+struct eis_backend {
+    struct backend base;
+#ifdef MINI_DBUS
+    struct dbus_mini *bus;
+#else
+    sd_bus *bus;
+#endif
+    struct ei *ei;
+    struct ei_device *kbd;
+
+    bool     paused;            /* nothing may be sent (paused or reconnecting) */
+    bool     lost;              /* disconnected, reconnect from flush() */
+    struct backoff retry;       /* ... since retry.start_ns */
+    uint32_t sequence;          /* for ei_device_start_emulating() */
+
+    uint32_t *log;              /* sent or waiting, not yet acknowledged */
+    size_t   log_len, log_cap;
+    size_t   sent;              /* log[0..sent) went out on this emulation,
+                                 * the rest waits for the device or a ping */
+    uint64_t log_base;          /* position of log[0] since the start */
+    uint64_t pinged;            /* position covered by the newest ping */
+
+    struct eis_ping pings[MAX_PINGS];
+    unsigned ping_head, ping_count;
+    uint64_t sync_wanted;       /* newest cookie to ping once the log is sent */
+
+    const char *socket;         /* $LIBEI_SOCKET, NULL to go through KWin */
+
+    /* base.standby: the spare connection, its keyboard resumed. It is
+     * set up from events on epfd like the main one is pumped: the
+     * connectToEIS reply, then negotiation. */
+    struct {
+#ifdef MINI_DBUS
+        uint32_t call;          /* connectToEIS serial while it is out, else 0 */
+#else
+        sd_bus_slot *call;      /* connectToEIS while it is out */
+#endif
+        struct ei *ei;
+        struct ei_device *kbd;
+        bool     ready;         /* negotiated, it can take over */
+        bool     paused;
+        uint64_t deadline_ns;   /* given up if not ready by then */
+        uint64_t retry_ns;      /* no new attempt before this */
+    } standby;
+    int epfd;                   /* both connections and a standby's D-Bus call,
+                                 * for get_fd(); -1 without standby */
+};
+
+static void send_entry(struct eis_backend *e, uint32_t ent) {
+    if (ent & LOG_FRAME)
+        ei_device_frame(e->kbd, 0);
+    else
+        ei_device_keyboard_key(e->kbd, ent & 0xffff, ent & LOG_PRESS);
+}
+
+static void send_ping(struct eis_backend *e, uint64_t cookie);
+
+/* Send the log on from sent, each key event with a ping, for as long as
+ * pings are free; then the sync wanted meanwhile */
+static void pump(struct eis_backend *e) {
+    if (e->paused) return;
+    while (e->sent < e->log_len && e->ping_count < MAX_PINGS) {
+        uint32_t ent = e->log[e->sent++];
+        send_entry(e, ent);
+        if (!(ent & LOG_FRAME)) send_ping(e, 0);
+    }
+    if (e->sync_wanted && e->sent == e->log_len && e->ping_count < MAX_PINGS) {
+        uint64_t cookie = e->sync_wanted;
+        e->sync_wanted = 0;
+        send_ping(e, cookie);
+    }
+}
+
+static void log_append(struct eis_backend *e, uint32_t ent) {
+    if (e->log_len == e->log_cap) {
+        size_t cap = e->log_cap ? e->log_cap * 2 : 1024;
+        uint32_t *log = realloc(e->log, cap * sizeof(*log));
+        if (!log) {
+            /* can't keep it for a replay, but can still send it, unless
+             * it would overtake what waits */
+            if (!e->paused && e->sent == e->log_len) send_entry(e, ent);
+            return;
+        }
+        e->log = log;
+        e->log_cap = cap;
+    }
+    e->log[e->log_len++] = ent;
+    pump(e);
+}
+
+/* The server has processed everything up to pos: forget it */
+static void log_ack(struct eis_backend *e, uint64_t pos) {
+    if (pos <= e->log_base) return;
+    size_t n = pos - e->log_base;
+    if (n > e->log_len) n = e->log_len;
+    memmove(e->log, e->log + n, (e->log_len - n) * sizeof(*e->log));
+    e->log_len -= n;
+    e->sent = e->sent > n ? e->sent - n : 0;
+    e->log_base += n;
+}
+
+static void send_ping(struct eis_backend *e, uint64_t cookie) {
+    if (e->ping_count == MAX_PINGS) {
+        /* fold into the newest ping; its ack comes a little late */
+        struct eis_ping *p = &e->pings[(e->ping_head + e->ping_count - 1) % MAX_PINGS];
+        if (cookie > p->cookie) p->cookie = cookie;
+        return;
+    }
+    struct eis_ping *p = &e->pings[(e->ping_head + e->ping_count) % MAX_PINGS];
+    p->ping = ei_new_ping(e->ei);
+    p->pos = e->log_base + e->sent;
+    p->cookie = cookie;
+    p->stale = false;
+    e->ping_count++;
+    e->pinged = p->pos;
+    ei_ping(p->ping);
+    uint64_t ns = flight_record(FL_PING, e->ping_count, p->pos);
+    PROBE2(ping, p->pos, ns);
+}
+
+/* Pongs arrive in ping order */
+static void on_pong(struct eis_backend *e, struct ei_ping *ping) {
+    if (!e->ping_count || e->pings[e->ping_head].ping != ping) {
+        DBG("pong for an unknown ping\n");
+        return;
+    }
+    struct eis_ping p = e->pings[e->ping_head];
+    e->ping_head = (e->ping_head + 1) % MAX_PINGS;
+    e->ping_count--;
+    ei_ping_unref(p.ping);
+    uint64_t ns = flight_record(FL_PONG, p.stale, p.pos);
+    PROBE3(pong, p.pos, p.stale, ns);
+
+    if (p.stale) {
+        /* the events behind it get replayed; ack them once that is done */
+        if (p.cookie > e->sync_wanted) e->sync_wanted = p.cookie;
+    } else {
+        log_ack(e, p.pos);
+        if (p.cookie && e->base.on_sync) e->base.on_sync(&e->base, p.cookie);
+    }
+    pump(e);
+}
+
+static void drop_pings(struct eis_backend *e) {
+    while (e->ping_count) {
+        struct eis_ping *p = &e->pings[e->ping_head];
+        if (p->cookie > e->sync_wanted) e->sync_wanted = p->cookie;
+        ei_ping_unref(p->ping);
+        e->ping_head = (e->ping_head + 1) % MAX_PINGS;
+        e->ping_count--;
+    }
+}
+
+static void pause_device(struct eis_backend *e) {
+    if (e->paused) return;
+    uint64_t ns = flight_record(FL_PAUSE, 0, e->log_len);
+    PROBE2(pause, e->log_len, ns);
+    METRIC_INC(pauses);
+    e->paused = true;
+    e->sent = 0;
+    e->pinged = e->log_base;    /* a stale ping covers nothing */
+    for (unsigned i = 0; i < e->ping_count; i++)
+        e->pings[(e->ping_head + i) % MAX_PINGS].stale = true;
+}
+
+/* Send everything not yet acknowledged on a fresh emulation, as fast as
+ * the pongs allow */
+static void replay_log(struct eis_backend *e) {
+    DBG("replaying %zu events\n", e->log_len);
+    flight_record(FL_REPLAY, 0, e->log_len);
+    e->paused = false;
+    e->sent = 0;
+    pump(e);
+}
+
+static void update_mods(struct eis_backend *e, struct ei_event *ev) {
+    struct backend *b = &e->base;
+    uint32_t group = ei_event_keyboard_get_xkb_group(ev);
+    if (group && (!b->mods_known || group != b->mods.group))
+        fprintf(stderr, "ei-type: layout group %u is active, text is typed for group 0\n", group);
+
+    b->mods.depressed = ei_event_keyboard_get_xkb_mods_depressed(ev);
+    b->mods.latched   = ei_event_keyboard_get_xkb_mods_latched(ev);
+    b->mods.locked    = ei_event_keyboard_get_xkb_mods_locked(ev);
+    b->mods.group     = group;
+    b->mods_known = true;
+    flight_record(FL_MODS, (b->mods.depressed & 0xff) | (b->mods.latched & 0xff) << 8 |
+                  (b->mods.locked & 0xff) << 16, group);
+    DBG("modifiers: depressed=%#x latched=%#x locked=%#x group=%u\n",
+        b->mods.depressed, b->mods.latched, b->mods.locked, group);
+}
+
+/* With MAX_PINGS out, hold the typing loop until the log is sent:
+ * keys typed faster than the server answers wait in the engine, not in
+ * the log */
+static bool eis_busy(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    return e->ping_count == MAX_PINGS && !e->paused && !b->dead;
+}
+
+static void eis_key(struct backend *b, uint32_t code, bool press) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    log_append(e, code | (press ? LOG_PRESS : 0));
+}
+
+static void eis_frame(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    log_append(e, LOG_FRAME);
+}
+
+static bool reconnect(struct eis_backend *e);
+
+static void close_standby(struct eis_backend *e);
+static void process_standby(struct eis_backend *e);
+
+static void process_events(struct eis_backend *e) {
+    if (e->standby.call || e->standby.ei) process_standby(e);
+    if (!e->ei) return;     /* between reconnect attempts */
+    ei_dispatch(e->ei);
+
+    struct ei_event *ev;
+    while ((ev = ei_get_event(e->ei)) != NULL) {
+        switch (ei_event_get_type(ev)) {
+        case EI_EVENT_PONG:
+            on_pong(e, ei_event_pong_get_ping(ev));
+            break;
+        case EI_EVENT_DEVICE_PAUSED:
+            if (ei_event_get_device(ev) == e->kbd) {
+                DBG("device paused, buffering keys\n");
+                pause_device(e);
+            }
+            break;
+        case EI_EVENT_DEVICE_RESUMED:
+            if (ei_event_get_device(ev) == e->kbd && e->paused) {
+                DBG("device resumed\n");
+                ei_device_start_emulating(e->kbd, ++e->sequence);
+                uint64_t ns = flight_record(FL_RESUME, e->sequence, 0);
+                PROBE2(resume, e->sequence, ns);
+                replay_log(e);
+            }
+            break;
+        case EI_EVENT_KEYBOARD_MODIFIERS:
+            if (ei_event_get_device(ev) == e->kbd) update_mods(e, ev);
+            break;
+        case EI_EVENT_DEVICE_REMOVED:
+            if (ei_event_get_device(ev) != e->kbd) break;
+            /* fall through */
+        case EI_EVENT_DISCONNECT:
+            fprintf(stderr, "ei-type: disconnected by EIS, reconnecting\n");
+            flight_record(FL_DISCONNECT, 0, 0);
+            pause_device(e);
+            e->lost = true;
+            backoff_start(&e->retry, RECONNECT_MIN_MS, RECONNECT_MAX_MS,
+                          e->base.reconnect_timeout_ms);
+            e->base.retry_ns = e->retry.next_ns;
+            break;
+        default:
+            DBG("event: %d\n", ei_event_get_type(ev));
+            break;
+        }
+        ei_event_unref(ev);
+        if (e->lost) break;
+    }
+}
+
+/* With a standby, an epoll fd over both connections: it has to be
+ * answered too */
+static int eis_get_fd(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    if (e->epfd >= 0) return e->epfd;
+    return e->ei ? ei_get_fd(e->ei) : -1;
+}
+
+static void eis_flush(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    process_events(e);
+
+    /* Keys typed faster than the server acknowledges them, or while
+     * paused, pile up; past LOG_MAX, hold the typing loop here until it
+     * catches up or the device is back */
+    while (!b->dead && !g_quit && (e->lost || e->log_len >= LOG_MAX)) {
+        if (e->lost) {
+            if (now_ns() < e->retry.next_ns) {
+                if (b->reconnect_async) return;
+                clock_sleep_until(e->retry.next_ns);   /* a signal cuts it short, then g_quit says why */
+                continue;
+            }
+            if (!reconnect(e) && b->dead) {
+                flight_error(ECONNRESET);
+                return;
+            }
+            continue;
+        }
+        if (!e->paused && e->pinged < e->log_base + e->sent)
+            send_ping(e, 0);
+        struct pollfd pfd = { .fd = eis_get_fd(b), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+        process_events(e);
+    }
+
+    /* Key events have their pings; one per flush covers the frames
+     * after the last, so the log empties */
+    if (!e->paused && e->pinged < e->log_base + e->sent)
+        send_ping(e, 0);
+}
+
+/* Round trip through the server: the pong comes back after every event
+ * sent before the ping has been processed. While paused, or while part
+ * of the log waits for pings, the ack has to wait for the rest. */
+static void eis_sync(struct backend *b, uint64_t cookie) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    if (cookie > e->sync_wanted) e->sync_wanted = cookie;
+    pump(e);
+}
+
+static void disconnect(struct eis_backend *e) {
+    drop_pings(e);
+    if (e->kbd) ei_device_unref(e->kbd);
+    if (e->ei)  ei_unref(e->ei);
+    e->kbd = NULL;
+    e->ei = NULL;
+}
+
+/* Wait until the server has everything, through a pause if need be */
+static void drain(struct eis_backend *e) {
+    if (e->paused && e->log_len)
+        fprintf(stderr, "ei-type: device paused, waiting for it to finish typing\n");
+    while (e->log_len && !e->base.dead && !g_quit) {
+        eis_flush(&e->base);
+        /* still lost, flush() gave up for now: there is no connection */
+        if (!e->log_len || e->base.dead || e->lost) break;
+        struct pollfd pfd = { .fd = eis_get_fd(&e->base), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+    }
+}
+
+static void eis_destroy(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    if (e->ei && !b->dead) drain(e);
+    disconnect(e);
+    close_standby(e);
+    if (e->epfd >= 0) close(e->epfd);
+#ifdef MINI_DBUS
+    dbus_mini_close(e->bus);
+#else
+    if (e->bus) sd_bus_unref(e->bus);
+#endif
+    free(e->log);
+    free(e);
+}
+
+#ifdef MINI_DBUS
+/* Call connectToEIS and return the EIS fd, or -1 */
+static int connect_kwin_eis(struct dbus_mini *bus) {
+    int fd = dbus_mini_call_fd(bus,
+        "org.kde.KWin",
+        "/org/kde/KWin/EIS/RemoteDesktop",
+        "org.kde.KWin.EIS.RemoteDesktop",
+        "connectToEIS", CAP_ALL);
+    DBG("got EIS fd=%d\n", fd);
+    return fd;
+}
+#else
+/* A dup of the EIS fd in a connectToEIS reply, or -1 */
+static int reply_eis_fd(sd_bus_message *reply) {
+    int fd = -1;
+    int32_t cookie = 0;
+    int r = sd_bus_message_read(reply, "hi", &fd, &cookie);
+    if (r < 0 || fd < 0) {
+        fprintf(stderr, "ei-type: failed to read EIS fd from reply (r=%d, fd=%d)\n", r, fd);
+        return -1;
+    }
+    DBG("got EIS fd=%d cookie=%d\n", fd, cookie);
+
+    /* dup the fd — sd_bus_message_unref will close the original */
+    int eis_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    if (eis_fd < 0) {
+        fprintf(stderr, "ei-type: fcntl F_DUPFD_CLOEXEC failed: %s\n", strerror(errno));
+        return -1;
+    }
+    DBG("dup'd fd=%d -> %d\n", fd, eis_fd);
+    return eis_fd;
+}
+
+/* Call connectToEIS and return a dup of the EIS fd, or -1 */
+static int connect_kwin_eis(sd_bus *bus) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+
+    int r = sd_bus_call_method(bus,
+        "org.kde.KWin",
+        "/org/kde/KWin/EIS/RemoteDesktop",
+        "org.kde.KWin.EIS.RemoteDesktop",
+        "connectToEIS",
+        &error, &reply, "i", (int32_t)CAP_ALL);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: D-Bus connectToEIS failed: %s\n",
+                error.message ? error.message : strerror(-r));
+        sd_bus_error_free(&error);
+        return -1;
+    }
+
+    int eis_fd = reply_eis_fd(reply);
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+    return eis_fd;
+}
+#endif
+
+/* One batch of negotiation events: bind the seat, take its keyboard,
+ * and once that is resumed set *ready, emulating unless it is for the
+ * standby. False if the server will not give us one. */
+static bool negotiate_events(struct eis_backend *e, struct ei *ei, struct ei_device **kbd,
+                             bool emulate, bool *ready) {
+    bool failed = false;
+    struct ei_event *ev;
+    while ((ev = ei_get_event(ei)) != NULL) {
+        enum ei_event_type type = ei_event_get_type(ev);
+        DBG("event: %d\n", type);
+
+        switch (type) {
+        case EI_EVENT_CONNECT:
+            DBG("connected to EIS\n");
+            break;
+
+        case EI_EVENT_SEAT_ADDED: {
+            struct ei_seat *seat = ei_event_get_seat(ev);
+            DBG("seat added, checking capabilities...\n");
+            static const enum ei_device_capability all_caps[] = {
+                EI_DEVICE_CAP_KEYBOARD,
+                EI_DEVICE_CAP_POINTER,
+                EI_DEVICE_CAP_POINTER_ABSOLUTE,
+                EI_DEVICE_CAP_BUTTON,
+                EI_DEVICE_CAP_SCROLL,
+                EI_DEVICE_CAP_TOUCH,
+            };
+            bool has_kbd = false;
+            for (int c = 0; c < 6; c++) {
+                bool has = ei_seat_has_capability(seat, all_caps[c]);
+                DBG("  cap %d: %s\n", all_caps[c], has ? "yes" : "no");
+                if (all_caps[c] == EI_DEVICE_CAP_KEYBOARD) has_kbd = has;
+            }
+            if (!has_kbd) {
+                fprintf(stderr, "ei-type: seat does not have keyboard capability\n");
+                flight_error(ENODEV);
+                failed = true;
+                break;
+            }
+            /* Bind all supported capabilities (KWin provides them as a set) */
+            ei_seat_bind_capabilities(seat,
+                EI_DEVICE_CAP_KEYBOARD,
+                EI_DEVICE_CAP_POINTER,
+                EI_DEVICE_CAP_POINTER_ABSOLUTE,
+                EI_DEVICE_CAP_BUTTON,
+                EI_DEVICE_CAP_SCROLL,
+                EI_DEVICE_CAP_TOUCH,
+                NULL);
+            DBG("seat capabilities bound\n");
+            break;
+        }
+
+        case EI_EVENT_DEVICE_ADDED: {
+            struct ei_device *dev = ei_event_get_device(ev);
+            if (ei_device_has_capability(dev, EI_DEVICE_CAP_KEYBOARD)) {
+                DBG("keyboard device added\n");
+                *kbd = ei_device_ref(dev);
+            }
+            break;
+        }
+
+        case EI_EVENT_DEVICE_RESUMED:
+            if (*kbd && !*ready) {
+                DBG("device resumed%s\n", emulate ? ", starting emulation" : "");
+                if (emulate) ei_device_start_emulating(*kbd, ++e->sequence);
+                *ready = true;
+            }
+            break;
+
+        case EI_EVENT_KEYBOARD_MODIFIERS:
+            /* initial state, e.g. Caps Lock already on */
+            if (ei_event_get_device(ev) == *kbd) update_mods(e, ev);
+            break;
+
+        case EI_EVENT_DISCONNECT:
+            fprintf(stderr, "ei-type: disconnected by EIS\n");
+            flight_record(FL_DISCONNECT, 0, 0);
+            failed = true;
+            break;
+
+        default:
+            break;
+        }
+
+        ei_event_unref(ev);
+    }
+    return !failed;
+}
+
+/* Negotiate keyboard device via event loop. One poll up to the deadline
+ * per batch of events: no periodic wakeups while the server thinks. */
+static bool negotiate_keyboard(struct eis_backend *e, struct ei *ei, struct ei_device **kbd) {
+    bool ready = false, failed = false, timed_out = false;
+    uint64_t deadline = now_ns() + NEGOTIATE_TIMEOUT_MS * 1000000ull;
+
+    while (!ready && !g_quit && !failed) {
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            timed_out = true;
+            break;
+        }
+        /* on the virtual clock the server may still be a real one, in
+         * another process: time would run out before it can answer */
+        struct pollfd pfd = { .fd = ei_get_fd(ei), .events = POLLIN };
+        int pr = clock_poll(&pfd, 1, clock_is_virtual() ? CLOCK_FOREVER : deadline - now);
+        if (pr < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
+            break;
+        }
+        if (pr == 0) continue;
+
+        ei_dispatch(ei);
+        failed = !negotiate_events(e, ei, kbd, true, &ready);
+    }
+
+    if (timed_out) {
+        fprintf(stderr, "ei-type: timeout waiting for EIS events (no response in %ds)\n",
+                NEGOTIATE_TIMEOUT_MS / 1000);
+    }
+
+    return *kbd && ready;
+}
+
+/* Set up libei on eis_fd, or on $LIBEI_SOCKET with -1. On failure the
+ * caller lets go of what *ei got. */
+static bool setup_ei(struct eis_backend *e, struct ei **ei, int eis_fd) {
+    *ei = ei_new_sender(NULL);
+    if (!*ei) {
+        fprintf(stderr, "ei-type: ei_new_sender failed\n");
+        if (eis_fd >= 0) close(eis_fd);
+        return false;
+    }
+    ei_configure_name(*ei, "ei-type");
+
+    if (e->socket) {
+        int r = ei_setup_backend_socket(*ei, NULL);
+        if (r < 0) {
+            fprintf(stderr, "ei-type: cannot connect to %s: %s\n", e->socket, strerror(-r));
+            return false;
+        }
+        DBG("connected to %s, ei_get_fd=%d\n", e->socket, ei_get_fd(*ei));
+    } else {
+        int r = ei_setup_backend_fd(*ei, eis_fd);
+        if (r < 0) {
+            fprintf(stderr, "ei-type: ei_setup_backend_fd failed: %s\n", strerror(-r));
+            return false;
+        }
+        DBG("ei_setup_backend_fd ok, ei_get_fd=%d\n", ei_get_fd(*ei));
+    }
+    return true;
+}
+
+/* connectToEIS (or $LIBEI_SOCKET), set up libei on the connection and
+ * get an emulating keyboard. On failure the caller lets go of what *ei
+ * and *kbd got. */
+static bool open_connection(struct eis_backend *e, struct ei **ei, struct ei_device **kbd) {
+    int eis_fd = -1;
+    if (!e->socket) {
+        eis_fd = connect_kwin_eis(e->bus);
+        if (eis_fd < 0) return false;
+        PROBE1(dbus_done, now_ns());
+    }
+
+    if (!setup_ei(e, ei, eis_fd)) return false;
+
+    if (!negotiate_keyboard(e, *ei, kbd)) {
+        fprintf(stderr, "ei-type: failed to get keyboard device\n");
+        return false;
+    }
+    return true;
+}
+
+static bool open_eis(struct eis_backend *e) {
+    if (!open_connection(e, &e->ei, &e->kbd)) return false;
+    PROBE1(device_ready, now_ns());
+    return true;
+}
+
+static void watch(struct eis_backend *e, int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events };
+    if (e->epfd >= 0) epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void unwatch(struct eis_backend *e, int fd) {
+    if (e->epfd >= 0) epoll_ctl(e->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+#ifdef MINI_DBUS
+static int bus_fd(struct eis_backend *e) { return dbus_mini_get_fd(e->bus); }
+#else
+static int bus_fd(struct eis_backend *e) { return sd_bus_get_fd(e->bus); }
+#endif
+
+static void close_standby(struct eis_backend *e) {
+    if (e->standby.call) {
+        /* with dbus-mini a late reply is dropped by the next call */
+#ifdef MINI_DBUS
+        e->standby.call = 0;
+#else
+        e->standby.call = sd_bus_slot_unref(e->standby.call);
+#endif
+        unwatch(e, bus_fd(e));
+    }
+    if (e->standby.kbd) ei_device_unref(e->standby.kbd);
+    if (e->standby.ei)  ei_unref(e->standby.ei);
+    e->standby.kbd = NULL;
+    e->standby.ei = NULL;
+    e->standby.ready = false;
+    METRIC_SET(standby_ready, 0);
+}
+
+/* A failed attempt is not repeated for RECONNECT_MAX_MS */
+static void standby_failed(struct eis_backend *e) {
+    fprintf(stderr, "ei-type: no standby connection, trying again later\n");
+    close_standby(e);
+    e->standby.retry_ns = now_ns() + RECONNECT_MAX_MS * 1000000ull;
+}
+
+/* The standby's connection is there (eis_fd, or -1 for $LIBEI_SOCKET):
+ * watch it, its events negotiate the keyboard */
+static void start_standby(struct eis_backend *e, int eis_fd) {
+    if (!setup_ei(e, &e->standby.ei, eis_fd)) {
+        standby_failed(e);
+        return;
+    }
+    watch(e, ei_get_fd(e->standby.ei), EPOLLIN);
+}
+
+#ifdef MINI_DBUS
+static bool call_standby(struct eis_backend *e) {
+    e->standby.call = dbus_mini_send_fd_call(e->bus,
+        "org.kde.KWin",
+        "/org/kde/KWin/EIS/RemoteDesktop",
+        "org.kde.KWin.EIS.RemoteDesktop",
+        "connectToEIS", CAP_ALL);
+    if (!e->standby.call) return false;
+    watch(e, bus_fd(e), EPOLLIN);
+    return true;
+}
+
+static void take_standby_reply(struct eis_backend *e) {
+    int fd = dbus_mini_reply_fd(e->bus, e->standby.call, "connectToEIS");
+    if (fd == -EAGAIN) return;
+    DBG("got standby EIS fd=%d\n", fd);
+    e->standby.call = 0;
+    unwatch(e, bus_fd(e));
+    if (fd < 0) standby_failed(e);
+    else start_standby(e, fd);
+}
+#else
+static int on_standby_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+    struct eis_backend *e = userdata;
+    (void)ret_error;
+    e->standby.call = sd_bus_slot_unref(e->standby.call);
+    unwatch(e, bus_fd(e));
+
+    const sd_bus_error *error = sd_bus_message_get_error(reply);
+    int fd = -1;
+    if (error)
+        fprintf(stderr, "ei-type: D-Bus connectToEIS failed: %s\n",
+                error->message ? error->message : error->name);
+    else
+        fd = reply_eis_fd(reply);
+    if (fd < 0) standby_failed(e);
+    else start_standby(e, fd);
+    return 0;
+}
+
+static bool call_standby(struct eis_backend *e) {
+    int r = sd_bus_call_method_async(e->bus, &e->standby.call,
+        "org.kde.KWin",
+        "/org/kde/KWin/EIS/RemoteDesktop",
+        "org.kde.KWin.EIS.RemoteDesktop",
+        "connectToEIS",
+        on_standby_reply, e, "i", (int32_t)CAP_ALL);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: D-Bus connectToEIS failed: %s\n", strerror(-r));
+        return false;
+    }
+    /* POLLOUT too while the call has not all been written */
+    watch(e, bus_fd(e), (uint32_t)sd_bus_get_events(e->bus));
+    return true;
+}
+
+/* on_standby_reply() runs from here once the reply is in */
+static void take_standby_reply(struct eis_backend *e) {
+    int r;
+    while ((r = sd_bus_process(e->bus, NULL)) > 0) {}
+    if (r < 0) {
+        fprintf(stderr, "ei-type: D-Bus: %s\n", strerror(-r));
+        standby_failed(e);
+        return;
+    }
+    if (e->standby.call) {
+        struct epoll_event ev = { .events = (uint32_t)sd_bus_get_events(e->bus) };
+        epoll_ctl(e->epfd, EPOLL_CTL_MOD, bus_fd(e), &ev);
+    }
+}
+#endif
+
+/* Whatever came in for the standby: while it is set up, the
+ * connectToEIS reply, then negotiation events. Once ready it only has
+ * to stay alive: answer the server, note pauses, drop it when it goes. */
+static void process_standby(struct eis_backend *e) {
+    if (e->standby.call) take_standby_reply(e);
+    if (!e->standby.ei) return;
+    ei_dispatch(e->standby.ei);
+
+    if (!e->standby.ready) {
+        bool ready = false;
+        if (!negotiate_events(e, e->standby.ei, &e->standby.kbd, false, &ready)) {
+            standby_failed(e);
+        } else if (ready) {
+            e->standby.ready = true;
+            e->standby.paused = false;
+            METRIC_SET(standby_ready, 1);
+            DBG("standby connection ready\n");
+        }
+        return;
+    }
+
+    bool lost = false;
+    struct ei_event *ev;
+    while ((ev = ei_get_event(e->standby.ei)) != NULL) {
+        switch (ei_event_get_type(ev)) {
+        case EI_EVENT_DEVICE_PAUSED:
+            if (ei_event_get_device(ev) == e->standby.kbd) e->standby.paused = true;
+            break;
+        case EI_EVENT_DEVICE_RESUMED:
+            if (ei_event_get_device(ev) == e->standby.kbd) e->standby.paused = false;
+            break;
+        case EI_EVENT_DEVICE_REMOVED:
+            if (ei_event_get_device(ev) != e->standby.kbd) break;
+            /* fall through */
+        case EI_EVENT_DISCONNECT:
+            lost = true;
+            break;
+        default:
+            break;
+        }
+        ei_event_unref(ev);
+    }
+    if (lost) {
+        DBG("standby connection lost\n");
+        close_standby(e);
+    }
+}
+
+/* Called while idle: starts setting up a standby, or gives up on one the
+ * server is slow with. Nothing here waits for the server, the replies
+ * come in through get_fd() like the main connection's events. */
+static void eis_idle(struct backend *b) {
+    struct eis_backend *e = (struct eis_backend *)b;
+    if (!b->standby || b->dead || e->paused) return;
+
+    if (e->standby.call || (e->standby.ei && !e->standby.ready)) {
+        /* as in negotiate_keyboard(), the virtual clock does not count */
+        if (!clock_is_virtual() && now_ns() >= e->standby.deadline_ns) {
+            fprintf(stderr, "ei-type: standby: timeout waiting for EIS (no response in %ds)\n",
+                    NEGOTIATE_TIMEOUT_MS / 1000);
+            standby_failed(e);
+        }
+        return;
+    }
+    if (e->standby.ei || now_ns() < e->standby.retry_ns) return;
+
+    if (e->epfd < 0) {
+        e->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (e->epfd < 0) {
+            fprintf(stderr, "ei-type: no standby connection: epoll: %s\n", strerror(errno));
+            b->standby = false;
+            return;
+        }
+        watch(e, ei_get_fd(e->ei), EPOLLIN);
+    }
+    e->standby.deadline_ns = now_ns() + NEGOTIATE_TIMEOUT_MS * 1000000ull;
+    if (e->socket) start_standby(e, -1);
+    else if (!call_standby(e)) standby_failed(e);
+}
+
+/* Switch to the standby, which is resumed already */
+static bool promote_standby(struct eis_backend *e) {
+    if (e->standby.ready) process_standby(e);   /* it may be gone as well */
+    if (!e->standby.ready || e->standby.paused) return false;
+
+    disconnect(e);
+    e->ei = e->standby.ei;
+    e->kbd = e->standby.kbd;
+    e->standby.ei = NULL;
+    e->standby.kbd = NULL;
+    e->standby.ready = false;
+    METRIC_SET(standby_ready, 0);
+    METRIC_INC(standby_promotions);
+    ei_device_start_emulating(e->kbd, ++e->sequence);
+    flight_record(FL_RECONNECT, 1, 0);
+    DBG("switched to the standby connection\n");
+    return true;
+}
+
+/* One attempt at a new connection, then replay from the last
+ * acknowledged position. The standby is taken if there is one. If it
+ * fails the next attempt is scheduled with exponential backoff, and
+ * once reconnect_timeout_ms has run out the backend is dead. */
+static bool reconnect(struct eis_backend *e) {
+    bool ok = promote_standby(e);
+    if (!ok) {
+        /* a standby connectToEIS still out is dropped: the call in
+         * open_eis() waits for a reply of its own */
+        if (e->standby.call) close_standby(e);
+        disconnect(e);
+        ok = open_eis(e);
+        flight_record(FL_RECONNECT, ok, 0);
+        if (ok) watch(e, ei_get_fd(e->ei), EPOLLIN);
+    }
+    if (!ok) {
+        METRIC_INC(reconnect_failures);
+        unsigned delay_ms = e->retry.delay_ms;
+        if (!backoff_failed(&e->retry)) {
+            e->base.retry_ns = 0;
+            e->base.dead = true;
+            return false;
+        }
+        e->base.retry_ns = e->retry.next_ns;
+        fprintf(stderr, "ei-type: reconnecting failed, next attempt in %ums\n", delay_ms);
+        return false;
+    }
+    e->lost = false;
+    e->base.retry_ns = 0;
+
+    uint64_t ns = now_ns() - e->retry.start_ns;
+    metrics_observe(&g_metrics.recover_latency, ns);
+    METRIC_INC(reconnects);
+    fprintf(stderr, "ei-type: reconnected after %.1fms\n", (double)ns / 1e6);
+    replay_log(e);
+    return true;
+}
+
+struct backend *backend_eis_new(void) {
+    struct eis_backend *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->base.name    = "eis";
+    e->base.key     = eis_key;
+    e->base.frame   = eis_frame;
+    e->base.flush   = eis_flush;
+    e->base.destroy = eis_destroy;
+    e->base.get_fd  = eis_get_fd;
+    e->base.busy    = eis_busy;
+    e->base.sync    = eis_sync;
+    e->base.idle    = eis_idle;
+    e->base.reconnect_timeout_ms = RECONNECT_TIMEOUT_MS;
+    e->socket = getenv("LIBEI_SOCKET");
+    e->epfd = -1;
+
+    /* Connect to KWin EIS via D-Bus */
+#ifdef MINI_DBUS
+    if (!e->socket && !(e->bus = dbus_mini_open_session())) {
+        eis_destroy(&e->base);
+        return NULL;
+    }
+#else
+    int r = e->socket ? 0 : sd_bus_open_user(&e->bus);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: failed to connect to session bus: %s\n", strerror(-r));
+        eis_destroy(&e->base);
+        return NULL;
+    }
+#endif
+
+    if (!open_eis(e)) {
+        eis_destroy(&e->base);
+        return NULL;
+    }
+
+    return &e->base;
+}
@@ -0,0 +1,146 @@
+/*
+ * backend-uinput.c — /dev/uinput virtual keyboard backend
+ *
+ * For kiosks, TTYs and headless sessions without a compositor that speaks
+ * EIS. Creates a kernel virtual keyboard and writes evdev events to it.
+ *
+ * Events are queued in a fixed array and written with one write() per
+ * flush, each frame terminated by a single SYN_REPORT. With -d 0 the
+ * typing loop never flushes between keys, so a whole line goes out in a
+ * handful of syscalls.
+ *
+ * Needs write access to /dev/uinput (root, or a udev rule such as
+ *   KERNEL=="uinput", GROUP="input", MODE="0660", OPTIONS+="static_node=uinput"
+ * with the user in the input group).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "backend.h"
+#include "flight.h"
+#include "metrics.h"
+
+/* Time for udev/libinput to pick up the new device before the first key,
+ * and for readers to drain the last events before it disappears */
+#define UINPUT_SETTLE_US 200000
+
+/* Events per write(); a typed character is at most 4 keys + 4 SYNs */
+#define UINPUT_BATCH 256
+
+struct uinput_backend {
+    struct backend base;
+    int fd;
+    size_t nev;
+    struct input_event ev[UINPUT_BATCH];
+};
+
+static void uinput_write(struct uinput_backend *u) {
+    const char *p = (const char *)u->ev;
+    size_t left = u->nev * sizeof(u->ev[0]);
+
+    while (left > 0) {
+        ssize_t w = write(u->fd, p, left);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            flight_error(errno);
+            fprintf(stderr, "ei-type: uinput write failed: %s\n", strerror(errno));
+            break;
+        }
+        p += w;
+        left -= (size_t)w;
+        METRIC_ADD(bytes_written, (uint64_t)w);
+    }
+    u->nev = 0;
+}
+
+static void uinput_queue(struct uinput_backend *u, uint16_t type, uint16_t code, int32_t value) {
+    /* keep room for the SYN that closes the current frame */
+    if (u->nev >= UINPUT_BATCH - 1 && type != EV_SYN) uinput_write(u);
+
+    /* the kernel stamps the time itself */
+    struct input_event *ev = &u->ev[u->nev++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+static void uinput_key(struct backend *b, uint32_t code, bool press) {
+    struct uinput_backend *u = (struct uinput_backend *)b;
+    uinput_queue(u, EV_KEY, (uint16_t)code, press ? 1 : 0);
+}
+
+static void uinput_frame(struct backend *b) {
+    struct uinput_backend *u = (struct uinput_backend *)b;
+    uinput_queue(u, EV_SYN, SYN_REPORT, 0);
+}
+
+static void uinput_flush(struct backend *b) {
+    struct uinput_backend *u = (struct uinput_backend *)b;
+    if (u->nev) uinput_write(u);
+}
+
+static void uinput_destroy(struct backend *b) {
+    struct uinput_backend *u = (struct uinput_backend *)b;
+    if (u->fd >= 0) {
+        uinput_flush(b);
+        usleep(UINPUT_SETTLE_US);
+        ioctl(u->fd, UI_DEV_DESTROY);
+        close(u->fd);
+    }
+    free(u);
+}
+
+struct backend *backend_uinput_new(void) {
+    struct uinput_backend *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    u->base.name    = "uinput";
+    u->base.key     = uinput_key;
+    u->base.frame   = uinput_frame;
+    u->base.flush   = uinput_flush;
+    u->base.destroy = uinput_destroy;
+
+    u->fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+    if (u->fd < 0) {
+        fprintf(stderr, "ei-type: failed to open /dev/uinput: %s\n", strerror(errno));
+        free(u);
+        return NULL;
+    }
+
+    /* Advertise the whole main keyboard block so --key can use any code */
+    int r = ioctl(u->fd, UI_SET_EVBIT, EV_KEY);
+    if (r == 0) r = ioctl(u->fd, UI_SET_EVBIT, EV_SYN);
+    for (int k = 1; r == 0 && k < 256; k++) {
+        r = ioctl(u->fd, UI_SET_KEYBIT, k);
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor  = 0x1;
+    setup.id.product = 0x1;
+    setup.id.version = 1;
+    snprintf(setup.name, sizeof(setup.name), "ei-type virtual keyboard");
+
+    if (r == 0) r = ioctl(u->fd, UI_DEV_SETUP, &setup);
+    if (r == 0) r = ioctl(u->fd, UI_DEV_CREATE);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: failed to create uinput device: %s\n", strerror(errno));
+        close(u->fd);
+        free(u);
+        return NULL;
+    }
+
+    DBG("uinput device created, waiting %d ms for it to settle\n", UINPUT_SETTLE_US / 1000);
+    usleep(UINPUT_SETTLE_US);
+
+    return &u->base;
+}
@@ -0,0 +1,444 @@
+/*
+ * backend-vk.c — zwp_virtual_keyboard_v1 backend (wlroots compositors)
+ *
+ * For compositors without EIS (sway, river, labwc, ...). Instead of relying
+ * on the compositor's layout we upload our own XKB keymap:
+ *
+ *   - a fixed US section at the usual evdev codes (the keysyms column of
+ *     keys.def), so --key combos and the modifier keys behave like on a
+ *     real keyboard: the compositor does not derive modifier state from
+ *     our key events, so vk_key sends it along with every modifier key,
+ *     and
+ *   - a dynamic section where every character of the pending text gets a
+ *     keycode of its own, so any Unicode character is a single key press
+ *     with no Shift and no compose sequence.
+ *
+ * The keymap is only regenerated and re-uploaded when text contains a
+ * character that has no slot yet. When the slots run out they are all
+ * recycled for the text at hand.
+ *
+ * Runs without a GPU under a headless wlroots session:
+ *   WLR_BACKENDS=headless WLR_RENDERER=pixman WLR_LIBINPUT_NO_DEVICES=1 sway &
+ *   echo "naïve café ✓" | WAYLAND_DISPLAY=wayland-1 ei-type --backend vk
+ * tests/vk-sway.sh (make check-vk) does that with a terminal as the client
+ * and checks what it received.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include <wayland-client.h>
+#include "virtual-keyboard-unstable-v1-client-protocol.h"
+
+#include "backend.h"
+#include "flight.h"
+
+/* evdev codes 1..247 map to XKB keycodes 9..255 */
+#define VK_MAX_CODE 247
+
+/* Modifier keys of the fixed section, the real modifier they set and its
+ * bit in the masks sent with zwp_virtual_keyboard_v1_modifiers (real
+ * modifiers come first in an xkb keymap, Shift to Mod5) */
+static const struct {
+    uint32_t code;
+    const char *mod;
+    uint32_t mask;
+} vk_modmap[] = {
+    { KEY_LEFTSHIFT,  "Shift",   1u << 0 },
+    { KEY_RIGHTSHIFT, "Shift",   1u << 0 },
+    { KEY_CAPSLOCK,   "Lock",    1u << 1 },
+    { KEY_LEFTCTRL,   "Control", 1u << 2 },
+    { KEY_RIGHTCTRL,  "Control", 1u << 2 },
+    { KEY_LEFTALT,    "Mod1",    1u << 3 },
+    { KEY_RIGHTALT,   "Mod1",    1u << 3 },
+    { KEY_NUMLOCK,    "Mod2",    1u << 4 },
+    { KEY_LEFTMETA,   "Mod4",    1u << 6 },
+    { KEY_RIGHTMETA,  "Mod4",    1u << 6 },
+};
+#define VK_NMODS (sizeof(vk_modmap) / sizeof(vk_modmap[0]))
+
+struct vk_backend {
+    struct backend base;
+    struct wl_display *display;
+    struct wl_registry *registry;
+    struct wl_seat *seat;
+    struct zwp_virtual_keyboard_manager_v1 *manager;
+    struct zwp_virtual_keyboard_v1 *vk;
+
+    /* slot_cp[code] is the codepoint assigned to a dynamic evdev code,
+     * 0 if the code is free; fixed[code] marks codes owned by keytab_syms */
+    uint32_t slot_cp[VK_MAX_CODE + 1];
+    bool     fixed[VK_MAX_CODE + 1];
+    int      nslots;
+    int      nfree;
+    unsigned uploads;
+
+    /* Which vk_modmap keys are held down, and the bits Caps and Num Lock
+     * have toggled on (see vk_key) */
+    bool     mod_down[VK_NMODS];
+    uint32_t locked;
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+                            uint32_t name, const char *interface, uint32_t version) {
+    struct vk_backend *v = data;
+    (void)version;
+    if (strcmp(interface, "wl_seat") == 0 && !v->seat) {
+        v->seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+    } else if (strcmp(interface, "zwp_virtual_keyboard_manager_v1") == 0) {
+        v->manager = wl_registry_bind(registry, name,
+                                      &zwp_virtual_keyboard_manager_v1_interface, 1);
+    }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry, uint32_t name) {
+    (void)data; (void)registry; (void)name;
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+/* XKB keysym name for a codepoint; "U%04X" covers everything printable */
+static void keysym_name(uint32_t cp, char *buf, size_t len) {
+    switch (cp) {
+        case '\n': snprintf(buf, len, "Return");    return;
+        case '\t': snprintf(buf, len, "Tab");       return;
+        case '\b': snprintf(buf, len, "BackSpace"); return;
+        case ' ':  snprintf(buf, len, "space");     return;
+    }
+    snprintf(buf, len, "U%04X", cp);
+}
+
+static bool vk_typeable(uint32_t cp) {
+    if (cp == '\n' || cp == '\t' || cp == '\b') return true;
+    if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) return false;
+    if (cp >= 0xd800 && cp <= 0xdfff) return false;
+    return cp <= 0x10ffff;
+}
+
+static void send_modifiers(struct vk_backend *v) {
+    uint32_t depressed = 0;
+    for (size_t i = 0; i < VK_NMODS; i++) {
+        if (v->mod_down[i]) depressed |= vk_modmap[i].mask;
+    }
+    zwp_virtual_keyboard_v1_modifiers(v->vk, depressed, 0, v->locked, 0);
+}
+
+static int upload_keymap(struct vk_backend *v) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (!f) return -errno;
+
+    fprintf(f, "xkb_keymap {\n");
+    fprintf(f, "xkb_keycodes \"ei-type\" {\n  minimum = 8;\n  maximum = 255;\n");
+    for (uint32_t c = 1; c <= VK_MAX_CODE; c++) {
+        if (v->fixed[c] || v->slot_cp[c])
+            fprintf(f, "  <K%03u> = %u;\n", c, c + 8);
+    }
+    fprintf(f, "};\n");
+    fprintf(f, "xkb_types \"ei-type\" { include \"complete\" };\n");
+    fprintf(f, "xkb_compatibility \"ei-type\" { include \"complete\" };\n");
+    fprintf(f, "xkb_symbols \"ei-type\" {\n");
+    for (size_t i = 0; i < KEYTAB_NSYMS; i++) {
+        fprintf(f, "  key <K%03u> { [ %s ] };\n", keytab_syms[i].code, keytab_syms[i].syms);
+    }
+    for (uint32_t c = 1; c <= VK_MAX_CODE; c++) {
+        if (!v->slot_cp[c]) continue;
+        char sym[16];
+        keysym_name(v->slot_cp[c], sym, sizeof(sym));
+        fprintf(f, "  key <K%03u> { [ %s ] };\n", c, sym);
+    }
+    for (size_t i = 0; i < VK_NMODS; i++) {
+        fprintf(f, "  modifier_map %s { <K%03u> };\n", vk_modmap[i].mod, vk_modmap[i].code);
+    }
+    fprintf(f, "};\n};\n");
+    if (fclose(f) != 0) {
+        free(text);
+        return -ENOMEM;
+    }
+
+    /* the compositor maps size bytes, including the terminating NUL */
+    int fd = memfd_create("ei-type-keymap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        int err = errno;
+        free(text);
+        return -err;
+    }
+    size_t size = len + 1;
+    ssize_t w = write(fd, text, size);
+    free(text);
+    if (w < 0 || (size_t)w != size) {
+        close(fd);
+        return -EIO;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    zwp_virtual_keyboard_v1_keymap(v->vk, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1, fd, (uint32_t)size);
+    /* a new keymap starts out with no modifiers; keep any still held */
+    if (v->uploads > 0) send_modifiers(v);
+    wl_display_flush(v->display);
+    close(fd);
+
+    v->uploads++;
+    DBG("vk: uploaded keymap #%u (%d/%d dynamic slots used, %zu bytes)\n",
+        v->uploads, v->nslots - v->nfree, v->nslots, size);
+    return 0;
+}
+
+static uint32_t slot_lookup(struct vk_backend *v, uint32_t cp) {
+    for (uint32_t c = 1; c <= VK_MAX_CODE; c++) {
+        if (v->slot_cp[c] == cp) return c;
+    }
+    return 0;
+}
+
+static uint32_t slot_assign(struct vk_backend *v, uint32_t cp) {
+    for (uint32_t c = 1; c <= VK_MAX_CODE; c++) {
+        if (!v->fixed[c] && !v->slot_cp[c]) {
+            v->slot_cp[c] = cp;
+            v->nfree--;
+            return c;
+        }
+    }
+    return 0;
+}
+
+static void slots_reset(struct vk_backend *v) {
+    memset(v->slot_cp, 0, sizeof(v->slot_cp));
+    v->nfree = v->nslots;
+}
+
+/* Count the codepoints in cps[0..n) that do not have a slot yet */
+static int count_missing(struct vk_backend *v, const uint32_t *cps, size_t n) {
+    int missing = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!vk_typeable(cps[i]) || slot_lookup(v, cps[i])) continue;
+        bool dup = false;
+        for (size_t j = 0; j < i; j++) {
+            if (cps[j] == cps[i]) { dup = true; break; }
+        }
+        if (!dup) missing++;
+    }
+    return missing;
+}
+
+static int vk_prepare(struct backend *b, const uint32_t *cps, size_t n) {
+    struct vk_backend *v = (struct vk_backend *)b;
+
+    int missing = count_missing(v, cps, n);
+    if (missing == 0) return 0;
+
+    /* Recycle every slot rather than evicting piecemeal: the new keymap
+     * then holds exactly what this text needs */
+    if (missing > v->nfree) slots_reset(v);
+
+    for (size_t i = 0; i < n && v->nfree > 0; i++) {
+        if (vk_typeable(cps[i]) && !slot_lookup(v, cps[i]))
+            slot_assign(v, cps[i]);
+    }
+    return upload_keymap(v);
+}
+
+static bool vk_map_char(struct backend *b, uint32_t cp, struct keyinfo *out) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    if (!vk_typeable(cp)) return false;
+
+    uint32_t code = slot_lookup(v, cp);
+    if (!code) {
+        /* Text longer than the slot table: make room for this one */
+        if (v->nfree == 0) slots_reset(v);
+        code = slot_assign(v, cp);
+        if (!code || upload_keymap(v) < 0) return false;
+    }
+    out->code = code;
+    out->shift = false;
+    return true;
+}
+
+static uint32_t now_ms(void) {
+    return (uint32_t)(now_ns() / 1000000);
+}
+
+/* The compositor forwards our key events without running them through
+ * the keymap, so the modifier state clients see only changes when we
+ * say so: track it here and send it with every modifier key */
+static void vk_key(struct backend *b, uint32_t code, bool press) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    zwp_virtual_keyboard_v1_key(v->vk, now_ms(), code,
+        press ? WL_KEYBOARD_KEY_STATE_PRESSED : WL_KEYBOARD_KEY_STATE_RELEASED);
+
+    size_t m = 0;
+    while (m < VK_NMODS && vk_modmap[m].code != code) m++;
+    if (m == VK_NMODS) return;
+    v->mod_down[m] = press;
+    if (press && (code == KEY_CAPSLOCK || code == KEY_NUMLOCK)) v->locked ^= vk_modmap[m].mask;
+    send_modifiers(v);
+}
+
+/* Virtual keyboard events carry no frame; they go out on flush */
+static void vk_frame(struct backend *b) {
+    (void)b;
+}
+
+/* Send queued requests and process whatever the compositor has sent.
+ * Only blocks while the socket is full: with -d 0 and a lot of text the
+ * requests outrun the compositor, and libwayland's buffer would fill up
+ * and abort the connection if we kept queueing without draining it. */
+static void vk_flush(struct backend *b) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    int fd = wl_display_get_fd(v->display);
+
+    if (b->dead) return;
+    while (wl_display_prepare_read(v->display) != 0) {
+        if (wl_display_dispatch_pending(v->display) < 0) goto lost;
+    }
+    while (wl_display_flush(v->display) < 0) {
+        struct pollfd out = { .fd = fd, .events = POLLOUT };
+        if (errno != EAGAIN ||
+            (poll(&out, 1, -1) < 0 && errno != EINTR) ||
+            (out.revents & (POLLERR | POLLHUP))) {
+            wl_display_cancel_read(v->display);
+            goto lost;
+        }
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) > 0) {
+        wl_display_read_events(v->display);
+    } else {
+        wl_display_cancel_read(v->display);
+    }
+    if (wl_display_dispatch_pending(v->display) >= 0) return;
+
+lost:
+    fprintf(stderr, "ei-type: lost Wayland connection: %s\n",
+            strerror(wl_display_get_error(v->display)));
+    flight_error(wl_display_get_error(v->display));
+    b->dead = true;
+}
+
+static int vk_get_fd(struct backend *b) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    return wl_display_get_fd(v->display);
+}
+
+struct vk_sync {
+    struct backend *b;
+    uint64_t cookie;
+};
+
+static void sync_done(void *data, struct wl_callback *cb, uint32_t serial) {
+    struct vk_sync *s = data;
+    (void)serial;
+    wl_callback_destroy(cb);
+    if (s->b->on_sync) s->b->on_sync(s->b, s->cookie);
+    free(s);
+}
+
+static const struct wl_callback_listener sync_listener = {
+    .done = sync_done,
+};
+
+/* wl_display.sync is answered after every earlier request was handled */
+static void vk_sync(struct backend *b, uint64_t cookie) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    struct vk_sync *s = malloc(sizeof(*s));
+    if (!s) {
+        /* cannot wait for it; report on flush like backends without acks */
+        wl_display_flush(v->display);
+        if (b->on_sync) b->on_sync(b, cookie);
+        return;
+    }
+    s->b = b;
+    s->cookie = cookie;
+    wl_callback_add_listener(wl_display_sync(v->display), &sync_listener, s);
+    wl_display_flush(v->display);
+}
+
+static void vk_destroy(struct backend *b) {
+    struct vk_backend *v = (struct vk_backend *)b;
+    if (v->vk) {
+        zwp_virtual_keyboard_v1_destroy(v->vk);
+        /* make sure every key event reached the compositor before we go */
+        wl_display_roundtrip(v->display);
+    }
+    if (v->manager)  zwp_virtual_keyboard_manager_v1_destroy(v->manager);
+    if (v->seat)     wl_seat_destroy(v->seat);
+    if (v->registry) wl_registry_destroy(v->registry);
+    if (v->display)  wl_display_disconnect(v->display);
+    free(v);
+}
+
+struct backend *backend_vk_new(void) {
+    struct vk_backend *v = calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    v->base.name     = "vk";
+    v->base.prepare  = vk_prepare;
+    v->base.map_char = vk_map_char;
+    v->base.key      = vk_key;
+    v->base.frame    = vk_frame;
+    v->base.flush    = vk_flush;
+    v->base.destroy  = vk_destroy;
+    v->base.get_fd   = vk_get_fd;
+    v->base.sync     = vk_sync;
+
+    for (size_t i = 0; i < KEYTAB_NSYMS; i++) {
+        v->fixed[keytab_syms[i].code] = true;
+    }
+    /* code 0 is KEY_RESERVED and never a slot */
+    for (uint32_t c = 1; c <= VK_MAX_CODE; c++) {
+        if (!v->fixed[c]) v->nslots++;
+    }
+    v->nfree = v->nslots;
+
+    v->display = wl_display_connect(NULL);
+    if (!v->display) {
+        fprintf(stderr, "ei-type: failed to connect to Wayland display\n");
+        vk_destroy(&v->base);
+        return NULL;
+    }
+
+    v->registry = wl_display_get_registry(v->display);
+    wl_registry_add_listener(v->registry, &registry_listener, v);
+    wl_display_roundtrip(v->display);
+
+    if (!v->manager) {
+        fprintf(stderr, "ei-type: compositor does not support zwp_virtual_keyboard_manager_v1\n");
+        vk_destroy(&v->base);
+        return NULL;
+    }
+    if (!v->seat) {
+        fprintf(stderr, "ei-type: no wl_seat found\n");
+        vk_destroy(&v->base);
+        return NULL;
+    }
+
+    v->vk = zwp_virtual_keyboard_manager_v1_create_virtual_keyboard(v->manager, v->seat);
+
+    /* A keymap must be in place before the first key event */
+    int r = upload_keymap(v);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: failed to upload keymap: %s\n", strerror(-r));
+        vk_destroy(&v->base);
+        return NULL;
+    }
+    if (wl_display_roundtrip(v->display) < 0) {
+        fprintf(stderr, "ei-type: Wayland error %d creating virtual keyboard\n",
+                wl_display_get_error(v->display));
+        vk_destroy(&v->base);
+        return NULL;
+    }
+    DBG("vk: virtual keyboard ready, %d dynamic slots\n", v->nslots);
+
+    return &v->base;
+}
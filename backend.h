@@ -0,0 +1,103 @@
+/*
+ * backend.h — key injection backends for ei-type
+ *
+ * The typing engine in libeitype.c is written against this interface;
+ * each backend turns evdev key events into whatever its transport needs.
+ *
+ *   eis     — KWin EIS via D-Bus + libei (default)
+ *   uinput  — kernel virtual keyboard via /dev/uinput
+ *   vk      — zwp_virtual_keyboard_v1 (wlroots compositors)
+ *
+ * key() and frame() may only queue; nothing is guaranteed to reach the
+ * transport until flush().
+ */
+#ifndef EI_TYPE_BACKEND_H
+#define EI_TYPE_BACKEND_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clock.h"
+#include "keymap.h"
+
+extern bool g_verbose;
+extern volatile sig_atomic_t g_quit;
+
+#define DBG(...) do { if (g_verbose) fprintf(stderr, "ei-type: " __VA_ARGS__); } while(0)
+
+struct backend {
+    const char *name;
+
+    /* Optional: make every codepoint in cps[0..n) typeable before the
+     * first key of the run is pressed. Backends with a fixed layout
+     * leave this NULL. */
+    int  (*prepare)(struct backend *b, const uint32_t *cps, size_t n);
+
+    /* Optional: map a codepoint to a key. NULL means char_to_key(). */
+    bool (*map_char)(struct backend *b, uint32_t cp, struct keyinfo *out);
+
+    void (*key)(struct backend *b, uint32_t code, bool press);
+    void (*frame)(struct backend *b);
+    void (*flush)(struct backend *b);
+    void (*destroy)(struct backend *b);
+
+    /* Optional: fd that turns readable when flush() has incoming events
+     * to process (acks, pings). NULL means there is nothing to wait for. */
+    int  (*get_fd)(struct backend *b);
+
+    /* Optional: key() should not be called until the server has answered
+     * some of what was sent; the caller waits for get_fd() and calls
+     * flush() until this is false. NULL means never busy. */
+    bool (*busy)(struct backend *b);
+
+    /* Optional: ask the server to acknowledge everything sent so far.
+     * A later flush() calls on_sync(b, cookie) once it has. Acks arrive in
+     * request order. NULL means events count as delivered when flush()
+     * returns. */
+    void (*sync)(struct backend *b, uint64_t cookie);
+    void (*on_sync)(struct backend *b, uint64_t cookie);
+    void *user;         /* for on_sync */
+
+    /* Optional: called by long-running callers while nothing is being
+     * typed, for upkeep such as starting the standby. Must not block:
+     * whatever it waits for comes in through get_fd(). */
+    void (*idle)(struct backend *b);
+
+    /* Set by the backend once the server is gone; nothing more gets through */
+    bool dead;
+
+    /* For backends that reconnect when the server drops them (eis): give
+     * up after trying this long, 0 to keep trying. With standby, idle()
+     * keeps a second connection negotiated to switch to at once. */
+    unsigned reconnect_timeout_ms;
+    bool standby;
+
+    /* While reconnecting: when the next attempt is due (now_ns()), else
+     * 0. flush() normally waits for it; with reconnect_async it returns
+     * instead, and the caller calls flush() again once it is due. */
+    uint64_t retry_ns;
+    bool reconnect_async;
+
+    /* Modifier state as the server last reported it (xkb masks), for
+     * backends that get such reports; mods_known stays false otherwise */
+    struct {
+        uint32_t depressed, latched, locked, group;
+    } mods;
+    bool mods_known;
+};
+
+/* Core xkb modifier bits; xkbcommon keymaps always put them first */
+#define XKB_MOD_SHIFT (1u << 0)
+#define XKB_MOD_LOCK  (1u << 1)
+
+/* Each constructor prints its own diagnostics and returns NULL on failure */
+struct backend *backend_eis_new(void);
+struct backend *backend_uinput_new(void);
+#ifdef HAVE_VK
+struct backend *backend_vk_new(void);
+#endif
+
+#endif
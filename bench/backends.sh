@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compare keys/sec and flush latency of the injection backends.
+#
+# Types the same text through each backend with --stats and prints the
+# summary lines. Focus a scratch window (e.g. an empty editor) first —
+# every run really types.
+#
+# Usage: bench/backends.sh [chars] [delay_ms] [backends...]
+#   bench/backends.sh 2000 0 eis uinput
+
+set -eu
+
+EI_TYPE=${EI_TYPE:-./ei-type}
+CHARS=${1:-2000}
+DELAY=${2:-0}
+BACKENDS="eis uinput"
+if [ $# -gt 2 ]; then
+    shift 2
+    BACKENDS=$*
+fi
+
+# Mixed-case prose with punctuation, one line per 80 chars
+TEXT=$(head -c "$CHARS" /dev/zero | tr '\0' 'x' | \
+       sed 's/x\{16\}/The quick Fox, 9 /g' | fold -w 80)
+
+sleep 2
+for b in $BACKENDS; do
+    printf '%s\n' "$TEXT" | "$EI_TYPE" --backend "$b" -d "$DELAY" --stats 2>&1 | \
+        grep 'stats:' || echo "ei-type: $b backend failed"
+    sleep 1
+done
@@ -0,0 +1,67 @@
+/*
+ * bench.h — what the C benchmarks share: a monotonic timestamp, reading
+ * a file whole, and translating text the way stdin input is (utf8_decode
+ * everything, then char_to_key per codepoint)
+ */
+#ifndef EI_TYPE_BENCH_H
+#define EI_TYPE_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "keymap.h"
+
+static inline double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* The whole of path in a malloc'd buffer, NULL on errors (errno set) */
+static inline char *load(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    char *buf = NULL;
+    size_t cap = 0, n = 0, r;
+    do {
+        if (cap - n < 65536) {
+            cap = cap ? cap * 2 : 1 << 20;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = grown;
+        }
+        r = fread(buf + n, 1, cap - n, f);
+        n += r;
+    } while (r > 0);
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+/* Decode and look up everything; adds the codepoints seen to *nchars and
+ * the ones without a key to *unmapped. The result only keeps the work
+ * from being optimized away. */
+static inline uint32_t decode_lookup(const char *s, size_t len,
+                                     size_t *nchars, size_t *unmapped) {
+    uint32_t cps[1024], sink = 0;
+    while (len > 0) {
+        size_t ncp, used = utf8_decode(s, len < 1024 ? len : 1024, cps, &ncp);
+        if (used == 0) break;
+        for (size_t i = 0; i < ncp; i++) {
+            struct keyinfo k = char_to_key(cps[i]);
+            sink += k.code + k.shift;
+            *unmapped += k.code == 0;
+        }
+        *nchars += ncp;
+        s += used;
+        len -= used;
+    }
+    return sink;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Wakeups of an idle ei-type, e.g. one left running as the consumer of a
+# speech-to-text pipe.
+#
+# Runs ei-type against tools/ei-soak, a local libeis server that never
+# pings its clients. After a few keys its stdin stays open and empty,
+# and over the idle period the context switches of all its threads must
+# stay at exactly 0: idle is event-driven, and nothing here sends it an
+# event. Exits non-zero otherwise; make check runs it.
+#
+# Usage: bench/idle-wakeups.sh [seconds]
+#   EI_TYPE=./ei-type bench/idle-wakeups.sh 60
+
+set -eu
+
+EI_TYPE=${EI_TYPE:-./ei-type}
+SECS=${1:-10}
+
+exec tools/ei-soak --keys 100 --idle "$SECS" -- "$EI_TYPE" -d 0
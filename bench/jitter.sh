@@ -0,0 +1,38 @@
+#!/bin/sh
+# Wakeup jitter of the typing loop under CPU load, with and without
+# --realtime.
+#
+# Starts one busy loop per CPU (twice over), then types the same text
+# with --stats in normal and real-time mode and prints the jitter
+# histograms: how late each inter-key wait woke up. Focus a scratch
+# window first — every run really types.
+#
+# Usage: bench/jitter.sh [chars] [delay_ms] [backend]
+#   bench/jitter.sh 1000 1 uinput
+
+set -eu
+
+EI_TYPE=${EI_TYPE:-./ei-type}
+CHARS=${1:-1000}
+DELAY=${2:-1}
+BACKEND=${3:-eis}
+
+TEXT=$(head -c "$CHARS" /dev/zero | tr '\0' 'x' | \
+       sed 's/x\{16\}/The quick Fox, 9 /g' | fold -w 80)
+
+HOGS=""
+trap 'kill $HOGS 2>/dev/null' EXIT INT TERM
+for _ in $(seq $(( $(nproc) * 2 ))); do
+    sh -c 'while :; do :; done' &
+    HOGS="$HOGS $!"
+done
+
+sleep 2
+for mode in normal realtime; do
+    flag=""
+    [ "$mode" = realtime ] && flag=--realtime
+    printf '%-9s ' "$mode:"
+    printf '%s\n' "$TEXT" | "$EI_TYPE" --backend "$BACKEND" -d "$DELAY" --stats $flag 2>&1 | \
+        grep 'jitter:' || echo "ei-type: $mode run failed"
+    sleep 1
+done
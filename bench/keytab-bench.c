@@ -0,0 +1,102 @@
+/*
+ * keytab-bench — cost of the generated key table lookups
+ *
+ * Translates each corpus the way typed text is (utf8_decode, then
+ * char_to_key per codepoint), looks up key names with key_from_name and
+ * parses a mix of --key combos with parse_chord, so changes to the
+ * tables or the lookups can be compared in numbers. The corpora in
+ * bench/corpus are shared with the Rust benchmark (benches/keymap.rs).
+ *
+ * Build: make bench
+ * Usage: bench/keytab-bench [iterations] [corpus...]
+ *   without corpora, bench/corpus/{prose,code,shell,intl}.txt
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static const char *const default_corpora[] = {
+    "bench/corpus/prose.txt",
+    "bench/corpus/code.txt",
+    "bench/corpus/shell.txt",
+    "bench/corpus/intl.txt",
+};
+
+static const char *const names[] = {
+    "enter", "tab", "esc", "ctrl", "shift", "alt", "super", "f1", "f12",
+    "f24", "home", "end", "pageup", "pgdn", "delete", "insert", "up",
+    "left", "kp5", "kpenter", "mute", "play", "nosuchkey",
+};
+
+/* What --key and KEY records see: plain names, chords, shifted
+ * characters and repeats */
+static const char *const combos[] = {
+    "enter", "tab", "ctrl+v", "ctrl+shift+t", "alt+f4", "super+l",
+    "shift+home", "ctrl+a", "down*10", "A", "ctrl+alt+delete", "f12",
+    "pagedown", "shift+down*3", "?", "ctrl+shift+alt+super+k", "kp5", "*",
+};
+
+int main(int argc, char *argv[]) {
+    long iters = argc > 1 ? atol(argv[1]) : 20000;
+    const char *const *corpora = argc > 2 ? (const char *const *)argv + 2 : default_corpora;
+    size_t ncorpora = argc > 2 ? (size_t)(argc - 2)
+                               : sizeof(default_corpora) / sizeof(default_corpora[0]);
+    if (iters < 1) iters = 1;
+    volatile uint32_t sink = 0;
+
+    for (size_t c = 0; c < ncorpora; c++) {
+        size_t len = 0, nchars = 0, unmapped = 0;
+        char *text = load(corpora[c], &len);
+        if (!text) {
+            perror(corpora[c]);
+            return 1;
+        }
+
+        /* one untimed pass to count, and to warm the caches */
+        sink += decode_lookup(text, len, &nchars, &unmapped);
+
+        size_t n = 0, u = 0;
+        double t0 = now_s();
+        for (long it = 0; it < iters; it++) sink += decode_lookup(text, len, &n, &u);
+        double t1 = now_s();
+        const char *name = strrchr(corpora[c], '/');
+        printf("char_to_key %-10s %7.2f ns/char  (%zu chars, %zu bytes, %zu unmapped)\n",
+               name ? name + 1 : corpora[c], (t1 - t0) * 1e9 / ((double)n),
+               nchars, len, unmapped);
+        free(text);
+    }
+
+    const size_t nnames = sizeof(names) / sizeof(names[0]);
+    double t0 = now_s();
+    for (long it = 0; it < iters; it++) {
+        for (size_t i = 0; i < nnames; i++) {
+            sink += key_from_name(names[i]);
+        }
+    }
+    double t1 = now_s();
+    printf("key_from_name          %7.2f ns/op    (%zu names x %ld, %d entries)\n",
+           (t1 - t0) * 1e9 / ((double)nnames * (double)iters), nnames, iters,
+           KEYTAB_NNAMES);
+
+    const size_t ncombos = sizeof(combos) / sizeof(combos[0]);
+    struct chord ch;
+    for (size_t i = 0; i < ncombos; i++) {
+        if (!parse_chord(combos[i], &ch)) return 1;
+    }
+    t0 = now_s();
+    for (long it = 0; it < iters; it++) {
+        for (size_t i = 0; i < ncombos; i++) {
+            parse_chord(combos[i], &ch);
+            sink += ch.key + (uint32_t)ch.nmod + ch.repeat;
+        }
+    }
+    t1 = now_s();
+    printf("parse_chord            %7.2f ns/op    (%zu combos x %ld)\n",
+           (t1 - t0) * 1e9 / ((double)ncombos * (double)iters), ncombos, iters);
+
+    return sink == 0xdeadbeef;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Cold-start time and size of ei-type: sd-bus vs `make MINI_DBUS=1` for
+# the C binary, zbus+tokio vs --no-default-features for the Rust one.
+#
+# Builds each variant into $OUT, then times `ei-type --key shift` (a
+# harmless key; KWin must be running) RUNS times per variant and prints
+# min/median/max wall time with the file size, stripped size and number
+# of shared libraries loaded. For a truly cold first run drop the page
+# cache beforehand (as root: echo 3 > /proc/sys/vm/drop_caches).
+#
+# Usage: bench/startup.sh [runs]
+
+set -eu
+
+RUNS=${1:-20}
+OUT=${OUT:-bench/startup-bins}
+mkdir -p "$OUT"
+
+make -s -B ei-type MINI_DBUS=0 && cp ei-type "$OUT/c-sdbus"
+make -s -B ei-type MINI_DBUS=1 && cp ei-type "$OUT/c-mini"
+make -s -B ei-type          # leave the default build in place
+if command -v cargo >/dev/null 2>&1; then
+    make -s rust && cp target/release/ei-type "$OUT/rust-zbus"
+    make -s rust-mini && cp target/mini/release/ei-type "$OUT/rust-mini"
+fi
+
+now_us() {
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+printf '%-10s %9s %9s %5s %9s %9s %9s\n' variant bytes stripped libs min_ms med_ms max_ms
+for bin in "$OUT"/c-sdbus "$OUT"/c-mini "$OUT"/rust-zbus "$OUT"/rust-mini; do
+    [ -x "$bin" ] || continue
+    size=$(stat -c %s "$bin")
+    strip -o "$OUT/.stripped" "$bin"
+    stripped=$(stat -c %s "$OUT/.stripped")
+    libs=$(ldd "$bin" | grep -c '=>' || true)
+
+    i=0
+    : > "$OUT/.times"
+    while [ "$i" -lt "$RUNS" ]; do
+        t0=$(now_us)
+        "$bin" --key shift -d 0 >/dev/null 2>&1 || echo "ei-type: $bin failed" >&2
+        t1=$(now_us)
+        echo $((t1 - t0)) >> "$OUT/.times"
+        i=$((i + 1))
+    done
+    sort -n "$OUT/.times" | awk -v name="${bin##*/}" -v size="$size" \
+        -v stripped="$stripped" -v libs="$libs" '
+        { t[NR] = $1 }
+        END { printf "%-10s %9d %9d %5d %9.2f %9.2f %9.2f\n", name, size, stripped, libs,
+              t[1] / 1e3, t[int((NR + 1) / 2)] / 1e3, t[NR] / 1e3 }'
+done
+rm -f "$OUT/.times" "$OUT/.stripped"
@@ -0,0 +1,106 @@
+/*
+ * translate-bench — throughput of text → key translation on large input
+ *
+ * Translates a multi-megabyte buffer to key codes the way -f does
+ * (keymap_scan: plain runs by table lookup, the rest through
+ * utf8_decode) and the way stdin input is (utf8_decode everything, then
+ * char_to_key per codepoint), and times the scan alone.
+ *
+ * Build: make bench
+ * Usage: bench/translate-bench [megabytes] [file]
+ *   without a file, prose with some punctuation, capitals and UTF-8
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static const char corpus[] =
+    "the quick brown fox jumps over the lazy dog and then some more words\n"
+    "follow in lower case, as dictated text mostly is: 42 items at 7 each\n"
+    "Pack my box with five dozen liquor jugs! \"How vexingly quick\" it was.\n"
+    "caf\xc3\xa9 na\xc3\xafve r\xc3\xa9sum\xc3\xa9 \xe2\x80\x94 and a stray emoji \xf0\x9f\x99\x82 in between\n";
+
+/* -f's way: plain runs straight from the table */
+static uint32_t scan_runs(const char *s, size_t len) {
+    uint32_t cps[1024], sink = 0;
+    while (len > 0) {
+        bool plain;
+        size_t run = keymap_scan(s, len, &plain), used = run;
+        if (plain) {
+            for (size_t i = 0; i < run; i++) sink += keytab_ascii[(unsigned char)s[i]].code;
+        } else {
+            size_t ncp;
+            used = utf8_decode(s, run < 1024 ? run : 1024, cps, &ncp);
+            if (used == 0) used = 1;
+            for (size_t i = 0; i < ncp; i++) {
+                struct keyinfo k = char_to_key(cps[i]);
+                sink += k.code + k.shift;
+            }
+        }
+        s += used;
+        len -= used;
+    }
+    return sink;
+}
+
+static uint32_t scan_only(const char *s, size_t len, size_t *runs) {
+    uint32_t plains = 0;
+    *runs = 0;
+    while (len > 0) {
+        bool plain;
+        size_t run = keymap_scan(s, len, &plain);
+        plains += plain;
+        (*runs)++;
+        s += run;
+        len -= run;
+    }
+    return plains;
+}
+
+int main(int argc, char *argv[]) {
+    size_t mb = argc > 1 ? (size_t)atol(argv[1]) : 64;
+    size_t len = 0;
+    char *text;
+
+    if (argc > 2) {
+        text = load(argv[2], &len);
+        if (!text) {
+            perror(argv[2]);
+            return 1;
+        }
+    } else {
+        const size_t clen = sizeof(corpus) - 1;
+        len = mb << 20;
+        text = malloc(len);
+        if (!text) return 1;
+        for (size_t i = 0; i < len; i += clen)
+            memcpy(text + i, corpus, len - i < clen ? len - i : clen);
+    }
+    if (len == 0) return 1;
+
+    volatile uint32_t sink = 0;
+    size_t runs = 0;
+    const double mib = (double)len / (1 << 20);
+
+    size_t nchars = 0, unmapped = 0;
+    double t0 = now_s();
+    sink += decode_lookup(text, len, &nchars, &unmapped);
+    double t1 = now_s();
+    sink += scan_runs(text, len);
+    double t2 = now_s();
+    uint32_t plains = scan_only(text, len, &runs);
+    double t3 = now_s();
+    sink += plains;
+
+    printf("decode+lookup: %7.3f ns/byte  %8.1f MiB/s\n", (t1 - t0) * 1e9 / (double)len, mib / (t1 - t0));
+    printf("scan+lookup:   %7.3f ns/byte  %8.1f MiB/s\n", (t2 - t1) * 1e9 / (double)len, mib / (t2 - t1));
+    printf("scan only:     %7.3f ns/byte  %8.1f MiB/s  (%zu runs, %u plain, %.1f bytes/run)\n",
+           (t3 - t2) * 1e9 / (double)len, mib / (t3 - t2), runs, plains, (double)len / (double)runs);
+
+    free(text);
+    return sink == 0xdeadbeef;
+}
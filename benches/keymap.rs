@@ -0,0 +1,90 @@
+//! Criterion benchmarks of the keymap: ns per character translating the
+//! corpora in bench/corpus (shared with bench/keytab-bench.c) and ns per
+//! combo parse. Run with `make rust-bench` or `cargo bench --bench keymap`.
+
+use std::hint::black_box;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+// The binary has no library target; the module builds here on its own,
+// with the tables build.rs generates for the whole package
+#[path = "../src/keymap.rs"]
+mod keymap;
+
+const CORPORA: &[(&str, &str)] = &[
+    ("prose", include_str!("../bench/corpus/prose.txt")),
+    ("code", include_str!("../bench/corpus/code.txt")),
+    ("shell", include_str!("../bench/corpus/shell.txt")),
+    ("intl", include_str!("../bench/corpus/intl.txt")),
+];
+
+/// The same mix as bench/keytab-bench.c
+const COMBOS: &[&str] = &[
+    "enter", "tab", "ctrl+v", "ctrl+shift+t", "alt+f4", "super+l",
+    "shift+home", "ctrl+a", "down*10", "A", "ctrl+alt+delete", "f12",
+    "pagedown", "shift+down*3", "?", "ctrl+shift+alt+super+k", "kp5", "*",
+];
+
+fn translation(c: &mut Criterion) {
+    let mut group = c.benchmark_group("translate");
+    for &(name, text) in CORPORA {
+        group.throughput(Throughput::Elements(text.chars().count() as u64));
+
+        // per character, as the typing loop looks keys up
+        group.bench_with_input(BenchmarkId::new("char_to_key", name), text, |b, text| {
+            b.iter(|| {
+                let mut sink = 0u32;
+                for c in black_box(text).chars() {
+                    if let Some(k) = keymap::char_to_key(c) {
+                        sink = sink.wrapping_add(k.code + k.shift as u32);
+                    }
+                }
+                sink
+            })
+        });
+
+        // the whole input up front, as the tests do
+        group.bench_with_input(BenchmarkId::new("translate", name), text, |b, text| {
+            b.iter(|| keymap::translate(black_box(text)))
+        });
+
+        // from bytes, as main.rs does with each read of stdin
+        group.bench_with_input(BenchmarkId::new("translate_utf8", name), text, |b, text| {
+            let mut keys = Vec::with_capacity(text.len());
+            b.iter(|| {
+                keys.clear();
+                keymap::translate_utf8(black_box(text.as_bytes()), &mut keys)
+            })
+        });
+    }
+    group.finish();
+}
+
+fn combos(c: &mut Criterion) {
+    let mut group = c.benchmark_group("combo");
+
+    // parse_combo takes no repeat count; "*" alone is the asterisk
+    let single: Vec<&str> = COMBOS.iter().copied().filter(|c| !c.contains('*') || *c == "*").collect();
+    group.throughput(Throughput::Elements(single.len() as u64));
+    group.bench_function("parse_combo", |b| {
+        b.iter(|| {
+            for &combo in &single {
+                black_box(keymap::parse_combo(black_box(combo)).ok());
+            }
+        })
+    });
+
+    // plus repeat counts and the chord Vec
+    group.throughput(Throughput::Elements(COMBOS.len() as u64));
+    group.bench_function("parse_sequence", |b| {
+        b.iter(|| {
+            for &combo in COMBOS {
+                black_box(keymap::parse_sequence(black_box(combo)).ok());
+            }
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, translation, combos);
+criterion_main!(benches);
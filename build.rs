@@ -0,0 +1,186 @@
+//! Generate the key tables from keys.def (shared with the C build).
+//!
+//! Emits `$OUT_DIR/keytab.rs` with the `KEY_*` constants, a dense ASCII
+//! lookup table and a perfect-hash map of key names, included by
+//! src/keymap.rs.
+
+use std::env;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::Path;
+
+struct Key {
+    name: String,
+    code: u32,
+    modifier: bool,
+    chars: Vec<u8>,
+    aliases: Vec<String>,
+}
+
+fn decode_chars(field: &str, line: usize) -> Vec<u8> {
+    if field == "-" {
+        return Vec::new();
+    }
+    let mut out = Vec::new();
+    let mut bytes = field.bytes();
+    while let Some(b) = bytes.next() {
+        let c = if b == b'\\' {
+            match bytes.next() {
+                Some(b's') => b' ',
+                Some(b'n') => b'\n',
+                Some(b't') => b'\t',
+                Some(b'\\') => b'\\',
+                other => panic!("keys.def:{}: unknown escape {:?}", line, other),
+            }
+        } else {
+            b
+        };
+        assert!(c < 128, "keys.def:{}: non-ASCII character in chars column", line);
+        out.push(c);
+    }
+    assert!(out.len() <= 2, "keys.def:{}: at most two characters per key", line);
+    out
+}
+
+fn parse(text: &str) -> Vec<Key> {
+    let mut keys = Vec::new();
+    for (i, line) in text.lines().enumerate() {
+        let line_no = i + 1;
+        if line.starts_with('#') || line.trim().is_empty() {
+            continue;
+        }
+        let cols: Vec<&str> = line.split_whitespace().collect();
+        assert!(cols.len() == 6, "keys.def:{}: expected 6 columns, got {}", line_no, cols.len());
+        keys.push(Key {
+            name: cols[0].to_owned(),
+            code: cols[1]
+                .parse()
+                .unwrap_or_else(|_| panic!("keys.def:{}: bad keycode '{}'", line_no, cols[1])),
+            modifier: cols[2] == "mod",
+            chars: decode_chars(cols[3], line_no),
+            aliases: if cols[5] == "-" {
+                Vec::new()
+            } else {
+                cols[5].split(',').map(str::to_owned).collect()
+            },
+        });
+    }
+    keys
+}
+
+/// FNV-1a with a seed; must match `name_hash` in src/keymap.rs.
+fn name_hash(name: &[u8], seed: u32) -> u32 {
+    let mut h = 0x811c_9dc5u32 ^ seed;
+    for &b in name {
+        h ^= b as u32;
+        h = h.wrapping_mul(0x0100_0193);
+    }
+    h
+}
+
+/// Hash-and-displace: names are split into buckets by `name_hash(_, 0)`,
+/// then each bucket (largest first) gets the smallest seed that places all
+/// of its names in free slots. Returns (displacements, slot → entry index).
+fn build_phf(names: &[&str]) -> (Vec<u32>, Vec<Option<usize>>) {
+    let nslots = (names.len() * 2).next_power_of_two();
+    let nbuckets = (names.len() / 2).next_power_of_two();
+
+    let mut buckets: Vec<Vec<usize>> = vec![Vec::new(); nbuckets];
+    for (i, n) in names.iter().enumerate() {
+        buckets[name_hash(n.as_bytes(), 0) as usize & (nbuckets - 1)].push(i);
+    }
+    let mut order: Vec<usize> = (0..nbuckets).collect();
+    order.sort_by_key(|&b| std::cmp::Reverse(buckets[b].len()));
+
+    let mut disp = vec![0u32; nbuckets];
+    let mut slots: Vec<Option<usize>> = vec![None; nslots];
+    for b in order {
+        if buckets[b].is_empty() {
+            continue;
+        }
+        let mut seed = 1u32;
+        loop {
+            let mut taken = Vec::with_capacity(buckets[b].len());
+            let ok = buckets[b].iter().all(|&i| {
+                let s = name_hash(names[i].as_bytes(), seed) as usize & (nslots - 1);
+                let free = slots[s].is_none() && !taken.contains(&s);
+                taken.push(s);
+                free
+            });
+            if ok {
+                for (&i, &s) in buckets[b].iter().zip(&taken) {
+                    slots[s] = Some(i);
+                }
+                disp[b] = seed;
+                break;
+            }
+            seed += 1;
+            assert!(seed < 1_000_000, "no perfect hash found for key names");
+        }
+    }
+    (disp, slots)
+}
+
+fn main() {
+    let manifest = env::var("CARGO_MANIFEST_DIR").unwrap();
+    let def = Path::new(&manifest).join("keys.def");
+    println!("cargo:rerun-if-changed={}", def.display());
+    println!("cargo:rerun-if-changed=build.rs");
+
+    let keys = parse(&fs::read_to_string(&def).expect("read keys.def"));
+    let mut out = String::new();
+    writeln!(out, "// Generated from keys.def by build.rs — do not edit").unwrap();
+    writeln!(out).unwrap();
+
+    for k in &keys {
+        writeln!(out, "pub const KEY_{}: u32 = {};", k.name, k.code).unwrap();
+    }
+
+    // Dense ASCII table: (keycode, shift), keycode 0 when unmapped
+    let mut ascii = vec![(String::from("0"), false); 128];
+    for k in &keys {
+        for (level, &c) in k.chars.iter().enumerate() {
+            assert!(
+                ascii[c as usize].0 == "0",
+                "character {:?} mapped twice in keys.def",
+                c as char
+            );
+            ascii[c as usize] = (format!("KEY_{}", k.name), level == 1);
+        }
+    }
+    writeln!(out).unwrap();
+    writeln!(out, "static ASCII: [(u32, bool); 128] = [").unwrap();
+    for (code, shift) in &ascii {
+        writeln!(out, "    ({}, {}),", code, shift).unwrap();
+    }
+    writeln!(out, "];").unwrap();
+
+    // Key names (canonical lowercase evdev name plus aliases)
+    let mut entries: Vec<(String, &Key)> = Vec::new();
+    for k in &keys {
+        entries.push((k.name.to_lowercase(), k));
+        for a in &k.aliases {
+            entries.push((a.clone(), k));
+        }
+    }
+    let names: Vec<&str> = entries.iter().map(|(n, _)| n.as_str()).collect();
+    let (disp, slots) = build_phf(&names);
+
+    writeln!(out).unwrap();
+    writeln!(out, "static NAME_DISP: [u32; {}] = {:?};", disp.len(), disp).unwrap();
+    writeln!(out).unwrap();
+    writeln!(out, "static NAME_SLOTS: [(&str, u32, bool); {}] = [", slots.len()).unwrap();
+    for s in &slots {
+        match s {
+            Some(i) => {
+                let (name, k) = &entries[*i];
+                writeln!(out, "    ({:?}, KEY_{}, {}),", name, k.name, k.modifier).unwrap();
+            }
+            None => writeln!(out, "    (\"\", 0, false),").unwrap(),
+        }
+    }
+    writeln!(out, "];").unwrap();
+
+    let dest = Path::new(&env::var("OUT_DIR").unwrap()).join("keytab.rs");
+    fs::write(dest, out).expect("write keytab.rs");
+}
@@ -0,0 +1,88 @@
+/*
+ * clock.c — real and virtual time for clock.h
+ */
+
+#define _GNU_SOURCE
+#include <stdatomic.h>
+#include <time.h>
+
+#include "clock.h"
+
+#define NS 1000000000ull
+
+static atomic_bool virtual_on;
+static atomic_uint_fast64_t virtual_ns;
+
+static struct timespec to_timespec(uint64_t ns) {
+    return (struct timespec){ .tv_sec = (time_t)(ns / NS), .tv_nsec = (long)(ns % NS) };
+}
+
+uint64_t now_ns(void) {
+    if (atomic_load_explicit(&virtual_on, memory_order_relaxed))
+        return atomic_load_explicit(&virtual_ns, memory_order_relaxed);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS + (uint64_t)ts.tv_nsec;
+}
+
+/* Virtual time only goes forward, whoever else moved it meanwhile */
+static void advance_to(uint64_t deadline) {
+    uint_fast64_t cur = atomic_load_explicit(&virtual_ns, memory_order_relaxed);
+    while (cur < deadline &&
+           !atomic_compare_exchange_weak_explicit(&virtual_ns, &cur, deadline,
+                                                  memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+void clock_sleep(uint64_t ns) {
+    if (atomic_load_explicit(&virtual_on, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&virtual_ns, ns, memory_order_relaxed);
+        return;
+    }
+    struct timespec ts = to_timespec(ns);
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+void clock_sleep_until(uint64_t deadline) {
+    if (atomic_load_explicit(&virtual_on, memory_order_relaxed)) {
+        advance_to(deadline);
+        return;
+    }
+    struct timespec ts = to_timespec(deadline);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+int clock_poll(struct pollfd *fds, nfds_t n, uint64_t timeout_ns) {
+    if (timeout_ns == CLOCK_FOREVER) return ppoll(fds, n, NULL, NULL);
+
+    if (atomic_load_explicit(&virtual_on, memory_order_relaxed)) {
+        static const struct timespec zero = { 0, 0 };
+        int r = ppoll(fds, n, &zero, NULL);
+        if (r == 0) clock_sleep(timeout_ns);
+        return r;
+    }
+    struct timespec ts = to_timespec(timeout_ns);
+    return ppoll(fds, n, &ts, NULL);
+}
+
+void clock_set_virtual(uint64_t start_ns) {
+    atomic_store(&virtual_ns, start_ns ? start_ns : 1);
+    atomic_store(&virtual_on, true);
+}
+
+bool clock_is_virtual(void) {
+    return atomic_load_explicit(&virtual_on, memory_order_relaxed);
+}
+
+void backoff_start(struct backoff *b, unsigned min_ms, unsigned max_ms, unsigned timeout_ms) {
+    uint64_t now = now_ns();
+    *b = (struct backoff){ .start_ns = now, .next_ns = now, .delay_ms = min_ms,
+                           .max_ms = max_ms, .timeout_ms = timeout_ms };
+}
+
+bool backoff_failed(struct backoff *b) {
+    uint64_t now = now_ns();
+    if (b->timeout_ms && (now - b->start_ns) / 1000000 + b->delay_ms > b->timeout_ms) return false;
+    b->next_ns = now + b->delay_ms * 1000000ull;
+    b->delay_ms = b->delay_ms * 2 < b->max_ms ? b->delay_ms * 2 : b->max_ms;
+    return true;
+}
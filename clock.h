@@ -0,0 +1,63 @@
+/*
+ * clock.h — the time source behind pacing and timeouts
+ *
+ * Inter-key delays, macro deadlines, negotiation timeouts, reconnect
+ * backoff and every timestamp (stats, metrics, flight recorder) go
+ * through these calls. Normally that is CLOCK_MONOTONIC and real sleeps.
+ *
+ * clock_set_virtual() switches the process to a virtual clock, for
+ * tests: time stands still until someone waits, and a wait moves it on
+ * by exactly the amount asked without sleeping. clock_poll() still looks
+ * at its fds, without blocking, so fakes that answer from within the
+ * process (a libei stand-in pushing events on an eventfd) see the same
+ * sequence as in real time; only a wait without a limit blocks for real.
+ * Hours of typing, timeouts and reconnects then run in milliseconds with
+ * exact, repeatable timestamps (tests/clock-test). The test build of
+ * ei-type (make check) turns it on when $EI_TYPE_VIRTUAL_CLOCK is set,
+ * starting at that many ns; a server in another process answers in real
+ * time, so negotiating with one waits for it without a limit.
+ */
+#ifndef EI_TYPE_CLOCK_H
+#define EI_TYPE_CLOCK_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* clock_poll() timeout for waiting as long as it takes */
+#define CLOCK_FOREVER UINT64_MAX
+
+/* CLOCK_MONOTONIC in ns, or the virtual time */
+uint64_t now_ns(void);
+
+/* Sleep for ns, or until deadline on the now_ns() clock. A signal may
+ * cut a real sleep short; callers that care check the time again. */
+void clock_sleep(uint64_t ns);
+void clock_sleep_until(uint64_t deadline);
+
+/* poll(2) with a timeout in ns. With the virtual clock nothing blocks
+ * unless the timeout is CLOCK_FOREVER: if no fd is ready, the time moves
+ * on by the timeout and 0 is returned. */
+int clock_poll(struct pollfd *fds, nfds_t n, uint64_t timeout_ns);
+
+/* Switch to the virtual clock at start_ns (at least 1: callers use 0 for
+ * "no time yet"). Call it before anything reads the time. */
+void clock_set_virtual(uint64_t start_ns);
+bool clock_is_virtual(void);
+
+/* Retrying with exponential backoff. The first attempt is due at once;
+ * after each failure the next comes delay_ms later, starting at min_ms
+ * and doubling up to max_ms. With timeout_ms (0: no limit), no attempt
+ * is scheduled that would start more than timeout_ms after the start. */
+struct backoff {
+    uint64_t start_ns;          /* backoff_start() */
+    uint64_t next_ns;           /* the next attempt is due */
+    unsigned delay_ms, max_ms, timeout_ms;
+};
+
+void backoff_start(struct backoff *b, unsigned min_ms, unsigned max_ms, unsigned timeout_ms);
+
+/* An attempt failed: schedule the next one. False once time is up. */
+bool backoff_failed(struct backoff *b);
+
+#endif
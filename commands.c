@@ -0,0 +1,655 @@
+/*
+ * commands.c — a line-based record stream, one record per line
+ *
+ *   TEXT <text>     type text; \n, \t and \\ escapes, other bytes literal
+ *   TEXTFD          type the UTF-8 contents of the memfd sent with this
+ *                   record (SCM_RIGHTS, daemon sockets only; at most
+ *                   MAX_PASSED_FDS per submission)
+ *   KEY <combos>    same syntax as --key
+ *   DELAY <ms>      pause, up to a day (86400000)
+ *   SYNC [token]    reply "SYNC <token>" once every earlier record has
+ *                   been processed by the server
+ *   FLUSH           push queued events out now (only matters with -d 0)
+ *   PRIORITY <n>    daemon: later submissions of this client run before
+ *                   waiting ones of lower priority (default 0)
+ *   STATS           reply "STATS submissions=<n> wait_avg_us=<n>
+ *                   wait_max_us=<n>" for this client's queue wait
+ *   CANCEL          daemon: stop the submission being typed, whoever
+ *                   sent it, and release every key it holds. Acts as
+ *                   soon as it is read, without queueing. Replied to
+ *                   with "CANCEL <n>", n the characters that were typed,
+ *                   or "CANCEL -" if nothing was running. The owner of
+ *                   the submission gets "CANCELLED <n>"; the rest of
+ *                   it is skipped, except SYNC records.
+ *
+ * Empty lines and lines starting with '#' are ignored. Records run in
+ * order over one connection; SYNC does not block, so a controller can
+ * pipeline records and match replies by token. Malformed records are
+ * answered with "ERR <line> <reason>" and skipped.
+ *
+ * In the daemon a client's records are grouped into submissions, each
+ * ending at a SYNC (or end of input); a submission runs without another
+ * client's records in between (see daemon.c). A submission over a limit
+ * (MAX_SUBMISSION bytes of records, MAX_PASSED_FDS fds) is dropped whole:
+ * nothing of it is typed, and its SYNC is answered with "ERR <line>
+ * submission dropped: <reason>" instead. A line is never held past
+ * MAX_SUBMISSION bytes either: the rest of it is skipped, and outside
+ * the daemon it is answered with "ERR <line> line too long".
+ *
+ * The daemon does not wait for a producer to read its replies. They are
+ * buffered, and a producer that lets MAX_REPLIES of them pile up is
+ * dropped, along with the submissions it has waiting.
+ *
+ * TEXTFD is for bulk text: the daemon maps the memfd read-only and types
+ * straight from the mapping, so a large document never passes through
+ * the socket buffer. The memfd must be sealed against writing and
+ * shrinking, so the mapping cannot change or fault while it is typed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "commands.h"
+#include "eitype-private.h"
+#include "metrics.h"
+
+#define TEXTFD_SEALS (F_SEAL_WRITE | F_SEAL_SHRINK)
+
+/* Longest DELAY record: a day */
+#define MAX_DELAY_MS (24 * 60 * 60 * 1000L)
+
+/* Records of one submission still being collected are held in memory */
+#define MAX_SUBMISSION (4u << 20)
+
+struct submission {
+    struct submission *next;
+    int      priority;
+    uint64_t queued_ns;
+    unsigned lineno;    /* of the first record */
+    char    *records;   /* '\n'-terminated lines */
+    size_t   len, cap;
+    struct fd_queue fds;
+};
+
+/* Session whose submission is being run */
+static struct cmd_session *g_running;
+
+/* Replies a queued session holds for a producer that is not reading
+ * them; past this it is dropped rather than let the daemon block */
+#define MAX_REPLIES (64u << 10)
+
+static void give_up(struct cmd_session *s);
+
+void cmd_session_flush(struct cmd_session *s) {
+    size_t off = 0;
+    while (off < s->out_len) {
+        ssize_t w = write(s->out_fd, s->out + off, s->out_len - off);
+        if (w >= 0) {
+            off += (size_t)w;
+        } else if (errno == EAGAIN && !s->queued) {
+            /* --commands answers in order, whatever stdout is */
+            struct pollfd pfd = { .fd = s->out_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) off = s->out_len;
+        } else if (errno != EINTR) {
+            /* EAGAIN: the rest waits for POLLOUT; else nobody is reading */
+            if (errno != EAGAIN) off = s->out_len;
+            break;
+        }
+    }
+    s->out_len -= off;
+    memmove(s->out, s->out + off, s->out_len);
+}
+
+__attribute__((format(printf, 2, 3)))
+static void reply(struct cmd_session *s, const char *fmt, ...) {
+    if (s->overflow) return;
+
+    va_list ap, aq;
+    va_start(ap, fmt);
+    va_copy(aq, ap);
+    int n = vsnprintf(NULL, 0, fmt, aq);
+    va_end(aq);
+    if (n >= 0 && s->out_cap - s->out_len <= (size_t)n) {
+        size_t cap = s->out_cap ? s->out_cap : 256;
+        while (cap - s->out_len <= (size_t)n) cap *= 2;
+        char *nout = realloc(s->out, cap);
+        if (nout) {
+            s->out = nout;
+            s->out_cap = cap;
+        } else {
+            n = -1;
+        }
+    }
+    if (n >= 0) {
+        vsnprintf(s->out + s->out_len, s->out_cap - s->out_len, fmt, ap);
+        s->out_len += (size_t)n;
+    }
+    va_end(ap);
+
+    cmd_session_flush(s);
+    if (s->out_len > MAX_REPLIES) give_up(s);
+}
+
+struct pending_sync {
+    struct cmd_session *s;
+    char token[];
+};
+
+static void sync_done(void *data) {
+    struct pending_sync *p = data;
+    reply(p->s, "SYNC %s\n", p->token);
+    p->s->replies_pending--;
+    free(p);
+}
+
+static void request_sync(struct cmd_session *s, const char *token) {
+    size_t len = strlen(token);
+    struct pending_sync *p = malloc(sizeof(*p) + len + 1);
+    if (!p) return;
+    p->s = s;
+    memcpy(p->token, token, len + 1);
+
+    s->replies_pending++;
+    int r;
+    while ((r = eitype_sync(s->t, sync_done, p)) == -EBUSY && !g_quit) wait_backend(s->t);
+    if (r < 0) {
+        s->replies_pending--;
+        free(p);
+    }
+}
+
+/* Undo TEXT escapes in place; returns false on an unknown escape */
+static bool unescape(char *s, size_t *len) {
+    char *out = s;
+    for (char *p = s; *p; p++) {
+        if (*p != '\\') { *out++ = *p; continue; }
+        switch (*++p) {
+            case 'n':  *out++ = '\n'; break;
+            case 't':  *out++ = '\t'; break;
+            case '\\': *out++ = '\\'; break;
+            default:   return false;
+        }
+    }
+    *out = '\0';
+    *len = (size_t)(out - s);
+    return true;
+}
+
+static int fd_queue_pop(struct fd_queue *q) {
+    if (q->n == 0) return -1;
+    int fd = q->fds[0];
+    memmove(&q->fds[0], &q->fds[1], --q->n * sizeof(q->fds[0]));
+    return fd;
+}
+
+static void fd_queue_clear(struct fd_queue *q) {
+    for (unsigned i = 0; i < q->n; i++) close(q->fds[i]);
+    q->n = 0;
+}
+
+static int run_textfd(struct cmd_session *s, struct fd_queue *fds, unsigned lineno) {
+    int fd = fd_queue_pop(fds);
+    if (fd < 0) {
+        reply(s, "ERR %u TEXTFD without a file descriptor\n", lineno);
+        return 0;
+    }
+
+    int r = 0;
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & TEXTFD_SEALS) != TEXTFD_SEALS) {
+        reply(s, "ERR %u TEXTFD needs a memfd sealed against write and shrink\n", lineno);
+    } else if (fstat(fd, &st) < 0) {
+        reply(s, "ERR %u TEXTFD: %s\n", lineno, strerror(errno));
+    } else if (st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            reply(s, "ERR %u TEXTFD: %s\n", lineno, strerror(errno));
+        } else {
+            madvise(map, size, MADV_SEQUENTIAL);
+            r = eitype_type_utf8(s->t, map, size);
+            munmap(map, size);
+        }
+    }
+    close(fd);
+    return r;
+}
+
+/* Split a record into its name and argument, in place */
+static char *record_arg(char *line) {
+    char *arg = strchr(line, ' ');
+    if (arg) *arg++ = '\0';
+    else arg = line + strlen(line);
+    return arg;
+}
+
+static bool parse_priority(const char *arg, int *out) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < -100 || n > 100) return false;
+    *out = (int)n;
+    return true;
+}
+
+/* Run one record. Returns the characters it typed, or a negative errno
+ * if typing stopped early. */
+static int run_command(struct cmd_session *s, struct fd_queue *fds, char *line, unsigned lineno) {
+    struct eitype *t = s->t;
+    if (line[0] == '\0' || line[0] == '#') return 0;
+
+    char *arg = record_arg(line);
+
+    if (strcmp(line, "TEXT") == 0) {
+        size_t len;
+        if (!unescape(arg, &len)) {
+            reply(s, "ERR %u bad escape in TEXT\n", lineno);
+            return 0;
+        }
+        return eitype_type_utf8(t, arg, len);
+    } else if (strcmp(line, "TEXTFD") == 0) {
+        return run_textfd(s, fds, lineno);
+    } else if (strcmp(line, "KEY") == 0) {
+        int r = eitype_key_combo(t, arg);
+        if (r == -EINVAL) reply(s, "ERR %u bad key combo\n", lineno);
+        else if (r < 0) return r;
+    } else if (strcmp(line, "DELAY") == 0) {
+        char *end;
+        long ms = strtol(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || ms < 0 || ms > MAX_DELAY_MS) {
+            reply(s, "ERR %u bad DELAY\n", lineno);
+            return 0;
+        }
+        eitype_flush(t);
+        run_begin(t);
+        wait_us(t, (uint64_t)ms * 1000);
+        return run_end(t);
+    } else if (strcmp(line, "SYNC") == 0) {
+        request_sync(s, arg);
+    } else if (strcmp(line, "FLUSH") == 0) {
+        eitype_flush(t);
+    } else if (strcmp(line, "PRIORITY") == 0) {
+        /* only matters when queued, where it is taken while collecting */
+        int prio;
+        if (!parse_priority(arg, &prio))
+            reply(s, "ERR %u bad PRIORITY\n", lineno);
+    } else if (strcmp(line, "STATS") == 0) {
+        reply(s, "STATS submissions=%llu wait_avg_us=%llu wait_max_us=%llu\n",
+              (unsigned long long)s->submissions,
+              (unsigned long long)(s->submissions ? s->wait_ns / s->submissions / 1000 : 0),
+              (unsigned long long)(s->wait_max_ns / 1000));
+    } else if (strcmp(line, "CANCEL") == 0) {
+        /* records run one at a time here, there is never anything to stop */
+        reply(s, "CANCEL -\n");
+    } else {
+        reply(s, "ERR %u unknown record '%s'\n", lineno, line);
+    }
+    return 0;
+}
+
+/* read() that also collects fds passed with SCM_RIGHTS on sockets */
+static ssize_t read_input(struct cmd_session *s, char *dst, size_t n) {
+    if (!s->is_socket) return read(s->in_fd, dst, n);
+
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    } ctl;
+    struct iovec iov = { .iov_base = dst, .iov_len = n };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf),
+    };
+    ssize_t r = recvmsg(s->in_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (r < 0) return r;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        size_t nfd = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nfd; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(fd));
+            if (s->fds.n < MAX_PASSED_FDS) s->fds.fds[s->fds.n++] = fd;
+            else close(fd);
+        }
+    }
+    return r;
+}
+
+static void free_submission(struct submission *sub) {
+    fd_queue_clear(&sub->fds);
+    free(sub->records);
+    free(sub);
+}
+
+/* Move the open submission to the back of the session's queue */
+static void close_submission(struct cmd_session *s) {
+    struct submission *sub = s->open;
+    if (!sub) return;
+    s->open = NULL;
+    sub->priority = s->priority;
+    sub->queued_ns = now_ns();
+    if (s->tail) s->tail->next = sub;
+    else s->head = sub;
+    s->tail = sub;
+    s->waiting++;
+}
+
+/* The producer does not read its replies: stop reading it and drop
+ * what it queued. A submission already running is finished, and the
+ * session is done once its SYNCs are answered. */
+static void give_up(struct cmd_session *s) {
+    DBG("producer is not reading its replies, dropping it\n");
+    s->overflow = true;
+    s->out_len = 0;
+    s->eof = true;
+    s->len = s->scanned = 0;
+    s->skipping = false;
+    s->discard = NULL;
+    if (s->open) free_submission(s->open);
+    s->open = NULL;
+    while (s->head) {
+        struct submission *sub = s->head;
+        s->head = sub->next;
+        free_submission(sub);
+    }
+    s->tail = NULL;
+    s->waiting = 0;
+}
+
+/* Drop the open submission whole: the rest of it, up to its SYNC, is
+ * skipped as it arrives, so no part of it gets typed */
+static void discard_submission(struct cmd_session *s, const char *why) {
+    if (s->open) free_submission(s->open);
+    s->open = NULL;
+    s->discard = why;
+    METRIC_INC(dropped);
+}
+
+/* Add a record to the open submission. SYNC closes it: the producer
+ * asked to hear when everything up to here is done, which makes it the
+ * natural end of an atomic unit. */
+static void collect(struct cmd_session *s, const char *line, unsigned lineno) {
+    size_t len = strlen(line);
+
+    if (strcmp(line, "CANCEL") == 0) {
+        if (!g_running) {
+            reply(s, "CANCEL -\n");
+        } else if (!s->cancel_waiting) {
+            s->cancel_waiting = true;
+            s->replies_pending++;
+            eitype_cancel(s->t);
+        }
+        return;
+    }
+
+    /* PRIORITY applies to the submission it ends up in, nothing to run */
+    if (strncmp(line, "PRIORITY", 8) == 0 && (line[8] == ' ' || line[8] == '\0')) {
+        if (!parse_priority(line[8] ? line + 9 : "", &s->priority))
+            reply(s, "ERR %u bad PRIORITY\n", lineno);
+        return;
+    }
+
+    /* the fd of a TEXTFD record travels with it; a submission holds at
+     * most MAX_PASSED_FDS */
+    bool textfd = strcmp(line, "TEXTFD") == 0;
+    bool sync = strncmp(line, "SYNC", 4) == 0 && (line[4] == ' ' || line[4] == '\0');
+    struct submission *sub = s->open;
+    if (!s->discard && textfd && sub && sub->fds.n == MAX_PASSED_FDS)
+        discard_submission(s, "too many fds");
+    else if (!s->discard && (sub ? sub->len : 0) + len + 1 > MAX_SUBMISSION)
+        discard_submission(s, "too large");
+
+    if (!s->discard && !sub) {
+        sub = calloc(1, sizeof(*sub));
+        if (sub) {
+            sub->lineno = lineno;
+            s->open = sub;
+        } else {
+            discard_submission(s, "out of memory");
+        }
+    }
+    if (!s->discard && sub->cap - sub->len < len + 1) {
+        size_t cap = sub->cap ? sub->cap : 4096;
+        while (cap - sub->len < len + 1) cap *= 2;
+        char *nrec = realloc(sub->records, cap);
+        if (nrec) {
+            sub->records = nrec;
+            sub->cap = cap;
+        } else {
+            discard_submission(s, "out of memory");
+        }
+    }
+
+    if (s->discard) {
+        if (textfd) {
+            int fd = fd_queue_pop(&s->fds);
+            if (fd >= 0) close(fd);
+        }
+        if (sync) {
+            reply(s, "ERR %u submission dropped: %s\n", lineno, s->discard);
+            s->discard = NULL;
+        }
+        return;
+    }
+
+    memcpy(sub->records + sub->len, line, len);
+    sub->records[sub->len + len] = '\n';
+    sub->len += len + 1;
+
+    if (textfd) {
+        int fd = fd_queue_pop(&s->fds);
+        if (fd >= 0) sub->fds.fds[sub->fds.n++] = fd;
+    }
+
+    if (sync) close_submission(s);
+}
+
+int cmd_session_next_priority(const struct cmd_session *s) {
+    return s->head->priority;
+}
+
+size_t cmd_session_queued(const struct cmd_session *s) {
+    return s->waiting;
+}
+
+static void parse_lines(struct cmd_session *s);
+
+long cmd_session_run_next(struct cmd_session *s) {
+    struct submission *sub = s->head;
+    s->head = sub->next;
+    if (!s->head) s->tail = NULL;
+    s->waiting--;
+
+    uint64_t wait = now_ns() - sub->queued_ns;
+    s->submissions++;
+    s->wait_ns += wait;
+    if (wait > s->wait_max_ns) s->wait_max_ns = wait;
+
+    /* a cancel between two records counts too, not just one mid-record */
+    unsigned gen = atomic_load(&s->t->cancel_gen);
+    bool cancelled = false;
+    long delivered = 0;
+
+    g_running = s;
+    char *line = sub->records, *end = sub->records + sub->len;
+    unsigned lineno = sub->lineno;
+    while (line < end && !g_quit) {
+        char *nl = memchr(line, '\n', (size_t)(end - line));
+        *nl = '\0';
+        if (atomic_load(&s->t->cancel_gen) != gen) cancelled = true;
+
+        /* once cancelled only SYNC still runs, so its reply is not lost */
+        if (!cancelled || strncmp(line, "SYNC", 4) == 0) {
+            int r = run_command(s, &sub->fds, line, lineno);
+            if (r >= 0) {
+                delivered += r;
+            } else if (r == -ECANCELED) {
+                delivered += (long)eitype_delivered(s->t);
+                cancelled = true;
+            }
+        }
+        lineno++;
+        line = nl + 1;
+    }
+    if (atomic_load(&s->t->cancel_gen) != gen) cancelled = true;
+    g_running = NULL;
+    METRIC_INC(submissions);
+    metrics_observe(&g_metrics.request_latency, now_ns() - sub->queued_ns);
+    free_submission(sub);
+
+    if (cancelled) METRIC_INC(cancelled);
+
+    /* records held back while the queue was full */
+    parse_lines(s);
+
+    if (!cancelled) return -1;
+    DBG("submission cancelled after %ld characters\n", delivered);
+    reply(s, "CANCELLED %ld\n", delivered);
+    return delivered;
+}
+
+void cmd_session_cancelled(struct cmd_session *s, long delivered) {
+    if (!s->cancel_waiting) return;
+    s->cancel_waiting = false;
+    s->replies_pending--;
+    reply(s, "CANCEL %ld\n", delivered);
+}
+
+bool cmd_session_init(struct cmd_session *s, struct eitype *t, int in_fd, int out_fd, bool queued) {
+    struct stat st;
+    *s = (struct cmd_session){
+        .t = t,
+        .in_fd = in_fd,
+        .out_fd = out_fd,
+        .is_socket = fstat(in_fd, &st) == 0 && S_ISSOCK(st.st_mode),
+        .queued = queued,
+        .cap = 65536,
+    };
+    s->buf = malloc(s->cap);
+    return s->buf != NULL;
+}
+
+/* A line longer than any submission may be has ended. Nothing of it
+ * was kept: it is answered with ERR, in a queued session by dropping
+ * the submission it belongs to. */
+static void end_long_line(struct cmd_session *s) {
+    unsigned lineno = ++s->lineno;
+    s->skipping = false;
+    if (!s->queued) {
+        reply(s, "ERR %u line too long\n", lineno);
+        return;
+    }
+    if (!s->discard) discard_submission(s, "too large");
+    if (s->skip_sync) {
+        reply(s, "ERR %u submission dropped: %s\n", lineno, s->discard);
+        s->discard = NULL;
+    }
+}
+
+/* Run (or queue) the complete lines in buf, as many as the queue has
+ * room for; buf keeps the rest */
+static void parse_lines(struct cmd_session *s) {
+    size_t start = 0;
+    while (!g_quit && !s->overflow && s->waiting < MAX_QUEUED) {
+        char *nl = memchr(s->buf + s->scanned, '\n', s->len - s->scanned);
+        if (!nl) {
+            s->scanned = s->len;
+            break;
+        }
+        *nl = '\0';
+        if (s->queued) collect(s, s->buf + start, ++s->lineno);
+        else run_command(s, &s->fds, s->buf + start, ++s->lineno);
+        start = s->scanned = (size_t)(nl - s->buf) + 1;
+    }
+    if (s->overflow) return;
+    s->len -= start;
+    s->scanned -= start;
+    memmove(s->buf, s->buf + start, s->len);
+
+    /* a line cannot grow past what a submission may hold: stop keeping
+     * it, and skip the rest of it as it arrives */
+    if (s->scanned == s->len && s->len > MAX_SUBMISSION) {
+        s->skip_sync = strncmp(s->buf, "SYNC ", 5) == 0;
+        s->skipping = true;
+        s->len = s->scanned = 0;
+    }
+
+    /* whatever is left when input ends is one last submission, or the
+     * end of a dropped one */
+    if (s->eof && s->len == 0) {
+        if (s->discard) {
+            reply(s, "ERR %u submission dropped: %s\n", s->lineno, s->discard);
+            s->discard = NULL;
+        }
+        close_submission(s);
+    }
+}
+
+bool cmd_session_read(struct cmd_session *s) {
+    if (!cmd_session_wants_input(s)) return true;
+    if (s->cap - s->len < 4096) {
+        char *nbuf = realloc(s->buf, s->cap * 2);
+        if (!nbuf) return false;
+        s->buf = nbuf;
+        s->cap *= 2;
+    }
+    ssize_t r = read_input(s, s->buf + s->len, s->cap - s->len - 1);
+    if (r < 0) {
+        if (errno == EINTR || errno == EAGAIN) return true;
+        fprintf(stderr, "ei-type: failed to read commands: %s\n", strerror(errno));
+        /* the producer is gone; a half-collected submission is dropped */
+        s->eof = true;
+        if (s->open) free_submission(s->open);
+        s->open = NULL;
+        s->discard = NULL;
+        return false;
+    }
+
+    bool at_eof = r == 0;
+    if (s->skipping) {
+        /* buf is empty while a long line is skipped */
+        char *nl = memchr(s->buf, '\n', (size_t)r);
+        if (!nl && !at_eof) return true;
+        if (nl) {
+            r -= nl + 1 - s->buf;
+            memmove(s->buf, nl + 1, (size_t)r);
+        }
+        end_long_line(s);
+        if (s->overflow) return true;
+    }
+    if (at_eof) {
+        /* a last record without its newline still counts */
+        s->eof = true;
+        if (s->len > 0 && s->buf[s->len - 1] != '\n') s->buf[s->len++] = '\n';
+    }
+    s->len += (size_t)r;
+
+    parse_lines(s);
+    return true;
+}
+
+void cmd_session_finish(struct cmd_session *s) {
+    if (s->open) free_submission(s->open);
+    while (s->head) {
+        struct submission *sub = s->head;
+        s->head = sub->next;
+        free_submission(sub);
+    }
+    s->open = s->tail = NULL;
+    fd_queue_clear(&s->fds);
+    free(s->buf);
+    s->buf = NULL;
+    free(s->out);
+    s->out = NULL;
+}
@@ -0,0 +1,126 @@
+/*
+ * commands.h — the TEXT/KEY/DELAY/SYNC/FLUSH record protocol
+ *
+ * Spoken on stdin by `ei-type --commands` and on each client connection
+ * of `ei-type --daemon`. A session reads records from one fd and writes
+ * replies to another; the caller owns the poll loop.
+ *
+ * A direct session runs each record as it arrives. A queued session
+ * (the daemon's) instead collects records into submissions, each ending
+ * at a SYNC record or at end of input, and leaves it to the caller to
+ * run them with cmd_session_run_next() when the connection is free. A
+ * submission always runs as a whole, so producers never interleave,
+ * unless a CANCEL cuts it short.
+ */
+#ifndef EI_TYPE_COMMANDS_H
+#define EI_TYPE_COMMANDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eitype.h"
+
+/* File descriptors received with SCM_RIGHTS and not yet consumed */
+#define MAX_PASSED_FDS 16
+
+/* Closed submissions a queued session holds before it stops reading */
+#define MAX_QUEUED 16
+
+struct fd_queue {
+    int      fds[MAX_PASSED_FDS];
+    unsigned n;
+};
+
+struct submission;
+
+struct cmd_session {
+    struct eitype *t;
+    int  in_fd, out_fd;
+    bool is_socket;     /* in_fd can carry fds (TEXTFD) */
+    bool queued;        /* collect submissions instead of running records */
+    bool eof;
+
+    char    *buf;
+    size_t   len, cap;
+    size_t   scanned;       /* buf[0..scanned) has no newline left */
+    bool     skipping;      /* in a line over the limit, dropped up to
+                             * its newline */
+    bool     skip_sync;     /* ... and that line is a SYNC */
+    unsigned lineno;
+    unsigned replies_pending;   /* SYNC and CANCEL replies still owed */
+    bool     cancel_waiting;    /* sent CANCEL, owed its reply */
+    struct fd_queue fds;
+
+    int priority;       /* for submissions closed from now on (PRIORITY) */
+    struct submission *open;        /* being collected */
+    const char *discard;            /* why the open one was dropped: the
+                                     * rest of it is skipped up to its SYNC */
+    struct submission *head, *tail; /* closed, waiting to run */
+    unsigned waiting;               /* how many of them */
+
+    /* Replies out_fd has not taken yet. A queued session never blocks
+     * on them; past a limit it gives up on its producer (overflow). */
+    char  *out;
+    size_t out_len, out_cap;
+    bool   overflow;
+
+    /* Queue wait of this producer's submissions: closed → started */
+    uint64_t submissions;
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+};
+
+/* Returns false if out of memory */
+bool cmd_session_init(struct cmd_session *s, struct eitype *t, int in_fd, int out_fd, bool queued);
+
+/* Read what in_fd has and run (or queue) every complete record. Sets eof
+ * at end of input; returns false on a read error. */
+bool cmd_session_read(struct cmd_session *s);
+
+/* There is room for what in_fd has: poll it for reading. A queued
+ * session with MAX_QUEUED submissions waiting is not read, a CANCEL
+ * behind them included, until one has run. */
+static inline bool cmd_session_wants_input(const struct cmd_session *s) {
+    return !s->eof && s->waiting < MAX_QUEUED;
+}
+
+/* Replies are waiting for out_fd: poll it for writing */
+static inline bool cmd_session_has_replies(const struct cmd_session *s) {
+    return s->out_len > 0;
+}
+
+/* Write what replies out_fd takes without blocking */
+void cmd_session_flush(struct cmd_session *s);
+
+/* A queued session has a closed submission waiting */
+static inline bool cmd_session_pending(const struct cmd_session *s) {
+    return s->head != NULL;
+}
+
+/* Priority of the next submission; only valid if one is pending */
+int cmd_session_next_priority(const struct cmd_session *s);
+
+/* Closed submissions waiting to run */
+size_t cmd_session_queued(const struct cmd_session *s);
+
+/* Run the oldest closed submission to completion. Returns -1, or the
+ * number of characters typed if the submission was cancelled; every
+ * session then gets cmd_session_cancelled() with it. */
+long cmd_session_run_next(struct cmd_session *s);
+
+/* Answer this session's CANCEL, if it sent one */
+void cmd_session_cancelled(struct cmd_session *s, long delivered);
+
+/* Input is over, nothing is left to run and every SYNC was answered
+ * and written out, or the producer stopped reading its replies */
+static inline bool cmd_session_done(const struct cmd_session *s) {
+    return s->eof && !s->open && !s->head && s->replies_pending == 0 &&
+           (s->out_len == 0 || s->overflow);
+}
+
+/* Free the session and anything still queued. Does not close
+ * in_fd/out_fd. */
+void cmd_session_finish(struct cmd_session *s);
+
+#endif
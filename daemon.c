@@ -0,0 +1,662 @@
+/*
+ * daemon.c — long-running injector and its client
+ *
+ * The daemon keeps one backend connection open and serves the record
+ * protocol of commands.c on a Unix socket. Only clients of the same user
+ * are served.
+ *
+ * Every client is a producer. Its records are collected into
+ * submissions (up to each SYNC) and queued; the daemon runs one
+ * submission at a time, to completion, so text from two producers never
+ * interleaves. The next submission is the highest-priority one waiting,
+ * and producers of equal priority take turns. How long submissions wait
+ * is kept per producer (STATS record, and logged with -v on hangup).
+ * A producer with MAX_QUEUED submissions waiting is not read until one
+ * has run, and one that does not read its replies is dropped, so no
+ * client can hold the daemon's memory or stall it.
+ *
+ * While a submission is typed, the pauses between keys are spent reading
+ * the other clients, so a CANCEL record stops it at the next key. So
+ * does SIGUSR1, for binding `ei-type --client --cancel` or `pkill -USR1
+ * ei-type` to a hotkey.
+ *
+ * The client copies stdin into a memfd, seals it and passes it with a
+ * TEXTFD record, so the text crosses into the daemon without going
+ * through the socket buffer. It exits once the daemon has acked it.
+ *
+ * The counters of metrics.h are served next to the socket, on
+ * ei-type.metrics (the socket path with .sock replaced): connect, and
+ * get them in the Prometheus text format, with an HTTP header if the
+ * request was an HTTP GET. Outside MINI_DBUS builds they are also
+ * properties of /org/eitype/Daemon on the session bus.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MINI_DBUS
+#include <systemd/sd-bus.h>
+#endif
+
+#include "daemon.h"
+#include "commands.h"
+#include "eitype-private.h"
+#include "metrics.h"
+
+/* Fill addr from path, or the default socket in $XDG_RUNTIME_DIR */
+static bool socket_addr(const char *path, struct sockaddr_un *addr) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    int n;
+    if (path) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+    } else if (dir) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/ei-type.sock", dir);
+    } else {
+        fprintf(stderr, "ei-type: XDG_RUNTIME_DIR is not set, pass a socket path\n");
+        return false;
+    }
+    if (n < 0 || (size_t)n >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "ei-type: socket path too long\n");
+        return false;
+    }
+    return true;
+}
+
+/* The metrics socket: sock's path with a .sock suffix replaced */
+static bool metrics_addr(const struct sockaddr_un *sock, struct sockaddr_un *addr) {
+    *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+    size_t len = strlen(sock->sun_path);
+    if (len >= 5 && strcmp(sock->sun_path + len - 5, ".sock") == 0) len -= 5;
+    int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%.*s.metrics",
+                     (int)len, sock->sun_path);
+    if (n < 0 || (size_t)n >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "ei-type: metrics socket path too long\n");
+        return false;
+    }
+    return true;
+}
+
+static bool peer_is_us(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return false;
+    return cred.uid == getuid();
+}
+
+static int listen_on(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ei-type: socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* replace a stale socket from an earlier run, but nothing else */
+    struct stat st;
+    if (lstat(addr->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(addr->sun_path);
+
+    if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 || listen(fd, 16) < 0) {
+        fprintf(stderr, "ei-type: cannot listen on %s: %s\n", addr->sun_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(addr->sun_path, 0600);
+    return fd;
+}
+
+#define MAX_CLIENTS 32
+
+/* Metrics connections waiting for their request */
+#define MAX_SCRAPES 4
+
+struct client {
+    int      fd;        /* -1: free slot */
+    unsigned id;
+    struct cmd_session s;
+};
+
+struct daemon {
+    struct eitype *t;
+    int      lfd;
+    struct client clients[MAX_CLIENTS];
+    unsigned last;      /* client served last, for round-robin */
+    unsigned next_id;
+
+    unsigned dispatches;    /* backend events processed, for WAIT_BACKEND */
+
+    int      mfd;       /* metrics socket, -1 if none */
+    int      scrapes[MAX_SCRAPES];  /* -1: free slot */
+#ifndef MINI_DBUS
+    sd_bus  *bus;       /* metrics properties, NULL if no session bus */
+#endif
+};
+
+static struct eitype *g_daemon_t;
+
+static void cancel_handler(int sig) {
+    (void)sig;
+    if (g_daemon_t) eitype_cancel(g_daemon_t);
+}
+
+/* Next client to run a submission: the highest priority waiting wins,
+ * ties go to the first client after the one served last */
+static struct client *schedule(struct daemon *d) {
+    struct client *best = NULL;
+    int best_prio = 0;
+    for (unsigned i = 1; i <= MAX_CLIENTS; i++) {
+        struct client *c = &d->clients[(d->last + i) % MAX_CLIENTS];
+        if (c->fd < 0 || !cmd_session_pending(&c->s)) continue;
+        int prio = cmd_session_next_priority(&c->s);
+        if (!best || prio > best_prio) {
+            best = c;
+            best_prio = prio;
+        }
+    }
+    if (best) d->last = (unsigned)(best - d->clients);
+    return best;
+}
+
+static void drop_client(struct client *c) {
+    struct cmd_session *s = &c->s;
+    DBG("client %u gone: %llu submissions, queue wait avg %.1fms max %.1fms\n", c->id,
+        (unsigned long long)s->submissions,
+        s->submissions ? (double)s->wait_ns / (double)s->submissions / 1e6 : 0.0,
+        (double)s->wait_max_ns / 1e6);
+    cmd_session_finish(s);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void accept_client(struct daemon *d) {
+    /* non-blocking: a client that does not read its replies must not
+     * stall the others (see cmd_session_flush) */
+    int fd = accept4(d->lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+
+    struct client *c = NULL;
+    for (unsigned i = 0; i < MAX_CLIENTS && !c; i++) {
+        if (d->clients[i].fd < 0) c = &d->clients[i];
+    }
+    if (!c || !peer_is_us(fd) || !cmd_session_init(&c->s, d->t, fd, fd, true)) {
+        DBG("rejected client\n");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->id = d->next_id++;
+    DBG("client %u connected\n", c->id);
+}
+
+static struct metrics_gauges gauges(const struct daemon *d) {
+    struct metrics_gauges g = { 0 };
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        if (d->clients[i].fd < 0) continue;
+        g.clients++;
+        g.queue_depth += cmd_session_queued(&d->clients[i].s);
+    }
+    return g;
+}
+
+static void accept_scrape(struct daemon *d) {
+    int fd = accept4(d->mfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) return;
+
+    for (unsigned i = 0; i < MAX_SCRAPES; i++) {
+        if (d->scrapes[i] < 0 && peer_is_us(fd)) {
+            d->scrapes[i] = fd;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/* The request is in (or the scraper shut down its end): answer, hang up */
+static void answer_scrape(struct daemon *d, unsigned i) {
+    int fd = d->scrapes[i];
+    d->scrapes[i] = -1;
+
+    char req[512];
+    ssize_t n = read(fd, req, sizeof(req));
+    bool http = n >= 4 && memcmp(req, "GET ", 4) == 0;
+
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (f) {
+        struct metrics_gauges g = gauges(d);
+        metrics_write(f, &g);
+        fclose(f);
+    }
+    if (!text) {
+        close(fd);
+        return;
+    }
+
+    /* a few KB: fits the socket buffer, so this does not block */
+    char hdr[128];
+    int hlen = http ? snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", len) : 0;
+    if (hlen > 0) send(fd, hdr, (size_t)hlen, MSG_NOSIGNAL);
+    send(fd, text, len, MSG_NOSIGNAL);
+    free(text);
+    close(fd);
+}
+
+#ifndef MINI_DBUS
+static int get_property(sd_bus *bus, const char *path, const char *interface,
+                        const char *property, sd_bus_message *reply, void *userdata,
+                        sd_bus_error *error) {
+    (void)bus; (void)path; (void)interface; (void)error;
+    static const struct {
+        const char *name;
+        atomic_uint_fast64_t *v;
+    } counters[] = {
+        { "Keys",              &g_metrics.keys },
+        { "Frames",            &g_metrics.frames },
+        { "Flushes",           &g_metrics.flushes },
+        { "BytesWritten",      &g_metrics.bytes_written },
+        { "UnmappableChars",   &g_metrics.unmappable },
+        { "Submissions",       &g_metrics.submissions },
+        { "Cancelled",         &g_metrics.cancelled },
+        { "Dropped",           &g_metrics.dropped },
+        { "Pauses",            &g_metrics.pauses },
+        { "Reconnects",        &g_metrics.reconnects },
+        { "ReconnectFailures", &g_metrics.reconnect_failures },
+        { "StandbyPromotions", &g_metrics.standby_promotions },
+        { "StandbyReady",      &g_metrics.standby_ready },
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (strcmp(property, counters[i].name) == 0)
+            return sd_bus_message_append(reply, "t", (uint64_t)atomic_load_explicit(
+                                             counters[i].v, memory_order_relaxed));
+    }
+
+    struct metrics_gauges g = gauges(userdata);
+    if (strcmp(property, "QueueDepth") == 0) return sd_bus_message_append(reply, "t", g.queue_depth);
+    if (strcmp(property, "Clients") == 0) return sd_bus_message_append(reply, "t", g.clients);
+
+    /* histograms: (upper bound in ns, count) per bucket, UINT64_MAX last */
+    static const struct {
+        const char *name;
+        struct metrics_hist *h;
+    } histograms[] = {
+        { "RequestLatency", &g_metrics.request_latency },
+        { "SyncLatency",    &g_metrics.sync_latency },
+        { "RecoverLatency", &g_metrics.recover_latency },
+    };
+    struct metrics_hist *h = NULL;
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++) {
+        if (strcmp(property, histograms[i].name) == 0) h = histograms[i].h;
+    }
+    if (!h) return -ENOENT;
+    int r = sd_bus_message_open_container(reply, 'a', "(tt)");
+    for (unsigned b = 0; r >= 0 && b <= METRICS_BUCKETS; b++) {
+        bool last = b == METRICS_BUCKETS;
+        if (!last && !h->bounds_ns[b]) continue;
+        r = sd_bus_message_append(reply, "(tt)", last ? UINT64_MAX : h->bounds_ns[b],
+                                  (uint64_t)atomic_load_explicit(&h->count[b],
+                                                                 memory_order_relaxed));
+    }
+    return r < 0 ? r : sd_bus_message_close_container(reply);
+}
+
+/* no flags: the values change without PropertiesChanged signals */
+#define METRIC_PROPERTY(name, sig) SD_BUS_PROPERTY(name, sig, get_property, 0, 0)
+
+static const sd_bus_vtable metrics_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    METRIC_PROPERTY("Keys", "t"),
+    METRIC_PROPERTY("Frames", "t"),
+    METRIC_PROPERTY("Flushes", "t"),
+    METRIC_PROPERTY("BytesWritten", "t"),
+    METRIC_PROPERTY("UnmappableChars", "t"),
+    METRIC_PROPERTY("Submissions", "t"),
+    METRIC_PROPERTY("Cancelled", "t"),
+    METRIC_PROPERTY("Dropped", "t"),
+    METRIC_PROPERTY("Pauses", "t"),
+    METRIC_PROPERTY("Reconnects", "t"),
+    METRIC_PROPERTY("ReconnectFailures", "t"),
+    METRIC_PROPERTY("StandbyPromotions", "t"),
+    METRIC_PROPERTY("StandbyReady", "t"),
+    METRIC_PROPERTY("QueueDepth", "t"),
+    METRIC_PROPERTY("Clients", "t"),
+    METRIC_PROPERTY("RequestLatency", "a(tt)"),
+    METRIC_PROPERTY("SyncLatency", "a(tt)"),
+    METRIC_PROPERTY("RecoverLatency", "a(tt)"),
+    SD_BUS_VTABLE_END
+};
+
+/* Export the metrics on the session bus; without one, go on without */
+static void bus_open(struct daemon *d) {
+    sd_bus *bus = NULL;
+    int r = sd_bus_open_user(&bus);
+    if (r >= 0) r = sd_bus_add_object_vtable(bus, NULL, "/org/eitype/Daemon",
+                                             "org.eitype.Metrics", metrics_vtable, d);
+    if (r >= 0) r = sd_bus_request_name(bus, "org.eitype.Daemon", 0);
+    if (r < 0) {
+        DBG("no metrics on D-Bus: %s\n", strerror(-r));
+        sd_bus_unref(bus);
+        return;
+    }
+    d->bus = bus;
+}
+#endif
+
+/* Wait up to timeout_ns (CLOCK_FOREVER: no limit) for new clients,
+ * client input and backend events, and handle whatever is ready. Client
+ * records are only queued here, except CANCEL. */
+static int serve_io(struct daemon *d, uint64_t timeout_ns) {
+    enum { BACKEND = MAX_CLIENTS + 1, METRICS, SCRAPES, BUS = SCRAPES + MAX_SCRAPES, NFDS };
+    struct pollfd pfd[NFDS];
+    pfd[0] = (struct pollfd){ .fd = d->lfd, .events = POLLIN };
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        struct client *c = &d->clients[i];
+        short events = 0;
+        if (c->fd >= 0 && cmd_session_wants_input(&c->s)) events |= POLLIN;
+        if (c->fd >= 0 && cmd_session_has_replies(&c->s)) events |= POLLOUT;
+        pfd[i + 1] = (struct pollfd){ .fd = events ? c->fd : -1, .events = events };
+    }
+    pfd[BACKEND] = (struct pollfd){ .fd = eitype_get_fd(d->t), .events = POLLIN };
+    pfd[METRICS] = (struct pollfd){ .fd = d->mfd, .events = POLLIN };
+    for (unsigned i = 0; i < MAX_SCRAPES; i++)
+        pfd[SCRAPES + i] = (struct pollfd){ .fd = d->scrapes[i], .events = POLLIN };
+    pfd[BUS] = (struct pollfd){ .fd = -1 };
+#ifndef MINI_DBUS
+    if (d->bus) {
+        while (sd_bus_process(d->bus, NULL) > 0) {}
+        int events = sd_bus_get_events(d->bus);
+        pfd[BUS] = (struct pollfd){ .fd = sd_bus_get_fd(d->bus),
+                                    .events = (short)(events > 0 ? events : POLLIN) };
+    }
+#endif
+
+    int r = clock_poll(pfd, NFDS, timeout_ns);
+    if (r <= 0) return r;
+
+    if (pfd[BACKEND].revents) {
+        eitype_dispatch(d->t);
+        d->dispatches++;
+    }
+    if (pfd[0].revents) accept_client(d);
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        struct cmd_session *s = &d->clients[i].s;
+        if (pfd[i + 1].revents & (POLLOUT | POLLERR | POLLHUP)) cmd_session_flush(s);
+        if (pfd[i + 1].revents & ~POLLOUT && cmd_session_wants_input(s)) cmd_session_read(s);
+    }
+    for (unsigned i = 0; i < MAX_SCRAPES; i++) {
+        if (pfd[SCRAPES + i].revents) answer_scrape(d, i);
+    }
+    if (pfd[METRICS].revents) accept_scrape(d);
+#ifndef MINI_DBUS
+    if (pfd[BUS].revents) {
+        while (sd_bus_process(d->bus, NULL) > 0) {}
+    }
+#endif
+    return r;
+}
+
+/* The backend is busy, or eitype_sync() is: serve clients until it has
+ * had events (a reconnect attempt counts), or a CANCEL came */
+static void wait_backend_serving(struct daemon *d) {
+    struct eitype *t = d->t;
+    unsigned gen = atomic_load(&t->cancel_gen), seen = d->dispatches;
+    while (d->dispatches == seen && atomic_load(&t->cancel_gen) == gen &&
+           !g_quit && !t->b->dead) {
+        uint64_t timeout = CLOCK_FOREVER, now = now_ns();
+        if (t->b->retry_ns) timeout = t->b->retry_ns > now ? t->b->retry_ns - now : 0;
+        if (serve_io(d, timeout) < 0 && errno != EINTR) {
+            /* cannot watch the clients; wait for the backend alone */
+            struct pollfd pfd = { .fd = eitype_get_fd(t), .events = POLLIN };
+            clock_poll(&pfd, 1, timeout);
+            eitype_dispatch(t);
+            break;
+        }
+        if (t->b->retry_ns && now_ns() >= t->b->retry_ns) {
+            eitype_dispatch(t);
+            d->dispatches++;
+        }
+    }
+}
+
+/* Pause between keys of a running submission: keep serving clients so
+ * a CANCEL gets through, and stop waiting as soon as it does. Without a
+ * delay, serve once without waiting. */
+static void daemon_wait(struct eitype *t, uint64_t delay_us, void *data) {
+    struct daemon *d = data;
+    if (delay_us == WAIT_BACKEND) {
+        wait_backend_serving(d);
+        return;
+    }
+    uint64_t deadline = now_ns() + delay_us * 1000;
+
+    while (!run_status(t)) {
+        uint64_t now = now_ns();
+        if (serve_io(d, deadline > now ? deadline - now : 0) < 0 && errno != EINTR) {
+            /* cannot watch the clients; at least keep the pace */
+            clock_sleep_until(deadline);
+            break;
+        }
+        if (now_ns() >= deadline) break;
+    }
+}
+
+int run_daemon(struct eitype *t, const char *path) {
+    struct sockaddr_un addr, maddr;
+    if (!socket_addr(path, &addr) || !metrics_addr(&addr, &maddr)) return 1;
+
+    static struct daemon d;
+    d.t = t;
+    d.lfd = listen_on(&addr);
+    if (d.lfd < 0) return 1;
+    DBG("listening on %s\n", addr.sun_path);
+
+    /* metrics are nice to have: serve without them if need be */
+    d.mfd = listen_on(&maddr);
+    if (d.mfd >= 0) DBG("metrics on %s\n", maddr.sun_path);
+    for (unsigned i = 0; i < MAX_SCRAPES; i++) d.scrapes[i] = -1;
+#ifndef MINI_DBUS
+    bus_open(&d);
+#endif
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) d.clients[i].fd = -1;
+    d.last = MAX_CLIENTS - 1;
+    d.next_id = 1;
+
+    /* a client that hangs up early must not take the daemon with it */
+    signal(SIGPIPE, SIG_IGN);
+
+    t->wait = daemon_wait;
+    t->wait_data = &d;
+    g_daemon_t = t;
+    signal(SIGUSR1, cancel_handler);
+    /* reconnect attempts come from this loop, so clients are served
+     * between them */
+    t->b->reconnect_async = true;
+
+    while (!g_quit && !t->b->dead) {
+        if (t->stats.pending_since) eitype_flush(t);
+        if (t->b->retry_ns && now_ns() >= t->b->retry_ns) eitype_dispatch(t);
+        uint64_t retry_ns = t->b->retry_ns;
+
+        /* with work queued, only look for input without waiting; while
+         * reconnecting, submissions wait for the connection */
+        bool runnable = false;
+        for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+            if (d.clients[i].fd >= 0 && cmd_session_pending(&d.clients[i].s)) runnable = !retry_ns;
+        }
+        /* nothing to type: time for the backend's own upkeep */
+        if (!runnable && t->b->idle) t->b->idle(t->b);
+        uint64_t timeout = runnable ? 0 : CLOCK_FOREVER, now = now_ns();
+        if (retry_ns) timeout = retry_ns > now ? retry_ns - now : 0;
+        if (serve_io(&d, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
+            break;
+        }
+
+        /* one submission per pass, so new arrivals are seen in between */
+        struct client *c = t->b->retry_ns ? NULL : schedule(&d);
+        long cancelled = c ? cmd_session_run_next(&c->s) : -1;
+        if (cancelled >= 0) {
+            for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+                if (d.clients[i].fd >= 0) cmd_session_cancelled(&d.clients[i].s, cancelled);
+            }
+        }
+
+        for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+            if (d.clients[i].fd >= 0 && cmd_session_done(&d.clients[i].s)) drop_client(&d.clients[i]);
+        }
+    }
+
+    signal(SIGUSR1, SIG_DFL);
+    g_daemon_t = NULL;
+    t->wait = NULL;
+    t->b->reconnect_async = false;
+    for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+        if (d.clients[i].fd >= 0) drop_client(&d.clients[i]);
+    }
+    close(d.lfd);
+    unlink(addr.sun_path);
+    for (unsigned i = 0; i < MAX_SCRAPES; i++) {
+        if (d.scrapes[i] >= 0) close(d.scrapes[i]);
+    }
+    if (d.mfd >= 0) {
+        close(d.mfd);
+        unlink(maddr.sun_path);
+    }
+#ifndef MINI_DBUS
+    d.bus = sd_bus_flush_close_unref(d.bus);
+#endif
+    return t->b->dead ? 1 : 0;
+}
+
+/* Copy stdin into a memfd sealed against any further change */
+static int stdin_memfd(void) {
+    int fd = memfd_create("ei-type-text", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        fprintf(stderr, "ei-type: memfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ei-type: failed to read stdin: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        for (ssize_t off = 0; off < r; ) {
+            ssize_t w = write(fd, buf + off, (size_t)(r - off));
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "ei-type: memfd write: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+            }
+            off += w;
+        }
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        fprintf(stderr, "ei-type: sealing memfd: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Send one record with fd attached */
+static bool send_with_fd(int sock, const char *record, int fd) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { .iov_base = (void *)record, .iov_len = strlen(record) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+
+    ssize_t r;
+    while ((r = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    return r == (ssize_t)iov.iov_len;
+}
+
+int run_client(const char *path, const char *key_combo, bool cancel) {
+    struct sockaddr_un addr;
+    if (!socket_addr(path, &addr)) return 1;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "ei-type: cannot connect to %s: %s\n", addr.sun_path, strerror(errno));
+        if (sock >= 0) close(sock);
+        return 1;
+    }
+
+    bool ok;
+    if (cancel) {
+        ok = dprintf(sock, "CANCEL\n") > 0;
+    } else if (key_combo) {
+        /* one record per line: combos are whitespace separated anyway */
+        char *combo = strdup(key_combo);
+        if (!combo) { close(sock); return 1; }
+        for (char *p = combo; *p; p++) if (*p == '\n' || *p == '\r') *p = ' ';
+        ok = dprintf(sock, "KEY %s\nSYNC done\n", combo) > 0;
+        free(combo);
+    } else {
+        int fd = stdin_memfd();
+        if (fd < 0) { close(sock); return 1; }
+        ok = send_with_fd(sock, "TEXTFD\n", fd) && dprintf(sock, "SYNC done\n") > 0;
+        close(fd);
+    }
+    if (!ok) {
+        fprintf(stderr, "ei-type: failed to send to daemon: %s\n", strerror(errno));
+        close(sock);
+        return 1;
+    }
+    shutdown(sock, SHUT_WR);
+
+    /* wait for the ack; report anything the daemon rejected */
+    FILE *f = fdopen(sock, "r");
+    if (!f) { close(sock); return 1; }
+    char *line = NULL;
+    size_t cap = 0;
+    int rc = 1;
+    while (getline(&line, &cap, f) > 0) {
+        if (strcmp(line, "SYNC done\n") == 0 || strncmp(line, "CANCEL ", 7) == 0) {
+            if (rc == 1) rc = 0;
+            if (strcmp(line, "CANCEL -\n") == 0)
+                fprintf(stderr, "ei-type: nothing to cancel\n");
+            else if (line[0] == 'C')
+                fprintf(stderr, "ei-type: cancelled after %ld characters\n", atol(line + 7));
+        } else if (strncmp(line, "CANCELLED ", 10) == 0) {
+            fprintf(stderr, "ei-type: cancelled after %ld characters\n", atol(line + 10));
+            rc = 2;
+        } else if (strncmp(line, "ERR ", 4) == 0) {
+            fprintf(stderr, "ei-type: daemon: %s", line + 4);
+            rc = 2;
+        }
+    }
+    if (rc == 1) fprintf(stderr, "ei-type: daemon closed the connection early\n");
+    free(line);
+    fclose(f);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * daemon.h — ei-type --daemon / --client over a Unix socket
+ */
+#ifndef EI_TYPE_DAEMON_H
+#define EI_TYPE_DAEMON_H
+
+#include <stdbool.h>
+
+#include "eitype.h"
+
+/* Serve the commands.c protocol to clients on path (NULL: default
+ * $XDG_RUNTIME_DIR/ei-type.sock) until interrupted, and metrics.h on
+ * the matching .metrics socket. Returns an exit code. */
+int run_daemon(struct eitype *t, const char *path);
+
+/* Hand stdin to the daemon as a sealed memfd (or send key_combo, if not
+ * NULL) and wait until it has been typed. With cancel, stop whatever the
+ * daemon is typing instead. Returns an exit code. */
+int run_client(const char *path, const char *key_combo, bool cancel);
+
+#endif
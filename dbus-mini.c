@@ -0,0 +1,509 @@
+/*
+ * dbus-mini.c — just enough D-Bus for one method call
+ *
+ * Speaks the wire protocol directly: SASL EXTERNAL with fd passing, a
+ * Hello, then method calls taking an int32 (or rtkit's uint64, uint32).
+ * Auth and Hello go out in one write and Hello's reply is never waited
+ * for, so connectToEIS costs two round trips to the bus.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbus-mini.h"
+#include "backend.h"
+
+#define MSG_METHOD_CALL   1
+#define MSG_METHOD_RETURN 2
+#define MSG_ERROR         3
+
+#define FIELD_PATH         1
+#define FIELD_INTERFACE    2
+#define FIELD_MEMBER       3
+#define FIELD_ERROR_NAME   4
+#define FIELD_REPLY_SERIAL 5
+#define FIELD_DESTINATION  6
+#define FIELD_SIGNATURE    8
+#define FIELD_UNIX_FDS     9
+
+/* Replies we skip (NameAcquired, Hello's) are tiny; anything bigger than
+ * this is not for us either */
+#define MAX_MESSAGE (64 * 1024)
+#define MAX_FDS 16
+
+struct dbus_mini {
+    int      fd;
+    uint32_t serial;
+    unsigned char *in;
+    size_t   in_len, in_cap;
+    int      fds[MAX_FDS];      /* received, not yet claimed by a message */
+    unsigned nfds;
+};
+
+/* Outgoing message; our headers are a few hundred bytes */
+struct msg {
+    unsigned char buf[1024];
+    size_t len;
+    bool   overflow;
+};
+
+static void put(struct msg *m, const void *p, size_t n) {
+    if (m->len + n > sizeof(m->buf)) {
+        m->overflow = true;
+        return;
+    }
+    memcpy(m->buf + m->len, p, n);
+    m->len += n;
+}
+
+static void put_align(struct msg *m, size_t a) {
+    static const unsigned char zero[8];
+    put(m, zero, (a - m->len % a) % a);
+}
+
+static void put_u8(struct msg *m, uint8_t v) { put(m, &v, 1); }
+
+static void put_u32(struct msg *m, uint32_t v) {
+    put_align(m, 4);
+    put(m, &v, 4);      /* host order, as the first header byte says */
+}
+
+static void put_str(struct msg *m, const char *s) {
+    size_t n = strlen(s);
+    put_u32(m, (uint32_t)n);
+    put(m, s, n + 1);
+}
+
+static void put_sig(struct msg *m, const char *s) {
+    size_t n = strlen(s);
+    put_u8(m, (uint8_t)n);
+    put(m, s, n + 1);
+}
+
+static void put_field(struct msg *m, uint8_t code, const char *type, const char *value) {
+    put_align(m, 8);
+    put_u8(m, code);
+    put_sig(m, type);
+    if (type[0] == 'g') put_sig(m, value);
+    else put_str(m, value);
+}
+
+/* Method call; body is already marshalled for signature sig (or NULL) */
+static void build_call(struct msg *m, uint32_t serial, const char *dest, const char *path,
+                       const char *iface, const char *member,
+                       const char *sig, const void *body, uint32_t body_len) {
+    m->len = 0;
+    m->overflow = false;
+    put_u8(m, __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 'l' : 'B');
+    put_u8(m, MSG_METHOD_CALL);
+    put_u8(m, 0);
+    put_u8(m, 1);
+    put_u32(m, body_len);
+    put_u32(m, serial);
+    put_u32(m, 0);      /* header field array length, patched below */
+
+    put_field(m, FIELD_PATH, "o", path);
+    if (iface) put_field(m, FIELD_INTERFACE, "s", iface);
+    put_field(m, FIELD_MEMBER, "s", member);
+    put_field(m, FIELD_DESTINATION, "s", dest);
+    if (sig) put_field(m, FIELD_SIGNATURE, "g", sig);
+
+    uint32_t fields = (uint32_t)(m->len - 16);
+    memcpy(m->buf + 12, &fields, 4);
+    put_align(m, 8);
+    put(m, body, body_len);
+}
+
+static bool send_all(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n) {
+        ssize_t w = send(fd, c, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        c += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+/* Append what the socket has to bus->in, collecting passed fds. With
+ * MSG_DONTWAIT in flags, 0 if it has nothing yet; -1 on errors. */
+static int recv_more(struct dbus_mini *bus, int flags) {
+    if (bus->in_cap - bus->in_len < 4096) {
+        size_t cap = bus->in_cap ? bus->in_cap * 2 : 8192;
+        unsigned char *in = realloc(bus->in, cap);
+        if (!in) return -1;
+        bus->in = in;
+        bus->in_cap = cap;
+    }
+
+    struct iovec iov = { bus->in + bus->in_len, bus->in_cap - bus->in_len };
+    union {
+        char buf[CMSG_SPACE(MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf),
+    };
+    ssize_t n;
+    do n = recvmsg(bus->fd, &mh, MSG_CMSG_CLOEXEC | flags);
+    while (n < 0 && errno == EINTR);
+    if (n < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) {
+        fprintf(stderr, "ei-type: D-Bus connection %s\n", n ? strerror(errno) : "closed");
+        return -1;
+    }
+    bus->in_len += (size_t)n;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        size_t k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)(void *)CMSG_DATA(c);
+        for (size_t i = 0; i < k; i++) {
+            if (bus->nfds < MAX_FDS) bus->fds[bus->nfds++] = fds[i];
+            else close(fds[i]);
+        }
+    }
+    return 1;
+}
+
+static void consume(struct dbus_mini *bus, size_t n) {
+    memmove(bus->in, bus->in + n, bus->in_len - n);
+    bus->in_len -= n;
+}
+
+/* Read one "\r\n"-terminated SASL line into line */
+static bool read_line(struct dbus_mini *bus, char *line, size_t size) {
+    for (;;) {
+        unsigned char *end = bus->in_len ? memmem(bus->in, bus->in_len, "\r\n", 2) : NULL;
+        if (end) {
+            size_t n = (size_t)(end - bus->in);
+            if (n >= size) n = size - 1;
+            memcpy(line, bus->in, n);
+            line[n] = '\0';
+            consume(bus, (size_t)(end - bus->in) + 2);
+            return true;
+        }
+        if (bus->in_len > 1024 || recv_more(bus, 0) < 0) return false;
+    }
+}
+
+/* A received message, pointing into bus->in */
+struct reply {
+    uint8_t  type;
+    bool     swap;          /* sent in the other byte order */
+    uint32_t reply_serial;
+    uint32_t unix_fds;
+    const char *signature;
+    const char *error_name;
+    const unsigned char *body;
+    uint32_t body_len;
+    size_t   total;
+};
+
+/* swap: the sender's byte order differs from ours */
+static uint32_t get_u32(const unsigned char *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static size_t align_to(size_t off, size_t a) {
+    return (off + a - 1) / a * a;
+}
+
+/* Parse the header fields we care about. Returns false if malformed. */
+static bool parse_header(const unsigned char *p, size_t end, struct reply *r) {
+    size_t off = 16;
+    while (off < end) {
+        off = align_to(off, 8);
+        if (off + 3 > end) return false;
+        uint8_t code = p[off++];
+        uint8_t siglen = p[off++];
+        if (siglen != 1 || off + 2 > end) return false;
+        char type = (char)p[off];
+        off += 2;
+
+        switch (type) {
+        case 's': case 'o': {
+            off = align_to(off, 4);
+            if (off + 4 > end) return false;
+            uint32_t len = get_u32(p + off, r->swap);
+            if (end - off < 5 || len > end - off - 5 || p[off + 4 + len] != '\0') return false;
+            if (code == FIELD_ERROR_NAME) r->error_name = (const char *)p + off + 4;
+            off += 4 + len + 1;
+            break;
+        }
+        case 'g': {
+            if (off >= end) return false;
+            uint8_t len = p[off];
+            if ((size_t)len + 2 > end - off || p[off + 1 + len] != '\0') return false;
+            if (code == FIELD_SIGNATURE) r->signature = (const char *)p + off + 1;
+            off += 1 + len + 1;
+            break;
+        }
+        case 'u': {
+            off = align_to(off, 4);
+            if (off + 4 > end) return false;
+            uint32_t v = get_u32(p + off, r->swap);
+            if (code == FIELD_REPLY_SERIAL) r->reply_serial = v;
+            if (code == FIELD_UNIX_FDS) r->unix_fds = v;
+            off += 4;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/* The next message into r: 1, or without wait 0 if it has not all come
+ * in yet; -1 on errors */
+static int read_message(struct dbus_mini *bus, struct reply *r, bool wait) {
+    for (;;) {
+        if (bus->in_len >= 16) {
+            const unsigned char *p = bus->in;
+            memset(r, 0, sizeof(*r));
+            r->swap = p[0] != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? 'l' : 'B');
+            r->type = p[1];
+            r->body_len = get_u32(p + 4, r->swap);
+            uint32_t fields = get_u32(p + 12, r->swap);
+            if ((p[0] != 'l' && p[0] != 'B') || fields > MAX_MESSAGE || r->body_len > MAX_MESSAGE) {
+                fprintf(stderr, "ei-type: malformed D-Bus message\n");
+                return -1;
+            }
+            size_t body_off = align_to(16 + fields, 8);
+            r->total = body_off + r->body_len;
+            if (bus->in_len >= r->total) {
+                if (!parse_header(p, 16 + fields, r)) {
+                    fprintf(stderr, "ei-type: malformed D-Bus message header\n");
+                    return -1;
+                }
+                r->body = p + body_off;
+                if (!r->signature) r->signature = "";
+                return 1;
+            }
+        }
+        int got = recv_more(bus, wait ? 0 : MSG_DONTWAIT);
+        if (got <= 0) return got;
+    }
+}
+
+/* Take the fds that came with a message off the queue */
+static unsigned claim_fds(struct dbus_mini *bus, uint32_t n, int *out) {
+    unsigned k = n < bus->nfds ? n : bus->nfds;
+    memcpy(out, bus->fds, k * sizeof(int));
+    memmove(bus->fds, bus->fds + k, (bus->nfds - k) * sizeof(int));
+    bus->nfds -= k;
+    return k;
+}
+
+/* Socket address from a D-Bus address string */
+static bool parse_address(const char *addr, struct sockaddr_un *sa, socklen_t *salen) {
+    /* first unix: entry; entries are ';'-separated, keys ','-separated */
+    for (const char *p = addr; p && *p; p = strchr(p, ';') ? strchr(p, ';') + 1 : NULL) {
+        if (strncmp(p, "unix:", 5) != 0) continue;
+        const char *kv = p + 5;
+        while (*kv && *kv != ';') {
+            bool abstract = strncmp(kv, "abstract=", 9) == 0;
+            bool path = strncmp(kv, "path=", 5) == 0;
+            const char *v = kv + (abstract ? 9 : path ? 5 : 0);
+            size_t n = 0;
+            char out[sizeof(sa->sun_path)];
+            for (; *v && *v != ',' && *v != ';' && n < sizeof(out) - 1; v++) {
+                unsigned hex;
+                if (*v == '%' && sscanf(v + 1, "%2x", &hex) == 1) {
+                    out[n++] = (char)hex;
+                    v += 2;
+                } else {
+                    out[n++] = *v;
+                }
+            }
+            if (abstract || path) {
+                memset(sa, 0, sizeof(*sa));
+                sa->sun_family = AF_UNIX;
+                memcpy(sa->sun_path + (abstract ? 1 : 0), out, n);
+                *salen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + n + (abstract ? 1 : 0));
+                return true;
+            }
+            kv = strchr(kv, ',');
+            if (!kv) break;
+            kv++;
+        }
+    }
+    return false;
+}
+
+static struct dbus_mini *open_bus(const char *addr, const char *what) {
+    struct sockaddr_un sa;
+    socklen_t salen;
+    if (!parse_address(addr, &sa, &salen)) {
+        fprintf(stderr, "ei-type: unsupported D-Bus address '%s'\n", addr);
+        return NULL;
+    }
+
+    struct dbus_mini *bus = calloc(1, sizeof(*bus));
+    if (!bus) return NULL;
+    bus->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (bus->fd < 0 || connect(bus->fd, (struct sockaddr *)&sa, salen) < 0) {
+        fprintf(stderr, "ei-type: failed to connect to %s bus: %s\n", what, strerror(errno));
+        dbus_mini_close(bus);
+        return NULL;
+    }
+
+    /* AUTH EXTERNAL takes our uid as hex-encoded ASCII. Everything up to
+     * Hello goes in one write; the bus answers it in order. */
+    char uid[16], hex[sizeof(uid) * 2 + 1];
+    int n = snprintf(uid, sizeof(uid), "%u", (unsigned)getuid());
+    for (int i = 0; i < n; i++) sprintf(hex + 2 * i, "%02x", (unsigned char)uid[i]);
+
+    struct msg m;
+    m.len = 0;
+    m.overflow = false;
+    put_u8(&m, '\0');
+    char auth[96];
+    int alen = snprintf(auth, sizeof(auth), "AUTH EXTERNAL %s\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n", hex);
+    put(&m, auth, (size_t)alen);
+
+    struct msg hello;
+    build_call(&hello, ++bus->serial, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+               "org.freedesktop.DBus", "Hello", NULL, NULL, 0);
+    put(&m, hello.buf, hello.len);
+
+    char line[256];
+    if (m.overflow || hello.overflow || !send_all(bus->fd, m.buf, m.len) ||
+        !read_line(bus, line, sizeof(line)) || strncmp(line, "OK ", 3) != 0) {
+        fprintf(stderr, "ei-type: D-Bus authentication failed\n");
+        dbus_mini_close(bus);
+        return NULL;
+    }
+    if (!read_line(bus, line, sizeof(line)) || strcmp(line, "AGREE_UNIX_FD") != 0) {
+        fprintf(stderr, "ei-type: D-Bus does not pass file descriptors\n");
+        dbus_mini_close(bus);
+        return NULL;
+    }
+    DBG("D-Bus %s bus authenticated\n", what);
+    return bus;
+}
+
+struct dbus_mini *dbus_mini_open_session(void) {
+    char def[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];
+    const char *addr = getenv("DBUS_SESSION_BUS_ADDRESS");
+    if (!addr || !*addr) {
+        const char *rt = getenv("XDG_RUNTIME_DIR");
+        if (!rt) {
+            fprintf(stderr, "ei-type: neither DBUS_SESSION_BUS_ADDRESS nor XDG_RUNTIME_DIR is set\n");
+            return NULL;
+        }
+        snprintf(def, sizeof(def), "unix:path=%s/bus", rt);
+        addr = def;
+    }
+    return open_bus(addr, "session");
+}
+
+struct dbus_mini *dbus_mini_open_system(void) {
+    const char *addr = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    if (!addr || !*addr) addr = "unix:path=/run/dbus/system_bus_socket";
+    return open_bus(addr, "system");
+}
+
+/* Send a call; its serial, or 0 on failure */
+static uint32_t send_call(struct dbus_mini *bus, const char *dest, const char *path,
+                          const char *iface, const char *member,
+                          const char *sig, const void *body, uint32_t body_len) {
+    struct msg m;
+    uint32_t serial = ++bus->serial;
+    build_call(&m, serial, dest, path, iface, member, sig, body, body_len);
+    if (m.overflow || !send_all(bus->fd, m.buf, m.len)) {
+        fprintf(stderr, "ei-type: D-Bus %s failed: %s\n", member, m.overflow ? "message too long" : strerror(errno));
+        return 0;
+    }
+    return serial;
+}
+
+/* Read messages up to the reply to serial, skipping others. With
+ * want_fd, return the fd the reply starts with, else 0 on success; -1 on
+ * failure. Without wait, -EAGAIN once the socket has no more for now. */
+static int take_reply(struct dbus_mini *bus, uint32_t serial, const char *member,
+                      bool want_fd, bool wait) {
+    for (;;) {
+        struct reply r;
+        int got = read_message(bus, &r, wait);
+        if (got <= 0) return got ? -1 : -EAGAIN;
+
+        int fds[MAX_FDS];
+        unsigned nfds = claim_fds(bus, r.unix_fds, fds);
+        int fd = -1;
+        bool ours = (r.type == MSG_METHOD_RETURN || r.type == MSG_ERROR) && r.reply_serial == serial;
+
+        if (ours && r.type == MSG_ERROR) {
+            const char *text = r.error_name ? r.error_name : "error";
+            if (r.signature[0] == 's' && r.body_len >= 5) {
+                uint32_t len = get_u32(r.body, r.swap);
+                if (len <= r.body_len - 5) text = (const char *)r.body + 4;
+            }
+            fprintf(stderr, "ei-type: D-Bus %s failed: %s\n", member, text);
+        } else if (ours && !want_fd) {
+            fd = 0;
+        } else if (ours) {
+            uint32_t idx = r.body_len >= 4 ? get_u32(r.body, r.swap) : UINT32_MAX;
+            if (r.signature[0] == 'h' && idx < nfds) {
+                fd = fds[idx];
+                fds[idx] = -1;
+            } else {
+                fprintf(stderr, "ei-type: D-Bus %s reply has no fd (signature '%s')\n", member, r.signature);
+            }
+        }
+
+        for (unsigned i = 0; i < nfds; i++)
+            if (fds[i] >= 0) close(fds[i]);
+        consume(bus, r.total);
+        if (ours) return fd;
+    }
+}
+
+int dbus_mini_call_fd(struct dbus_mini *bus, const char *dest, const char *path,
+                      const char *iface, const char *member, int32_t arg) {
+    uint32_t serial = send_call(bus, dest, path, iface, member, "i", &arg, sizeof(arg));
+    return serial ? take_reply(bus, serial, member, true, true) : -1;
+}
+
+uint32_t dbus_mini_send_fd_call(struct dbus_mini *bus, const char *dest, const char *path,
+                                const char *iface, const char *member, int32_t arg) {
+    return send_call(bus, dest, path, iface, member, "i", &arg, sizeof(arg));
+}
+
+int dbus_mini_get_fd(struct dbus_mini *bus) {
+    return bus->fd;
+}
+
+int dbus_mini_reply_fd(struct dbus_mini *bus, uint32_t serial, const char *member) {
+    return take_reply(bus, serial, member, true, false);
+}
+
+int dbus_mini_call_tu(struct dbus_mini *bus, const char *dest, const char *path,
+                      const char *iface, const char *member, uint64_t t, uint32_t u) {
+    unsigned char body[12];     /* uint64 at 0, uint32 at 8: aligned as is */
+    memcpy(body, &t, 8);
+    memcpy(body + 8, &u, 4);
+    uint32_t serial = send_call(bus, dest, path, iface, member, "tu", body, sizeof(body));
+    return serial ? take_reply(bus, serial, member, false, true) : -1;
+}
+
+void dbus_mini_close(struct dbus_mini *bus) {
+    if (!bus) return;
+    if (bus->fd >= 0) close(bus->fd);
+    for (unsigned i = 0; i < bus->nfds; i++) close(bus->fds[i]);
+    free(bus->in);
+    free(bus);
+}
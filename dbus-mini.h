@@ -0,0 +1,46 @@
+/*
+ * dbus-mini.h — just enough D-Bus for one method call
+ *
+ * Connects to the session bus, authenticates with SASL EXTERNAL and makes
+ * method calls whose reply carries a file descriptor, which is all
+ * connectToEIS needs (and, on the system bus, the one rtkit call behind
+ * --realtime). Built instead of sd-bus with `make MINI_DBUS=1`,
+ * so ei-type does not load libsystemd at startup.
+ */
+#ifndef EI_TYPE_DBUS_MINI_H
+#define EI_TYPE_DBUS_MINI_H
+
+#include <stdint.h>
+
+struct dbus_mini;
+
+/* Connect to $DBUS_SESSION_BUS_ADDRESS (or $XDG_RUNTIME_DIR/bus).
+ * Prints its own diagnostics and returns NULL on failure. */
+struct dbus_mini *dbus_mini_open_session(void);
+
+/* The same for $DBUS_SYSTEM_BUS_ADDRESS (or the well-known socket) */
+struct dbus_mini *dbus_mini_open_system(void);
+
+/* Call dest path iface.member(int32 arg) and return the fd the reply
+ * starts with (signature "h..."), owned by the caller, or -1 */
+int dbus_mini_call_fd(struct dbus_mini *bus, const char *dest, const char *path,
+                      const char *iface, const char *member, int32_t arg);
+
+/* The same call without waiting for the reply: its serial, or 0 if it
+ * could not be sent. Once dbus_mini_get_fd() turns readable,
+ * dbus_mini_reply_fd() takes what has come in without blocking: the
+ * reply's fd, -1 if the call failed, -EAGAIN if it is not there yet.
+ * Other messages are dropped on the way, so only one call at a time. */
+uint32_t dbus_mini_send_fd_call(struct dbus_mini *bus, const char *dest, const char *path,
+                                const char *iface, const char *member, int32_t arg);
+int dbus_mini_get_fd(struct dbus_mini *bus);
+int dbus_mini_reply_fd(struct dbus_mini *bus, uint32_t serial, const char *member);
+
+/* Call dest path iface.member(uint64 t, uint32 u), as rtkit's
+ * MakeThreadRealtime takes. Returns 0 once it replied, or -1. */
+int dbus_mini_call_tu(struct dbus_mini *bus, const char *dest, const char *path,
+                      const char *iface, const char *member, uint64_t t, uint32_t u);
+
+void dbus_mini_close(struct dbus_mini *bus);
+
+#endif
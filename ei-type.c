@@ -3,9 +3,13 @@
  *
  * Connects to org.kde.KWin.EIS.RemoteDesktop on D-Bus, gets a libei fd,
  * negotiates a keyboard device, and injects evdev key events for each
- * character read from stdin.
+ * character read from stdin. On wlroots compositors the vk backend uses
+ * zwp_virtual_keyboard_v1 instead (see backend-vk.c).
  *
- * Build: gcc -O2 -o ei-type ei-type.c $(pkg-config --cflags --libs libei-1.0) -lsystemd
+ * This is the command line front end; the engine is libeitype (eitype.h),
+ * which other programs can link to type from their own process.
+ *
+ * Build: make
  * Usage: echo "Hello, World!" | ei-type
  */
 
@@ -16,520 +20,510 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <signal.h>
+#include <getopt.h>
 #include <poll.h>
-#include <ctype.h>
 #include <errno.h>
-#include <getopt.h>
 #include <fcntl.h>
-
-#include <libei.h>
-#include <systemd/sd-bus.h>
-
-static bool g_verbose = false;
-#define DBG(...) do { if (g_verbose) fprintf(stderr, "ei-type: " __VA_ARGS__); } while(0)
-
-/* Default inter-key delay in microseconds */
-#define DEFAULT_DELAY_US 5000
-
-/* Evdev keycodes (linux/input-event-codes.h values) */
-#define KEY_ESC       1
-#define KEY_1         2
-#define KEY_2         3
-#define KEY_3         4
-#define KEY_4         5
-#define KEY_5         6
-#define KEY_6         7
-#define KEY_7         8
-#define KEY_8         9
-#define KEY_9        10
-#define KEY_0        11
-#define KEY_MINUS    12
-#define KEY_EQUAL    13
-#define KEY_TAB      15
-#define KEY_Q        16
-#define KEY_W        17
-#define KEY_E        18
-#define KEY_R        19
-#define KEY_T        20
-#define KEY_Y        21
-#define KEY_U        22
-#define KEY_I        23
-#define KEY_O        24
-#define KEY_P        25
-#define KEY_LEFTBRACE  26
-#define KEY_RIGHTBRACE 27
-#define KEY_ENTER    28
-#define KEY_A        30
-#define KEY_S        31
-#define KEY_D        32
-#define KEY_F        33
-#define KEY_G        34
-#define KEY_H        35
-#define KEY_J        36
-#define KEY_K        37
-#define KEY_L        38
-#define KEY_SEMICOLON 39
-#define KEY_APOSTROPHE 40
-#define KEY_GRAVE    41
-#define KEY_LEFTSHIFT 42
-#define KEY_BACKSLASH 43
-#define KEY_Z        44
-#define KEY_X        45
-#define KEY_C        46
-#define KEY_V        47
-#define KEY_B        48
-#define KEY_N        49
-#define KEY_M        50
-#define KEY_COMMA    51
-#define KEY_DOT      52
-#define KEY_SLASH    53
-#define KEY_SPACE    57
-#define KEY_LEFTCTRL  29
-#define KEY_LEFTALT   56
-#define KEY_LEFTMETA 125
-
-/* libei device capabilities (bitmask, matches enum ei_device_capability) */
-#define CAP_POINTER          (1 << 0)
-#define CAP_POINTER_ABSOLUTE (1 << 1)
-#define CAP_KEYBOARD         (1 << 2)
-#define CAP_TOUCH            (1 << 3)
-#define CAP_SCROLL           (1 << 4)
-#define CAP_BUTTON           (1 << 5)
-#define CAP_ALL (CAP_POINTER | CAP_POINTER_ABSOLUTE | CAP_KEYBOARD | CAP_TOUCH | CAP_SCROLL | CAP_BUTTON)
-
-static volatile sig_atomic_t g_quit = 0;
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eitype-private.h"
+#include "clock.h"
+#include "commands.h"
+#include "daemon.h"
+#include "flight.h"
+#include "macro.h"
+#include "realtime.h"
 
 static void sighandler(int sig) {
     (void)sig;
     g_quit = 1;
 }
 
-struct keyinfo {
-    uint32_t code;
-    bool     shift;
-};
+/* Flight recorder dump: on SIGUSR2, after a failure and, with --flight,
+ * at exit */
+static char flight_path[PATH_MAX];
+static char flight_msg[PATH_MAX + 64];
+static bool flight_at_exit;
 
-static struct keyinfo char_to_key(char c) {
-    struct keyinfo k = {0, false};
+static void on_sigusr2(int sig) {
+    (void)sig;
+    if (!flight_path[0] || flight_dump(flight_path) < 0) return;
+    ssize_t w = write(STDERR_FILENO, flight_msg, strlen(flight_msg));
+    (void)w;
+}
 
-    /* lowercase letters */
-    if (c >= 'a' && c <= 'z') {
-        static const uint32_t az[] = {
-            KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
-            KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
-            KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
-        };
-        k.code = az[c - 'a'];
-        return k;
+static void dump_flight(void) {
+    if (!flight_at_exit && !flight_failed()) return;
+    if (!flight_path[0]) {
+        fprintf(stderr, "ei-type: flight recorder not written: XDG_RUNTIME_DIR is not set, "
+                "pass --flight=PATH\n");
+        return;
     }
+    int r = flight_dump(flight_path);
+    if (r < 0)
+        fprintf(stderr, "ei-type: cannot write flight recorder to %s: %s\n", flight_path, strerror(-r));
+    else
+        fprintf(stderr, "%s", flight_msg);
+}
 
-    /* uppercase letters */
-    if (c >= 'A' && c <= 'Z') {
-        static const uint32_t az[] = {
-            KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
-            KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
-            KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
-        };
-        k.code = az[c - 'A'];
-        k.shift = true;
-        return k;
-    }
+/* Without $XDG_RUNTIME_DIR there is no default: a predictable name in a
+ * shared directory like /tmp could be a planted symlink, and the uinput
+ * backend runs as root where that variable is usually unset */
+static void flight_setup(const char *path) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (path)
+        snprintf(flight_path, sizeof(flight_path), "%s", path);
+    else if (dir && *dir)
+        snprintf(flight_path, sizeof(flight_path), "%s/ei-type-flight.%d", dir, (int)getpid());
+    snprintf(flight_msg, sizeof(flight_msg), "ei-type: flight recorder written to %s\n", flight_path);
+    flight_at_exit = path != NULL;
+    signal(SIGUSR2, on_sigusr2);
+    atexit(dump_flight);
+}
 
-    /* digits */
-    if (c >= '1' && c <= '9') {
-        k.code = KEY_1 + (c - '1');
-        return k;
+static void print_stats(const struct eitype *t, uint64_t start_ns) {
+    const struct eitype_stats *st = &t->stats;
+    double secs = (double)(now_ns() - start_ns) / 1e9;
+    fprintf(stderr, "ei-type: stats: backend=%s keys=%llu frames=%llu flushes=%llu "
+            "elapsed=%.3fs rate=%.0f keys/s latency avg=%.1fus max=%.1fus\n",
+            t->b->name,
+            (unsigned long long)st->keys,
+            (unsigned long long)st->frames,
+            (unsigned long long)st->flushes,
+            secs, secs > 0 ? (double)st->keys / secs : 0.0,
+            st->flushes ? (double)st->latency_ns / (double)st->flushes / 1e3 : 0.0,
+            (double)st->latency_max_ns / 1e3);
+
+    /* oversleep per inter-key wait, bucketed by powers of two */
+    uint64_t waits = 0;
+    for (int b = 0; b < JITTER_BUCKETS; b++) waits += st->jitter[b];
+    if (!waits) return;
+    fprintf(stderr, "ei-type: jitter: waits=%llu max=%.1fus",
+            (unsigned long long)waits, (double)st->jitter_max_ns / 1e3);
+    for (int b = 0; b < JITTER_BUCKETS; b++) {
+        if (!st->jitter[b]) continue;
+        if (b == JITTER_BUCKETS - 1)
+            fprintf(stderr, " >=%lluus:%llu", 1ull << (b - 1), (unsigned long long)st->jitter[b]);
+        else
+            fprintf(stderr, " <%lluus:%llu", 1ull << b, (unsigned long long)st->jitter[b]);
     }
-    if (c == '0') { k.code = KEY_0; return k; }
-
-    /* space, enter, tab */
-    if (c == ' ')  { k.code = KEY_SPACE; return k; }
-    if (c == '\n') { k.code = KEY_ENTER; return k; }
-    if (c == '\t') { k.code = KEY_TAB;   return k; }
-
-    /* punctuation (unshifted) */
-    switch (c) {
-        case '-':  k.code = KEY_MINUS;      return k;
-        case '=':  k.code = KEY_EQUAL;      return k;
-        case '[':  k.code = KEY_LEFTBRACE;  return k;
-        case ']':  k.code = KEY_RIGHTBRACE; return k;
-        case '\\': k.code = KEY_BACKSLASH;  return k;
-        case ';':  k.code = KEY_SEMICOLON;  return k;
-        case '\'': k.code = KEY_APOSTROPHE; return k;
-        case '`':  k.code = KEY_GRAVE;      return k;
-        case ',':  k.code = KEY_COMMA;      return k;
-        case '.':  k.code = KEY_DOT;        return k;
-        case '/':  k.code = KEY_SLASH;      return k;
+    fprintf(stderr, "\n");
+}
+
+/* Plain stdin mode reads and decodes input on a thread started before
+ * the backend connects, so piped text is ready the moment the device
+ * resumes instead of only then being read. Chunks are handed over in
+ * order; a pipe wakes the typing loop. */
+struct chunk {
+    struct chunk *next;
+    size_t   n;
+    uint32_t cps[];
+};
+
+struct reader {
+    pthread_mutex_t lock;
+    struct chunk *head, *tail;
+    bool     eof;
+    int      wake[2];
+    uint64_t first_ns;      /* first chunk decoded */
+};
+
+static void reader_push(struct reader *r, struct chunk *c, bool eof) {
+    pthread_mutex_lock(&r->lock);
+    if (c) {
+        if (!r->first_ns) r->first_ns = now_ns();
+        if (r->tail) r->tail->next = c;
+        else r->head = c;
+        r->tail = c;
     }
+    r->eof = eof;
+    pthread_mutex_unlock(&r->lock);
+    ssize_t w = write(r->wake[1], "", 1);   /* full pipe: already awake */
+    (void)w;
+}
 
-    /* shifted punctuation */
-    k.shift = true;
-    switch (c) {
-        case '!': k.code = KEY_1;          return k;
-        case '@': k.code = KEY_2;          return k;
-        case '#': k.code = KEY_3;          return k;
-        case '$': k.code = KEY_4;          return k;
-        case '%': k.code = KEY_5;          return k;
-        case '^': k.code = KEY_6;          return k;
-        case '&': k.code = KEY_7;          return k;
-        case '*': k.code = KEY_8;          return k;
-        case '(': k.code = KEY_9;          return k;
-        case ')': k.code = KEY_0;          return k;
-        case '_': k.code = KEY_MINUS;      return k;
-        case '+': k.code = KEY_EQUAL;      return k;
-        case '{': k.code = KEY_LEFTBRACE;  return k;
-        case '}': k.code = KEY_RIGHTBRACE; return k;
-        case '|': k.code = KEY_BACKSLASH;  return k;
-        case ':': k.code = KEY_SEMICOLON;  return k;
-        case '"': k.code = KEY_APOSTROPHE; return k;
-        case '~': k.code = KEY_GRAVE;      return k;
-        case '<': k.code = KEY_COMMA;      return k;
-        case '>': k.code = KEY_DOT;        return k;
-        case '?': k.code = KEY_SLASH;      return k;
+/* read(2), not stdio: the thread may still be blocked in it at exit */
+static void *reader_main(void *data) {
+    struct reader *r = data;
+    char buf[4096];
+    size_t have = 0;
+
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf + have, sizeof(buf) - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        size_t len = have + (size_t)n;
+
+        struct chunk *c = malloc(sizeof(*c) + len * sizeof(uint32_t));
+        if (!c) break;
+        c->next = NULL;
+        size_t used = utf8_decode(buf, len, c->cps, &c->n);
+        reader_push(r, c, false);
+
+        /* keep a partial UTF-8 sequence for the next read */
+        have = len - used;
+        memmove(buf, buf + used, have);
     }
+    reader_push(r, NULL, true);
+    return NULL;
+}
 
-    /* unmapped character */
-    k.code = 0;
-    k.shift = false;
-    return k;
+static bool reader_start(struct reader *r) {
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_init(&r->lock, NULL);
+    if (pipe2(r->wake, O_CLOEXEC | O_NONBLOCK) < 0) return false;
+
+    /* signals go to the typing loop, which polls and sees EINTR */
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, reader_main, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) return false;
+    pthread_detach(thread);
+    return true;
 }
 
-/* Parse a key combo like "ctrl+v", "enter", "shift+a" and send it */
-static void send_key_combo(struct ei_device *dev, const char *combo, int delay_us) {
-    char buf[256];
-    strncpy(buf, combo, sizeof(buf) - 1);
-    buf[sizeof(buf) - 1] = '\0';
-
-    uint32_t modifiers[4];
-    int nmod = 0;
-    uint32_t keycode = 0;
-
-    char *saveptr;
-    char *tok = strtok_r(buf, "+", &saveptr);
-    while (tok) {
-        /* convert to lowercase for comparison */
-        for (char *p = tok; *p; p++) *p = tolower(*p);
-
-        char *next = strtok_r(NULL, "+", &saveptr);
-        if (next == NULL) {
-            /* last token is the key itself */
-            if (strlen(tok) == 1) {
-                struct keyinfo ki = char_to_key(tok[0]);
-                keycode = ki.code;
-                if (ki.shift && nmod < 4) modifiers[nmod++] = KEY_LEFTSHIFT;
-            } else if (strcmp(tok, "enter") == 0 || strcmp(tok, "return") == 0) {
-                keycode = KEY_ENTER;
-            } else if (strcmp(tok, "tab") == 0) {
-                keycode = KEY_TAB;
-            } else if (strcmp(tok, "space") == 0) {
-                keycode = KEY_SPACE;
-            } else if (strcmp(tok, "esc") == 0 || strcmp(tok, "escape") == 0) {
-                keycode = KEY_ESC;
-            } else {
-                fprintf(stderr, "ei-type: unknown key '%s'\n", tok);
-                return;
-            }
-        } else {
-            /* modifier */
-            if (nmod >= 4) { tok = next; continue; }
-            if (strcmp(tok, "ctrl") == 0 || strcmp(tok, "control") == 0) {
-                modifiers[nmod++] = KEY_LEFTCTRL;
-            } else if (strcmp(tok, "shift") == 0) {
-                modifiers[nmod++] = KEY_LEFTSHIFT;
-            } else if (strcmp(tok, "alt") == 0) {
-                modifiers[nmod++] = KEY_LEFTALT;
-            } else if (strcmp(tok, "super") == 0 || strcmp(tok, "meta") == 0) {
-                modifiers[nmod++] = KEY_LEFTMETA;
-            } else {
-                fprintf(stderr, "ei-type: unknown modifier '%s'\n", tok);
-                return;
-            }
+/* Next decoded chunk, answering the backend while waiting. NULL at end
+ * of input or when interrupted. */
+static struct chunk *reader_next(struct reader *r, struct eitype *t) {
+    while (!g_quit && !t->b->dead) {
+        pthread_mutex_lock(&r->lock);
+        struct chunk *c = r->head;
+        if (c) {
+            r->head = c->next;
+            if (!r->head) r->tail = NULL;
         }
-        tok = next;
+        bool eof = r->eof;
+        pthread_mutex_unlock(&r->lock);
+        if (c) return c;
+        if (eof) return NULL;
+
+        struct pollfd pfd[2] = {
+            { .fd = r->wake[0], .events = POLLIN },
+            { .fd = eitype_get_fd(t), .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
+            return NULL;
+        }
+        if (pfd[0].revents) {
+            char drain[64];
+            while (read(r->wake[0], drain, sizeof(drain)) > 0) {}
+        }
+        if (pfd[1].revents) eitype_dispatch(t);
     }
+    return NULL;
+}
 
-    if (!keycode) return;
+/* Where startup time went, relative to process start */
+static void print_startup(const struct eitype *t, const struct reader *r,
+                          uint64_t launch_ns, uint64_t ready_ns) {
+    double ready = (double)(ready_ns - launch_ns) / 1e6;
+    double input = r->first_ns ? (double)(r->first_ns - launch_ns) / 1e6 : 0.0;
+    double first = t->stats.first_flush ? (double)(t->stats.first_flush - launch_ns) / 1e6 : 0.0;
+    /* input work done while the backend was still connecting; input
+     * that arrived later saved nothing */
+    double overlap = r->first_ns && r->first_ns < ready_ns ? input : 0.0;
+    fprintf(stderr, "ei-type: startup: backend ready %.1fms, input ready %.1fms, "
+            "first key %.1fms, %.1fms of input overlapped setup\n",
+            ready, input, first, overlap);
+}
 
-    /* press modifiers */
-    for (int i = 0; i < nmod; i++) {
-        ei_device_keyboard_key(dev, modifiers[i], true);
-        ei_device_frame(dev, 0);
+/* -f: map the file instead of reading it. Paging it in starts now,
+ * while the backend connects. An empty file maps to NULL. */
+static bool map_file(const char *path, const char **text, size_t *size) {
+    *text = NULL;
+    *size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "ei-type: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
     }
-
-    /* press and release key */
-    ei_device_keyboard_key(dev, keycode, true);
-    ei_device_frame(dev, 0);
-    usleep(delay_us);
-    ei_device_keyboard_key(dev, keycode, false);
-    ei_device_frame(dev, 0);
-
-    /* release modifiers in reverse */
-    for (int i = nmod - 1; i >= 0; i--) {
-        ei_device_keyboard_key(dev, modifiers[i], false);
-        ei_device_frame(dev, 0);
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
     }
 
-    ei_dispatch(ei_device_get_context(dev));
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "ei-type: cannot map %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    *text = map;
+    *size = (size_t)st.st_size;
+    madvise(map, *size, MADV_SEQUENTIAL);
+    madvise(map, *size, MADV_WILLNEED);
+    return true;
 }
 
-static void type_char(struct ei_device *dev, char c, int delay_us) {
-    struct keyinfo ki = char_to_key(c);
-    if (ki.code == 0) return; /* skip unmappable */
-
-    if (ki.shift) {
-        ei_device_keyboard_key(dev, KEY_LEFTSHIFT, true);
-        ei_device_frame(dev, 0);
-    }
+/* --commands: records on stdin, replies on stdout (see commands.c) */
+static int run_commands(struct eitype *t) {
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, STDIN_FILENO, STDOUT_FILENO, false)) return 1;
 
-    ei_device_keyboard_key(dev, ki.code, true);
-    ei_device_frame(dev, 0);
-    usleep(delay_us);
+    while (!g_quit && !t->b->dead && !cmd_session_done(&s)) {
+        /* nothing queued may sit in a buffer while we wait for input */
+        if (t->stats.pending_since) eitype_flush(t);
 
-    ei_device_keyboard_key(dev, ki.code, false);
-    ei_device_frame(dev, 0);
+        int bfd = eitype_get_fd(t);   /* changes when eis reconnects */
+        struct pollfd pfd[2] = {
+            { .fd = s.eof ? -1 : STDIN_FILENO, .events = POLLIN },
+            { .fd = bfd, .events = POLLIN },
+        };
+        if (s.eof && bfd < 0) break;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
+            break;
+        }
 
-    if (ki.shift) {
-        ei_device_keyboard_key(dev, KEY_LEFTSHIFT, false);
-        ei_device_frame(dev, 0);
+        if (pfd[1].revents) eitype_dispatch(t);
+        if (pfd[0].revents && !cmd_session_read(&s)) break;
     }
 
-    ei_dispatch(ei_device_get_context(dev));
+    eitype_flush(t);
+    cmd_session_finish(&s);
+    return 0;
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-d delay_ms] [-v] [--key combo]\n", prog);
-    fprintf(stderr, "  -d N       inter-key delay in ms (default: 5)\n");
-    fprintf(stderr, "  --key STR  send a key combo (e.g. ctrl+v, enter)\n");
-    fprintf(stderr, "  -v         verbose debug output\n");
-    fprintf(stderr, "  -h         show this help\n");
+    fprintf(stderr, "Usage: %s [-d delay_ms] [-v] [--backend NAME] [-f FILE | --key combo | --commands | --daemon [--standby]]\n", prog);
+    fprintf(stderr, "       %s [--backend NAME] --play FILE [--speed X]\n", prog);
+    fprintf(stderr, "       %s --record FILE\n", prog);
+    fprintf(stderr, "       %s --client [--key combo | --cancel]\n", prog);
+    fprintf(stderr, "  -d N            inter-key delay in ms (default: 5)\n");
+    fprintf(stderr, "  -f FILE         type FILE (mapped, not read) instead of stdin\n");
+    fprintf(stderr, "  --key STR       send key combos (e.g. ctrl+v, \"ctrl+a ctrl+c\", down*10)\n");
+    fprintf(stderr, "  --commands      read TEXT/KEY/DELAY/SYNC/FLUSH records from stdin\n");
+    fprintf(stderr, "  --daemon[=PATH] serve the same records on a Unix socket\n");
+    fprintf(stderr, "                  (default: $XDG_RUNTIME_DIR/ei-type.sock)\n");
+    fprintf(stderr, "  --standby       with --daemon: keep a second EIS connection ready to\n");
+    fprintf(stderr, "                  take over at once when the first one drops\n");
+    fprintf(stderr, "  --client[=PATH] hand stdin (or --key) to a running daemon\n");
+    fprintf(stderr, "  --cancel        with --client: stop what the daemon is typing\n");
+    fprintf(stderr, "  --record FILE   record the keys an EIS sender types into a macro file\n");
+    fprintf(stderr, "                  (connects as a receiver to $LIBEI_SOCKET)\n");
+    fprintf(stderr, "  --play FILE     send a recorded macro again with its original timing\n");
+    fprintf(stderr, "  --speed X       with --play: X times as fast (default 1)\n");
+    fprintf(stderr, "  --socket PATH   eis: connect to this EIS socket instead of KWin\n");
+    fprintf(stderr, "                  (same as LIBEI_SOCKET=PATH, e.g. tools/ei-soak)\n");
+    fprintf(stderr, "  --backend NAME  eis (KWin, default), uinput (/dev/uinput)");
+#ifdef HAVE_VK
+    fprintf(stderr, " or vk (wlroots virtual keyboard)");
+#endif
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  --realtime[=N]  type from a SCHED_FIFO thread (priority N, default %d)\n",
+            REALTIME_DEFAULT_PRIO);
+    fprintf(stderr, "                  with memory locked; uses rtkit when unprivileged\n");
+    fprintf(stderr, "  --stats         print keys/sec, flush latency and wakeup jitter on exit\n");
+    fprintf(stderr, "  --flight=PATH   write the flight recorder (recent events) to PATH at exit;\n");
+    fprintf(stderr, "                  it goes to $XDG_RUNTIME_DIR/ei-type-flight.PID on\n");
+    fprintf(stderr, "                  failure or SIGUSR2, if that is set (decode with\n");
+    fprintf(stderr, "                  tools/ei-flight)\n");
+    fprintf(stderr, "  -v              verbose debug output\n");
+    fprintf(stderr, "  -h              show this help\n");
     fprintf(stderr, "\nReads text from stdin and types it into the focused window.\n");
 }
 
 int main(int argc, char *argv[]) {
+#ifdef EI_TYPE_TEST
+    /* test build (make check): time only moves when we wait (clock.h) */
+    const char *vclock = getenv("EI_TYPE_VIRTUAL_CLOCK");
+    if (vclock) clock_set_virtual(strtoull(vclock, NULL, 0));
+#endif
+    uint64_t launch_ns = now_ns();
     int delay_us = DEFAULT_DELAY_US;
     const char *key_combo = NULL;
+    const char *backend_name = "eis";
+    bool stats = false;
+    bool commands = false;
+    bool daemon_mode = false, client_mode = false, cancel = false, standby = false;
+    const char *socket_path = NULL;
+    int rt_prio = 0;
+    const char *flight = NULL;
+    const char *file = NULL;
+    const char *record = NULL, *play = NULL;
+    double speed = 1.0;
 
     static struct option longopts[] = {
         {"key",     required_argument, NULL, 'k'},
+        {"backend", required_argument, NULL, 'b'},
         {"delay",   required_argument, NULL, 'd'},
+        {"file",    required_argument, NULL, 'f'},
+        {"stats",   no_argument,       NULL, 's'},
+        {"commands", no_argument,      NULL, 'c'},
+        {"daemon",  optional_argument, NULL, 'D'},
+        {"client",  optional_argument, NULL, 'C'},
+        {"cancel",  no_argument,       NULL, 'X'},
+        {"realtime", optional_argument, NULL, 'R'},
+        {"flight",  required_argument, NULL, 'F'},
+        {"record",  required_argument, NULL, 'O'},
+        {"play",    required_argument, NULL, 'P'},
+        {"speed",   required_argument, NULL, 'S'},
+        {"socket",  required_argument, NULL, 'E'},
+        {"standby", no_argument,       NULL, 'W'},
         {"verbose", no_argument,       NULL, 'v'},
         {"help",    no_argument,       NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "d:vh", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:f:vh", longopts, NULL)) != -1) {
         switch (opt) {
             case 'k': key_combo = optarg; break;
+            case 'b': backend_name = optarg; break;
             case 'd': delay_us = atoi(optarg) * 1000; break;
+            case 'f': file = optarg; break;
+            case 's': stats = true; break;
+            case 'c': commands = true; break;
+            case 'D': daemon_mode = true; socket_path = optarg; break;
+            case 'C': client_mode = true; socket_path = optarg; break;
+            case 'X': cancel = true; break;
+            case 'W': standby = true; break;
+            case 'F': flight = optarg; break;
+            case 'O': record = optarg; break;
+            case 'E': setenv("LIBEI_SOCKET", optarg, 1); break;
+            case 'P': play = optarg; break;
+            case 'S':
+                speed = strtod(optarg, NULL);
+                if (!(speed > 0)) {
+                    fprintf(stderr, "ei-type: --speed must be above 0\n");
+                    return 1;
+                }
+                break;
+            case 'R':
+                rt_prio = optarg ? atoi(optarg) : REALTIME_DEFAULT_PRIO;
+                if (rt_prio < 1 || rt_prio > 99) {
+                    fprintf(stderr, "ei-type: --realtime priority must be 1-99\n");
+                    return 1;
+                }
+                break;
             case 'v': g_verbose = true; break;
             case 'h': usage(argv[0]); return 0;
             default:  usage(argv[0]); return 1;
         }
     }
 
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
-
-    /* Connect to KWin EIS via D-Bus */
-    sd_bus *bus = NULL;
-    int r = sd_bus_open_user(&bus);
-    if (r < 0) {
-        fprintf(stderr, "ei-type: failed to connect to session bus: %s\n", strerror(-r));
+    if (cancel && !client_mode) {
+        fprintf(stderr, "ei-type: --cancel needs --client\n");
         return 1;
     }
-
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *reply = NULL;
-
-    r = sd_bus_call_method(bus,
-        "org.kde.KWin",
-        "/org/kde/KWin/EIS/RemoteDesktop",
-        "org.kde.KWin.EIS.RemoteDesktop",
-        "connectToEIS",
-        &error, &reply, "i", (int32_t)CAP_ALL);
-    if (r < 0) {
-        fprintf(stderr, "ei-type: D-Bus connectToEIS failed: %s\n",
-                error.message ? error.message : strerror(-r));
-        sd_bus_error_free(&error);
-        sd_bus_unref(bus);
+    if (standby && !daemon_mode) {
+        fprintf(stderr, "ei-type: --standby needs --daemon\n");
         return 1;
     }
-
-    int fd = -1;
-    int32_t cookie = 0;
-    r = sd_bus_message_read(reply, "hi", &fd, &cookie);
-    if (r < 0 || fd < 0) {
-        fprintf(stderr, "ei-type: failed to read EIS fd from reply (r=%d, fd=%d)\n", r, fd);
-        sd_bus_message_unref(reply);
-        sd_bus_unref(bus);
+    if (speed != 1.0 && !play) {
+        fprintf(stderr, "ei-type: --speed needs --play\n");
         return 1;
     }
-    DBG("got EIS fd=%d cookie=%d\n", fd, cookie);
-
-    /* dup the fd — sd_bus_message_unref will close the original */
-    int eis_fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
-    if (eis_fd < 0) {
-        fprintf(stderr, "ei-type: fcntl F_DUPFD_CLOEXEC failed: %s\n", strerror(errno));
-        sd_bus_message_unref(reply);
-        sd_bus_unref(bus);
-        return 1;
-    }
-    DBG("dup'd fd=%d -> %d\n", fd, eis_fd);
-    sd_bus_message_unref(reply);
-    sd_bus_error_free(&error);
-
-    /* Set up libei */
-    struct ei *ei = ei_new_sender(NULL);
-    if (!ei) {
-        fprintf(stderr, "ei-type: ei_new_sender failed\n");
-        close(eis_fd);
-        sd_bus_unref(bus);
-        return 1;
-    }
-    ei_configure_name(ei, "ei-type");
+    if (client_mode) return run_client(socket_path, key_combo, cancel);
 
-    r = ei_setup_backend_fd(ei, eis_fd);
-    if (r < 0) {
-        fprintf(stderr, "ei-type: ei_setup_backend_fd failed: %s\n", strerror(-r));
-        ei_unref(ei);
-        sd_bus_unref(bus);
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    if (record) return macro_record(record);
+    flight_setup(flight);
+
+    const char *file_text = NULL;
+    size_t file_size = 0;
+    if (file && !map_file(file, &file_text, &file_size)) return 1;
+
+    /* Text on stdin: start reading it while the backend connects */
+    static struct reader reader;
+    bool prefetch = !key_combo && !commands && !daemon_mode && !file && !play;
+    if (prefetch && !reader_start(&reader)) {
+        fprintf(stderr, "ei-type: failed to start the input reader: %s\n", strerror(errno));
         return 1;
     }
-    DBG("ei_setup_backend_fd ok, ei_get_fd=%d\n", ei_get_fd(ei));
-
-    /* Negotiate keyboard device via event loop */
-    struct ei_device *kbd = NULL;
-    bool ready = false;
-    int timeout_count = 0;
-    const int max_timeouts = 10; /* 10 * 500ms = 5s max */
-
-    while (!ready && !g_quit && timeout_count < max_timeouts) {
-        struct pollfd pfd = { .fd = ei_get_fd(ei), .events = POLLIN };
-        int pr = poll(&pfd, 1, 500);
-        if (pr < 0) {
-            if (errno == EINTR) continue;
-            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
-            break;
-        }
 
-        if (pr == 0) {
-            timeout_count++;
-            DBG("poll timeout %d/%d\n", timeout_count, max_timeouts);
+    struct eitype *t = eitype_connect(backend_name);
+    if (!t) {
+        flight_error(errno);
+        if (errno == EINVAL) {
+            fprintf(stderr, "ei-type: unknown backend '%s'\n", backend_name);
+            usage(argv[0]);
         }
+        return 1;
+    }
+    eitype_set_delay(t, delay_us > 0 ? (unsigned)delay_us : 0);
 
-        /* Always dispatch — data may have arrived between polls */
-        ei_dispatch(ei);
-
-        struct ei_event *ev;
-        while ((ev = ei_get_event(ei)) != NULL) {
-            enum ei_event_type type = ei_event_get_type(ev);
-            DBG("event: %d\n", type);
-
-            switch (type) {
-            case EI_EVENT_CONNECT:
-                DBG("connected to EIS\n");
-                break;
-
-            case EI_EVENT_SEAT_ADDED: {
-                struct ei_seat *seat = ei_event_get_seat(ev);
-                DBG("seat added, checking capabilities...\n");
-                static const enum ei_device_capability all_caps[] = {
-                    EI_DEVICE_CAP_KEYBOARD,
-                    EI_DEVICE_CAP_POINTER,
-                    EI_DEVICE_CAP_POINTER_ABSOLUTE,
-                    EI_DEVICE_CAP_BUTTON,
-                    EI_DEVICE_CAP_SCROLL,
-                    EI_DEVICE_CAP_TOUCH,
-                };
-                bool has_kbd = false;
-                for (int c = 0; c < 6; c++) {
-                    bool has = ei_seat_has_capability(seat, all_caps[c]);
-                    DBG("  cap %d: %s\n", all_caps[c], has ? "yes" : "no");
-                    if (all_caps[c] == EI_DEVICE_CAP_KEYBOARD) has_kbd = has;
-                }
-                if (!has_kbd) {
-                    fprintf(stderr, "ei-type: seat does not have keyboard capability\n");
-                    g_quit = 1;
-                    break;
-                }
-                /* Bind all supported capabilities (KWin provides them as a set) */
-                ei_seat_bind_capabilities(seat,
-                    EI_DEVICE_CAP_KEYBOARD,
-                    EI_DEVICE_CAP_POINTER,
-                    EI_DEVICE_CAP_POINTER_ABSOLUTE,
-                    EI_DEVICE_CAP_BUTTON,
-                    EI_DEVICE_CAP_SCROLL,
-                    EI_DEVICE_CAP_TOUCH,
-                    NULL);
-                DBG("seat capabilities bound\n");
-                break;
-            }
-
-            case EI_EVENT_DEVICE_ADDED: {
-                struct ei_device *dev = ei_event_get_device(ev);
-                if (ei_device_has_capability(dev, EI_DEVICE_CAP_KEYBOARD)) {
-                    DBG("keyboard device added\n");
-                    kbd = ei_device_ref(dev);
-                }
-                break;
-            }
-
-            case EI_EVENT_DEVICE_RESUMED:
-                if (kbd) {
-                    DBG("device resumed, starting emulation\n");
-                    ei_device_start_emulating(kbd, 0);
-                    ready = true;
-                }
-                break;
-
-            case EI_EVENT_DISCONNECT:
-                fprintf(stderr, "ei-type: disconnected by EIS\n");
-                g_quit = 1;
-                break;
-
-            default:
-                break;
-            }
+    /* After the reader started (it keeps normal scheduling) and the
+     * backend connected; only typing has deadlines */
+    if (rt_prio && !realtime_enter(rt_prio))
+        fprintf(stderr, "ei-type: --realtime: typing with normal scheduling\n");
+    uint64_t start_ns = now_ns();
+    DBG("backend ready after %.1fms\n", (double)(start_ns - launch_ns) / 1e6);
 
-            ei_event_unref(ev);
-        }
+    /* If --key mode, send the combos and exit */
+    if (key_combo) {
+        int r = eitype_key_combo(t, key_combo);
+        clock_sleep((uint64_t)delay_us * 1000);
+        if (stats) print_stats(t, start_ns);
+        eitype_close(t);
+        return r < 0 ? 1 : 0;
     }
 
-    if (timeout_count >= max_timeouts) {
-        fprintf(stderr, "ei-type: timeout waiting for EIS events (no response in 5s)\n");
+    if (commands || daemon_mode) {
+        /* the daemon outlives compositor restarts */
+        if (daemon_mode) {
+            t->b->reconnect_timeout_ms = 0;
+            t->b->standby = standby;
+        }
+        int rc = daemon_mode ? run_daemon(t, socket_path) : run_commands(t);
+        if (stats) print_stats(t, start_ns);
+        eitype_close(t);
+        return rc;
     }
 
-    if (!kbd || !ready) {
-        fprintf(stderr, "ei-type: failed to get keyboard device\n");
-        ei_unref(ei);
-        sd_bus_unref(bus);
-        return 1;
+    if (play) {
+        int rc = macro_play(t, play, speed, stats || g_verbose);
+        if (stats) print_stats(t, start_ns);
+        eitype_close(t);
+        return rc;
     }
 
-    /* If --key mode, send the combo and exit */
-    if (key_combo) {
-        send_key_combo(kbd, key_combo, delay_us);
-        usleep(delay_us);
-        ei_device_unref(kbd);
-        ei_unref(ei);
-        sd_bus_unref(bus);
-        return 0;
+    /* -f: the whole file is one run; plain text skips decoding */
+    if (file) {
+        int r = file_size ? eitype_type_utf8(t, file_text, file_size) : 0;
+        if (r == -ECANCELED)
+            fprintf(stderr, "ei-type: interrupted after %zu characters\n", eitype_delivered(t));
+        else if (r < 0)
+            fprintf(stderr, "ei-type: failed after %zu characters\n", eitype_delivered(t));
+        if (stats) print_stats(t, start_ns);
+        eitype_close(t);
+        return r < 0 && r != -ECANCELED ? 1 : 0;
     }
 
-    /* Read stdin and type each character */
-    char buf[4096];
-    while (!g_quit && fgets(buf, sizeof(buf), stdin)) {
-        for (int i = 0; buf[i] && !g_quit; i++) {
-            type_char(kbd, buf[i], delay_us);
-            usleep(delay_us);
-        }
+    /* Type what the reader decoded. Each chunk is decoded up front so
+     * the backend can prepare (e.g. upload a keymap) once per chunk. */
+    size_t typed = 0;
+    struct chunk *c;
+    while ((c = reader_next(&reader, t)) != NULL) {
+        run_begin(t);
+        typed += (size_t)type_codepoints(t, c->cps, c->n);
+        run_end(t);
+        eitype_flush(t);
+        free(c);
     }
 
-    /* Clean shutdown */
-    ei_device_unref(kbd);
-    ei_unref(ei);
-    sd_bus_unref(bus);
+    /* Clean shutdown; eitype_close() lets go of any key still down. A
+     * backend that gave up (reconnecting timed out) is a failure. */
+    bool failed = t->b->dead;
+    if (failed) fprintf(stderr, "ei-type: failed after %zu characters\n", typed);
+    else if (g_quit) fprintf(stderr, "ei-type: interrupted after %zu characters\n", typed);
+    if (stats || g_verbose) print_startup(t, &reader, launch_ns, start_ns);
+    if (stats) print_stats(t, start_ns);
+    eitype_close(t);
 
-    return 0;
+    return failed ? 1 : 0;
 }
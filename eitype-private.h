@@ -0,0 +1,105 @@
+/*
+ * eitype-private.h — libeitype internals shared with the ei-type CLI
+ *
+ * Not installed. The CLI links the library objects statically and reaches
+ * past the public ABI for --stats and for streaming stdin input.
+ */
+#ifndef EI_TYPE_PRIVATE_H
+#define EI_TYPE_PRIVATE_H
+
+#include <stdatomic.h>
+
+#include "eitype.h"
+#include "backend.h"
+
+/* Default inter-key delay in microseconds */
+#define DEFAULT_DELAY_US 5000
+
+/* Without a delay, how often pace() still flushes and the wait hook
+ * gets to look at input */
+#define UNPACED_POLL 256
+
+/* eitype_sync() calls waiting for their ack, oldest first */
+#define MAX_SYNCS 256
+
+/* Keys tracked in the key-state table; every backend's codes are below */
+#define MAX_KEYCODE 256
+
+/* --stats jitter histogram: bucket b counts waits that overslept by
+ * less than 2^b us (bucket 0: under 1us), the last one everything above */
+#define JITTER_BUCKETS 16
+
+/* Counters for --stats, to compare backends and delays */
+struct eitype_stats {
+    uint64_t keys;
+    uint64_t frames;
+    uint64_t flushes;
+    uint64_t latency_ns;     /* sum over flushes: first queued key → written */
+    uint64_t latency_max_ns;
+    uint64_t pending_since;  /* time of the first key not yet flushed, 0 if none */
+    uint64_t first_flush;    /* time the first key was flushed, 0 if none yet */
+    uint64_t jitter[JITTER_BUCKETS];
+    uint64_t jitter_max_ns;  /* worst oversleep of an inter-key wait */
+};
+
+struct eitype {
+    struct backend *b;
+    int delay_us;
+    struct eitype_stats stats;
+
+    /* Keys pressed and not yet released, released on cancel and close */
+    uint8_t held[MAX_KEYCODE / 8];
+
+    /* eitype_cancel() bumps cancel_gen; a typing call stops once it
+     * differs from the value it started with */
+    atomic_uint cancel_gen;
+    unsigned run_gen;
+    size_t   delivered;     /* characters typed by the last call */
+
+    /* Optional: replaces clock_sleep() between key events, e.g. to read
+     * input meanwhile. Must return early once the run is cancelled.
+     * Without a delay it is still called every UNPACED_POLL events, with
+     * delay_us 0, to look at the input without waiting. With delay_us
+     * WAIT_BACKEND it waits for the backend instead (wait_backend()). */
+    void (*wait)(struct eitype *t, uint64_t delay_us, void *data);
+    void *wait_data;
+    unsigned unpaced;       /* pace() calls without a delay */
+
+    struct {
+        uint64_t cookie;
+        void   (*done)(void *data);
+        void    *data;
+        uint64_t sent_ns;   /* for the sync latency metric */
+    } syncs[MAX_SYNCS];
+    unsigned sync_head, sync_count;
+    uint64_t next_cookie;
+};
+
+/* Send a key event or a frame as is: no keymap, no pacing. Keys are
+ * tracked in held[] like typed ones. */
+void emit_key(struct eitype *t, uint32_t code, bool press);
+void emit_frame(struct eitype *t);
+
+/* Sleep, through the wait hook if there is one */
+void wait_us(struct eitype *t, uint64_t delay_us);
+
+/* wait hook delay: wait until the backend had events to process, or a
+ * cancel came meanwhile */
+#define WAIT_BACKEND UINT64_MAX
+
+/* Wait for the backend's fd and process what it has, through the wait
+ * hook if there is one, so its owner goes on serving its own fds */
+void wait_backend(struct eitype *t);
+
+/* Bracket a typing run. run_status() says why it stopped early as a
+ * negative errno (0 if it has not); run_end() releases held keys if it
+ * did and returns the same. */
+void run_begin(struct eitype *t);
+int  run_status(const struct eitype *t);
+int  run_end(struct eitype *t);
+
+/* Type a run of codepoints, letting the backend prepare for all of them.
+ * Returns the number typed. */
+int type_codepoints(struct eitype *t, const uint32_t *cps, size_t n);
+
+#endif
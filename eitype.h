@@ -0,0 +1,89 @@
+/*
+ * eitype.h — libeitype: in-process text injection
+ *
+ * The connection, keyboard negotiation and typing engine of ei-type as a
+ * shared library, so a dictation engine can keep one connection open and
+ * inject text with no fork/exec and no IPC.
+ *
+ *   struct eitype *t = eitype_connect(NULL);
+ *   eitype_type_utf8(t, "Hello, World!\n", 14);
+ *   eitype_key_combo(t, "ctrl+s");
+ *   eitype_flush(t);
+ *   eitype_close(t);
+ *
+ * Functions returning int return 0 (or a count) on success and a negative
+ * errno on failure. A handle is not thread-safe; use it from one thread.
+ *
+ * Link: cc ... -leitype
+ */
+#ifndef EITYPE_H
+#define EITYPE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct eitype;
+
+/* Connect and negotiate a keyboard device. backend is "eis" (KWin, also
+ * used for NULL), "uinput" or "vk". Returns NULL with errno set on
+ * failure: EINVAL for an unknown backend, ECONNREFUSED if the connection
+ * or negotiation failed. With LIBEI_SOCKET in the environment, "eis"
+ * connects to that EIS socket instead of asking KWin for one.
+ * Diagnostics go to stderr; set EITYPE_DEBUG in the environment for a
+ * trace. */
+struct eitype *eitype_connect(const char *backend);
+
+/* Inter-key delay in microseconds (default 5000). With 0, events are
+ * batched until eitype_flush(). */
+void eitype_set_delay(struct eitype *t, unsigned delay_us);
+
+/* Type UTF-8 text. Characters the backend cannot type are skipped.
+ * Returns the number of characters typed. */
+int eitype_type_utf8(struct eitype *t, const char *text, size_t len);
+
+/* Send key combos, same syntax as ei-type --key ("ctrl+v",
+ * "ctrl+a ctrl+c", "down*10"). -EINVAL if any combo does not parse; in
+ * that case nothing is sent. */
+int eitype_key_combo(struct eitype *t, const char *combo);
+
+/* Stop the eitype_type_utf8() or eitype_key_combo() call in progress
+ * at its next key event; it releases every key it holds down and
+ * returns -ECANCELED. Safe to call from a signal handler or another
+ * thread. Does nothing if no call is in progress. */
+void eitype_cancel(struct eitype *t);
+
+/* Characters typed by the last eitype_type_utf8() call, including one
+ * that was cancelled */
+size_t eitype_delivered(const struct eitype *t);
+
+/* Push every queued event to the server */
+int eitype_flush(struct eitype *t);
+
+/* Flush, then call done(data) from a later eitype_dispatch() once the
+ * server has processed everything sent so far (right away on backends
+ * without acks). -EBUSY if too many syncs are outstanding. */
+int eitype_sync(struct eitype *t, void (*done)(void *data), void *data);
+
+/* fd to poll for readability in the caller's main loop. Call
+ * eitype_dispatch() when it is readable: the server's pings must be
+ * answered even while nothing is being typed. The fd changes when the
+ * library reconnects, so get it again before each poll. Negative if the
+ * backend never has anything to read (uinput). */
+int eitype_get_fd(struct eitype *t);
+
+/* Process incoming events without blocking. A paused device or a dropped
+ * connection is handled here: keys typed meanwhile are replayed once it is
+ * back. -ECONNRESET once the server is gone for good. */
+int eitype_dispatch(struct eitype *t);
+
+/* Release the device and close the connection */
+void eitype_close(struct eitype *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ * flight.c — flight recorder ring (see flight.h)
+ *
+ * Writers claim a slot with one atomic increment and never wait; the
+ * ring keeps the newest FLIGHT_ENTRIES events. A dump taken while a
+ * writer is busy may catch that one entry half-written.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "clock.h"
+#include "flight.h"
+
+static struct flight_entry ring[FLIGHT_ENTRIES];
+static atomic_uint_fast64_t head;
+static atomic_bool failed;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t flight_record(enum flight_event ev, uint32_t a, uint64_t b) {
+    uint64_t n = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    struct flight_entry *e = &ring[n & (FLIGHT_ENTRIES - 1)];
+    e->ns = now_ns();
+    e->event = ev;
+    e->a = a;
+    e->b = b;
+    return e->ns;
+}
+
+void flight_error(int err) {
+    flight_record(FL_ERROR, (uint32_t)(err < 0 ? -err : err), 0);
+    atomic_store(&failed, true);
+}
+
+bool flight_failed(void) {
+    return atomic_load(&failed);
+}
+
+static bool write_all(int fd, const void *p, size_t n) {
+    const char *c = p;
+    while (n) {
+        ssize_t w = write(fd, c, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        c += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+int flight_dump(const char *path) {
+    int saved = errno;
+    uint64_t end = atomic_load(&head);
+    uint64_t count = end < FLIGHT_ENTRIES ? end : FLIGHT_ENTRIES;
+
+    struct flight_header hdr = {
+        .version = FLIGHT_VERSION,
+        .entry_size = sizeof(struct flight_entry),
+        .entries = count,
+        .lost = end - count,
+        .mono_ns = now_ns(),
+        .real_ns = clock_ns(CLOCK_REALTIME),
+    };
+    memcpy(hdr.magic, FLIGHT_MAGIC, sizeof(hdr.magic));
+
+    int r = 0;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        r = -errno;
+        errno = saved;
+        return r;
+    }
+    /* oldest first: the part after the newest entry, then up to it */
+    size_t start = (size_t)((end - count) & (FLIGHT_ENTRIES - 1));
+    size_t first = count < FLIGHT_ENTRIES - start ? (size_t)count : FLIGHT_ENTRIES - start;
+    if (!write_all(fd, &hdr, sizeof(hdr)) ||
+        !write_all(fd, &ring[start], first * sizeof(ring[0])) ||
+        !write_all(fd, ring, ((size_t)count - first) * sizeof(ring[0])))
+        r = -errno;
+    close(fd);
+    errno = saved;
+    return r;
+}
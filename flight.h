@@ -0,0 +1,73 @@
+/*
+ * flight.h — flight recorder: the last injection events, for bug reports
+ *
+ * A fixed ring of timestamped events (keys, frames, flushes, syncs and
+ * the EIS pings, pauses and reconnects behind them), recorded always and
+ * written out on demand. Recording is a clock read and three stores.
+ * tools/ei-flight decodes a dump into a timeline; the Rust binary writes
+ * the same format.
+ *
+ * Dump file, host byte order:
+ *   header  "EIFLIGHT", u32 version, u32 entry size, u64 entries,
+ *           u64 entries lost to wraparound, u64 CLOCK_MONOTONIC and
+ *           u64 CLOCK_REALTIME at dump time (ns)
+ *   entries oldest first: u64 CLOCK_MONOTONIC ns, u32 event, u32 a, u64 b
+ *
+ * Under a virtual clock (clock.h) the CLOCK_MONOTONIC values are the
+ * virtual time.
+ */
+#ifndef EI_TYPE_FLIGHT_H
+#define EI_TYPE_FLIGHT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FLIGHT_MAGIC   "EIFLIGHT"
+#define FLIGHT_VERSION 1
+#define FLIGHT_ENTRIES (1u << 15)   /* a power of two */
+
+/* Event codes, shared with src/flight.rs and tools/ei-flight.c; the
+ * meaning of a and b is given for each */
+enum flight_event {
+    FL_KEY = 1,        /* a: keycode, b: 1 press, 0 release */
+    FL_FRAME,
+    FL_FLUSH,          /* b: ns its first key waited, 0 if it had none */
+    FL_SYNC,           /* b: cookie */
+    FL_SYNC_DONE,      /* b: cookie */
+    FL_CANCEL,
+    FL_PING,           /* a: pings in flight, b: log position it acks */
+    FL_PONG,           /* a: 1 if stale (sent before a pause), b: position */
+    FL_PAUSE,          /* b: events not yet acknowledged */
+    FL_RESUME,         /* a: emulation sequence */
+    FL_REPLAY,         /* b: events sent again */
+    FL_DISCONNECT,
+    FL_RECONNECT,      /* a: 1 if it worked */
+    FL_MODS,           /* a: depressed | latched << 8 | locked << 16, b: group */
+    FL_ERROR,          /* a: errno, 0 if there is none */
+};
+
+struct flight_header {
+    char     magic[8];
+    uint32_t version, entry_size;
+    uint64_t entries, lost;
+    uint64_t mono_ns, real_ns;
+};
+
+struct flight_entry {
+    uint64_t ns;
+    uint32_t event;
+    uint32_t a;
+    uint64_t b;
+};
+
+/* Returns the timestamp it recorded */
+uint64_t flight_record(enum flight_event ev, uint32_t a, uint64_t b);
+
+/* Record an error; flight_failed() says whether there was one */
+void flight_error(int err);
+bool flight_failed(void);
+
+/* Write the ring to path (async-signal-safe). Returns 0 or -errno. */
+int flight_dump(const char *path);
+
+#endif
@@ -0,0 +1,118 @@
+# gen-keytab.awk — generate keytab.h and keytab.c from keys.def
+#
+# Usage: awk -v hdr=keytab.h -v src=keytab.c -f gen-keytab.awk keys.def
+
+function fail(msg) {
+    printf "keys.def:%d: %s\n", NR, msg > "/dev/stderr"
+    failed = 1
+    exit 1
+}
+
+# Decode the chars column into codes[1..n]; returns n
+function decode_chars(s, codes,    n, i, c) {
+    n = 0
+    if (s == "-") return 0
+    for (i = 1; i <= length(s); i++) {
+        c = substr(s, i, 1)
+        if (c == "\\") {
+            c = substr(s, ++i, 1)
+            if (c == "s")       c = " "
+            else if (c == "n")  c = "\n"
+            else if (c == "t")  c = "\t"
+            else if (c != "\\") fail("unknown escape \\" c)
+        }
+        if (!(c in ord)) fail("non-ASCII character in chars column")
+        codes[++n] = ord[c]
+    }
+    if (n > 2) fail("at most two characters per key")
+    return n
+}
+
+function cname(code) {
+    if (code == 10) return "'\\n'"
+    if (code == 9)  return "'\\t'"
+    if (code == 39) return "'\\''"
+    if (code == 92) return "'\\\\'"
+    return "'" chr[code] "'"
+}
+
+BEGIN {
+    for (i = 1; i < 128; i++) {
+        c = sprintf("%c", i)
+        ord[c] = i
+        chr[i] = c
+    }
+    nkeys = nnames = nsyms = 0
+}
+
+/^#/ || NF == 0 { next }
+
+{
+    if (NF != 6) fail("expected 6 columns, got " NF)
+    name = $1; code = $2; flags = $3; chars = $4; syms = $5; aliases = $6
+    if (code !~ /^[0-9]+$/) fail("bad keycode '" code "'")
+    if (name in seen) fail("duplicate key " name)
+    seen[name] = 1
+
+    macro = "KEY_" name
+    keys[++nkeys] = macro
+    keycode[nkeys] = code
+    ismod = (flags == "mod") ? "true" : "false"
+
+    names[++nnames] = tolower(name); name_macro[nnames] = macro; name_mod[nnames] = ismod
+    if (aliases != "-") {
+        na = split(aliases, al, ",")
+        for (j = 1; j <= na; j++) {
+            names[++nnames] = al[j]; name_macro[nnames] = macro; name_mod[nnames] = ismod
+        }
+    }
+
+    if (syms != "-") {
+        gsub(",", ", ", syms)
+        sym_macro[++nsyms] = macro
+        sym_text[nsyms] = syms
+    }
+
+    n = decode_chars(chars, cc)
+    for (j = 1; j <= n; j++) {
+        if (cc[j] in ascii_macro) fail("character " cname(cc[j]) " mapped twice")
+        ascii_macro[cc[j]] = macro
+        ascii_shift[cc[j]] = (j == 2) ? "true" : "false"
+    }
+}
+
+END {
+    if (failed) exit 1
+
+    print "/* Generated from keys.def by gen-keytab.awk — do not edit */" > hdr
+    print "#ifndef EI_TYPE_KEYTAB_H" > hdr
+    print "#define EI_TYPE_KEYTAB_H" > hdr
+    print "" > hdr
+    for (i = 1; i <= nkeys; i++)
+        printf "#define %-18s %d\n", keys[i], keycode[i] > hdr
+    print "" > hdr
+    printf "#define KEYTAB_NNAMES %d\n", nnames > hdr
+    printf "#define KEYTAB_NSYMS  %d\n", nsyms > hdr
+    print "" > hdr
+    print "#endif" > hdr
+
+    print "/* Generated from keys.def by gen-keytab.awk — do not edit */" > src
+    print "#include \"keymap.h\"" > src
+    print "" > src
+    print "const struct keyinfo keytab_ascii[128] = {" > src
+    for (i = 1; i < 128; i++) {
+        if (i in ascii_macro)
+            printf "    [%3d] = { %-16s %-5s }, /* %s */\n", i, ascii_macro[i] ",", ascii_shift[i], cname(i) > src
+    }
+    print "};" > src
+    print "" > src
+    print "const struct keyname keytab_names[KEYTAB_NNAMES] = {" > src
+    for (i = 1; i <= nnames; i++)
+        printf "    { %-16s %-16s %-5s },\n", "\"" names[i] "\",", name_macro[i] ",", name_mod[i] > src
+    print "};" > src
+    print "" > src
+    print "const struct keysyms keytab_syms[KEYTAB_NSYMS] = {" > src
+    for (i = 1; i <= nsyms; i++)
+        printf "    { %-16s \"%s\" },\n", sym_macro[i] ",", sym_text[i] > src
+    print "};" > src
+}
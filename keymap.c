@@ -0,0 +1,197 @@
+/*
+ * keymap.c — key name lookup over the generated keys.def tables, the
+ * text side of translation (UTF-8 decoding and run classification) and
+ * --key combo parsing
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keymap.h"
+
+/* Combos are parsed once per invocation, a linear scan is plenty */
+static const struct keyname *find_name(const char *name) {
+    for (size_t i = 0; i < KEYTAB_NNAMES; i++) {
+        if (strcmp(keytab_names[i].name, name) == 0) return &keytab_names[i];
+    }
+    return NULL;
+}
+
+uint32_t key_from_name(const char *name) {
+    const struct keyname *k = find_name(name);
+    return k ? k->code : 0;
+}
+
+uint32_t modifier_from_name(const char *name) {
+    const struct keyname *k = find_name(name);
+    return k && k->modifier ? k->code : 0;
+}
+
+bool is_modifier_key(uint32_t code) {
+    for (size_t i = 0; i < KEYTAB_NNAMES; i++) {
+        if (keytab_names[i].code == code) return keytab_names[i].modifier;
+    }
+    return false;
+}
+
+size_t utf8_decode(const char *buf, size_t len, uint32_t *out, size_t *nout) {
+    const unsigned char *s = (const unsigned char *)buf;
+    size_t i = 0, n = 0;
+
+    while (i < len) {
+        unsigned char c = s[i];
+        uint32_t cp;
+        size_t need;
+
+        if (c < 0x80)                { cp = c;        need = 0; }
+        else if ((c & 0xe0) == 0xc0) { cp = c & 0x1f; need = 1; }
+        else if ((c & 0xf0) == 0xe0) { cp = c & 0x0f; need = 2; }
+        else if ((c & 0xf8) == 0xf0) { cp = c & 0x07; need = 3; }
+        else { out[n++] = 0xfffd; i++; continue; }
+
+        if (i + need >= len) break; /* truncated, wait for more */
+
+        size_t j;
+        for (j = 1; j <= need; j++) {
+            if ((s[i + j] & 0xc0) != 0x80) break;
+            cp = (cp << 6) | (s[i + j] & 0x3f);
+        }
+        if (j <= need) {
+            out[n++] = 0xfffd;
+            i += j;
+            continue;
+        }
+        out[n++] = cp;
+        i += need + 1;
+    }
+
+    *nout = n;
+    return i;
+}
+
+static bool is_plain(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == ' ';
+}
+
+/* keymap_scan() looks at 8 bytes at a time, in a uint64_t (SWAR): for
+ * bytes below 0x80, adding 0x80 - lo sets a byte's top bit iff it is
+ * >= lo, and no byte carries into the next */
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+/* Top bit of each byte of w (top bits clear) in [lo, hi] */
+static inline uint64_t bytes_in(uint64_t w, unsigned lo, unsigned hi) {
+    return (w + ONES * (0x80 - lo)) & ~(w + ONES * (0x7f - hi)) & HIGHS;
+}
+
+/* Top bit of each plain byte of w */
+static inline uint64_t plain_bytes(uint64_t w) {
+    uint64_t ascii = ~w & HIGHS;
+    w &= ~HIGHS;
+    return ascii & (bytes_in(w, 'a', 'z') | bytes_in(w, '0', '9') | bytes_in(w, ' ', ' '));
+}
+
+/* Index of the first byte in memory order with its top bit set in m */
+static inline size_t first_byte(uint64_t m) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (size_t)__builtin_clzll(m) / 8;
+#else
+    return (size_t)__builtin_ctzll(m) / 8;
+#endif
+}
+
+size_t keymap_scan(const char *s, size_t len, bool *plain) {
+    const unsigned char *p = (const unsigned char *)s;
+    bool want = is_plain(p[0]);
+    *plain = want;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        uint64_t m = plain_bytes(w);
+        uint64_t other = want ? ~m & HIGHS : m;
+        if (other) return i + first_byte(other);
+    }
+    while (i < len && is_plain(p[i]) == want) i++;
+    return i;
+}
+
+bool parse_chord(const char *combo, struct chord *c) {
+    char buf[256];
+    if (strlen(combo) >= sizeof(buf)) {
+        fprintf(stderr, "ei-type: key combo too long\n");
+        return false;
+    }
+    strcpy(buf, combo);
+
+    c->nmod = 0;
+    c->key = 0;
+    c->repeat = 1;
+
+    /* a trailing "*N" repeats the chord; "*" on its own is the asterisk */
+    char *star = strrchr(buf, '*');
+    if (star && star != buf && isdigit((unsigned char)star[1])) {
+        char *end;
+        unsigned long n = strtoul(star + 1, &end, 10);
+        if (*end == '\0') {
+            if (n == 0 || n > MAX_REPEAT) {
+                fprintf(stderr, "ei-type: repeat count in '%s' must be 1-%d\n", combo, MAX_REPEAT);
+                return false;
+            }
+            c->repeat = (unsigned)n;
+            *star = '\0';
+        }
+    }
+
+    char *saveptr;
+    char *tok = strtok_r(buf, "+", &saveptr);
+    while (tok) {
+        /* convert to lowercase for comparison */
+        for (char *p = tok; *p; p++) *p = tolower((unsigned char)*p);
+
+        char *next = strtok_r(NULL, "+", &saveptr);
+        if (next == NULL) {
+            /* last token is the key itself */
+            if (strlen(tok) == 1) {
+                struct keyinfo ki = char_to_key((unsigned char)tok[0]);
+                c->key = ki.code;
+                if (ki.shift && !chord_has_mod(c, KEY_LEFTSHIFT)) {
+                    if (c->nmod >= MAX_MODS) goto too_many;
+                    c->mods[c->nmod++] = KEY_LEFTSHIFT;
+                }
+            } else {
+                c->key = key_from_name(tok);
+            }
+            if (!c->key) {
+                fprintf(stderr, "ei-type: unknown key '%s'\n", tok);
+                return false;
+            }
+        } else {
+            /* modifier */
+            uint32_t m = modifier_from_name(tok);
+            if (!m) {
+                fprintf(stderr, "ei-type: unknown modifier '%s'\n", tok);
+                return false;
+            }
+            if (!chord_has_mod(c, m)) {
+                if (c->nmod >= MAX_MODS) goto too_many;
+                c->mods[c->nmod++] = m;
+            }
+        }
+        tok = next;
+    }
+
+    if (!c->key) {
+        fprintf(stderr, "ei-type: empty key combo\n");
+        return false;
+    }
+    return true;
+
+too_many:
+    /* cannot happen with the modifiers of keys.def; never type less */
+    fprintf(stderr, "ei-type: more than %d modifiers in '%s'\n", MAX_MODS, combo);
+    return false;
+}
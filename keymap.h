@@ -0,0 +1,84 @@
+/*
+ * keymap.h — evdev keycodes and character → key mapping (US layout)
+ *
+ * The tables live in keys.def; keytab.h/keytab.c are generated from it.
+ */
+#ifndef EI_TYPE_KEYMAP_H
+#define EI_TYPE_KEYMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keytab.h"
+
+struct keyinfo {
+    uint32_t code;
+    bool     shift;
+};
+
+struct keyname {
+    const char *name;   /* lowercase --key name */
+    uint32_t    code;
+    bool        modifier;
+};
+
+struct keysyms {
+    uint32_t    code;
+    const char *syms;   /* XKB keysyms per level, "a, A" */
+};
+
+extern const struct keyinfo keytab_ascii[128];
+extern const struct keyname keytab_names[KEYTAB_NNAMES];
+extern const struct keysyms keytab_syms[KEYTAB_NSYMS];
+
+/* Map a Unicode codepoint to an evdev keycode; code is 0 if unmapped */
+static inline struct keyinfo char_to_key(uint32_t c) {
+    if (c < 128) return keytab_ascii[c];
+    return (struct keyinfo){0, false};
+}
+
+/* Decode UTF-8 into codepoints; invalid bytes become U+FFFD.
+ * A sequence cut off at the end of buf is left for the next read:
+ * returns the number of bytes consumed. */
+size_t utf8_decode(const char *buf, size_t len, uint32_t *out, size_t *nout);
+
+/* Split text into runs for typing. Plain bytes (a-z, 0-9 and space) are
+ * one unshifted key each and need no decoding; returns the length of
+ * the run at the start of s (len > 0), all plain or none, and sets
+ * *plain to which. A run that is not plain ends before the next plain
+ * byte, so it never splits a valid UTF-8 sequence. */
+size_t keymap_scan(const char *s, size_t len, bool *plain);
+
+/* Named keys ("enter", "f5", "pageup", ...) and modifiers ("ctrl", "shift", ...).
+ * Names must already be lowercase. Both return 0 if unknown. */
+uint32_t key_from_name(const char *name);
+uint32_t modifier_from_name(const char *name);
+
+/* Whether an evdev keycode is one of the modifier keys */
+bool is_modifier_key(uint32_t code);
+
+/* Distinct modifier keys in keys.def, so a chord never runs out */
+#define MAX_MODS   8
+#define MAX_REPEAT 10000
+
+/* One combo of a --key sequence: modifiers held around a repeated key */
+struct chord {
+    uint32_t mods[MAX_MODS];
+    int      nmod;
+    uint32_t key;
+    unsigned repeat;
+};
+
+static inline bool chord_has_mod(const struct chord *c, uint32_t m) {
+    for (int i = 0; i < c->nmod; i++) {
+        if (c->mods[i] == m) return true;
+    }
+    return false;
+}
+
+/* Parse a key combo like "ctrl+v", "enter", "shift+a" or "down*10";
+ * prints what is wrong with it and returns false if it does not parse */
+bool parse_chord(const char *combo, struct chord *c);
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * libeitype.c — typing engine behind ei-type and libeitype.so
+ *
+ * Turns text and key combos into key events on a backend (backend.h),
+ * pacing them with the inter-key delay. The public entry points are
+ * declared in eitype.h; only those are exported from the shared library.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "eitype-private.h"
+#include "flight.h"
+#include "metrics.h"
+#include "probes.h"
+
+#define EITYPE_EXPORT __attribute__((visibility("default")))
+
+bool g_verbose = false;
+
+/* Set from a signal handler by the CLI; stops typing mid-run */
+volatile sig_atomic_t g_quit = 0;
+
+void wait_backend(struct eitype *t) {
+    if (t->wait) {
+        t->wait(t, WAIT_BACKEND, t->wait_data);
+        return;
+    }
+    int fd = eitype_get_fd(t);
+    if (fd >= 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (clock_poll(&pfd, 1, CLOCK_FOREVER) < 0 && errno != EINTR) g_quit = 1;
+    }
+    eitype_dispatch(t);
+}
+
+void emit_key(struct eitype *t, uint32_t code, bool press) {
+    /* a busy backend takes no more until the server answers; once
+     * cancelled the key is queued anyway, run_end() needs its release */
+    while (t->b->busy && t->b->busy(t->b) && !run_status(t)) wait_backend(t);
+
+    if (!t->stats.pending_since) t->stats.pending_since = now_ns();
+    uint64_t ns = flight_record(FL_KEY, code, press);
+    PROBE3(key, code, press, ns);
+    t->b->key(t->b, code, press);
+    if (press) {
+        t->stats.keys++;
+        METRIC_INC(keys);
+    }
+
+    if (code < MAX_KEYCODE) {
+        if (press) t->held[code / 8] |= (uint8_t)(1u << (code % 8));
+        else t->held[code / 8] &= (uint8_t)~(1u << (code % 8));
+    }
+}
+
+void emit_frame(struct eitype *t) {
+    PROBE1(frame, flight_record(FL_FRAME, 0, 0));
+    t->b->frame(t->b);
+    t->stats.frames++;
+    METRIC_INC(frames);
+}
+
+static void emit_flush(struct eitype *t) {
+    t->b->flush(t->b);
+    t->stats.flushes++;
+    METRIC_INC(flushes);
+    uint64_t lat = 0;
+    if (t->stats.pending_since) {
+        uint64_t now = now_ns();
+        lat = now - t->stats.pending_since;
+        if (!t->stats.first_flush) t->stats.first_flush = now;
+        t->stats.latency_ns += lat;
+        if (lat > t->stats.latency_max_ns) t->stats.latency_max_ns = lat;
+        t->stats.pending_since = 0;
+    }
+    uint64_t ns = flight_record(FL_FLUSH, 0, lat);
+    PROBE2(flush, lat, ns);
+}
+
+void wait_us(struct eitype *t, uint64_t delay_us) {
+    uint64_t start = now_ns();
+    if (t->wait) t->wait(t, delay_us, t->wait_data);
+    else clock_sleep(delay_us * 1000);
+
+    /* how late we woke up; a wait cut short by cancel counts as on time */
+    uint64_t slept = now_ns() - start, want = delay_us * 1000;
+    uint64_t late = slept > want ? slept - want : 0;
+    unsigned b = 0;
+    for (uint64_t us = late / 1000; us && b < JITTER_BUCKETS - 1; us >>= 1) b++;
+    t->stats.jitter[b]++;
+    if (late > t->stats.jitter_max_ns) t->stats.jitter_max_ns = late;
+}
+
+/* Flush and wait between key events. With no delay only every
+ * UNPACED_POLL events are flushed, so backends that batch (uinput) can
+ * coalesce many frames per write while the server still hears from us,
+ * and the wait hook looks at its input: a CANCEL has to get through
+ * however fast we type. */
+static void pace(struct eitype *t) {
+    if (t->delay_us <= 0) {
+        if (++t->unpaced % UNPACED_POLL) return;
+        emit_flush(t);
+        if (t->wait) t->wait(t, 0, t->wait_data);
+        return;
+    }
+    emit_flush(t);
+    wait_us(t, (uint64_t)t->delay_us);
+}
+
+void run_begin(struct eitype *t) {
+    t->run_gen = atomic_load(&t->cancel_gen);
+    t->delivered = 0;
+    t->unpaced = 0;
+}
+
+int run_status(const struct eitype *t) {
+    if (t->b->dead) return -ECONNRESET;
+    if (g_quit || atomic_load(&t->cancel_gen) != t->run_gen) return -ECANCELED;
+    return 0;
+}
+
+/* Release whatever a stopped run left pressed, modifiers last so no
+ * half-released combo turns into a shifted or ctrl'd key */
+static void release_held(struct eitype *t) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t code = 0; code < MAX_KEYCODE; code++) {
+            if (!(t->held[code / 8] & (1u << (code % 8)))) continue;
+            if (is_modifier_key(code) != (pass == 1)) continue;
+            DBG("releasing held key %u\n", code);
+            emit_key(t, code, false);
+            emit_frame(t);
+        }
+    }
+}
+
+int run_end(struct eitype *t) {
+    int r = run_status(t);
+    if (r < 0 && !t->b->dead) {
+        release_held(t);
+        emit_flush(t);
+    }
+    return r;
+}
+
+static bool map_char(struct backend *b, uint32_t cp, struct keyinfo *out) {
+    if (b->map_char) return b->map_char(b, cp, out);
+    *out = char_to_key(cp);
+    return out->code != 0;
+}
+
+/*
+ * Send a whitespace-separated sequence of combos, e.g. "ctrl+a ctrl+c" or
+ * "end shift+home delete". Modifiers stay down from one chord to the next
+ * when both use them, so "shift+down*3 shift+end" is one Shift press.
+ * The whole sequence is parsed before anything is sent.
+ */
+static int send_key_sequence(struct eitype *t, const char *seq) {
+    static const char ws[] = " \t\r\n";
+    char *copy = strdup(seq);
+    if (!copy) return -ENOMEM;
+
+    struct chord c;
+    char *saveptr;
+    int n = 0;
+    for (char *tok = strtok_r(copy, ws, &saveptr); tok; tok = strtok_r(NULL, ws, &saveptr)) {
+        if (!parse_chord(tok, &c)) {
+            free(copy);
+            return -EINVAL;
+        }
+        n++;
+    }
+    free(copy);
+    if (n == 0) {
+        fprintf(stderr, "ei-type: empty key combo\n");
+        return -EINVAL;
+    }
+
+    copy = strdup(seq);
+    if (!copy) return -ENOMEM;
+
+    struct chord held = { .nmod = 0 };
+    bool first = true;
+    for (char *tok = strtok_r(copy, ws, &saveptr); tok; tok = strtok_r(NULL, ws, &saveptr)) {
+        parse_chord(tok, &c);
+        if (!first) pace(t);
+        first = false;
+
+        /* release held modifiers this chord does not use, in reverse */
+        for (int i = held.nmod - 1; i >= 0; i--) {
+            if (chord_has_mod(&c, held.mods[i])) continue;
+            emit_key(t, held.mods[i], false);
+            emit_frame(t);
+            memmove(&held.mods[i], &held.mods[i + 1], (size_t)(held.nmod - i - 1) * sizeof(held.mods[0]));
+            held.nmod--;
+        }
+
+        /* press the ones it adds */
+        for (int i = 0; i < c.nmod; i++) {
+            if (chord_has_mod(&held, c.mods[i])) continue;
+            emit_key(t, c.mods[i], true);
+            emit_frame(t);
+            held.mods[held.nmod++] = c.mods[i];
+        }
+
+        /* press and release key */
+        for (unsigned r = 0; r < c.repeat && !run_status(t); r++) {
+            if (r > 0) pace(t);
+            emit_key(t, c.key, true);
+            emit_frame(t);
+            pace(t);
+            emit_key(t, c.key, false);
+            emit_frame(t);
+        }
+        if (run_status(t)) break;
+    }
+    free(copy);
+
+    /* release modifiers in reverse */
+    for (int i = held.nmod - 1; i >= 0; i--) {
+        emit_key(t, held.mods[i], false);
+        emit_frame(t);
+    }
+
+    emit_flush(t);
+    return 0;
+}
+
+/* A key that types nothing, pressed to use up a latched Shift the next
+ * character must not get */
+#define UNLATCH_KEY KEY_F24
+
+/* Whether Shift has to be pressed for ki, given the modifiers the server
+ * reports. Caps Lock flips the level of letters (and Shift+Lock gives
+ * lowercase); a latched Shift already applies to the next key, and is
+ * used up first by UNLATCH_KEY if the character is unshifted. Depressed
+ * modifiers are not used: our own Shift shows up there, late. */
+static bool plan_shift(struct eitype *t, uint32_t cp, const struct keyinfo *ki) {
+    struct backend *b = t->b;
+    if (!b->mods_known) return ki->shift;
+
+    bool want = ki->shift;
+    if ((b->mods.locked & XKB_MOD_LOCK) && cp < 128 && isalpha((int)cp))
+        want = !want;
+
+    if (b->mods.latched & XKB_MOD_SHIFT) {
+        /* the next key press uses up the latch; the server's next
+         * modifiers event says if it did */
+        b->mods.latched &= ~XKB_MOD_SHIFT;
+        if (!want) {
+            DBG("Shift is latched, pressing F24 to use it up before U+%04X\n", cp);
+            emit_key(t, UNLATCH_KEY, true);
+            emit_frame(t);
+            emit_key(t, UNLATCH_KEY, false);
+            emit_frame(t);
+        }
+        return false;
+    }
+    return want;
+}
+
+static bool type_char(struct eitype *t, uint32_t cp) {
+    struct keyinfo ki;
+    if (!map_char(t->b, cp, &ki)) {
+        DBG("skipping unmapped char U+%04X\n", cp);
+        METRIC_INC(unmappable);
+        return false;
+    }
+    ki.shift = plan_shift(t, cp, &ki);
+
+    if (ki.shift) {
+        emit_key(t, KEY_LEFTSHIFT, true);
+        emit_frame(t);
+    }
+
+    emit_key(t, ki.code, true);
+    emit_frame(t);
+    pace(t);
+
+    /* cancelled while the key was down: release_held() lets go */
+    if (run_status(t)) return false;
+
+    emit_key(t, ki.code, false);
+    emit_frame(t);
+
+    if (ki.shift) {
+        emit_key(t, KEY_LEFTSHIFT, false);
+        emit_frame(t);
+    }
+    return true;
+}
+
+/* Whether plain bytes (keymap_scan) can skip map_char and plan_shift:
+ * the backend uses the US table, and no Caps Lock or latched Shift
+ * changes what an unshifted key types */
+static bool plain_ok(const struct backend *b) {
+    if (b->map_char) return false;
+    return !b->mods_known ||
+           !((b->mods.locked & XKB_MOD_LOCK) || (b->mods.latched & XKB_MOD_SHIFT));
+}
+
+/* Type a run of plain bytes, one table lookup each. Returns how many
+ * were typed; stops early if cancelled or plain_ok() no longer holds,
+ * e.g. Caps Lock went on meanwhile. */
+static size_t type_plain(struct eitype *t, const char *s, size_t n) {
+    size_t i = 0;
+    for (; i < n && !run_status(t) && plain_ok(t->b); i++) {
+        uint32_t code = keytab_ascii[(unsigned char)s[i]].code;
+        emit_key(t, code, true);
+        emit_frame(t);
+        pace(t);
+
+        /* cancelled while the key was down: release_held() lets go */
+        if (run_status(t)) break;
+
+        emit_key(t, code, false);
+        emit_frame(t);
+        pace(t);
+    }
+    t->delivered += i;
+    return i;
+}
+
+int type_codepoints(struct eitype *t, const uint32_t *cps, size_t n) {
+    struct backend *b = t->b;
+    int typed = 0;
+
+    if (b->prepare) b->prepare(b, cps, n);
+    for (size_t i = 0; i < n && !run_status(t); i++) {
+        if (type_char(t, cps[i])) typed++;
+        pace(t);
+    }
+    t->delivered += (size_t)typed;
+    return typed;
+}
+
+/* Acks arrive in request order: everything up to cookie is done */
+static void sync_done(struct backend *b, uint64_t cookie) {
+    struct eitype *t = b->user;
+    uint64_t ns = flight_record(FL_SYNC_DONE, 0, cookie);
+    PROBE2(sync_ack, cookie, ns);
+    while (t->sync_count && t->syncs[t->sync_head].cookie <= cookie) {
+        metrics_observe(&g_metrics.sync_latency, ns - t->syncs[t->sync_head].sent_ns);
+        void (*done)(void *) = t->syncs[t->sync_head].done;
+        void *data = t->syncs[t->sync_head].data;
+        t->sync_head = (t->sync_head + 1) % MAX_SYNCS;
+        t->sync_count--;
+        done(data);
+    }
+}
+
+EITYPE_EXPORT struct eitype *eitype_connect(const char *backend) {
+    if (!backend) backend = "eis";
+    if (getenv("EITYPE_DEBUG")) g_verbose = true;
+    PROBE1(connect_start, now_ns());
+
+    struct backend *(*backend_new)(void);
+    if (strcmp(backend, "eis") == 0) {
+        backend_new = backend_eis_new;
+    } else if (strcmp(backend, "uinput") == 0) {
+        backend_new = backend_uinput_new;
+#ifdef HAVE_VK
+    } else if (strcmp(backend, "vk") == 0) {
+        backend_new = backend_vk_new;
+#endif
+    } else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct eitype *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->delay_us = DEFAULT_DELAY_US;
+    t->next_cookie = 1;
+
+    t->b = backend_new();
+    if (!t->b) {
+        free(t);
+        errno = ECONNREFUSED;
+        return NULL;
+    }
+    t->b->on_sync = sync_done;
+    t->b->user = t;
+    PROBE1(connect_done, now_ns());
+    return t;
+}
+
+EITYPE_EXPORT void eitype_set_delay(struct eitype *t, unsigned delay_us) {
+    t->delay_us = (int)delay_us;
+}
+
+EITYPE_EXPORT int eitype_type_utf8(struct eitype *t, const char *text, size_t len) {
+    uint32_t cps[1024];
+    int typed = 0;
+
+    run_begin(t);
+    /* plain runs go straight to keys; the rest is decoded in chunks,
+     * each chunk one prepare() run */
+    while (len > 0 && !run_status(t)) {
+        bool plain;
+        size_t run = keymap_scan(text, len, &plain), used;
+        if (plain && plain_ok(t->b)) {
+            used = type_plain(t, text, run);
+            typed += (int)used;
+        } else {
+            size_t chunk = run < 1024 ? run : 1024;
+            size_t ncp;
+            used = utf8_decode(text, chunk, cps, &ncp);
+            if (used == 0) {
+                if (chunk == len) break;    /* truncated sequence at the very end */
+                /* one cut off by a plain byte */
+                cps[0] = 0xfffd;
+                ncp = 1;
+                used = 1;
+            }
+            typed += type_codepoints(t, cps, ncp);
+        }
+        text += used;
+        len -= used;
+    }
+
+    int r = run_end(t);
+    return r < 0 ? r : typed;
+}
+
+EITYPE_EXPORT int eitype_key_combo(struct eitype *t, const char *combo) {
+    run_begin(t);
+    int r = send_key_sequence(t, combo);
+    if (r < 0) return r;
+    return run_end(t);
+}
+
+EITYPE_EXPORT void eitype_cancel(struct eitype *t) {
+    flight_record(FL_CANCEL, 0, 0);
+    atomic_fetch_add(&t->cancel_gen, 1);
+}
+
+EITYPE_EXPORT size_t eitype_delivered(const struct eitype *t) {
+    return t->delivered;
+}
+
+EITYPE_EXPORT int eitype_flush(struct eitype *t) {
+    if (t->b->dead) return -ECONNRESET;
+    emit_flush(t);
+    return t->b->dead ? -ECONNRESET : 0;
+}
+
+EITYPE_EXPORT int eitype_sync(struct eitype *t, void (*done)(void *data), void *data) {
+    if (t->b->dead) return -ECONNRESET;
+    if (t->sync_count == MAX_SYNCS) return -EBUSY;
+
+    unsigned slot = (t->sync_head + t->sync_count) % MAX_SYNCS;
+    uint64_t cookie = t->next_cookie++;
+    t->syncs[slot].cookie = cookie;
+    t->syncs[slot].done = done;
+    t->syncs[slot].data = data;
+    t->sync_count++;
+    uint64_t ns = flight_record(FL_SYNC, 0, cookie);
+    t->syncs[slot].sent_ns = ns;
+    PROBE2(sync, cookie, ns);
+
+    emit_flush(t);
+    if (t->b->sync) t->b->sync(t->b, cookie);
+    else sync_done(t->b, cookie);
+    return 0;
+}
+
+EITYPE_EXPORT int eitype_get_fd(struct eitype *t) {
+    return t->b->get_fd ? t->b->get_fd(t->b) : -EOPNOTSUPP;
+}
+
+EITYPE_EXPORT int eitype_dispatch(struct eitype *t) {
+    if (!t->b->dead) t->b->flush(t->b);
+    return t->b->dead ? -ECONNRESET : 0;
+}
+
+EITYPE_EXPORT void eitype_close(struct eitype *t) {
+    if (!t) return;
+    if (!t->b->dead) {
+        release_held(t);
+        emit_flush(t);
+    }
+    t->b->destroy(t->b);
+    free(t);
+}
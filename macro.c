@@ -0,0 +1,271 @@
+/*
+ * macro.c — record keyboard macros from EIS and play them back (see macro.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libei.h>
+
+#include "eitype-private.h"
+#include "macro.h"
+
+/* Playback waits on the backend fd until this close to a deadline, then
+ * sleeps the rest in one absolute-time sleep */
+#define COARSE_NS 2000000ull
+
+/* Playback lateness histogram: bucket b counts frames that went out
+ * less than 2^b us after their deadline, the last one everything above */
+#define LATE_BUCKETS 16
+
+static bool write_header(FILE *f, uint64_t entries, uint64_t duration_ns) {
+    struct macro_header hdr = {
+        .version = MACRO_VERSION,
+        .entry_size = sizeof(struct macro_entry),
+        .entries = entries,
+        .duration_ns = duration_ns,
+    };
+    memcpy(hdr.magic, MACRO_MAGIC, sizeof(hdr.magic));
+    return fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+}
+
+int macro_record(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "ei-type: cannot create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    /* entries 0 until the end: an interrupted recording still plays */
+    if (!write_header(f, 0, 0)) {
+        fprintf(stderr, "ei-type: cannot write %s: %s\n", path, strerror(errno));
+        fclose(f);
+        return 1;
+    }
+
+    struct ei *ei = ei_new_receiver(NULL);
+    if (!ei) {
+        fprintf(stderr, "ei-type: ei_new_receiver failed\n");
+        fclose(f);
+        return 1;
+    }
+    ei_configure_name(ei, "ei-type record");
+    int r = ei_setup_backend_socket(ei, NULL);
+    if (r < 0) {
+        fprintf(stderr, "ei-type: cannot connect to the EIS socket in $LIBEI_SOCKET: %s\n",
+                strerror(-r));
+        ei_unref(ei);
+        fclose(f);
+        return 1;
+    }
+
+    /* An entry is written once the next event shows whether it ended
+     * its frame */
+    struct macro_entry pending = {0};
+    bool have_pending = false, started = false, done = false;
+    uint64_t first = 0, last = 0, entries = 0;
+    bool ok = true;
+
+    while (!g_quit && !done && ok) {
+        struct pollfd pfd = { .fd = ei_get_fd(ei), .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "ei-type: poll error: %s\n", strerror(errno));
+            break;
+        }
+        ei_dispatch(ei);
+
+        struct ei_event *ev;
+        while ((ev = ei_get_event(ei)) != NULL) {
+            switch (ei_event_get_type(ev)) {
+            case EI_EVENT_CONNECT:
+                fprintf(stderr, "ei-type: recording to %s, Ctrl-C to stop\n", path);
+                break;
+            case EI_EVENT_SEAT_ADDED:
+                ei_seat_bind_capabilities(ei_event_get_seat(ev), EI_DEVICE_CAP_KEYBOARD, NULL);
+                break;
+            case EI_EVENT_KEYBOARD_KEY: {
+                /* the sender's frame time, in us */
+                uint64_t ns = ei_event_get_time(ev) * 1000;
+                if (!started) {
+                    first = ns;
+                    started = true;
+                }
+                ns = ns > first ? ns - first : 0;
+                if (ns < last) ns = last;
+                last = ns;
+
+                if (have_pending) {
+                    ok = ok && fwrite(&pending, sizeof(pending), 1, f) == 1;
+                    entries++;
+                }
+                pending = (struct macro_entry){
+                    .ns = ns,
+                    .code = ei_event_keyboard_get_key(ev),
+                    .flags = ei_event_keyboard_get_key_is_press(ev) ? MACRO_PRESS : 0,
+                };
+                have_pending = true;
+                DBG("recorded %s%u at %.3fms\n", pending.flags & MACRO_PRESS ? "+" : "-",
+                    pending.code, (double)ns / 1e6);
+                break;
+            }
+            case EI_EVENT_FRAME:
+                if (have_pending) {
+                    pending.flags |= MACRO_FRAME;
+                    ok = ok && fwrite(&pending, sizeof(pending), 1, f) == 1;
+                    entries++;
+                    have_pending = false;
+                }
+                break;
+            case EI_EVENT_DISCONNECT:
+                fprintf(stderr, "ei-type: disconnected by EIS\n");
+                done = true;
+                break;
+            default:
+                DBG("event: %d\n", ei_event_get_type(ev));
+                break;
+            }
+            ei_event_unref(ev);
+        }
+    }
+    ei_unref(ei);
+
+    if (have_pending) {
+        pending.flags |= MACRO_FRAME;
+        ok = ok && fwrite(&pending, sizeof(pending), 1, f) == 1;
+        entries++;
+    }
+    ok = ok && fflush(f) == 0 && write_header(f, entries, last);
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "ei-type: cannot write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "ei-type: recorded %llu events over %.3fs\n",
+            (unsigned long long)entries, (double)last / 1e9);
+    return 0;
+}
+
+/* Map a macro file; *n is its number of entries */
+static const struct macro_entry *map_macro(const char *path, void **map, size_t *size, size_t *n) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "ei-type: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct macro_header)) {
+        fprintf(stderr, "ei-type: %s is not a macro file\n", path);
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (*map == MAP_FAILED) {
+        fprintf(stderr, "ei-type: cannot map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    const struct macro_header *hdr = *map;
+    size_t fits = (*size - sizeof(*hdr)) / sizeof(struct macro_entry);
+    if (memcmp(hdr->magic, MACRO_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != MACRO_VERSION || hdr->entry_size != sizeof(struct macro_entry)) {
+        fprintf(stderr, "ei-type: %s is not a version %d macro file\n", path, MACRO_VERSION);
+        munmap(*map, *size);
+        return NULL;
+    }
+    if (hdr->entries > fits) {
+        fprintf(stderr, "ei-type: %s is truncated\n", path);
+        munmap(*map, *size);
+        return NULL;
+    }
+    /* 0 from a recording that never finished: play what it got */
+    *n = hdr->entries ? (size_t)hdr->entries : fits;
+    madvise(*map, *size, MADV_SEQUENTIAL);
+    madvise(*map, *size, MADV_WILLNEED);
+    return (const struct macro_entry *)(hdr + 1);
+}
+
+/* Sleep until deadline (CLOCK_MONOTONIC ns), answering the server
+ * meanwhile, or until the run is cancelled */
+static void wait_until(struct eitype *t, uint64_t deadline) {
+    while (run_status(t) == 0) {
+        uint64_t now = now_ns();
+        if (now >= deadline) return;
+
+        int fd = eitype_get_fd(t);
+        if (fd >= 0 && deadline - now > COARSE_NS) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if (clock_poll(&pfd, 1, deadline - now - COARSE_NS) > 0) eitype_dispatch(t);
+            continue;
+        }
+        clock_sleep_until(deadline);
+    }
+}
+
+int macro_play(struct eitype *t, const char *path, double speed, bool report) {
+    void *map;
+    size_t size, n;
+    const struct macro_entry *ent = map_macro(path, &map, &size, &n);
+    if (!ent) return 1;
+
+    uint64_t late_hist[LATE_BUCKETS] = {0};
+    uint64_t frames = 0, late_sum = 0, late_max = 0;
+    size_t played = 0;
+
+    run_begin(t);
+    uint64_t start = now_ns(), due = start;
+    bool frame_open = false;
+    for (size_t i = 0; i < n; i++) {
+        if (!frame_open) {
+            due = start + (uint64_t)((double)ent[i].ns / speed);
+            wait_until(t, due);
+            if (run_status(t) < 0) break;
+            frame_open = true;
+        }
+        emit_key(t, ent[i].code, ent[i].flags & MACRO_PRESS);
+        played++;
+        if (!(ent[i].flags & MACRO_FRAME) && i + 1 < n) continue;
+
+        emit_frame(t);
+        eitype_flush(t);
+        frame_open = false;
+
+        uint64_t late = now_ns() - due;
+        unsigned b = 0;
+        for (uint64_t us = late / 1000; us && b < LATE_BUCKETS - 1; us >>= 1) b++;
+        late_hist[b]++;
+        late_sum += late;
+        if (late > late_max) late_max = late;
+        frames++;
+    }
+    int r = run_end(t);
+    uint64_t elapsed = now_ns() - start;
+    munmap(map, size);
+
+    if (r == -ECANCELED)
+        fprintf(stderr, "ei-type: interrupted after %zu of %zu events\n", played, n);
+    if (report && frames) {
+        /* upper bounds of the buckets holding the median and the 99th percentile */
+        unsigned p50 = 0, p99 = 0;
+        uint64_t seen = 0;
+        for (unsigned b = 0; b < LATE_BUCKETS; b++) {
+            seen += late_hist[b];
+            if (!p50 && seen * 2 >= frames) p50 = 1u << b;
+            if (!p99 && seen * 100 >= frames * 99) p99 = 1u << b;
+        }
+        fprintf(stderr, "ei-type: played %zu events in %llu frames over %.3fs (speed %gx)\n",
+                played, (unsigned long long)frames, (double)elapsed / 1e9, speed);
+        fprintf(stderr, "ei-type: frame lateness: mean %.1fus, p50 <%uus, p99 <%uus, max %.1fus\n",
+                (double)late_sum / (double)frames / 1e3, p50, p99, (double)late_max / 1e3);
+    }
+    return r < 0 && r != -ECANCELED ? 1 : 0;
+}
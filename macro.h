@@ -0,0 +1,54 @@
+/*
+ * macro.h — ei-type --record / --play: keyboard macros
+ *
+ * --record connects to an EIS server as a libei receiver and writes the
+ * key events it is sent, with their times, to a macro file. --play maps
+ * the file and sends the events again through any backend, each frame
+ * on an absolute deadline at its recorded offset (divided by --speed),
+ * and reports how far off schedule the frames went out.
+ *
+ * Macro file, host byte order; entries have a fixed size so a file is
+ * played in place from the mapping:
+ *   header  "EIMACRO\0", u32 version, u32 entry size, u64 entries,
+ *           u64 ns from the first event to the last
+ *   entries u64 ns since the first event, u32 evdev code, u32 flags
+ */
+#ifndef EI_TYPE_MACRO_H
+#define EI_TYPE_MACRO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct eitype;
+
+#define MACRO_MAGIC   "EIMACRO"
+#define MACRO_VERSION 1
+
+/* Entry flags */
+#define MACRO_PRESS (1u << 0)   /* a press, else a release */
+#define MACRO_FRAME (1u << 1)   /* last event of its frame */
+
+struct macro_header {
+    char     magic[8];
+    uint32_t version, entry_size;
+    uint64_t entries;
+    uint64_t duration_ns;
+};
+
+struct macro_entry {
+    uint64_t ns;
+    uint32_t code;
+    uint32_t flags;
+};
+
+/* Record keyboard events into path until SIGINT/SIGTERM or the server
+ * disconnects. The EIS server is the one at $LIBEI_SOCKET: KWin's
+ * connectToEIS only hands out sender connections. Returns the exit
+ * status for main(). */
+int macro_record(const char *path);
+
+/* Play path on t, speed times as fast as it was recorded. With report,
+ * print how late the frames went out. Returns the exit status. */
+int macro_play(struct eitype *t, const char *path, double speed, bool report);
+
+#endif
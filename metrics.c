@@ -0,0 +1,95 @@
+/*
+ * metrics.c — the counters of metrics.h and their text exposition
+ */
+
+#include "metrics.h"
+
+#define MS 1000000ull
+
+struct metrics g_metrics = {
+    .request_latency = {
+        .name = "ei_type_request_latency_seconds",
+        .help = "Daemon submissions, from queued to typed",
+        .bounds_ns = { 5 * MS, 10 * MS, 25 * MS, 50 * MS, 100 * MS, 250 * MS,
+                       500 * MS, 1000 * MS, 2500 * MS, 5000 * MS, 10000 * MS, 30000 * MS },
+    },
+    .sync_latency = {
+        .name = "ei_type_sync_ack_latency_seconds",
+        .help = "SYNC records, from request to the server's ack",
+        .bounds_ns = { MS / 10, MS / 4, MS / 2, 1 * MS, 2 * MS, 5 * MS,
+                       10 * MS, 25 * MS, 50 * MS, 100 * MS, 250 * MS, 1000 * MS },
+    },
+    .recover_latency = {
+        .name = "ei_type_recover_seconds",
+        .help = "Reconnections, from the disconnect to a working keyboard again",
+        .bounds_ns = { 10 * MS, 25 * MS, 50 * MS, 100 * MS, 250 * MS, 500 * MS,
+                       1000 * MS, 2500 * MS, 5000 * MS, 10000 * MS, 30000 * MS, 60000 * MS },
+    },
+};
+
+void metrics_observe(struct metrics_hist *h, uint64_t ns) {
+    unsigned b = 0;
+    while (b < METRICS_BUCKETS && h->bounds_ns[b] && ns > h->bounds_ns[b]) b++;
+    if (b < METRICS_BUCKETS && !h->bounds_ns[b]) b = METRICS_BUCKETS;
+    atomic_fetch_add_explicit(&h->count[b], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+}
+
+static uint64_t get(const atomic_uint_fast64_t *v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static void counter(FILE *f, const char *name, const char *help, const atomic_uint_fast64_t *v) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, help, name, name, (unsigned long long)get(v));
+}
+
+static void gauge(FILE *f, const char *name, const char *help, uint64_t v) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n",
+            name, help, name, name, (unsigned long long)v);
+}
+
+static void histogram(FILE *f, const struct metrics_hist *h) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", h->name, h->help, h->name);
+    uint64_t total = 0;
+    for (unsigned b = 0; b < METRICS_BUCKETS && h->bounds_ns[b]; b++) {
+        total += get(&h->count[b]);
+        fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", h->name,
+                (double)h->bounds_ns[b] / 1e9, (unsigned long long)total);
+    }
+    total += get(&h->count[METRICS_BUCKETS]);
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", h->name, (unsigned long long)total);
+    fprintf(f, "%s_sum %.9f\n", h->name, (double)get(&h->sum_ns) / 1e9);
+    fprintf(f, "%s_count %llu\n", h->name, (unsigned long long)total);
+}
+
+void metrics_write(FILE *f, const struct metrics_gauges *g) {
+    struct metrics *m = &g_metrics;
+    counter(f, "ei_type_keys_total", "Key presses injected", &m->keys);
+    counter(f, "ei_type_frames_total", "Frames sent", &m->frames);
+    counter(f, "ei_type_flushes_total", "Flushes to the backend", &m->flushes);
+    counter(f, "ei_type_bytes_written_total",
+            "Bytes written to the device (uinput; libei and Wayland do their own writes)",
+            &m->bytes_written);
+    counter(f, "ei_type_unmappable_chars_total", "Characters skipped for having no key",
+            &m->unmappable);
+    counter(f, "ei_type_submissions_total", "Daemon submissions run", &m->submissions);
+    counter(f, "ei_type_cancelled_submissions_total", "Submissions cut short by a cancel",
+            &m->cancelled);
+    counter(f, "ei_type_dropped_submissions_total", "Submissions refused as too large",
+            &m->dropped);
+    counter(f, "ei_type_pauses_total", "Times the server paused the keyboard", &m->pauses);
+    counter(f, "ei_type_reconnects_total", "Reconnections to EIS after a disconnect",
+            &m->reconnects);
+    counter(f, "ei_type_reconnect_failures_total", "Reconnection attempts that failed",
+            &m->reconnect_failures);
+    counter(f, "ei_type_standby_promotions_total",
+            "Reconnections that switched to the standby connection", &m->standby_promotions);
+    gauge(f, "ei_type_standby_ready", "1 while a standby connection is negotiated",
+          get(&m->standby_ready));
+    gauge(f, "ei_type_queue_depth", "Submissions waiting to run", g->queue_depth);
+    gauge(f, "ei_type_clients", "Connected daemon clients", g->clients);
+    histogram(f, &m->request_latency);
+    histogram(f, &m->sync_latency);
+    histogram(f, &m->recover_latency);
+}
@@ -0,0 +1,62 @@
+/*
+ * metrics.h — counters for a long-running ei-type, Prometheus style
+ *
+ * Process-wide, like the flight recorder: the engine, the backends and
+ * the daemon bump them with relaxed atomic adds, and the daemon exports
+ * them on its metrics socket and as D-Bus properties (daemon.c).
+ */
+#ifndef EI_TYPE_METRICS_H
+#define EI_TYPE_METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_BUCKETS 12
+
+struct metrics_hist {
+    const char *name, *help;
+    uint64_t bounds_ns[METRICS_BUCKETS];    /* ascending; unused ones 0 */
+    atomic_uint_fast64_t count[METRICS_BUCKETS + 1];    /* last: +Inf */
+    atomic_uint_fast64_t sum_ns;
+};
+
+struct metrics {
+    atomic_uint_fast64_t keys;          /* key presses */
+    atomic_uint_fast64_t frames;
+    atomic_uint_fast64_t flushes;
+    atomic_uint_fast64_t bytes_written; /* to the device, where we write it */
+    atomic_uint_fast64_t unmappable;    /* characters skipped, no key for them */
+    atomic_uint_fast64_t submissions;   /* daemon submissions run */
+    atomic_uint_fast64_t cancelled;     /* ... and cut short by a cancel */
+    atomic_uint_fast64_t dropped;       /* ... and refused as too large */
+    atomic_uint_fast64_t pauses;
+    atomic_uint_fast64_t reconnects;
+    atomic_uint_fast64_t reconnect_failures;    /* per attempt */
+    atomic_uint_fast64_t standby_promotions;    /* reconnects that took the standby */
+    atomic_uint_fast64_t standby_ready;         /* gauge: 1 while there is one */
+    struct metrics_hist request_latency;    /* submission closed → typed */
+    struct metrics_hist sync_latency;       /* eitype_sync() → server ack */
+    struct metrics_hist recover_latency;    /* disconnected → keyboard back */
+};
+
+extern struct metrics g_metrics;
+
+#define METRIC_ADD(field, n) \
+    atomic_fetch_add_explicit(&g_metrics.field, (n), memory_order_relaxed)
+#define METRIC_INC(field) METRIC_ADD(field, 1)
+#define METRIC_SET(field, v) \
+    atomic_store_explicit(&g_metrics.field, (v), memory_order_relaxed)
+
+void metrics_observe(struct metrics_hist *h, uint64_t ns);
+
+/* Values only the caller knows, exported as gauges */
+struct metrics_gauges {
+    uint64_t queue_depth;   /* submissions waiting to run */
+    uint64_t clients;
+};
+
+/* Everything in the Prometheus text exposition format */
+void metrics_write(FILE *f, const struct metrics_gauges *g);
+
+#endif
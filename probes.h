@@ -0,0 +1,27 @@
+/*
+ * probes.h — USDT tracepoints, provider ei_type
+ *
+ * Each probe is a nop plus an ELF note until bpftrace (or perf, or
+ * SystemTap) attaches to it. Built in when sys/sdt.h is available
+ * (systemtap-sdt-dev); without it they compile to nothing. List them
+ * with `bpftrace -l 'usdt:./ei-type:*'`; scripts in tools/bpftrace.
+ *
+ * Arguments are values the code has at hand anyway, timestamps being
+ * the flight recorder's (CLOCK_MONOTONIC ns, last argument). The Rust
+ * binary has the same probes with the same arguments.
+ */
+#ifndef EI_TYPE_PROBES_H
+#define EI_TYPE_PROBES_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(name, a)          STAP_PROBE1(ei_type, name, a)
+#define PROBE2(name, a, b)       STAP_PROBE2(ei_type, name, a, b)
+#define PROBE3(name, a, b, c)    STAP_PROBE3(ei_type, name, a, b, c)
+#else
+#define PROBE1(name, a)          ((void)(a))
+#define PROBE2(name, a, b)       ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c)    ((void)(a), (void)(b), (void)(c))
+#endif
+
+#endif
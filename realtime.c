@@ -0,0 +1,131 @@
+/*
+ * realtime.c — ei-type --realtime
+ *
+ * Under load the typing thread can be descheduled between a press and
+ * its release, which shows up as stalls and stuck-looking keys. This
+ * puts it in SCHED_FIFO, directly or (unprivileged) through rtkit on
+ * the system bus, and removes the other sources of wakeup latency it
+ * can: page faults (mlockall plus prefaulted stack and heap) and timer
+ * slack. --stats shows the effect in its jitter histogram.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifdef MINI_DBUS
+#include "dbus-mini.h"
+#else
+#include <systemd/sd-bus.h>
+#endif
+
+#include "eitype-private.h"
+#include "realtime.h"
+
+/* Touched up front so the typing loop takes no page faults */
+#define PREFAULT_STACK (256 * 1024)
+#define PREFAULT_HEAP  (4 * 1024 * 1024)
+
+/* CPU time we may use without blocking. rtkit insists on a hard limit
+ * no higher than its own (200ms by default); the soft limit sends
+ * SIGXCPU first, and we give up real-time rather than get killed. */
+#define RTTIME_SOFT_US 100000
+#define RTTIME_HARD_US 200000
+
+#define RTKIT_NAME "org.freedesktop.RealtimeKit1"
+#define RTKIT_PATH "/org/freedesktop/RealtimeKit1"
+
+static pid_t rt_tid;
+
+/* SIGXCPU goes to the process, so name the thread explicitly */
+static void on_sigxcpu(int sig) {
+    (void)sig;
+    static const char msg[] = "ei-type: real-time CPU limit hit, back to normal scheduling\n";
+    struct sched_param sp = { .sched_priority = 0 };
+    sched_setscheduler(rt_tid, SCHED_OTHER, &sp);
+    ssize_t w = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void)w;
+}
+
+static bool rtkit_make_realtime(pid_t tid, int prio) {
+#ifdef MINI_DBUS
+    struct dbus_mini *bus = dbus_mini_open_system();
+    if (!bus) return false;
+    int r = dbus_mini_call_tu(bus, RTKIT_NAME, RTKIT_PATH, RTKIT_NAME, "MakeThreadRealtime",
+                              (uint64_t)tid, (uint32_t)prio);
+    dbus_mini_close(bus);
+    return r == 0;
+#else
+    sd_bus *bus = NULL;
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+    int r = sd_bus_open_system(&bus);
+    if (r >= 0)
+        r = sd_bus_call_method(bus, RTKIT_NAME, RTKIT_PATH, RTKIT_NAME, "MakeThreadRealtime",
+                               &err, NULL, "tu", (uint64_t)tid, (uint32_t)prio);
+    if (r < 0)
+        fprintf(stderr, "ei-type: rtkit MakeThreadRealtime failed: %s\n",
+                err.message ? err.message : strerror(-r));
+    sd_bus_error_free(&err);
+    sd_bus_unref(bus);
+    return r >= 0;
+#endif
+}
+
+static __attribute__((noinline)) void prefault_stack(void) {
+    volatile char stack[PREFAULT_STACK];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
+
+/* Keep freed heap in the process instead of handing it back to the
+ * kernel, so memory allocated while typing is already mapped (and,
+ * after mlockall, resident) */
+static void prefault_heap(void) {
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    volatile char *heap = malloc(PREFAULT_HEAP);
+    if (!heap) return;
+    for (size_t i = 0; i < PREFAULT_HEAP; i += 4096) heap[i] = 0;
+    free((void *)heap);
+}
+
+bool realtime_enter(int prio) {
+    /* timers expire on time instead of being batched (real-time threads
+     * get no slack anyway; this helps if we end up without it) */
+    if (prctl(PR_SET_TIMERSLACK, 1UL) < 0)
+        fprintf(stderr, "ei-type: cannot reduce timer slack: %s\n", strerror(errno));
+
+    prefault_heap();
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        fprintf(stderr, "ei-type: cannot lock memory (RLIMIT_MEMLOCK?): %s\n", strerror(errno));
+    prefault_stack();
+
+    rt_tid = (pid_t)syscall(SYS_gettid);
+    struct rlimit rl = { .rlim_cur = RTTIME_SOFT_US, .rlim_max = RTTIME_HARD_US };
+    if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+        fprintf(stderr, "ei-type: cannot set RLIMIT_RTTIME: %s\n", strerror(errno));
+    signal(SIGXCPU, on_sigxcpu);
+
+    struct sched_param sp = { .sched_priority = prio };
+    if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &sp) == 0) {
+        DBG("SCHED_FIFO priority %d\n", prio);
+        return true;
+    }
+    if (errno != EPERM) {
+        fprintf(stderr, "ei-type: cannot switch to SCHED_FIFO: %s\n", strerror(errno));
+        return false;
+    }
+    if (!rtkit_make_realtime(rt_tid, prio)) return false;
+    DBG("SCHED_FIFO priority %d via rtkit\n", prio);
+    return true;
+}
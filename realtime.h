@@ -0,0 +1,18 @@
+/*
+ * realtime.h — ei-type --realtime: keep the typing thread on the CPU
+ */
+#ifndef EI_TYPE_REALTIME_H
+#define EI_TYPE_REALTIME_H
+
+#include <stdbool.h>
+
+/* SCHED_FIFO priority without one given; rtkit allows up to 20 by default */
+#define REALTIME_DEFAULT_PRIO 10
+
+/* Move the calling thread to SCHED_FIFO at prio (through rtkit when we
+ * may not do it ourselves), lock and prefault memory and cut the timer
+ * slack. Steps that fail are reported and skipped; returns false if the
+ * thread could not be made real-time. */
+bool realtime_enter(int prio);
+
+#endif
@@ -0,0 +1,79 @@
+//! Heap allocation counter for the tests, to check that typing does not
+//! allocate.
+//!
+//! Test builds install `Counting` as the global allocator (main.rs). It
+//! counts the allocations (and reallocations) of each thread, so tests
+//! running side by side do not see each other's.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+
+thread_local! {
+    static COUNT: Cell<u64> = const { Cell::new(0) };
+}
+
+pub struct Counting;
+
+fn note() {
+    // try_with: the allocator also runs while thread-locals are torn down
+    let _ = COUNT.try_with(|c| c.set(c.get() + 1));
+}
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        note();
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        note();
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        note();
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+/// Allocations made by this thread while running f, and f's result
+pub fn count<T>(f: impl FnOnce() -> T) -> (u64, T) {
+    let before = COUNT.with(Cell::get);
+    let r = f();
+    (COUNT.with(Cell::get) - before, r)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::count;
+    use crate::keymap;
+
+    #[test]
+    fn translate_allocates_its_result_only() {
+        let text = "Hello, World! The quick brown fox, 0123456789 ~`[]{}\n\tünïcödé ✓\n";
+        let (allocs, keys) = count(|| keymap::translate(text));
+        assert_eq!(allocs, 1);
+        assert_eq!(keys.len(), text.chars().count());
+    }
+
+    #[test]
+    fn combos_parse_without_allocating() {
+        for combo in ["enter", "ctrl+v", "ctrl+shift+t", "alt+f4", "super+l", "A", "?",
+                      "ctrl+shift+alt+super+k", "kp5", "*"] {
+            let (allocs, r) = count(|| keymap::parse_combo(combo));
+            assert!(r.is_ok(), "{}", combo);
+            assert_eq!(allocs, 0, "{}", combo);
+        }
+    }
+
+    #[test]
+    fn sequences_allocate_their_result_only() {
+        let (allocs, r) = count(|| keymap::parse_sequence("ctrl+a ctrl+c shift+down*3 end shift+home"));
+        assert_eq!(r.map(|chords| chords.len()), Ok(5));
+        assert_eq!(allocs, 1);
+    }
+}
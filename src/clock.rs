@@ -0,0 +1,169 @@
+//! The time source behind pacing and timeouts, as clock.h is for the C
+//! binary: the monotonic clock and real sleeps, or for the tests a
+//! virtual clock that stands still until something waits and then moves
+//! on by exactly the amount asked, without sleeping.
+//! [`poll`] still looks at its fds without blocking, so an in-process
+//! fake server sees the same sequence as in real time; only a wait
+//! without a limit blocks for real. Atomics only: typing must not
+//! allocate and the flight recorder reads the time in a signal handler.
+
+use std::io;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering::Relaxed};
+use std::sync::OnceLock;
+use std::thread;
+use std::time::{Duration, Instant};
+
+static VIRTUAL: AtomicBool = AtomicBool::new(false);
+static VIRTUAL_NS: AtomicU64 = AtomicU64::new(0);
+/// The Instant and the virtual time the switch happened at
+static ORIGIN: OnceLock<(Instant, u64)> = OnceLock::new();
+
+/// Switch to the virtual clock at start_ns (at least 1, as in C). Call
+/// it before anything reads the time.
+#[cfg(test)]
+pub fn set_virtual(start_ns: u64) {
+    let start_ns = start_ns.max(1);
+    VIRTUAL_NS.store(start_ns, Relaxed);
+    let _ = ORIGIN.set((Instant::now(), start_ns));
+    VIRTUAL.store(true, Relaxed);
+}
+
+fn virtual_ns() -> Option<u64> {
+    VIRTUAL.load(Relaxed).then(|| VIRTUAL_NS.load(Relaxed))
+}
+
+/// CLOCK_MONOTONIC in ns, or the virtual time
+pub fn now_ns() -> u64 {
+    if let Some(ns) = virtual_ns() {
+        return ns;
+    }
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Instant::now() on this clock
+pub fn now() -> Instant {
+    match (virtual_ns(), ORIGIN.get()) {
+        (Some(ns), Some(&(at, start))) => at + Duration::from_nanos(ns - start),
+        _ => Instant::now(),
+    }
+}
+
+pub fn sleep(d: Duration) {
+    if VIRTUAL.load(Relaxed) {
+        VIRTUAL_NS.fetch_add(d.as_nanos() as u64, Relaxed);
+    } else {
+        thread::sleep(d);
+    }
+}
+
+/// poll(2) for up to timeout (None: as long as it takes). With the
+/// virtual clock, if no fd is ready the time moves on by the timeout and
+/// 0 is returned.
+pub fn poll(fds: &mut [libc::pollfd], timeout: Option<Duration>) -> io::Result<usize> {
+    let ms = |t: Duration| t.as_nanos().div_ceil(1_000_000).min(i32::MAX as u128) as i32;
+    let simulated = VIRTUAL.load(Relaxed) && timeout.is_some();
+    let wait = if simulated { 0 } else { timeout.map_or(-1, ms) };
+    let ret = unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, wait) };
+    if ret < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    if ret == 0 && simulated {
+        sleep(timeout.unwrap_or_default());
+    }
+    Ok(ret as usize)
+}
+
+/// Retrying with exponential backoff, as in clock.h. The first attempt
+/// is due at once; after each failure the next comes `delay` later,
+/// starting at min and doubling up to max. With a timeout, no attempt is
+/// scheduled that would start more than that after the start.
+pub struct Backoff {
+    start: Instant,
+    delay: Duration,
+    max: Duration,
+    timeout: Option<Duration>,
+}
+
+impl Backoff {
+    pub fn new(min: Duration, max: Duration, timeout: Option<Duration>) -> Self {
+        Backoff { start: now(), delay: min, max, timeout }
+    }
+
+    /// An attempt failed: how long to wait for the next one, None once
+    /// time is up
+    pub fn failed(&mut self) -> Option<Duration> {
+        let delay = self.delay;
+        if self.timeout.is_some_and(|t| self.elapsed() + delay > t) {
+            return None;
+        }
+        self.delay = (delay * 2).min(self.max);
+        Some(delay)
+    }
+
+    /// Time since the start
+    pub fn elapsed(&self) -> Duration {
+        now() - self.start
+    }
+}
+
+/// For the tests: the virtual clock, one test at a time. It is turned on
+/// once and only moves forward, so tests compare times, not absolutes.
+#[cfg(test)]
+pub fn lock_virtual() -> std::sync::MutexGuard<'static, ()> {
+    static LOCK: std::sync::Mutex<()> = std::sync::Mutex::new(());
+    let guard = LOCK.lock().unwrap_or_else(|e| e.into_inner());
+    if !VIRTUAL.load(Relaxed) {
+        set_virtual(1_000_000_000);
+    }
+    guard
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const MS: u64 = 1_000_000;
+
+    #[test]
+    fn sleep_moves_the_time_by_exactly_that() {
+        let _clock = lock_virtual();
+        let (t0, i0) = (now_ns(), now());
+        sleep(Duration::from_micros(5000));
+        assert_eq!(now_ns() - t0, 5 * MS);
+        sleep(Duration::from_millis(86_400_000));
+        assert_eq!(now_ns() - t0, 86_400_000 * MS + 5 * MS);
+        assert_eq!(now() - i0, Duration::from_nanos(now_ns() - t0));
+    }
+
+    #[test]
+    fn poll_times_out_in_virtual_time() {
+        let _clock = lock_virtual();
+        let mut p = [0; 2];
+        assert_eq!(unsafe { libc::pipe(p.as_mut_ptr()) }, 0);
+        let mut pfd = [libc::pollfd { fd: p[0], events: libc::POLLIN, revents: 0 }];
+
+        let t0 = now_ns();
+        assert_eq!(poll(&mut pfd, Some(Duration::from_millis(30))).unwrap(), 0);
+        assert_eq!(now_ns() - t0, 30 * MS);
+
+        // ready: no time passes
+        assert_eq!(unsafe { libc::write(p[1], b"x".as_ptr().cast(), 1) }, 1);
+        assert_eq!(poll(&mut pfd, Some(Duration::from_millis(30))).unwrap(), 1);
+        assert_eq!(now_ns() - t0, 30 * MS);
+        unsafe {
+            libc::close(p[0]);
+            libc::close(p[1]);
+        }
+    }
+
+    #[test]
+    fn backoff_without_a_timeout_keeps_going() {
+        let _clock = lock_virtual();
+        let mut b = Backoff::new(Duration::from_millis(100), Duration::from_secs(5), None);
+        let waits: Vec<u64> = (0..100).map(|_| b.failed().unwrap().as_millis() as u64).collect();
+        assert_eq!(waits[..8], [100, 200, 400, 800, 1600, 3200, 5000, 5000]);
+        assert!(waits[8..].iter().all(|&w| w == 5000));
+    }
+}
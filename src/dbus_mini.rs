@@ -0,0 +1,426 @@
+//! Just enough D-Bus for one method call.
+//!
+//! Built instead of zbus and tokio with `--no-default-features`: SASL
+//! EXTERNAL with fd passing, a Hello, and method calls with one int32
+//! argument whose reply starts with a file descriptor, which is all
+//! connectToEIS needs. Auth and Hello go out in one write and Hello's
+//! reply is never waited for, so the call costs two round trips.
+
+use std::collections::VecDeque;
+use std::error::Error;
+use std::ffi::OsStr;
+use std::io::{self, Write};
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd};
+use std::os::linux::net::SocketAddrExt;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::net::{SocketAddr, UnixStream};
+use std::path::Path;
+
+const METHOD_CALL: u8 = 1;
+const METHOD_RETURN: u8 = 2;
+const ERROR: u8 = 3;
+
+const FIELD_PATH: u8 = 1;
+const FIELD_INTERFACE: u8 = 2;
+const FIELD_MEMBER: u8 = 3;
+const FIELD_ERROR_NAME: u8 = 4;
+const FIELD_REPLY_SERIAL: u8 = 5;
+const FIELD_DESTINATION: u8 = 6;
+const FIELD_SIGNATURE: u8 = 8;
+const FIELD_UNIX_FDS: u8 = 9;
+
+/// Replies we skip (NameAcquired, Hello's) are tiny; anything bigger than
+/// this is not for us either.
+const MAX_MESSAGE: usize = 64 * 1024;
+
+const NATIVE_ENDIAN: u8 = if cfg!(target_endian = "little") { b'l' } else { b'B' };
+
+/// Outgoing message in host byte order, as its first byte says.
+struct Msg(Vec<u8>);
+
+impl Msg {
+    fn align(&mut self, a: usize) {
+        while self.0.len() % a != 0 {
+            self.0.push(0);
+        }
+    }
+
+    fn u32(&mut self, v: u32) {
+        self.align(4);
+        self.0.extend_from_slice(&v.to_ne_bytes());
+    }
+
+    fn str(&mut self, s: &str) {
+        self.u32(s.len() as u32);
+        self.0.extend_from_slice(s.as_bytes());
+        self.0.push(0);
+    }
+
+    fn sig(&mut self, s: &str) {
+        self.0.push(s.len() as u8);
+        self.0.extend_from_slice(s.as_bytes());
+        self.0.push(0);
+    }
+
+    fn field(&mut self, code: u8, ty: &str, value: &str) {
+        self.align(8);
+        self.0.push(code);
+        self.sig(ty);
+        if ty == "g" {
+            self.sig(value);
+        } else {
+            self.str(value);
+        }
+    }
+}
+
+/// Method call with an optional int32 body.
+fn method_call(serial: u32, dest: &str, path: &str, iface: &str, member: &str, arg: Option<i32>) -> Vec<u8> {
+    let mut m = Msg(Vec::with_capacity(256));
+    m.0.extend_from_slice(&[NATIVE_ENDIAN, METHOD_CALL, 0, 1]);
+    m.u32(if arg.is_some() { 4 } else { 0 });
+    m.u32(serial);
+    m.u32(0); // header field array length, patched below
+
+    m.field(FIELD_PATH, "o", path);
+    m.field(FIELD_INTERFACE, "s", iface);
+    m.field(FIELD_MEMBER, "s", member);
+    m.field(FIELD_DESTINATION, "s", dest);
+    if arg.is_some() {
+        m.field(FIELD_SIGNATURE, "g", "i");
+    }
+
+    let fields = (m.0.len() - 16) as u32;
+    m.0[12..16].copy_from_slice(&fields.to_ne_bytes());
+    m.align(8);
+    if let Some(a) = arg {
+        m.0.extend_from_slice(&a.to_ne_bytes());
+    }
+    m.0
+}
+
+fn malformed() -> Box<dyn Error> {
+    "malformed D-Bus message".into()
+}
+
+fn align_to(off: usize, a: usize) -> usize {
+    (off + a - 1) / a * a
+}
+
+/// A received message, as offsets into the input buffer.
+#[derive(Default)]
+struct Reply {
+    kind: u8,
+    swap: bool, // sent in the other byte order
+    reply_serial: u32,
+    unix_fds: u32,
+    signature: String,
+    error_name: Option<String>,
+    body: usize,
+    body_len: usize,
+    total: usize,
+}
+
+impl Reply {
+    fn u32_at(&self, buf: &[u8], off: usize) -> u32 {
+        let v = u32::from_ne_bytes(buf[off..off + 4].try_into().unwrap());
+        if self.swap {
+            v.swap_bytes()
+        } else {
+            v
+        }
+    }
+
+    /// Parse the header fields we care about.
+    fn parse_fields(&mut self, p: &[u8], end: usize) -> Result<(), Box<dyn Error>> {
+        let mut off = 16;
+        while off < end {
+            off = align_to(off, 8);
+            if off + 5 > end || p[off + 1] != 1 {
+                return Err(malformed());
+            }
+            let code = p[off];
+            let ty = p[off + 2];
+            off += 4;
+
+            match ty {
+                b's' | b'o' => {
+                    off = align_to(off, 4);
+                    if off + 5 > end {
+                        return Err(malformed());
+                    }
+                    let len = self.u32_at(p, off) as usize;
+                    if len > end - off - 5 || p[off + 4 + len] != 0 {
+                        return Err(malformed());
+                    }
+                    if code == FIELD_ERROR_NAME {
+                        self.error_name = Some(String::from_utf8_lossy(&p[off + 4..off + 4 + len]).into_owned());
+                    }
+                    off += 4 + len + 1;
+                }
+                b'g' => {
+                    let len = *p.get(off).ok_or_else(malformed)? as usize;
+                    if len + 2 > end - off || p[off + 1 + len] != 0 {
+                        return Err(malformed());
+                    }
+                    if code == FIELD_SIGNATURE {
+                        self.signature = String::from_utf8_lossy(&p[off + 1..off + 1 + len]).into_owned();
+                    }
+                    off += 1 + len + 1;
+                }
+                b'u' => {
+                    off = align_to(off, 4);
+                    if off + 4 > end {
+                        return Err(malformed());
+                    }
+                    let v = self.u32_at(p, off);
+                    match code {
+                        FIELD_REPLY_SERIAL => self.reply_serial = v,
+                        FIELD_UNIX_FDS => self.unix_fds = v,
+                        _ => {}
+                    }
+                    off += 4;
+                }
+                _ => return Err(malformed()),
+            }
+        }
+        Ok(())
+    }
+}
+
+pub struct Bus {
+    sock: UnixStream,
+    serial: u32,
+    input: Vec<u8>,
+    fds: VecDeque<OwnedFd>, // received, not yet claimed by a message
+}
+
+/// Session bus socket address from a D-Bus address string.
+fn parse_address(addr: &str) -> Option<SocketAddr> {
+    for entry in addr.split(';') {
+        let Some(kvs) = entry.strip_prefix("unix:") else {
+            continue;
+        };
+        // Other keys (guid=, a bare flag) are skipped, as in dbus-mini.c
+        for kv in kvs.split(',') {
+            let Some((key, value)) = kv.split_once('=') else {
+                continue;
+            };
+            if key != "path" && key != "abstract" {
+                continue;
+            }
+            let value = value.as_bytes();
+            let mut out = Vec::with_capacity(value.len());
+            let mut i = 0;
+            while i < value.len() {
+                let hex = value.get(i + 1..i + 3).and_then(|h| std::str::from_utf8(h).ok());
+                match hex.and_then(|h| u8::from_str_radix(h, 16).ok()) {
+                    Some(b) if value[i] == b'%' => {
+                        out.push(b);
+                        i += 3;
+                    }
+                    _ => {
+                        out.push(value[i]);
+                        i += 1;
+                    }
+                }
+            }
+            return if key == "path" {
+                SocketAddr::from_pathname(Path::new(OsStr::from_bytes(&out))).ok()
+            } else {
+                SocketAddr::from_abstract_name(&out).ok()
+            };
+        }
+    }
+    None
+}
+
+impl Bus {
+    /// Connect to `$DBUS_SESSION_BUS_ADDRESS` (or `$XDG_RUNTIME_DIR/bus`)
+    /// and authenticate.
+    pub fn session() -> Result<Bus, Box<dyn Error>> {
+        let addr = match std::env::var("DBUS_SESSION_BUS_ADDRESS") {
+            Ok(a) if !a.is_empty() => a,
+            _ => {
+                let rt = std::env::var("XDG_RUNTIME_DIR")
+                    .map_err(|_| "neither DBUS_SESSION_BUS_ADDRESS nor XDG_RUNTIME_DIR is set")?;
+                format!("unix:path={}/bus", rt)
+            }
+        };
+        let sa = parse_address(&addr).ok_or_else(|| format!("unsupported D-Bus address '{}'", addr))?;
+        let sock = UnixStream::connect_addr(&sa)?;
+
+        let mut bus = Bus {
+            sock,
+            serial: 0,
+            input: Vec::with_capacity(8192),
+            fds: VecDeque::new(),
+        };
+
+        // AUTH EXTERNAL takes our uid as hex-encoded ASCII
+        let uid = unsafe { libc::getuid() }.to_string();
+        let hex: String = uid.bytes().map(|b| format!("{:02x}", b)).collect();
+        let mut out = vec![0u8];
+        out.extend_from_slice(format!("AUTH EXTERNAL {}\r\nNEGOTIATE_UNIX_FD\r\nBEGIN\r\n", hex).as_bytes());
+        bus.serial += 1;
+        out.extend(method_call(
+            bus.serial,
+            "org.freedesktop.DBus",
+            "/org/freedesktop/DBus",
+            "org.freedesktop.DBus",
+            "Hello",
+            None,
+        ));
+        bus.sock.write_all(&out)?;
+
+        if !bus.read_line()?.starts_with("OK ") {
+            return Err("D-Bus authentication failed".into());
+        }
+        if bus.read_line()? != "AGREE_UNIX_FD" {
+            return Err("D-Bus does not pass file descriptors".into());
+        }
+        Ok(bus)
+    }
+
+    /// Append what the socket has to the input buffer, collecting passed fds.
+    fn recv_more(&mut self) -> io::Result<()> {
+        let mut chunk = [0u8; 4096];
+        let mut control = [0u64; 16]; // cmsg space for 16 fds, aligned
+        let mut iov = libc::iovec {
+            iov_base: chunk.as_mut_ptr().cast(),
+            iov_len: chunk.len(),
+        };
+        let mut mh: libc::msghdr = unsafe { std::mem::zeroed() };
+        mh.msg_iov = &mut iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.as_mut_ptr().cast();
+        mh.msg_controllen = std::mem::size_of_val(&control) as _;
+
+        let n = loop {
+            let n = unsafe { libc::recvmsg(self.sock.as_raw_fd(), &mut mh, libc::MSG_CMSG_CLOEXEC) };
+            if n >= 0 {
+                break n as usize;
+            }
+            let e = io::Error::last_os_error();
+            if e.kind() != io::ErrorKind::Interrupted {
+                return Err(e);
+            }
+        };
+        if n == 0 {
+            return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "D-Bus connection closed"));
+        }
+        self.input.extend_from_slice(&chunk[..n]);
+
+        unsafe {
+            let mut c = libc::CMSG_FIRSTHDR(&mh);
+            while !c.is_null() {
+                if (*c).cmsg_level == libc::SOL_SOCKET && (*c).cmsg_type == libc::SCM_RIGHTS {
+                    let data = libc::CMSG_DATA(c) as *const libc::c_int;
+                    let len = (*c).cmsg_len as usize - libc::CMSG_LEN(0) as usize;
+                    for i in 0..len / std::mem::size_of::<libc::c_int>() {
+                        self.fds.push_back(OwnedFd::from_raw_fd(data.add(i).read_unaligned()));
+                    }
+                }
+                c = libc::CMSG_NXTHDR(&mh, c);
+            }
+        }
+        Ok(())
+    }
+
+    /// One "\r\n"-terminated SASL line.
+    fn read_line(&mut self) -> Result<String, Box<dyn Error>> {
+        loop {
+            if let Some(end) = self.input.windows(2).position(|w| w == b"\r\n") {
+                let line = String::from_utf8_lossy(&self.input[..end]).into_owned();
+                self.input.drain(..end + 2);
+                return Ok(line);
+            }
+            if self.input.len() > 1024 {
+                return Err("D-Bus authentication failed".into());
+            }
+            self.recv_more()?;
+        }
+    }
+
+    fn read_message(&mut self) -> Result<Reply, Box<dyn Error>> {
+        loop {
+            if self.input.len() >= 16 {
+                let p = &self.input;
+                let mut r = Reply {
+                    kind: p[1],
+                    swap: p[0] != NATIVE_ENDIAN,
+                    ..Default::default()
+                };
+                if p[0] != b'l' && p[0] != b'B' {
+                    return Err(malformed());
+                }
+                r.body_len = r.u32_at(p, 4) as usize;
+                let fields = r.u32_at(p, 12) as usize;
+                if fields > MAX_MESSAGE || r.body_len > MAX_MESSAGE {
+                    return Err(malformed());
+                }
+                r.body = align_to(16 + fields, 8);
+                r.total = r.body + r.body_len;
+                if p.len() >= r.total {
+                    r.parse_fields(p, 16 + fields)?;
+                    return Ok(r);
+                }
+            }
+            self.recv_more()?;
+        }
+    }
+
+    /// Call `dest path iface.member(int32 arg)` and return the fd the
+    /// reply starts with (signature "h...").
+    pub fn call_fd(&mut self, dest: &str, path: &str, iface: &str, member: &str, arg: i32) -> Result<OwnedFd, Box<dyn Error>> {
+        self.serial += 1;
+        let serial = self.serial;
+        self.sock.write_all(&method_call(serial, dest, path, iface, member, Some(arg)))?;
+
+        loop {
+            let r = self.read_message()?;
+            let n = (r.unix_fds as usize).min(self.fds.len());
+            let mut fds: Vec<OwnedFd> = self.fds.drain(..n).collect();
+            let ours = (r.kind == METHOD_RETURN || r.kind == ERROR) && r.reply_serial == serial;
+
+            let result = if !ours {
+                None
+            } else if r.kind == ERROR {
+                let mut text = r.error_name.clone().unwrap_or_else(|| "error".into());
+                if r.signature.starts_with('s') && r.body_len >= 5 {
+                    let len = r.u32_at(&self.input, r.body) as usize;
+                    if len <= r.body_len - 5 {
+                        text = String::from_utf8_lossy(&self.input[r.body + 4..r.body + 4 + len]).into_owned();
+                    }
+                }
+                Some(Err(format!("{} failed: {}", member, text).into()))
+            } else {
+                let idx = if r.body_len >= 4 { r.u32_at(&self.input, r.body) as usize } else { usize::MAX };
+                if r.signature.starts_with('h') && idx < fds.len() {
+                    Some(Ok(fds.swap_remove(idx)))
+                } else {
+                    Some(Err(format!("{} reply has no fd (signature '{}')", member, r.signature).into()))
+                }
+            };
+
+            self.input.drain(..r.total);
+            if let Some(result) = result {
+                return result;
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn address_skips_keys_without_a_value() {
+        let sa = parse_address("tcp:host=x;unix:flag,guid=1%2,path=/run/user/1000/bus").unwrap();
+        assert_eq!(sa.as_pathname(), Some(Path::new("/run/user/1000/bus")));
+        let sa = parse_address("unix:abstract=/tmp/dbus%2dAb,guid=0").unwrap();
+        assert_eq!(sa.as_abstract_name(), Some(&b"/tmp/dbus-Ab"[..]));
+        assert!(parse_address("unix:guid=0;tcp:host=x").is_none());
+    }
+}
@@ -1,36 +1,209 @@
-use std::collections::HashMap;
+use std::collections::VecDeque;
+use std::io::ErrorKind;
 use std::os::fd::AsRawFd;
 use std::os::unix::net::UnixStream;
-use std::thread;
 use std::time::Duration;
 
 use reis::ei::{self, keyboard::KeyState};
 use reis::PendingRequestResult;
 
+use crate::clock;
+use crate::flight::{self, Event};
 use crate::keymap;
 
-/// Poll the context fd for readability with a 500ms timeout.
-fn poll_readable(context: &ei::Context) -> std::io::Result<bool> {
-    let fd = context.as_raw_fd();
-    let mut pfd = libc::pollfd {
-        fd,
+/// How long the server may take to give us a resumed keyboard.
+const NEGOTIATE_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Reconnecting: the first retry comes after RECONNECT_MIN_DELAY and the
+/// wait doubles up to RECONNECT_MAX_DELAY; after RECONNECT_TIMEOUT of
+/// failures we give up. A KWin restart takes a few seconds.
+const RECONNECT_MIN_DELAY: Duration = Duration::from_millis(100);
+const RECONNECT_MAX_DELAY: Duration = Duration::from_secs(5);
+const RECONNECT_TIMEOUT: Duration = Duration::from_secs(30);
+
+/// Initial room in the event log and the sync queue. Unacknowledged
+/// events are about a round trip's worth, so typing stays within these
+/// and never allocates; only a long pause grows them.
+const LOG_RESERVE: usize = 4096;
+const SYNCS_RESERVE: usize = 64;
+
+/// Syncs in flight before flush() waits for one. Typing sends one per
+/// flush; this leaves room in SYNCS_RESERVE for a replay's burst.
+const MAX_SYNCS: usize = SYNCS_RESERVE / 2;
+
+/// Poll the context fd for readability, for up to timeout (None: for
+/// as long as it takes).
+fn poll_readable(context: &ei::Context, timeout: Option<Duration>) -> std::io::Result<bool> {
+    let mut pfd = [libc::pollfd {
+        fd: context.as_raw_fd(),
         events: libc::POLLIN,
         revents: 0,
-    };
-    let ret = unsafe { libc::poll(&mut pfd, 1, 500) };
-    if ret < 0 {
-        Err(std::io::Error::last_os_error())
-    } else {
-        Ok(ret > 0)
+    }];
+    Ok(clock::poll(&mut pfd, timeout)? > 0)
+}
+
+/// Asks the compositor for a fresh EIS socket after a disconnect.
+pub type Reconnect = Box<dyn FnMut() -> Result<UnixStream, Box<dyn std::error::Error>> + Send>;
+
+/// A key event or frame, kept until the server has acknowledged it.
+#[derive(Clone, Copy)]
+enum Logged {
+    Key(u32, bool),
+    Frame,
+}
+
+/// Events sent or waiting to be, not yet acknowledged, by position
+/// since the start. Pre-sized (LOG_RESERVE) so that logging a key does
+/// not allocate while acks keep up.
+struct EventLog {
+    events: Vec<Logged>,
+    base: u64,
+}
+
+impl EventLog {
+    fn new() -> Self {
+        EventLog { events: Vec::with_capacity(LOG_RESERVE), base: 0 }
+    }
+
+    /// Position after the newest event
+    fn end(&self) -> u64 {
+        self.base + self.events.len() as u64
+    }
+
+    fn len(&self) -> usize {
+        self.events.len()
+    }
+
+    fn is_empty(&self) -> bool {
+        self.events.is_empty()
+    }
+
+    fn key(&mut self, code: u32, press: bool) -> Logged {
+        let ns = flight::record(Event::Key, code, press as u64);
+        crate::ei_type::key!(|| (code, press as u8, ns));
+        self.push(Logged::Key(code, press))
+    }
+
+    fn frame(&mut self) -> Logged {
+        let ns = flight::record(Event::Frame, 0, 0);
+        crate::ei_type::frame!(|| ns);
+        self.push(Logged::Frame)
+    }
+
+    fn push(&mut self, ev: Logged) -> Logged {
+        self.events.push(ev);
+        ev
+    }
+
+    /// The server has processed everything up to pos: forget it
+    fn ack(&mut self, pos: u64) {
+        let n = (pos.saturating_sub(self.base) as usize).min(self.events.len());
+        self.events.drain(..n);
+        self.base += n as u64;
+    }
+}
+
+/// Core xkb modifier bits; xkbcommon keymaps always put them first.
+const XKB_MOD_SHIFT: u32 = 1 << 0;
+const XKB_MOD_LOCK: u32 = 1 << 1;
+
+/// Modifier state as the server last reported it (xkb masks).
+#[derive(Clone, Copy, Default)]
+struct Modifiers {
+    depressed: u32,
+    latched: u32,
+    locked: u32,
+    group: u32,
+}
+
+impl Modifiers {
+    fn update(&mut self, depressed: u32, latched: u32, locked: u32, group: u32, verbose: bool) {
+        if group != 0 && group != self.group {
+            eprintln!("ei-type: layout group {} is active, text is typed for group 0", group);
+        }
+        *self = Modifiers { depressed, latched, locked, group };
+        flight::record(
+            Event::Mods,
+            (depressed & 0xff) | (latched & 0xff) << 8 | (locked & 0xff) << 16,
+            group as u64,
+        );
+        if verbose {
+            eprintln!(
+                "ei-type: modifiers: depressed={:#x} latched={:#x} locked={:#x} group={}",
+                depressed, latched, locked, group
+            );
+        }
+    }
+
+    /// How to get Shift right for c, given the modifiers the server
+    /// reports. Caps Lock flips the level of letters (and Shift+Lock
+    /// gives lowercase); a latched Shift already applies to the next key,
+    /// and has to be used up first if c is unshifted. Depressed modifiers
+    /// are not used: our own Shift shows up there, late.
+    fn plan_shift(&mut self, c: char, shift: bool, verbose: bool) -> ShiftPlan {
+        let mut want = shift;
+        if self.locked & XKB_MOD_LOCK != 0 && c.is_ascii_alphabetic() {
+            want = !want;
+        }
+        if self.latched & XKB_MOD_SHIFT != 0 {
+            // the next key press uses up the latch; the server's next
+            // modifiers event says if it did
+            self.latched &= !XKB_MOD_SHIFT;
+            if !want && verbose {
+                eprintln!("ei-type: Shift is latched, pressing F24 to use it up before '{}'", c.escape_debug());
+            }
+            return ShiftPlan { shift: false, unlatch: !want };
+        }
+        ShiftPlan { shift: want, unlatch: false }
     }
 }
 
+/// What a character needs besides its key: Shift held around it, and
+/// before it UNLATCH_KEY, to use up a latched Shift
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct ShiftPlan {
+    shift: bool,
+    unlatch: bool,
+}
+
+/// A key that types nothing
+const UNLATCH_KEY: u32 = keymap::KEY_F24;
+
+/// An `ei_connection.sync` in flight: once its callback is done, the
+/// server has processed the log up to `pos`. A sync sent before a pause
+/// is stale: the events ahead of it may have been dropped.
+struct PendingSync {
+    callback: ei::Callback,
+    pos: u64,
+    stale: bool,
+}
+
 pub struct EisConnection {
+    name: String,
     context: ei::Context,
+    connection: ei::Connection,
     keyboard: ei::Keyboard,
     device: ei::Device,
     last_serial: u32,
+    sequence: u32,
+    mods: Modifiers,
     verbose: bool,
+
+    // Every event sent stays here until acknowledged. While the device is
+    // paused new events only go here; on resume, or after reconnecting,
+    // the whole log is replayed. Each flush ends with a sync: the events
+    // of one flush (a key with its Shift, or a chord's modifiers and key)
+    // go out in one write, which the server reads and handles in one go
+    // and does not pause in the middle of, so it has acknowledged every
+    // key it took before the pause by then: nothing is typed twice. A
+    // replay syncs after every key event, as it can be long. After a
+    // disconnect, the key events the server had not answered may be.
+    paused: bool,
+    lost: bool,
+    log: EventLog,
+    synced: u64,
+    syncs: VecDeque<PendingSync>,
+    reconnect: Option<Reconnect>,
 }
 
 impl EisConnection {
@@ -43,6 +216,7 @@ impl EisConnection {
         verbose: bool,
     ) -> Result<Self, Box<dyn std::error::Error>> {
         let context = ei::Context::new(stream)?;
+        let name = name.to_owned();
 
         if verbose {
             eprintln!("ei-type: context created, starting handshake");
@@ -51,7 +225,7 @@ impl EisConnection {
         // Use the blocking handshake helper — handles version/name/context_type/interfaces
         let resp = reis::handshake::ei_handshake_blocking(
             &context,
-            name,
+            &name,
             ei::handshake::ContextType::Sender,
         )?;
         let mut last_serial = resp.serial;
@@ -86,15 +260,18 @@ impl EisConnection {
         }
 
         // Now process seat/device events using low-level API
-        let mut seat_caps: HashMap<String, u64> = HashMap::new();
+        let mut seat_caps: u64 = 0;
         let mut keyboard: Option<ei::Keyboard> = None;
         let mut kbd_device: Option<ei::Device> = None;
-        let mut device_interfaces: HashMap<String, reis::Object> = HashMap::new();
+        // the ei_keyboard interface of the device being announced
+        let mut device_keyboard: Option<reis::Object> = None;
+        let mut mods = Modifiers::default();
         let mut ready = false;
-        let mut timeout_count = 0;
-        let max_timeouts = 10;
+        // one poll up to the deadline per batch of events: no periodic
+        // wakeups while the server thinks
+        let deadline = clock::now() + NEGOTIATE_TIMEOUT;
 
-        while !ready && timeout_count < max_timeouts {
+        while !ready {
             // First drain any already-buffered events (handshake may have read extra data)
             let mut had_events = false;
             while let Some(result) = context.pending_event() {
@@ -138,11 +315,11 @@ impl EisConnection {
                             if verbose {
                                 eprintln!("ei-type: seat capability: {} mask={}", interface, mask);
                             }
-                            seat_caps.insert(interface, mask);
+                            seat_caps |= mask;
                         }
                         ei::seat::Event::Done => {
                             // Bind ALL capabilities — KWin requires this
-                            let combined: u64 = seat_caps.values().copied().sum();
+                            let combined = seat_caps;
                             if verbose {
                                 eprintln!("ei-type: binding all capabilities, mask={}", combined);
                             }
@@ -150,7 +327,7 @@ impl EisConnection {
                             context.flush()?;
                         }
                         ei::seat::Event::Device { device: _ } => {
-                            device_interfaces.clear();
+                            device_keyboard = None;
                             if verbose {
                                 eprintln!("ei-type: device announced");
                             }
@@ -162,11 +339,12 @@ impl EisConnection {
                             if verbose {
                                 eprintln!("ei-type: device interface: {}", object.interface());
                             }
-                            device_interfaces
-                                .insert(object.interface().to_owned(), object);
+                            if object.interface() == "ei_keyboard" {
+                                device_keyboard = Some(object);
+                            }
                         }
                         ei::device::Event::Done => {
-                            if let Some(obj) = device_interfaces.get("ei_keyboard") {
+                            if let Some(obj) = &device_keyboard {
                                 if let Some(kb) = obj.clone().downcast::<ei::Keyboard>() {
                                     if verbose {
                                         eprintln!("ei-type: keyboard device found");
@@ -187,6 +365,13 @@ impl EisConnection {
                         }
                         _ => {}
                     },
+                    ei::Event::Keyboard(
+                        _kb,
+                        ei::keyboard::Event::Modifiers { depressed, latched, locked, group, .. },
+                    ) => {
+                        // Initial state, e.g. Caps Lock already on
+                        mods.update(depressed, latched, locked, group, verbose);
+                    }
                     ei::Event::Keyboard(_kb, ref _evt) => {
                         if verbose {
                             eprintln!("ei-type: keyboard event (keymap etc.)");
@@ -208,26 +393,25 @@ impl EisConnection {
                 continue;
             }
 
-            // No pending events — poll for new data
-            match poll_readable(&context) {
+            // No pending events — wait for new data
+            let left = deadline.saturating_duration_since(clock::now());
+            if left.is_zero() {
+                return Err(format!(
+                    "timeout waiting for EIS events (no response in {}s)",
+                    NEGOTIATE_TIMEOUT.as_secs()
+                )
+                .into());
+            }
+            match poll_readable(&context, Some(left)) {
                 Ok(true) => {
                     context.read()?;
                 }
-                Ok(false) => {
-                    timeout_count += 1;
-                    if verbose {
-                        eprintln!("ei-type: poll timeout {}/{}", timeout_count, max_timeouts);
-                    }
-                }
+                Ok(false) => {}
                 Err(e) if e.kind() == std::io::ErrorKind::Interrupted => {}
                 Err(e) => return Err(e.into()),
             }
         }
 
-        if timeout_count >= max_timeouts {
-            return Err("timeout waiting for EIS events (no response in 5s)".into());
-        }
-
         let keyboard = keyboard.ok_or("no keyboard device found")?;
         let device = kbd_device.ok_or("no device found")?;
 
@@ -235,18 +419,8 @@ impl EisConnection {
         context.flush()?;
 
         // Drain any remaining events (keymap fds, other device resumed, etc.)
-        // Non-blocking: just process what's already buffered
-        while let Some(result) = context.pending_event() {
-            if let PendingRequestResult::Request(ei::Event::Connection(
-                _,
-                ei::connection::Event::Ping { ping },
-            )) = result
-            {
-                ping.done(0);
-            }
-        }
-        // Try one more read in case there's data on the socket
-        let _ = context.read();
+        // Non-blocking: just process what's already buffered; anything
+        // still on the socket is read when it wakes us up
         while let Some(result) = context.pending_event() {
             if let PendingRequestResult::Request(ei::Event::Connection(
                 _,
@@ -261,107 +435,594 @@ impl EisConnection {
         if verbose {
             eprintln!("ei-type: ready to type");
         }
+        crate::ei_type::device_ready!(|| flight::now());
 
         Ok(Self {
+            name,
             context,
+            connection: resp.connection,
             keyboard,
             device,
             last_serial,
+            sequence: 0,
+            mods,
             verbose,
+            paused: false,
+            lost: false,
+            log: EventLog::new(),
+            synced: 0,
+            syncs: VecDeque::with_capacity(SYNCS_RESERVE),
+            reconnect: None,
         })
     }
 
-    /// Process any pending incoming events (e.g. pings from the server).
-    fn dispatch(&self) {
-        let _ = self.context.read();
+    /// Reconnect through `f` when the server drops the connection, instead
+    /// of failing. Typing then continues from the last acknowledged event.
+    pub fn set_reconnect(&mut self, f: Reconnect) {
+        self.reconnect = Some(f);
+    }
+
+    fn send(&self, ev: Logged) {
+        match ev {
+            Logged::Key(code, press) => self.keyboard.key(
+                code,
+                if press { KeyState::Press } else { KeyState::Released },
+            ),
+            Logged::Frame => self.device.frame(self.last_serial, 0),
+        }
+    }
+
+    fn key(&mut self, code: u32, press: bool) {
+        let ev = self.log.key(code, press);
+        if !self.paused {
+            self.send(ev);
+        }
+    }
+
+    fn frame(&mut self) {
+        let ev = self.log.frame();
+        if !self.paused {
+            self.send(ev);
+        }
+    }
+
+    /// Ask for an ack once the server has processed the log up to pos.
+    /// reis allocates the callback object of each sync, which is why
+    /// typing sends one per flush and not one per key event.
+    fn request_sync(&mut self, pos: u64) {
+        let callback = self.connection.sync(1);
+        self.syncs.push_back(PendingSync { callback, pos, stale: false });
+        self.synced = pos;
+        let ns = flight::record(Event::Ping, self.syncs.len() as u32, pos);
+        crate::ei_type::ping!(|| (pos, ns));
+    }
+
+    /// Send what is queued with a sync covering it, then process incoming
+    /// events. With MAX_SYNCS in flight, wait for acks.
+    fn flush(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+        if !self.paused && self.synced < self.log.end() {
+            self.request_sync(self.log.end());
+        }
+        self.context.flush()?;
+        let ns = flight::record(Event::Flush, 0, 0);
+        crate::ei_type::flush!(|| (0u64, ns));
+        self.dispatch()?;
+        while !self.paused && self.syncs.len() >= MAX_SYNCS {
+            match poll_readable(&self.context, None) {
+                Ok(_) => {}
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.into()),
+            }
+            self.dispatch()?;
+        }
+        Ok(())
+    }
+
+    /// Process any pending incoming events: pings, sync acks, pause and
+    /// resume of the keyboard, and the server going away.
+    fn dispatch(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+        match self.context.read() {
+            Ok(0) => self.lost = true,
+            Ok(_) => {}
+            Err(e) if e.kind() == ErrorKind::WouldBlock || e.kind() == ErrorKind::Interrupted => {}
+            Err(_) => self.lost = true,
+        }
+
         while let Some(result) = self.context.pending_event() {
-            if let PendingRequestResult::Request(ei::Event::Connection(
-                _,
-                ei::connection::Event::Ping { ping },
-            )) = result
-            {
-                ping.done(0);
+            let PendingRequestResult::Request(event) = result else {
+                continue;
+            };
+            match event {
+                ei::Event::Connection(_, ei::connection::Event::Ping { ping }) => {
+                    ping.done(0);
+                }
+                ei::Event::Connection(_, ei::connection::Event::Disconnected { reason, explanation, .. }) => {
+                    eprintln!("ei-type: disconnected by EIS ({:?}: {:?}), reconnecting", reason, explanation);
+                    flight::record(Event::Disconnect, 0, 0);
+                    self.lost = true;
+                }
+                ei::Event::Keyboard(_, ei::keyboard::Event::Modifiers { depressed, latched, locked, group, .. }) => {
+                    self.mods.update(depressed, latched, locked, group, self.verbose);
+                }
+                ei::Event::Callback(callback, ei::callback::Event::Done { .. }) => {
+                    if self.syncs.front().is_some_and(|s| s.callback == callback) {
+                        let sync = self.syncs.pop_front().unwrap();
+                        let ns = flight::record(Event::Pong, sync.stale as u32, sync.pos);
+                        crate::ei_type::pong!(|| (sync.pos, sync.stale as u8, ns));
+                        if !sync.stale {
+                            self.log.ack(sync.pos);
+                        }
+                    }
+                }
+                ei::Event::Device(device, ei::device::Event::Paused { serial }) if device == self.device => {
+                    self.last_serial = serial;
+                    if self.verbose {
+                        eprintln!("ei-type: device paused, buffering keys");
+                    }
+                    self.pause();
+                }
+                ei::Event::Device(device, ei::device::Event::Resumed { serial }) if device == self.device => {
+                    self.last_serial = serial;
+                    if self.paused {
+                        self.sequence += 1;
+                        self.device.start_emulating(serial, self.sequence);
+                        let ns = flight::record(Event::Resume, self.sequence, 0);
+                        crate::ei_type::resume!(|| (self.sequence, ns));
+                        self.replay();
+                    }
+                }
+                _ => {}
+            }
+            if self.lost {
+                break;
             }
         }
+
+        if self.lost {
+            self.reconnect_now()?;
+        }
+        self.context.flush()?;
+        Ok(())
     }
 
-    /// Type a string character by character with inter-key delay.
-    pub fn type_text(
-        &mut self,
-        text: &str,
-        delay_us: u64,
-    ) -> Result<(), Box<dyn std::error::Error>> {
-        for c in text.chars() {
-            if let Some(ki) = keymap::char_to_key(c) {
-                self.type_key(ki.code, ki.shift, delay_us)?;
-            } else if self.verbose {
-                eprintln!("ei-type: skipping unmapped char '{}'", c.escape_debug());
+    fn pause(&mut self) {
+        if !self.paused {
+            let ns = flight::record(Event::Pause, 0, self.log.len() as u64);
+            crate::ei_type::pause!(|| (self.log.len() as u64, ns));
+        }
+        self.paused = true;
+        self.synced = self.log.base; // a stale sync covers nothing
+        for sync in &mut self.syncs {
+            sync.stale = true;
+        }
+    }
+
+    /// Send everything not yet acknowledged on a fresh emulation, each
+    /// key event with a sync of its own: a pause in the middle of a long
+    /// replay then repeats nothing either
+    fn replay(&mut self) {
+        if self.verbose {
+            eprintln!("ei-type: replaying {} events", self.log.len());
+        }
+        flight::record(Event::Replay, 0, self.log.len() as u64);
+        self.paused = false;
+        for i in 0..self.log.len() {
+            let ev = self.log.events[i];
+            self.send(ev);
+            if let Logged::Key(..) = ev {
+                self.request_sync(self.log.base + i as u64 + 1);
+            }
+        }
+        if self.synced < self.log.end() {
+            self.request_sync(self.log.end());
+        }
+    }
+
+    fn reconnect_now(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+        self.pause();
+        let mut backoff = clock::Backoff::new(RECONNECT_MIN_DELAY, RECONNECT_MAX_DELAY, Some(RECONNECT_TIMEOUT));
+        let fresh = loop {
+            let reconnect = self.reconnect.as_mut().ok_or("disconnected by EIS")?;
+            let fresh = reconnect().and_then(|stream| Self::connect(stream, &self.name, self.verbose));
+            flight::record(Event::Reconnect, fresh.is_ok() as u32, 0);
+            match fresh {
+                Ok(fresh) => break fresh,
+                Err(e) => match backoff.failed() {
+                    Some(delay) => {
+                        eprintln!("ei-type: reconnecting failed ({}), next attempt in {}ms", e, delay.as_millis());
+                        clock::sleep(delay);
+                    }
+                    None => {
+                        flight::error(libc::ECONNRESET);
+                        return Err(e);
+                    }
+                },
+            }
+        };
+        eprintln!("ei-type: reconnected after {:.1}ms", backoff.elapsed().as_secs_f64() * 1e3);
+
+        self.context = fresh.context;
+        self.connection = fresh.connection;
+        self.keyboard = fresh.keyboard;
+        self.device = fresh.device;
+        self.last_serial = fresh.last_serial;
+        self.sequence = 0;
+        self.mods = fresh.mods;
+        self.syncs.clear();
+        self.lost = false;
+        self.replay();
+        Ok(())
+    }
+
+    /// Wait until the server has processed everything typed, through a
+    /// pause if need be.
+    pub fn finish(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+        self.flush()?;
+        if self.paused && !self.log.is_empty() {
+            eprintln!("ei-type: device paused, waiting for it to finish typing");
+        }
+        while !self.log.is_empty() {
+            match poll_readable(&self.context, None) {
+                Ok(_) => {}
+                Err(e) if e.kind() == ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.into()),
             }
+            self.flush()?;
         }
         Ok(())
     }
 
-    /// Send a key combo like "ctrl+v" or "enter".
+    /// Type text already translated by `keymap::translate`, with the
+    /// inter-key delay.
+    pub fn type_keys(
+        &mut self,
+        keys: &[(char, Option<keymap::KeyInfo>)],
+        delay_us: u64,
+    ) -> Result<(), Box<dyn std::error::Error>> {
+        let verbose = self.verbose;
+        type_chars(self, keys, delay_us, verbose)
+    }
+
+    /// Send a sequence of key combos like "ctrl+a ctrl+c" or "down*10".
+    /// Modifiers shared by consecutive chords stay pressed in between.
     pub fn send_key_combo(
         &mut self,
         combo: &str,
         delay_us: u64,
     ) -> Result<(), Box<dyn std::error::Error>> {
-        let (modifiers, keycode) = keymap::parse_combo(combo)?;
+        let chords = keymap::parse_sequence(combo)?;
+        send_chords(self, &chords, delay_us)
+    }
+}
 
-        // Press modifiers
-        for &m in &modifiers {
-            self.keyboard.key(m, KeyState::Press);
-            self.device.frame(self.last_serial, 0);
+/// Where typed keys go: the connection, or a recorder in the tests. The
+/// pacing is in the functions over it, Shift planned from modifiers().
+trait KeySink {
+    fn key(&mut self, code: u32, press: bool);
+    fn frame(&mut self);
+    fn flush(&mut self) -> Result<(), Box<dyn std::error::Error>>;
+    fn modifiers(&mut self) -> &mut Modifiers;
+}
+
+impl KeySink for EisConnection {
+    fn key(&mut self, code: u32, press: bool) {
+        EisConnection::key(self, code, press)
+    }
+
+    fn frame(&mut self) {
+        EisConnection::frame(self)
+    }
+
+    fn flush(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+        EisConnection::flush(self)
+    }
+
+    fn modifiers(&mut self) -> &mut Modifiers {
+        &mut self.mods
+    }
+}
+
+/// Key combos, each key down for delay_us and delay_us between them.
+/// Modifiers shared by consecutive chords stay pressed in between.
+fn send_chords(
+    sink: &mut impl KeySink,
+    chords: &[keymap::Chord],
+    delay_us: u64,
+) -> Result<(), Box<dyn std::error::Error>> {
+    let mut held = keymap::Mods::default();
+
+    for (i, chord) in chords.iter().enumerate() {
+        if i > 0 {
+            clock::sleep(Duration::from_micros(delay_us));
+        }
+
+        // Release held modifiers this chord does not use, in reverse
+        while let Some(pos) = held.as_slice().iter().rposition(|&m| !chord.modifiers.contains(m)) {
+            sink.key(held.remove(pos), false);
+            sink.frame();
+        }
+
+        // Press the ones it adds
+        for &m in chord.modifiers.as_slice() {
+            if !held.contains(m) {
+                sink.key(m, true);
+                sink.frame();
+                held.add(m);
+            }
         }
 
         // Press and release key
-        self.keyboard.key(keycode, KeyState::Press);
-        self.device.frame(self.last_serial, 0);
-        self.context.flush()?;
-        thread::sleep(Duration::from_micros(delay_us));
+        for r in 0..chord.repeat {
+            if r > 0 {
+                clock::sleep(Duration::from_micros(delay_us));
+            }
+            sink.key(chord.key, true);
+            sink.frame();
+            sink.flush()?;
+            clock::sleep(Duration::from_micros(delay_us));
+
+            sink.key(chord.key, false);
+            sink.frame();
+            sink.flush()?;
+        }
+    }
+
+    // Release modifiers in reverse
+    for &m in held.as_slice().iter().rev() {
+        sink.key(m, false);
+        sink.frame();
+    }
+
+    sink.flush()?;
+    Ok(())
+}
+
+/// Characters translated by `keymap::translate`, Shift as the server's
+/// modifiers need it
+fn type_chars(
+    sink: &mut impl KeySink,
+    keys: &[(char, Option<keymap::KeyInfo>)],
+    delay_us: u64,
+    verbose: bool,
+) -> Result<(), Box<dyn std::error::Error>> {
+    for &(c, ref ki) in keys {
+        let Some(ki) = ki else {
+            if verbose {
+                eprintln!("ei-type: skipping unmapped char '{}'", c.escape_debug());
+            }
+            continue;
+        };
+        let plan = sink.modifiers().plan_shift(c, ki.shift, verbose);
+        if plan.unlatch {
+            sink.key(UNLATCH_KEY, true);
+            sink.frame();
+            sink.key(UNLATCH_KEY, false);
+            sink.frame();
+        }
+        type_key(sink, ki.code, plan.shift, delay_us)?;
+    }
+    Ok(())
+}
+
+/// One character's key, down for delay_us, then delay_us before the next
+fn type_key(
+    sink: &mut impl KeySink,
+    code: u32,
+    shift: bool,
+    delay_us: u64,
+) -> Result<(), Box<dyn std::error::Error>> {
+    if shift {
+        sink.key(keymap::KEY_LEFTSHIFT, true);
+        sink.frame();
+    }
+
+    sink.key(code, true);
+    sink.frame();
+    sink.flush()?;
+    clock::sleep(Duration::from_micros(delay_us));
+
+    sink.key(code, false);
+    sink.frame();
+
+    if shift {
+        sink.key(keymap::KEY_LEFTSHIFT, false);
+        sink.frame();
+    }
+
+    sink.flush()?;
+    clock::sleep(Duration::from_micros(delay_us));
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::alloc_count;
 
-        self.keyboard.key(keycode, KeyState::Released);
-        self.device.frame(self.last_serial, 0);
+    /// The connection's bookkeeping without reis: the event log and a
+    /// sync per flush, acked at once as by a server that keeps up. Left
+    /// out are the socket writes and what reis allocates for each sync
+    /// (request_sync).
+    struct LogSink {
+        log: EventLog,
+        syncs: VecDeque<u64>,
+        mods: Modifiers,
+    }
 
-        // Release modifiers in reverse
-        for &m in modifiers.iter().rev() {
-            self.keyboard.key(m, KeyState::Released);
-            self.device.frame(self.last_serial, 0);
+    impl KeySink for LogSink {
+        fn key(&mut self, code: u32, press: bool) {
+            self.log.key(code, press);
         }
 
-        self.context.flush()?;
-        self.dispatch();
-        Ok(())
+        fn frame(&mut self) {
+            self.log.frame();
+        }
+
+        fn flush(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+            self.syncs.push_back(self.log.end());
+            while let Some(pos) = self.syncs.pop_front() {
+                self.log.ack(pos);
+            }
+            Ok(())
+        }
+
+        fn modifiers(&mut self) -> &mut Modifiers {
+            &mut self.mods
+        }
     }
 
-    fn type_key(
-        &mut self,
-        code: u32,
-        shift: bool,
-        delay_us: u64,
-    ) -> Result<(), Box<dyn std::error::Error>> {
-        if shift {
-            self.keyboard.key(keymap::KEY_LEFTSHIFT, KeyState::Press);
-            self.device.frame(self.last_serial, 0);
+    #[test]
+    fn typing_bookkeeping_does_not_allocate_once_warm() {
+        let _clock = clock::lock_virtual();
+        let keys = keymap::translate("The quick brown fox jumps over the lazy dog!\n\tHELLO, World: 0123456789 ~`[]{}\n");
+        let chords = keymap::parse_sequence("ctrl+a ctrl+c shift+down*3 end shift+home").unwrap();
+        let mut sink = LogSink {
+            log: EventLog::new(),
+            syncs: VecDeque::with_capacity(SYNCS_RESERVE),
+            mods: Modifiers { locked: XKB_MOD_LOCK, ..Default::default() },
+        };
+        type_chars(&mut sink, &keys, 5000, false).unwrap();
+        send_chords(&mut sink, &chords, 5000).unwrap();
+
+        let (allocs, r) = alloc_count::count(|| -> Result<(), Box<dyn std::error::Error>> {
+            for _ in 0..100 {
+                type_chars(&mut sink, &keys, 5000, false)?;
+                send_chords(&mut sink, &chords, 5000)?;
+            }
+            Ok(())
+        });
+        assert!(r.is_ok());
+        assert_eq!(allocs, 0);
+        assert!(sink.log.is_empty());
+    }
+
+    #[test]
+    fn log_holds_its_reserve_without_allocating() {
+        // a pause: nothing is acked, the log fills up to its reserve
+        let mut log = EventLog::new();
+        let (allocs, ()) = alloc_count::count(|| {
+            for _ in 0..LOG_RESERVE / 2 {
+                log.key(keymap::KEY_A, true);
+                log.frame();
+            }
+        });
+        assert_eq!(allocs, 0);
+        assert_eq!(log.end(), LOG_RESERVE as u64);
+
+        log.ack(10);
+        assert_eq!(log.len(), LOG_RESERVE - 10);
+        assert_eq!(log.end(), LOG_RESERVE as u64);
+    }
+
+    /// Every key event with the time it was sent at
+    #[derive(Default)]
+    struct Recorder {
+        events: Vec<(u64, u32, bool)>,
+        mods: Modifiers,
+    }
+
+    impl KeySink for Recorder {
+        fn key(&mut self, code: u32, press: bool) {
+            self.events.push((clock::now_ns(), code, press));
         }
 
-        self.keyboard.key(code, KeyState::Press);
-        self.device.frame(self.last_serial, 0);
-        self.context.flush()?;
-        thread::sleep(Duration::from_micros(delay_us));
+        fn frame(&mut self) {}
 
-        self.keyboard.key(code, KeyState::Released);
-        self.device.frame(self.last_serial, 0);
+        fn flush(&mut self) -> Result<(), Box<dyn std::error::Error>> {
+            Ok(())
+        }
 
-        if shift {
-            self.keyboard.key(keymap::KEY_LEFTSHIFT, KeyState::Released);
-            self.device.frame(self.last_serial, 0);
+        fn modifiers(&mut self) -> &mut Modifiers {
+            &mut self.mods
         }
+    }
 
-        self.context.flush()?;
-        self.dispatch();
-        thread::sleep(Duration::from_micros(delay_us));
-        Ok(())
+    const MS: u64 = 1_000_000;
+
+    /// The events, times relative to t0
+    fn since(rec: &Recorder, t0: u64) -> Vec<(u64, u32, bool)> {
+        rec.events.iter().map(|&(ns, code, press)| (ns - t0, code, press)).collect()
+    }
+
+    #[test]
+    fn keys_are_paced_exactly() {
+        let _clock = clock::lock_virtual();
+        let mut rec = Recorder::default();
+        let t0 = clock::now_ns();
+        type_key(&mut rec, keymap::KEY_A, false, 5000).unwrap();
+        type_key(&mut rec, keymap::KEY_B, true, 5000).unwrap();
+        assert_eq!(since(&rec, t0), [
+            (0, keymap::KEY_A, true), (5 * MS, keymap::KEY_A, false),
+            (10 * MS, keymap::KEY_LEFTSHIFT, true), (10 * MS, keymap::KEY_B, true),
+            (15 * MS, keymap::KEY_B, false), (15 * MS, keymap::KEY_LEFTSHIFT, false),
+        ]);
+        assert_eq!(clock::now_ns() - t0, 20 * MS);
+    }
+
+    #[test]
+    fn combos_are_paced_exactly() {
+        let _clock = clock::lock_virtual();
+        let mut rec = Recorder::default();
+        let t0 = clock::now_ns();
+        send_chords(&mut rec, &keymap::parse_sequence("ctrl+a ctrl+c down*2").unwrap(), 5000).unwrap();
+        assert_eq!(since(&rec, t0), [
+            (0, keymap::KEY_LEFTCTRL, true), (0, keymap::KEY_A, true), (5 * MS, keymap::KEY_A, false),
+            (10 * MS, keymap::KEY_C, true), (15 * MS, keymap::KEY_C, false),
+            (20 * MS, keymap::KEY_LEFTCTRL, false), (20 * MS, keymap::KEY_DOWN, true),
+            (25 * MS, keymap::KEY_DOWN, false), (30 * MS, keymap::KEY_DOWN, true),
+            (35 * MS, keymap::KEY_DOWN, false),
+        ]);
+    }
+
+    /// The keys pressed and released typing text with these modifiers
+    fn shift_plan(locked: u32, latched: u32, text: &str) -> Vec<(u32, bool)> {
+        let mut rec = Recorder { mods: Modifiers { locked, latched, ..Default::default() }, ..Default::default() };
+        type_chars(&mut rec, &keymap::translate(text), 0, false).unwrap();
+        rec.events.iter().map(|&(_, code, press)| (code, press)).collect()
+    }
+
+    #[test]
+    fn caps_lock_flips_letters_only() {
+        use keymap::{KEY_1, KEY_A, KEY_B, KEY_LEFTSHIFT as SHIFT};
+        assert_eq!(shift_plan(XKB_MOD_LOCK, 0, "aB1!"), [
+            (SHIFT, true), (KEY_A, true), (KEY_A, false), (SHIFT, false),
+            (KEY_B, true), (KEY_B, false),
+            (KEY_1, true), (KEY_1, false),
+            (SHIFT, true), (KEY_1, true), (KEY_1, false), (SHIFT, false),
+        ]);
+    }
+
+    #[test]
+    fn latched_shift_is_used_or_used_up() {
+        use keymap::{KEY_A, KEY_B, KEY_F24, KEY_LEFTSHIFT as SHIFT};
+        // unshifted: F24 takes the latch
+        assert_eq!(shift_plan(0, XKB_MOD_SHIFT, "ab"), [
+            (KEY_F24, true), (KEY_F24, false),
+            (KEY_A, true), (KEY_A, false), (KEY_B, true), (KEY_B, false),
+        ]);
+        // shifted: the latch is its Shift
+        assert_eq!(shift_plan(0, XKB_MOD_SHIFT, "Ab"), [
+            (KEY_A, true), (KEY_A, false), (KEY_B, true), (KEY_B, false),
+        ]);
+        // with Caps Lock, the level after the flip counts
+        assert_eq!(shift_plan(XKB_MOD_LOCK, XKB_MOD_SHIFT, "Ab"), [
+            (KEY_F24, true), (KEY_F24, false), (KEY_A, true), (KEY_A, false),
+            (SHIFT, true), (KEY_B, true), (KEY_B, false), (SHIFT, false),
+        ]);
+    }
+
+    #[test]
+    fn reconnect_backoff_schedule() {
+        // every attempt failing at once, as reconnect_now() runs them
+        let _clock = clock::lock_virtual();
+        let mut backoff = clock::Backoff::new(RECONNECT_MIN_DELAY, RECONNECT_MAX_DELAY, Some(RECONNECT_TIMEOUT));
+        let t0 = clock::now_ns();
+        let mut attempts = vec![0];
+        while let Some(delay) = backoff.failed() {
+            clock::sleep(delay);
+            attempts.push((clock::now_ns() - t0) / MS);
+        }
+        assert_eq!(attempts, [0, 100, 300, 700, 1500, 3100, 6300, 11300, 16300, 21300, 26300]);
+        assert_eq!(backoff.elapsed(), Duration::from_millis(26300));
     }
 }
@@ -0,0 +1,200 @@
+//! Flight recorder: the last injection events, for bug reports.
+//!
+//! The same fixed ring and dump format as the C binary (flight.h), so
+//! tools/ei-flight decodes dumps of either. Recording is a clock read and
+//! a few relaxed stores; writers never wait. The ring is written out on
+//! SIGUSR2, after a failure and, with --flight, at exit.
+
+use std::ffi::CString;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering::Relaxed};
+use std::sync::OnceLock;
+
+const ENTRIES: usize = 1 << 15;
+const MAGIC: &[u8; 8] = b"EIFLIGHT";
+const VERSION: u32 = 1;
+const ENTRY_SIZE: usize = 24;
+
+/// Event codes, as in flight.h. Here a ping is an `ei_connection.sync`.
+#[derive(Clone, Copy)]
+#[repr(u32)]
+pub enum Event {
+    Key = 1,
+    Frame = 2,
+    Flush = 3,
+    Ping = 7,
+    Pong = 8,
+    Pause = 9,
+    Resume = 10,
+    Replay = 11,
+    Disconnect = 12,
+    Reconnect = 13,
+    Mods = 14,
+    Error = 15,
+}
+
+struct Slot {
+    ns: AtomicU64,
+    event_a: AtomicU64, // u32 event then u32 a, as laid out in the file
+    b: AtomicU64,
+}
+
+static RING: [Slot; ENTRIES] = [const {
+    Slot {
+        ns: AtomicU64::new(0),
+        event_a: AtomicU64::new(0),
+        b: AtomicU64::new(0),
+    }
+}; ENTRIES];
+static HEAD: AtomicU64 = AtomicU64::new(0);
+static FAILED: AtomicBool = AtomicBool::new(false);
+static AT_EXIT: AtomicBool = AtomicBool::new(false);
+static PATH: OnceLock<CString> = OnceLock::new();
+static MESSAGE: OnceLock<String> = OnceLock::new();
+
+fn clock_ns(clock: libc::clockid_t) -> u64 {
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { libc::clock_gettime(clock, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// The recorder's clock (CLOCK_MONOTONIC ns, or the virtual time of
+/// clock.rs), as the probes report it
+pub fn now() -> u64 {
+    crate::clock::now_ns()
+}
+
+/// Returns the timestamp it recorded
+pub fn record(ev: Event, a: u32, b: u64) -> u64 {
+    let n = HEAD.fetch_add(1, Relaxed);
+    let slot = &RING[n as usize & (ENTRIES - 1)];
+    let mut event_a = [0u8; 8];
+    event_a[..4].copy_from_slice(&(ev as u32).to_ne_bytes());
+    event_a[4..].copy_from_slice(&a.to_ne_bytes());
+    let ns = now();
+    slot.ns.store(ns, Relaxed);
+    slot.event_a.store(u64::from_ne_bytes(event_a), Relaxed);
+    slot.b.store(b, Relaxed);
+    ns
+}
+
+/// Record an error (an errno value, 0 if there is none) and dump at exit.
+pub fn error(err: i32) {
+    record(Event::Error, err as u32, 0);
+    FAILED.store(true, Relaxed);
+}
+
+fn write_all(fd: libc::c_int, mut buf: &[u8]) -> bool {
+    while !buf.is_empty() {
+        let w = unsafe { libc::write(fd, buf.as_ptr().cast(), buf.len()) };
+        if w < 0 && std::io::Error::last_os_error().kind() == std::io::ErrorKind::Interrupted {
+            continue;
+        }
+        if w <= 0 {
+            return false;
+        }
+        buf = &buf[w as usize..];
+    }
+    true
+}
+
+/// Write the ring to the dump path. Allocation-free, for the signal
+/// handler.
+fn dump() -> bool {
+    let Some(path) = PATH.get() else { return false };
+    let end = HEAD.load(Relaxed);
+    let count = end.min(ENTRIES as u64);
+
+    let mut hdr = [0u8; 48];
+    hdr[..8].copy_from_slice(MAGIC);
+    hdr[8..12].copy_from_slice(&VERSION.to_ne_bytes());
+    hdr[12..16].copy_from_slice(&(ENTRY_SIZE as u32).to_ne_bytes());
+    hdr[16..24].copy_from_slice(&count.to_ne_bytes());
+    hdr[24..32].copy_from_slice(&(end - count).to_ne_bytes());
+    hdr[32..40].copy_from_slice(&now().to_ne_bytes());
+    hdr[40..48].copy_from_slice(&clock_ns(libc::CLOCK_REALTIME).to_ne_bytes());
+
+    let fd = unsafe {
+        libc::open(
+            path.as_ptr(),
+            libc::O_WRONLY | libc::O_CREAT | libc::O_TRUNC | libc::O_CLOEXEC,
+            0o600,
+        )
+    };
+    if fd < 0 {
+        return false;
+    }
+    let mut ok = write_all(fd, &hdr);
+
+    // oldest first, a page's worth of entries per write
+    let mut buf = [0u8; ENTRY_SIZE * 170];
+    let mut used = 0;
+    for n in end - count..end {
+        let slot = &RING[n as usize & (ENTRIES - 1)];
+        let entry = &mut buf[used..used + ENTRY_SIZE];
+        entry[..8].copy_from_slice(&slot.ns.load(Relaxed).to_ne_bytes());
+        entry[8..16].copy_from_slice(&slot.event_a.load(Relaxed).to_ne_bytes());
+        entry[16..].copy_from_slice(&slot.b.load(Relaxed).to_ne_bytes());
+        used += ENTRY_SIZE;
+        if used == buf.len() {
+            ok &= write_all(fd, &buf);
+            used = 0;
+        }
+    }
+    ok &= write_all(fd, &buf[..used]);
+    unsafe { libc::close(fd) };
+    ok
+}
+
+extern "C" fn on_sigusr2(_: libc::c_int) {
+    if dump() {
+        if let Some(msg) = MESSAGE.get() {
+            write_all(libc::STDERR_FILENO, msg.as_bytes());
+        }
+    }
+}
+
+/// Set where dumps go: path, which is then also written at exit, or
+/// $XDG_RUNTIME_DIR/ei-type-flight.PID for SIGUSR2 and failures only.
+/// Without $XDG_RUNTIME_DIR there is no default path (a predictable name
+/// in /tmp could be a planted symlink; uinput runs as root, where it is
+/// usually unset), and dumps need --flight.
+pub fn setup(path: Option<&str>) {
+    AT_EXIT.store(path.is_some(), Relaxed);
+    let handler: extern "C" fn(libc::c_int) = on_sigusr2;
+    unsafe { libc::signal(libc::SIGUSR2, handler as libc::sighandler_t) };
+    let path = match path {
+        Some(p) => p.to_owned(),
+        None => match std::env::var("XDG_RUNTIME_DIR") {
+            Ok(dir) if !dir.is_empty() => {
+                format!("{}/ei-type-flight.{}", dir, std::process::id())
+            }
+            _ => return,
+        },
+    };
+    let Ok(cpath) = CString::new(path.as_str()) else { return };
+    let _ = PATH.set(cpath);
+    let _ = MESSAGE.set(format!("ei-type: flight recorder written to {}\n", path));
+}
+
+/// At exit: dump if asked to, or if something failed (failed marks the
+/// exit status as one more failure).
+pub fn finish(failed: bool) {
+    if failed && !FAILED.load(Relaxed) {
+        error(0);
+    }
+    if !AT_EXIT.load(Relaxed) && !FAILED.load(Relaxed) {
+        return;
+    }
+    match (dump(), PATH.get(), MESSAGE.get()) {
+        (true, _, Some(msg)) => eprint!("{}", msg),
+        (false, Some(path), _) => eprintln!(
+            "ei-type: cannot write flight recorder to {}: {}",
+            path.to_string_lossy(),
+            std::io::Error::last_os_error()
+        ),
+        (false, None, _) => eprintln!(
+            "ei-type: flight recorder not written: XDG_RUNTIME_DIR is not set, pass --flight=PATH"
+        ),
+        _ => {}
+    }
+}
@@ -1,160 +1,239 @@
+// The generated tables cover every key in keys.def, not all are used here
+#![allow(dead_code)]
+
 /// Key information: evdev keycode and whether shift is required.
 pub struct KeyInfo {
     pub code: u32,
     pub shift: bool,
 }
 
-// Evdev keycodes (linux/input-event-codes.h)
-pub const KEY_ESC: u32 = 1;
-pub const KEY_1: u32 = 2;
-pub const KEY_2: u32 = 3;
-pub const KEY_3: u32 = 4;
-pub const KEY_4: u32 = 5;
-pub const KEY_5: u32 = 6;
-pub const KEY_6: u32 = 7;
-pub const KEY_7: u32 = 8;
-pub const KEY_8: u32 = 9;
-pub const KEY_9: u32 = 10;
-pub const KEY_0: u32 = 11;
-pub const KEY_MINUS: u32 = 12;
-pub const KEY_EQUAL: u32 = 13;
-pub const KEY_TAB: u32 = 15;
-pub const KEY_Q: u32 = 16;
-pub const KEY_W: u32 = 17;
-pub const KEY_E: u32 = 18;
-pub const KEY_R: u32 = 19;
-pub const KEY_T: u32 = 20;
-pub const KEY_Y: u32 = 21;
-pub const KEY_U: u32 = 22;
-pub const KEY_I: u32 = 23;
-pub const KEY_O: u32 = 24;
-pub const KEY_P: u32 = 25;
-pub const KEY_LEFTBRACE: u32 = 26;
-pub const KEY_RIGHTBRACE: u32 = 27;
-pub const KEY_ENTER: u32 = 28;
-pub const KEY_LEFTCTRL: u32 = 29;
-pub const KEY_A: u32 = 30;
-pub const KEY_S: u32 = 31;
-pub const KEY_D: u32 = 32;
-pub const KEY_F: u32 = 33;
-pub const KEY_G: u32 = 34;
-pub const KEY_H: u32 = 35;
-pub const KEY_J: u32 = 36;
-pub const KEY_K: u32 = 37;
-pub const KEY_L: u32 = 38;
-pub const KEY_SEMICOLON: u32 = 39;
-pub const KEY_APOSTROPHE: u32 = 40;
-pub const KEY_GRAVE: u32 = 41;
-pub const KEY_LEFTSHIFT: u32 = 42;
-pub const KEY_BACKSLASH: u32 = 43;
-pub const KEY_Z: u32 = 44;
-pub const KEY_X: u32 = 45;
-pub const KEY_C: u32 = 46;
-pub const KEY_V: u32 = 47;
-pub const KEY_B: u32 = 48;
-pub const KEY_N: u32 = 49;
-pub const KEY_M: u32 = 50;
-pub const KEY_COMMA: u32 = 51;
-pub const KEY_DOT: u32 = 52;
-pub const KEY_SLASH: u32 = 53;
-pub const KEY_LEFTALT: u32 = 56;
-pub const KEY_SPACE: u32 = 57;
-pub const KEY_LEFTMETA: u32 = 125;
-
-const AZ_CODES: [u32; 26] = [
-    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
-    KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
-    KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z,
-];
+// Evdev keycodes, ASCII table and key-name hash, generated from keys.def
+include!(concat!(env!("OUT_DIR"), "/keytab.rs"));
+
+/// Longest key name accepted by `key_by_name` (lookups use a stack buffer).
+const MAX_NAME: usize = 16;
+
+/// FNV-1a with a seed; must match `name_hash` in build.rs.
+fn name_hash(name: &[u8], seed: u32) -> u32 {
+    let mut h = 0x811c_9dc5u32 ^ seed;
+    for &b in name {
+        h ^= b as u32;
+        h = h.wrapping_mul(0x0100_0193);
+    }
+    h
+}
+
+/// Look up a key name ("enter", "f5", "ctrl", ...), case-insensitively.
+/// Returns (keycode, is_modifier).
+pub fn key_by_name(name: &str) -> Option<(u32, bool)> {
+    if name.is_empty() || name.len() > MAX_NAME {
+        return None;
+    }
+    let mut buf = [0u8; MAX_NAME];
+    let lower = &mut buf[..name.len()];
+    lower.copy_from_slice(name.as_bytes());
+    lower.make_ascii_lowercase();
+
+    let bucket = name_hash(lower, 0) as usize & (NAME_DISP.len() - 1);
+    let slot = name_hash(lower, NAME_DISP[bucket]) as usize & (NAME_SLOTS.len() - 1);
+    let (n, code, modifier) = NAME_SLOTS[slot];
+    (n.as_bytes() == &*lower).then_some((code, modifier))
+}
 
 /// Map a character to its evdev keycode and shift state.
 pub fn char_to_key(c: char) -> Option<KeyInfo> {
-    match c {
-        'a'..='z' => Some(KeyInfo { code: AZ_CODES[(c as u8 - b'a') as usize], shift: false }),
-        'A'..='Z' => Some(KeyInfo { code: AZ_CODES[(c as u8 - b'A') as usize], shift: true }),
-        '1'..='9' => Some(KeyInfo { code: KEY_1 + (c as u32 - '1' as u32), shift: false }),
-        '0' => Some(KeyInfo { code: KEY_0, shift: false }),
-        ' ' => Some(KeyInfo { code: KEY_SPACE, shift: false }),
-        '\n' => Some(KeyInfo { code: KEY_ENTER, shift: false }),
-        '\t' => Some(KeyInfo { code: KEY_TAB, shift: false }),
-        // Unshifted punctuation
-        '-' => Some(KeyInfo { code: KEY_MINUS, shift: false }),
-        '=' => Some(KeyInfo { code: KEY_EQUAL, shift: false }),
-        '[' => Some(KeyInfo { code: KEY_LEFTBRACE, shift: false }),
-        ']' => Some(KeyInfo { code: KEY_RIGHTBRACE, shift: false }),
-        '\\' => Some(KeyInfo { code: KEY_BACKSLASH, shift: false }),
-        ';' => Some(KeyInfo { code: KEY_SEMICOLON, shift: false }),
-        '\'' => Some(KeyInfo { code: KEY_APOSTROPHE, shift: false }),
-        '`' => Some(KeyInfo { code: KEY_GRAVE, shift: false }),
-        ',' => Some(KeyInfo { code: KEY_COMMA, shift: false }),
-        '.' => Some(KeyInfo { code: KEY_DOT, shift: false }),
-        '/' => Some(KeyInfo { code: KEY_SLASH, shift: false }),
-        // Shifted punctuation
-        '!' => Some(KeyInfo { code: KEY_1, shift: true }),
-        '@' => Some(KeyInfo { code: KEY_2, shift: true }),
-        '#' => Some(KeyInfo { code: KEY_3, shift: true }),
-        '$' => Some(KeyInfo { code: KEY_4, shift: true }),
-        '%' => Some(KeyInfo { code: KEY_5, shift: true }),
-        '^' => Some(KeyInfo { code: KEY_6, shift: true }),
-        '&' => Some(KeyInfo { code: KEY_7, shift: true }),
-        '*' => Some(KeyInfo { code: KEY_8, shift: true }),
-        '(' => Some(KeyInfo { code: KEY_9, shift: true }),
-        ')' => Some(KeyInfo { code: KEY_0, shift: true }),
-        '_' => Some(KeyInfo { code: KEY_MINUS, shift: true }),
-        '+' => Some(KeyInfo { code: KEY_EQUAL, shift: true }),
-        '{' => Some(KeyInfo { code: KEY_LEFTBRACE, shift: true }),
-        '}' => Some(KeyInfo { code: KEY_RIGHTBRACE, shift: true }),
-        '|' => Some(KeyInfo { code: KEY_BACKSLASH, shift: true }),
-        ':' => Some(KeyInfo { code: KEY_SEMICOLON, shift: true }),
-        '"' => Some(KeyInfo { code: KEY_APOSTROPHE, shift: true }),
-        '~' => Some(KeyInfo { code: KEY_GRAVE, shift: true }),
-        '<' => Some(KeyInfo { code: KEY_COMMA, shift: true }),
-        '>' => Some(KeyInfo { code: KEY_DOT, shift: true }),
-        '?' => Some(KeyInfo { code: KEY_SLASH, shift: true }),
-        _ => None,
+    let (code, shift) = *ASCII.get(c as usize)?;
+    (code != 0).then_some(KeyInfo { code, shift })
+}
+
+/// Translate text to keys up front, keeping each character for the
+/// ones that have none. One allocation, sized for the worst case (a
+/// character per byte), so the typing loop never has to grow it.
+pub fn translate(text: &str) -> Vec<(char, Option<KeyInfo>)> {
+    let mut keys = Vec::with_capacity(text.len());
+    keys.extend(text.chars().map(|c| (c, char_to_key(c))));
+    keys
+}
+
+/// Translate the UTF-8 at the start of buf, for input read in pieces,
+/// appending to keys. Returns the bytes taken: a sequence cut off at the
+/// end is left for the next read, invalid ones become U+FFFD, as in the
+/// C reader. Once keys has room for a character per byte of buf, this
+/// does not allocate.
+pub fn translate_utf8(buf: &[u8], keys: &mut Vec<(char, Option<KeyInfo>)>) -> usize {
+    keys.reserve(buf.len());
+    let mut rest = buf;
+    loop {
+        let (valid, error) = match std::str::from_utf8(rest) {
+            Ok(text) => (text, None),
+            Err(e) => (std::str::from_utf8(&rest[..e.valid_up_to()]).unwrap(), Some(e)),
+        };
+        keys.extend(valid.chars().map(|c| (c, char_to_key(c))));
+        let Some(e) = error else {
+            return buf.len();
+        };
+        rest = &rest[e.valid_up_to()..];
+        match e.error_len() {
+            Some(n) => {
+                keys.push(('\u{fffd}', None));
+                rest = &rest[n..];
+            }
+            None => return buf.len() - rest.len(),
+        }
     }
 }
 
-/// Parse a key combo string like "ctrl+v", "enter", "shift+a".
-/// Returns (modifier_keycodes, final_keycode).
-pub fn parse_combo(combo: &str) -> Result<(Vec<u32>, u32), String> {
-    let parts: Vec<&str> = combo.split('+').collect();
-    if parts.is_empty() {
-        return Err("empty combo".into());
+/// Distinct modifier keys in keys.def, so a `Mods` can never overflow.
+pub const MAX_MODS: usize = 8;
+
+/// Modifier keycodes held for a combo, in press order, each once.
+/// Fixed capacity: parsing and typing combos does not allocate.
+#[derive(Clone, Copy, Default)]
+pub struct Mods {
+    codes: [u32; MAX_MODS],
+    len: usize,
+}
+
+impl Mods {
+    pub fn as_slice(&self) -> &[u32] {
+        &self.codes[..self.len]
     }
 
-    let mut modifiers = Vec::new();
+    pub fn contains(&self, code: u32) -> bool {
+        self.as_slice().contains(&code)
+    }
 
-    // All parts except last are modifiers
-    for &part in &parts[..parts.len() - 1] {
-        let modifier = match part.to_lowercase().as_str() {
-            "ctrl" | "control" => KEY_LEFTCTRL,
-            "shift" => KEY_LEFTSHIFT,
-            "alt" => KEY_LEFTALT,
-            "super" | "meta" => KEY_LEFTMETA,
-            other => return Err(format!("unknown modifier '{}'", other)),
-        };
-        modifiers.push(modifier);
+    /// Add code unless it is already there.
+    pub fn add(&mut self, code: u32) {
+        if !self.contains(code) {
+            assert!(self.len < MAX_MODS, "more modifiers than keys.def has");
+            self.codes[self.len] = code;
+            self.len += 1;
+        }
     }
 
-    // Last part is the key
-    let key_str = parts.last().unwrap().to_lowercase();
-    let keycode = if key_str.len() == 1 {
-        let c = key_str.chars().next().unwrap();
-        let ki = char_to_key(c).ok_or_else(|| format!("unknown key '{}'", c))?;
-        if ki.shift && !modifiers.contains(&KEY_LEFTSHIFT) {
-            modifiers.push(KEY_LEFTSHIFT);
+    pub fn remove(&mut self, index: usize) -> u32 {
+        let code = self.as_slice()[index];
+        self.codes.copy_within(index + 1..self.len, index);
+        self.len -= 1;
+        code
+    }
+}
+
+/// Parse a key combo string like "ctrl+v", "enter", "shift+a".
+/// Returns (modifier_keycodes, final_keycode).
+pub fn parse_combo(combo: &str) -> Result<(Mods, u32), String> {
+    let mut modifiers = Mods::default();
+
+    // All parts except last are modifiers; the last is the key
+    let (mod_str, key_str) = match combo.rsplit_once('+') {
+        Some((mods, key)) => (Some(mods), key),
+        None => (None, combo),
+    };
+    for part in mod_str.into_iter().flat_map(|m| m.split('+')) {
+        match key_by_name(part) {
+            Some((code, true)) => modifiers.add(code),
+            _ => return Err(format!("unknown modifier '{}'", part.to_lowercase())),
         }
-        ki.code
-    } else {
-        match key_str.as_str() {
-            "enter" | "return" => KEY_ENTER,
-            "tab" => KEY_TAB,
-            "space" => KEY_SPACE,
-            "esc" | "escape" => KEY_ESC,
-            other => return Err(format!("unknown key '{}'", other)),
+    }
+
+    // key_by_name ignores case; a single character is lowercased here
+    let mut chars = key_str.chars();
+    let keycode = match (chars.next(), chars.next()) {
+        (Some(c), None) => {
+            let c = c.to_ascii_lowercase();
+            let ki = char_to_key(c).ok_or_else(|| format!("unknown key '{}'", c))?;
+            if ki.shift {
+                modifiers.add(KEY_LEFTSHIFT);
+            }
+            ki.code
         }
+        _ => match key_by_name(key_str) {
+            Some((code, _)) => code,
+            None => return Err(format!("unknown key '{}'", key_str.to_lowercase())),
+        },
     };
 
     Ok((modifiers, keycode))
 }
+
+/// Largest repeat count accepted in a `key*N` chord.
+pub const MAX_REPEAT: u32 = 10_000;
+
+/// One combo of a `--key` sequence: modifiers held around a repeated key.
+pub struct Chord {
+    pub modifiers: Mods,
+    pub key: u32,
+    pub repeat: u32,
+}
+
+/// Split a trailing "*N" repeat count off a combo; "*" alone is the asterisk.
+fn split_repeat(combo: &str) -> Result<(&str, u32), String> {
+    if let Some(pos) = combo.rfind('*') {
+        let count = &combo[pos + 1..];
+        if pos > 0 && !count.is_empty() && count.bytes().all(|b| b.is_ascii_digit()) {
+            return match count.parse::<u32>() {
+                Ok(n) if (1..=MAX_REPEAT).contains(&n) => Ok((&combo[..pos], n)),
+                _ => Err(format!("repeat count in '{}' must be 1-{}", combo, MAX_REPEAT)),
+            };
+        }
+    }
+    Ok((combo, 1))
+}
+
+/// Parse a whitespace-separated combo sequence like "ctrl+a ctrl+c",
+/// "end shift+home delete" or "down*10". One allocation, the result.
+pub fn parse_sequence(seq: &str) -> Result<Vec<Chord>, String> {
+    let mut chords = Vec::with_capacity(seq.split_whitespace().count());
+    for part in seq.split_whitespace() {
+        let (combo, repeat) = split_repeat(part)?;
+        let (modifiers, key) = parse_combo(combo)?;
+        chords.push(Chord { modifiers, key, repeat });
+    }
+    if chords.is_empty() {
+        return Err("empty combo".into());
+    }
+    Ok(chords)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn chars(keys: &[(char, Option<KeyInfo>)]) -> String {
+        keys.iter().map(|&(c, _)| c).collect()
+    }
+
+    #[test]
+    fn utf8_split_across_reads() {
+        let text = "añ€😀b".as_bytes();
+        for cut in 0..=text.len() {
+            let (mut first, mut second) = (Vec::new(), Vec::new());
+            let used = translate_utf8(&text[..cut], &mut first);
+            let mut rest = text[used..cut].to_vec();
+            rest.extend_from_slice(&text[cut..]);
+            let all = translate_utf8(&rest, &mut second);
+            assert_eq!(all, rest.len(), "cut at {}", cut);
+            assert_eq!(chars(&first) + &chars(&second), "añ€😀b", "cut at {}", cut);
+        }
+    }
+
+    #[test]
+    fn combo_holds_every_modifier() {
+        let (mods, key) = parse_combo("ctrl+alt+super+rightctrl+altgr+rightmeta+rightshift+!").unwrap();
+        assert_eq!(key, KEY_1);
+        assert_eq!(
+            mods.as_slice(),
+            [KEY_LEFTCTRL, KEY_LEFTALT, KEY_LEFTMETA, KEY_RIGHTCTRL, KEY_RIGHTALT, KEY_RIGHTMETA, KEY_RIGHTSHIFT, KEY_LEFTSHIFT]
+        );
+    }
+
+    #[test]
+    fn utf8_invalid_becomes_replacement() {
+        let mut keys = Vec::new();
+        let used = translate_utf8(b"a\xffb\xe2\x82", &mut keys);
+        assert_eq!(chars(&keys), "a\u{fffd}b");
+        assert_eq!(used, 3);
+        assert!(keys[0].1.is_some() && keys[1].1.is_none());
+    }
+}
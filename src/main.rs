@@ -1,12 +1,46 @@
+#[cfg(test)]
+mod alloc_count;
+mod clock;
+#[cfg(not(feature = "zbus"))]
+mod dbus_mini;
 mod eis;
+mod flight;
 mod keymap;
 
+use std::env;
 use std::io::{self, Read};
 use std::os::unix::net::UnixStream;
+use std::path::{Path, PathBuf};
 use std::process;
+use std::sync::mpsc;
+use std::thread;
+use std::time::Instant;
 
 use clap::Parser;
 
+// Tests check that typing and reading stdin do not allocate
+#[cfg(test)]
+#[global_allocator]
+static ALLOC: alloc_count::Counting = alloc_count::Counting;
+
+/// USDT probes: the same names and arguments as the C binary's
+/// (probes.h), timestamps from the flight recorder's clock. Each is a
+/// nop until bpftrace attaches; see tools/bpftrace.
+#[usdt::provider]
+mod ei_type {
+    fn connect_start(ns: u64) {}
+    fn dbus_done(ns: u64) {}
+    fn device_ready(ns: u64) {}
+    fn connect_done(ns: u64) {}
+    fn key(code: u32, press: u8, ns: u64) {}
+    fn frame(ns: u64) {}
+    fn flush(latency_ns: u64, ns: u64) {}
+    fn ping(pos: u64, ns: u64) {}
+    fn pong(pos: u64, stale: u8, ns: u64) {}
+    fn pause(unacked: u64, ns: u64) {}
+    fn resume(sequence: u32, ns: u64) {}
+}
+
 /// Type text into the focused window via KWin EIS + libei
 #[derive(Parser)]
 #[command(name = "ei-type")]
@@ -15,22 +49,32 @@ struct Args {
     #[arg(short = 'd', long = "delay", default_value = "5")]
     delay_ms: u64,
 
-    /// Send a key combo (e.g. ctrl+v, enter)
+    /// Send key combos (e.g. ctrl+v, "ctrl+a ctrl+c", down*10)
     #[arg(long = "key")]
     key: Option<String>,
 
+    /// Write the flight recorder (recent events) to PATH at exit; it goes
+    /// to $XDG_RUNTIME_DIR/ei-type-flight.PID on failure or SIGUSR2, if
+    /// that is set
+    #[arg(long = "flight", value_name = "PATH")]
+    flight: Option<String>,
+
+    /// Connect to this EIS socket instead of KWin (same as
+    /// LIBEI_SOCKET=PATH, e.g. tools/ei-soak)
+    #[arg(long = "socket", value_name = "PATH")]
+    socket: Option<PathBuf>,
+
     /// Verbose debug output
     #[arg(short = 'v', long = "verbose")]
     verbose: bool,
 }
 
 /// Call KWin's connectToEIS D-Bus method, returning the EIS Unix socket.
-/// Returns both the stream AND the D-Bus connection (must stay alive for EIS to work).
-async fn connect_kwin_eis(verbose: bool) -> Result<(UnixStream, zbus::Connection), Box<dyn std::error::Error>> {
-    let connection = zbus::Connection::session().await?;
-
+/// The D-Bus connection must stay alive for EIS to work.
+#[cfg(feature = "zbus")]
+async fn request_eis_fd(connection: &zbus::Connection, verbose: bool) -> Result<UnixStream, Box<dyn std::error::Error>> {
     let proxy = zbus::Proxy::new(
-        &connection,
+        connection,
         "org.kde.KWin",
         "/org/kde/KWin/EIS/RemoteDesktop",
         "org.kde.KWin.EIS.RemoteDesktop",
@@ -45,55 +89,379 @@ async fn connect_kwin_eis(verbose: bool) -> Result<(UnixStream, zbus::Connection
     if verbose {
         eprintln!("ei-type: got EIS fd, cookie={}", cookie);
     }
+    ei_type::dbus_done!(|| flight::now());
 
     let owned_fd: std::os::fd::OwnedFd = fd.into();
     let stream = UnixStream::from(owned_fd);
     stream.set_nonblocking(true)?;
+    Ok(stream)
+}
+
+/// Open the session bus and get an EIS socket from KWin.
+/// Returns both the stream AND the D-Bus connection (must stay alive for EIS to work).
+#[cfg(feature = "zbus")]
+async fn connect_kwin_eis(verbose: bool) -> Result<(UnixStream, zbus::Connection), Box<dyn std::error::Error>> {
+    let connection = zbus::Connection::session().await?;
+    let stream = request_eis_fd(&connection, verbose).await?;
     Ok((stream, connection))
 }
 
+/// Call KWin's connectToEIS D-Bus method, returning the EIS Unix socket.
+/// The bus connection must stay alive for EIS to work.
+#[cfg(not(feature = "zbus"))]
+fn request_eis_fd(bus: &mut dbus_mini::Bus, verbose: bool) -> Result<UnixStream, Box<dyn std::error::Error>> {
+    // CAP_ALL = 63 — KWin requires all capabilities to be requested
+    let fd = bus.call_fd(
+        "org.kde.KWin",
+        "/org/kde/KWin/EIS/RemoteDesktop",
+        "org.kde.KWin.EIS.RemoteDesktop",
+        "connectToEIS",
+        63,
+    )?;
+
+    if verbose {
+        eprintln!("ei-type: got EIS fd");
+    }
+    ei_type::dbus_done!(|| flight::now());
+
+    let stream = UnixStream::from(fd);
+    stream.set_nonblocking(true)?;
+    Ok(stream)
+}
+
+/// The EIS socket from --socket or $LIBEI_SOCKET, if there is one. Like
+/// libei, a relative name is looked up in $XDG_RUNTIME_DIR.
+fn eis_socket(args: &Args) -> Option<PathBuf> {
+    let path = args.socket.clone().or_else(|| env::var_os("LIBEI_SOCKET").map(PathBuf::from))?;
+    if path.is_absolute() {
+        return Some(path);
+    }
+    Some(env::var_os("XDG_RUNTIME_DIR").map(PathBuf::from).unwrap_or_default().join(path))
+}
+
+/// Connect to an EIS socket directly, without asking KWin
+fn connect_socket(path: &Path) -> Result<UnixStream, Box<dyn std::error::Error>> {
+    let stream = UnixStream::connect(path).map_err(|e| format!("{}: {}", path.display(), e))?;
+    stream.set_nonblocking(true)?;
+    Ok(stream)
+}
+
+/// Exit, dumping the flight recorder first if asked to or on failure.
+fn exit(rc: i32) -> ! {
+    flight::finish(rc != 0);
+    process::exit(rc)
+}
+
+/// Keys translated from a piece of stdin
+type Keys = Vec<(char, Option<keymap::KeyInfo>)>;
+
+/// Bytes read from stdin at a time, and the pieces that can be between
+/// the input thread and typing at once. Their key buffers go back to the
+/// input thread once typed, so steady reading does not allocate.
+const READ_SIZE: usize = 4096;
+const CHUNKS: usize = 4;
+
+/// A piece of stdin, translated to keys
+struct Chunk {
+    keys: Keys,
+    ready: Instant,
+}
+
+/// The typing end of the input thread: translated pieces come in, their
+/// buffers go back with done()
+struct Input {
+    chunks: mpsc::Receiver<io::Result<Chunk>>,
+    free: mpsc::SyncSender<Keys>,
+}
+
+impl Input {
+    fn done(&self, mut keys: Keys) {
+        keys.clear();
+        // never full: there are only CHUNKS buffers
+        let _ = self.free.try_send(keys);
+    }
+}
+
+/// The reading end: src a read at a time, into the pooled buffers
+struct Reader<R> {
+    src: R,
+    buf: [u8; READ_SIZE],
+    have: usize,
+    spare: Option<Keys>,
+    chunks: mpsc::SyncSender<io::Result<Chunk>>,
+    free: mpsc::Receiver<Keys>,
+}
+
+impl<R: Read> Reader<R> {
+    fn new(src: R) -> (Self, Input) {
+        let (chunks, chunks_rx) = mpsc::sync_channel(CHUNKS);
+        let (free_tx, free) = mpsc::sync_channel(CHUNKS);
+        for _ in 0..CHUNKS {
+            let _ = free_tx.try_send(Vec::with_capacity(READ_SIZE));
+        }
+        let reader = Reader { src, buf: [0; READ_SIZE], have: 0, spare: None, chunks, free };
+        (reader, Input { chunks: chunks_rx, free: free_tx })
+    }
+
+    /// Read, translate and pass on the next piece. False at the end of
+    /// the input, after a read error, or once typing is over.
+    fn step(&mut self) -> bool {
+        let n = match self.src.read(&mut self.buf[self.have..]) {
+            Ok(0) => return false,
+            Ok(n) => n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => return true,
+            Err(e) => {
+                let _ = self.chunks.send(Err(e));
+                return false;
+            }
+        };
+        let len = self.have + n;
+
+        // waits while all CHUNKS buffers are being typed
+        let mut keys = match self.spare.take() {
+            Some(keys) => keys,
+            None => match self.free.recv() {
+                Ok(keys) => keys,
+                Err(_) => return false,
+            },
+        };
+        let used = keymap::translate_utf8(&self.buf[..len], &mut keys);
+        if keys.is_empty() {
+            self.spare = Some(keys);
+        } else if self.chunks.send(Ok(Chunk { keys, ready: clock::now() })).is_err() {
+            return false;
+        }
+
+        // keep a partial UTF-8 sequence for the next read
+        self.buf.copy_within(used..len, 0);
+        self.have = len - used;
+        true
+    }
+}
+
+/// Read and translate stdin on a thread, a read at a time, so typing
+/// starts on the first piece, the moment the device resumes if D-Bus
+/// and EIS are still being set up, and a pipe left open is typed as it
+/// comes. None with --key.
+fn start_input(args: &Args) -> Option<Input> {
+    if args.key.is_some() {
+        return None;
+    }
+    let (mut reader, input) = Reader::new(io::stdin());
+    thread::spawn(move || while reader.step() {});
+    Some(input)
+}
+
+/// Negotiate the keyboard and type. reconnect asks KWin for a new
+/// socket if it drops us (e.g. restarts).
+fn run(
+    args: Args,
+    launch: Instant,
+    input: Option<Input>,
+    stream: UnixStream,
+    reconnect: eis::Reconnect,
+) -> i32 {
+    let delay_us = args.delay_ms * 1000;
+
+    // Connect to EIS and negotiate keyboard device
+    let mut eis = match eis::EisConnection::connect(stream, "ei-type", args.verbose) {
+        Ok(c) => c,
+        Err(e) => {
+            eprintln!("ei-type: failed to get keyboard device: {}", e);
+            return 1;
+        }
+    };
+
+    eis.set_reconnect(reconnect);
+    let ready = clock::now();
+    ei_type::connect_done!(|| flight::now());
+
+    // Key combo mode
+    let input = match (&args.key, input) {
+        (Some(combo), _) => {
+            if let Err(e) = eis.send_key_combo(combo, delay_us).and_then(|_| eis.finish()) {
+                eprintln!("ei-type: key combo failed: {}", e);
+                return 1;
+            }
+            return 0;
+        }
+        (None, Some(input)) => input,
+        (None, None) => unreachable!("start_input reads stdin without --key"),
+    };
+
+    // Type each piece as the input thread reads and translates it
+    let mut input_ready = None;
+    let mut typing = None;
+    for chunk in input.chunks.iter() {
+        let chunk = match chunk {
+            Ok(chunk) => chunk,
+            Err(e) => {
+                eprintln!("ei-type: failed to read stdin: {}", e);
+                return 1;
+            }
+        };
+        input_ready.get_or_insert(chunk.ready);
+        typing.get_or_insert_with(clock::now);
+        if let Err(e) = eis.type_keys(&chunk.keys, delay_us) {
+            eprintln!("ei-type: typing failed: {}", e);
+            return 1;
+        }
+        input.done(chunk.keys);
+    }
+    if let Err(e) = eis.finish() {
+        eprintln!("ei-type: typing failed: {}", e);
+        return 1;
+    }
+
+    if args.verbose {
+        // input work done while EIS was still being set up; input that
+        // arrived later saved nothing
+        let ms = |t: Option<Instant>| t.map_or(0.0, |t| t.duration_since(launch).as_secs_f64() * 1e3);
+        let overlap = match input_ready {
+            Some(t) if t < ready => ms(input_ready),
+            _ => 0.0,
+        };
+        eprintln!(
+            "ei-type: startup: EIS ready {:.1}ms, input ready {:.1}ms, typing from {:.1}ms, \
+             {:.1}ms of input overlapped setup",
+            ms(Some(ready)),
+            ms(input_ready),
+            ms(typing),
+            overlap
+        );
+    }
+    0
+}
+
+#[cfg(feature = "zbus")]
 #[tokio::main(flavor = "current_thread")]
 async fn main() {
+    let launch = clock::now();
     let args = Args::parse();
-    let delay_us = args.delay_ms * 1000;
+    flight::setup(args.flight.as_deref());
+    if let Err(e) = usdt::register_probes() {
+        eprintln!("ei-type: USDT probes unavailable: {}", e);
+    }
+    ei_type::connect_start!(|| flight::now());
+    let input = start_input(&args);
+
+    if let Some(path) = eis_socket(&args) {
+        let stream = match connect_socket(&path) {
+            Ok(s) => s,
+            Err(e) => {
+                eprintln!("ei-type: cannot connect to EIS: {}", e);
+                exit(1);
+            }
+        };
+        let reconnect: eis::Reconnect = Box::new(move || connect_socket(&path));
+        let rc = tokio::task::spawn_blocking(move || run(args, launch, input, stream, reconnect))
+            .await
+            .unwrap_or(1);
+        exit(rc);
+    }
 
     // Get EIS socket from KWin via D-Bus
     // Keep the D-Bus connection alive — KWin invalidates EIS when D-Bus disconnects
-    let (stream, _dbus_conn) = match connect_kwin_eis(args.verbose).await {
+    let (stream, dbus_conn) = match connect_kwin_eis(args.verbose).await {
         Ok(s) => s,
         Err(e) => {
             eprintln!("ei-type: D-Bus connectToEIS failed: {}", e);
-            process::exit(1);
+            exit(1);
         }
     };
 
-    // Connect to EIS and negotiate keyboard device
-    let mut eis = match eis::EisConnection::connect(stream, "ei-type", args.verbose) {
-        Ok(c) => c,
+    // Typing runs off the runtime thread, so a reconnect can block on
+    // D-Bus while the runtime keeps serving it
+    let runtime = tokio::runtime::Handle::current();
+    let dbus = dbus_conn.clone();
+    let verbose = args.verbose;
+    let reconnect: eis::Reconnect = Box::new(move || runtime.block_on(request_eis_fd(&dbus, verbose)));
+    let rc = tokio::task::spawn_blocking(move || run(args, launch, input, stream, reconnect))
+        .await
+        .unwrap_or(1);
+    drop(dbus_conn);
+    exit(rc);
+}
+
+#[cfg(not(feature = "zbus"))]
+fn main() {
+    let launch = clock::now();
+    let args = Args::parse();
+    flight::setup(args.flight.as_deref());
+    if let Err(e) = usdt::register_probes() {
+        eprintln!("ei-type: USDT probes unavailable: {}", e);
+    }
+    ei_type::connect_start!(|| flight::now());
+    let input = start_input(&args);
+
+    if let Some(path) = eis_socket(&args) {
+        let stream = match connect_socket(&path) {
+            Ok(s) => s,
+            Err(e) => {
+                eprintln!("ei-type: cannot connect to EIS: {}", e);
+                exit(1);
+            }
+        };
+        let reconnect: eis::Reconnect = Box::new(move || connect_socket(&path));
+        exit(run(args, launch, input, stream, reconnect));
+    }
+
+    let mut bus = match dbus_mini::Bus::session() {
+        Ok(b) => b,
         Err(e) => {
-            eprintln!("ei-type: failed to get keyboard device: {}", e);
-            process::exit(1);
+            eprintln!("ei-type: failed to connect to session bus: {}", e);
+            exit(1);
         }
     };
-
-    // Key combo mode
-    if let Some(combo) = &args.key {
-        if let Err(e) = eis.send_key_combo(combo, delay_us) {
-            eprintln!("ei-type: key combo failed: {}", e);
-            process::exit(1);
+    let stream = match request_eis_fd(&mut bus, args.verbose) {
+        Ok(s) => s,
+        Err(e) => {
+            eprintln!("ei-type: D-Bus connectToEIS failed: {}", e);
+            exit(1);
         }
-        return;
-    }
+    };
+
+    // The closure owns the bus connection, keeping it alive as EIS requires
+    let verbose = args.verbose;
+    let reconnect: eis::Reconnect = Box::new(move || request_eis_fd(&mut bus, verbose));
+    exit(run(args, launch, input, stream, reconnect));
+}
 
-    // Read stdin and type each character
-    let mut input = String::new();
-    if let Err(e) = io::stdin().read_to_string(&mut input) {
-        eprintln!("ei-type: failed to read stdin: {}", e);
-        process::exit(1);
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    /// One piece from the reading end to the typing end and its buffer
+    /// back: the characters it carried
+    fn hand_over(reader: &mut Reader<Cursor<Vec<u8>>>, input: &Input) -> usize {
+        assert!(reader.step());
+        let chunk = input.chunks.try_recv().unwrap().unwrap();
+        let n = chunk.keys.len();
+        input.done(chunk.keys);
+        n
     }
 
-    if let Err(e) = eis.type_text(&input, delay_us) {
-        eprintln!("ei-type: typing failed: {}", e);
-        process::exit(1);
+    #[test]
+    fn stdin_handoff_does_not_allocate_once_warm() {
+        // reads end mid-character too: READ_SIZE is no multiple of a line
+        let line = "The quick brown fox, naïve café ✓ {}[]~\n";
+        let text = line.repeat(READ_SIZE * 200 / line.len());
+        let (mut reader, input) = Reader::new(Cursor::new(text.clone().into_bytes()));
+
+        let mut chars = 0;
+        for _ in 0..CHUNKS * 2 {
+            chars += hand_over(&mut reader, &input);
+        }
+        let (allocs, n) = alloc_count::count(|| (0..100).map(|_| hand_over(&mut reader, &input)).sum::<usize>());
+        assert_eq!(allocs, 0);
+
+        chars += n;
+        while reader.step() {
+            let chunk = input.chunks.try_recv().unwrap().unwrap();
+            chars += chunk.keys.len();
+            input.done(chunk.keys);
+        }
+        assert_eq!(chars, text.chars().count());
     }
 }
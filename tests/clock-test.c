@@ -0,0 +1,183 @@
+/*
+ * clock-test — exact timestamps from the engine on the virtual clock
+ *
+ * Types through a fake backend that stamps every key event with now_ns()
+ * and checks the times against what the delays add up to: the pacing of
+ * typed text, DELAY records (up to the longest one allowed) and the
+ * reconnect backoff schedule of backend-eis.c. The virtual clock moves
+ * only when something waits, so the times are exact and the run takes
+ * no time at all.
+ *
+ * Build and run: make check
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input-event-codes.h>
+
+#include "commands.h"
+#include "eitype-private.h"
+
+#define MS 1000000ull
+#define MAX_EVENTS 64
+
+/* libeitype.c picks backends by name; this test builds its own */
+struct backend *backend_eis_new(void) { return NULL; }
+struct backend *backend_uinput_new(void) { return NULL; }
+
+struct event {
+    uint64_t ns;
+    uint32_t code;
+    bool     press;
+};
+
+static struct {
+    struct backend base;
+    struct event events[MAX_EVENTS];
+    unsigned n;
+} fake;
+
+static void fake_key(struct backend *b, uint32_t code, bool press) {
+    (void)b;
+    if (fake.n < MAX_EVENTS) fake.events[fake.n++] = (struct event){ now_ns(), code, press };
+}
+
+static void fake_nop(struct backend *b) { (void)b; }
+
+static unsigned failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "clock-test:%d: ", __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+/* The events since the last call are exactly want[0..n), times relative
+ * to t0 */
+static void expect(const char *what, uint64_t t0, const struct event *want, unsigned n) {
+    CHECK(fake.n == n, "%s: %u key events, want %u", what, fake.n, n);
+    for (unsigned i = 0; i < n && i < fake.n; i++) {
+        const struct event *e = &fake.events[i];
+        CHECK(e->code == want[i].code && e->press == want[i].press && e->ns - t0 == want[i].ns,
+              "%s: event %u is key %u %s at +%lluns, want key %u %s at +%lluns", what, i,
+              e->code, e->press ? "down" : "up", (unsigned long long)(e->ns - t0),
+              want[i].code, want[i].press ? "down" : "up", (unsigned long long)want[i].ns);
+    }
+    fake.n = 0;
+}
+
+/* Each key down for one delay, then one delay before the next */
+static void test_pacing(struct eitype *t) {
+    uint64_t t0 = now_ns();
+    CHECK(eitype_type_utf8(t, "ab", 2) == 2, "pacing: \"ab\" not typed");
+    static const struct event want[] = {
+        {  0 * MS, KEY_A, true }, {  5 * MS, KEY_A, false },
+        { 10 * MS, KEY_B, true }, { 15 * MS, KEY_B, false },
+    };
+    expect("pacing", t0, want, 4);
+    CHECK(now_ns() - t0 == 20 * MS, "pacing: took %lluns, want 20ms",
+          (unsigned long long)(now_ns() - t0));
+}
+
+/* Runs records through a direct session; returns what it replied */
+static void run_records(struct eitype *t, const char *records, char *reply, size_t size) {
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("clock-test: pipe");
+        exit(1);
+    }
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, in[0], out[1], false)) {
+        fprintf(stderr, "clock-test: out of memory\n");
+        exit(1);
+    }
+    if (write(in[1], records, strlen(records)) != (ssize_t)strlen(records)) {
+        perror("clock-test: write");
+        exit(1);
+    }
+    close(in[1]);
+    while (!s.eof && cmd_session_read(&s)) {}
+    cmd_session_finish(&s);
+    close(in[0]);
+    close(out[1]);
+
+    ssize_t r = read(out[0], reply, size - 1);
+    reply[r > 0 ? r : 0] = '\0';
+    close(out[0]);
+}
+
+static void test_delay(struct eitype *t) {
+    char reply[256];
+    uint64_t t0 = now_ns();
+    run_records(t, "TEXT a\nDELAY 250\nTEXT b\n", reply, sizeof(reply));
+    static const struct event want[] = {
+        {   0 * MS, KEY_A, true }, {   5 * MS, KEY_A, false },
+        { 260 * MS, KEY_B, true }, { 265 * MS, KEY_B, false },
+    };
+    expect("DELAY", t0, want, 4);
+    CHECK(now_ns() - t0 == 270 * MS, "DELAY: took %lluns, want 270ms",
+          (unsigned long long)(now_ns() - t0));
+    CHECK(reply[0] == '\0', "DELAY: replied \"%s\"", reply);
+
+    /* the longest one is a day, to the ns; past that it is refused */
+    t0 = now_ns();
+    run_records(t, "DELAY 86400000\nDELAY 86400001\n", reply, sizeof(reply));
+    CHECK(now_ns() - t0 == 86400000 * MS, "DELAY: a day took %lluns",
+          (unsigned long long)(now_ns() - t0));
+    CHECK(strcmp(reply, "ERR 2 bad DELAY\n") == 0, "DELAY: replied \"%s\"", reply);
+}
+
+/* backend-eis.c: RECONNECT_MIN_MS 100, RECONNECT_MAX_MS 5000 and
+ * RECONNECT_TIMEOUT_MS 30000, each attempt failing at once */
+static void test_backoff(void) {
+    static const uint64_t want[] = {
+        0, 100, 300, 700, 1500, 3100, 6300, 11300, 16300, 21300, 26300,
+    };
+    struct backoff b;
+    backoff_start(&b, 100, 5000, 30000);
+    uint64_t t0 = b.start_ns;
+    unsigned n = 0;
+    do {
+        clock_sleep_until(b.next_ns);
+        CHECK(n < sizeof(want) / sizeof(want[0]) && now_ns() - t0 == want[n] * MS,
+              "backoff: attempt %u at +%lluns", n, (unsigned long long)(now_ns() - t0));
+        n++;
+    } while (backoff_failed(&b));
+    CHECK(n == sizeof(want) / sizeof(want[0]), "backoff: %u attempts, want %zu",
+          n, sizeof(want) / sizeof(want[0]));
+
+    /* without a timeout it keeps going, every RECONNECT_MAX_MS */
+    backoff_start(&b, 100, 5000, 0);
+    for (n = 0; n < 100; n++) {
+        clock_sleep_until(b.next_ns);
+        if (!backoff_failed(&b)) break;
+    }
+    CHECK(n == 100 && b.next_ns - now_ns() == 5000 * MS, "backoff: gave up without a timeout");
+}
+
+int main(void) {
+    clock_set_virtual(1000 * MS);
+
+    fake.base = (struct backend){
+        .name = "fake", .key = fake_key, .frame = fake_nop, .flush = fake_nop,
+        .destroy = fake_nop,
+    };
+    struct eitype *t = calloc(1, sizeof(*t));
+    if (!t) return 1;
+    t->b = &fake.base;
+    t->delay_us = DEFAULT_DELAY_US;
+
+    test_pacing(t);
+    test_delay(t);
+    test_backoff();
+    free(t);
+
+    printf("clock-test: %s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
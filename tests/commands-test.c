@@ -0,0 +1,421 @@
+/*
+ * commands-test — the daemon's record protocol against a fake backend
+ *
+ * Feeds records into a queued session (a socketpair, so TEXTFD can pass
+ * memfds), runs what it queues and checks what was typed and replied. A
+ * submission over a limit must be dropped whole: none of its keys typed,
+ * its fds closed and its SYNC answered with ERR. Without a delay the wait
+ * hook, where the daemon reads a CANCEL, must still be called, after a
+ * flush so the server is not left waiting for the whole text either, and
+ * a busy backend is waited for through it too. A KEY record holds every
+ * modifier of keys.def, none dropped. Shift follows Caps Lock and a
+ * latched Shift as the server reports them. Neither a line without its
+ * newline, a flood of submissions nor a producer that does not read its
+ * replies may hold memory without limit.
+ *
+ * Build and run: make check
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/input-event-codes.h>
+
+#include "commands.h"
+#include "eitype-private.h"
+
+/* libeitype.c picks backends by name; this test builds its own */
+struct backend *backend_eis_new(void) { return NULL; }
+struct backend *backend_uinput_new(void) { return NULL; }
+
+/* The keys pressed, as their codes, and the flushes */
+static struct {
+    struct backend base;
+    uint32_t pressed[256];
+    unsigned n;
+    unsigned flushes;
+    bool busy;
+} fake;
+
+static void fake_key(struct backend *b, uint32_t code, bool press) {
+    (void)b;
+    if (press && fake.n < 256) fake.pressed[fake.n++] = code;
+}
+
+static void fake_nop(struct backend *b) { (void)b; }
+
+static void fake_flush(struct backend *b) {
+    (void)b;
+    fake.flushes++;
+}
+
+static bool fake_busy(struct backend *b) {
+    (void)b;
+    return fake.busy;
+}
+
+static unsigned failures;
+
+#define CHECK(cond, ...) do { \
+    if (!(cond)) { \
+        failures++; \
+        fprintf(stderr, "commands-test:%d: ", __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+static int open_fds(void) {
+    int n = 0;
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return -1;
+    while (readdir(d)) n++;
+    closedir(d);
+    return n;
+}
+
+static bool send_line(int fd, const char *line, int pass_fd) {
+    struct iovec iov = { .iov_base = (void *)line, .iov_len = strlen(line) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (pass_fd >= 0) {
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &pass_fd, sizeof(int));
+    }
+    return sendmsg(fd, &msg, 0) == (ssize_t)iov.iov_len;
+}
+
+/* A sealed memfd holding text, as TEXTFD wants it */
+static int text_memfd(const char *text) {
+    int fd = memfd_create("commands-test", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0 || write(fd, text, strlen(text)) != (ssize_t)strlen(text) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        perror("commands-test: memfd");
+        exit(1);
+    }
+    return fd;
+}
+
+struct feed {
+    int fd;
+    enum { TOO_LARGE, TOO_MANY_FDS, LONG_LINE } kind;
+};
+
+/* The producer: a good submission, a bad one, a good one */
+static void *producer(void *data) {
+    struct feed *f = data;
+    send_line(f->fd, "TEXT a\nSYNC 1\n", -1);
+    if (f->kind == TOO_LARGE) {
+        static char line[65536];
+        memcpy(line, "TEXT ", 5);
+        memset(line + 5, 'x', sizeof(line) - 7);
+        line[sizeof(line) - 2] = '\n';
+        for (int i = 0; i < 80; i++) send_line(f->fd, line, -1);
+    } else if (f->kind == LONG_LINE) {
+        /* one 5 MB line, ended by the first record below */
+        static char chunk[65536];
+        memset(chunk, 'x', sizeof(chunk) - 1);
+        send_line(f->fd, "TEXT ", -1);
+        for (int i = 0; i < 80; i++) send_line(f->fd, chunk, -1);
+    } else {
+        for (int i = 0; i <= MAX_PASSED_FDS; i++) {
+            int mfd = text_memfd("x");
+            send_line(f->fd, "TEXTFD\n", mfd);
+            close(mfd);
+        }
+    }
+    send_line(f->fd, "TEXT x\nSYNC 2\nTEXT b\nSYNC 3\n", -1);
+    shutdown(f->fd, SHUT_WR);
+    return NULL;
+}
+
+static void test_dropped(struct eitype *t, int kind, const char *what, const char *want_err) {
+    int fds_before = open_fds(), sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("commands-test: socketpair");
+        exit(1);
+    }
+    struct feed f = { sv[1], kind };
+    pthread_t th;
+    pthread_create(&th, NULL, producer, &f);
+
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, sv[0], sv[0], true)) exit(1);
+    fake.n = 0;
+    size_t max_cap = 0;
+    while (!s.eof && cmd_session_read(&s)) {
+        while (cmd_session_pending(&s)) cmd_session_run_next(&s);
+        if (s.cap > max_cap) max_cap = s.cap;
+    }
+    pthread_join(th, NULL);
+    cmd_session_finish(&s);
+
+    CHECK(max_cap <= (8u << 20), "%s: input buffer grew to %zu bytes", what, max_cap);
+    CHECK(fake.n == 2 && fake.pressed[0] == KEY_A && fake.pressed[1] == KEY_B,
+          "%s: %u keys typed, want a and b only", what, fake.n);
+    char reply[256];
+    ssize_t r = read(sv[1], reply, sizeof(reply) - 1);
+    reply[r > 0 ? r : 0] = '\0';
+    char want[256];
+    snprintf(want, sizeof(want), "SYNC 1\n%sSYNC 3\n", want_err);
+    CHECK(strcmp(reply, want) == 0, "%s: replied \"%s\", want \"%s\"", what, reply, want);
+
+    close(sv[0]);
+    close(sv[1]);
+    CHECK(open_fds() == fds_before, "%s: %d fds left open", what, open_fds() - fds_before);
+}
+
+/* More submissions than a session queues at once: the rest stay in its
+ * buffer, unread, until there is room, and all of them still run */
+static void test_queue_bound(struct eitype *t) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("commands-test: socketpair");
+        exit(1);
+    }
+    enum { N = 3 * MAX_QUEUED };
+    for (int i = 0; i < N; i++) {
+        char rec[64];
+        snprintf(rec, sizeof(rec), "TEXT a\nSYNC %d\n", i);
+        send_line(sv[1], rec, -1);
+    }
+    shutdown(sv[1], SHUT_WR);
+
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, sv[0], sv[0], true)) exit(1);
+    fake.n = 0;
+    cmd_session_read(&s);
+    CHECK(cmd_session_queued(&s) == MAX_QUEUED && !cmd_session_wants_input(&s),
+          "queue bound: %zu submissions queued, want %d and no more reading",
+          cmd_session_queued(&s), MAX_QUEUED);
+    while (!cmd_session_done(&s)) {
+        if (cmd_session_pending(&s)) cmd_session_run_next(&s);
+        else if (!cmd_session_read(&s)) break;
+    }
+    cmd_session_finish(&s);
+    CHECK(fake.n == N, "queue bound: %u keys typed, want %d", fake.n, N);
+
+    char reply[4096];
+    ssize_t r = read(sv[1], reply, sizeof(reply) - 1);
+    reply[r > 0 ? r : 0] = '\0';
+    unsigned syncs = 0;
+    for (char *p = reply; (p = strstr(p, "SYNC ")); p++) syncs++;
+    CHECK(syncs == N, "queue bound: %u SYNC replies, want %d", syncs, N);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void *stats_flood(void *data) {
+    int fd = *(int *)data;
+    for (int i = 0; i < 20000; i++) {
+        if (!send_line(fd, "STATS\n", -1)) break;
+    }
+    send_line(fd, "SYNC done\n", -1);
+    shutdown(fd, SHUT_WR);
+    return NULL;
+}
+
+/* A producer that never reads its replies: the session must neither
+ * block on them nor hold them without limit, and gives up on it */
+static void test_slow_reader(struct eitype *t) {
+    int sv[2], sndbuf = 4096;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("commands-test: socketpair");
+        exit(1);
+    }
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    pthread_t th;
+    pthread_create(&th, NULL, stats_flood, &sv[1]);
+
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, sv[0], sv[0], true)) exit(1);
+    size_t max_out = 0;
+    while (!cmd_session_done(&s)) {
+        struct pollfd pfd = { .fd = sv[0], .events = POLLIN };
+        if (cmd_session_pending(&s)) cmd_session_run_next(&s);
+        else if (poll(&pfd, 1, 1000) != 1 || !cmd_session_read(&s)) break;
+        if (s.out_len > max_out) max_out = s.out_len;
+    }
+    CHECK(cmd_session_done(&s) && s.overflow, "slow reader: not given up on");
+    CHECK(max_out <= (128u << 10), "slow reader: %zu bytes of replies held", max_out);
+    cmd_session_finish(&s);
+    close(sv[0]);
+    pthread_join(th, NULL);
+    close(sv[1]);
+}
+
+/* The daemon's wait hook, as far as a CANCEL goes: cancels the first time
+ * it is called */
+static unsigned waits, waits_delayed, flushed_before_wait;
+
+static void cancel_wait(struct eitype *t, uint64_t delay_us, void *data) {
+    (void)data;
+    if (delay_us) waits_delayed++;
+    if (waits++ == 0) {
+        flushed_before_wait = fake.flushes;
+        eitype_cancel(t);
+    }
+}
+
+/* With -d 0 nothing paces the keys, yet a CANCEL must stop them */
+static void test_unpaced_cancel(struct eitype *t) {
+    static char text[4096];
+    memset(text, 'a', sizeof(text));
+    fake.n = 0;
+    fake.flushes = 0;
+    t->wait = cancel_wait;
+    int r = eitype_type_utf8(t, text, sizeof(text));
+    t->wait = NULL;
+
+    CHECK(r == -ECANCELED, "unpaced: typing returned %d, want -ECANCELED", r);
+    CHECK(waits == 1 && waits_delayed == 0, "unpaced: %u waits, %u with a delay, want 1 and 0",
+          waits, waits_delayed);
+    CHECK(flushed_before_wait == 1, "unpaced: %u flushes before the wait, want 1",
+          flushed_before_wait);
+    CHECK(fake.n == UNPACED_POLL / 2, "unpaced: %u keys typed before the cancel, want %d",
+          fake.n, UNPACED_POLL / 2);
+}
+
+/* A busy backend is waited for through the wait hook, where the daemon
+ * serves its clients: a stalled server must not keep a CANCEL out */
+static unsigned backend_waits;
+static bool cancel_in_wait;
+
+static void busy_wait(struct eitype *t, uint64_t delay_us, void *data) {
+    (void)data;
+    if (delay_us != WAIT_BACKEND) return;
+    backend_waits++;
+    if (cancel_in_wait) eitype_cancel(t);
+    else fake.busy = false;     /* the server answered */
+}
+
+static void test_busy_backend(struct eitype *t, bool cancel) {
+    const char *what = cancel ? "busy, cancelled" : "busy";
+    fake.n = 0;
+    fake.busy = true;
+    backend_waits = 0;
+    cancel_in_wait = cancel;
+    fake.base.busy = fake_busy;
+    t->wait = busy_wait;
+    int r = eitype_type_utf8(t, "ab", 2);
+    t->wait = NULL;
+    fake.base.busy = NULL;
+    fake.busy = false;
+
+    CHECK(backend_waits == 1, "%s: %u backend waits, want 1", what, backend_waits);
+    CHECK(cancel ? r == -ECANCELED : r == 2, "%s: typing returned %d", what, r);
+    CHECK(cancel || (fake.n == 2 && fake.pressed[0] == KEY_A && fake.pressed[1] == KEY_B),
+          "%s: %u keys typed, want a and b", what, fake.n);
+}
+
+/* Seven modifiers and a key that adds Shift: all eight held */
+static void test_all_mods(struct eitype *t) {
+    static const char records[] = "KEY ctrl+alt+super+rightctrl+altgr+rightmeta+rightshift+!\n";
+    static const uint32_t want[] = {
+        KEY_LEFTCTRL, KEY_LEFTALT, KEY_LEFTMETA, KEY_RIGHTCTRL, KEY_RIGHTALT,
+        KEY_RIGHTMETA, KEY_RIGHTSHIFT, KEY_LEFTSHIFT, KEY_1,
+    };
+    int in[2], out[2];
+    if (pipe(in) < 0 || pipe(out) < 0) {
+        perror("commands-test: pipe");
+        exit(1);
+    }
+    if (write(in[1], records, strlen(records)) != (ssize_t)strlen(records)) {
+        perror("commands-test: write");
+        exit(1);
+    }
+    close(in[1]);
+
+    struct cmd_session s;
+    if (!cmd_session_init(&s, t, in[0], out[1], false)) exit(1);
+    fake.n = 0;
+    while (!s.eof && cmd_session_read(&s)) {}
+    cmd_session_finish(&s);
+    close(in[0]);
+    close(out[1]);
+    char reply[256];
+    ssize_t r = read(out[0], reply, sizeof(reply) - 1);
+    reply[r > 0 ? r : 0] = '\0';
+    close(out[0]);
+
+    CHECK(reply[0] == '\0', "all mods: replied \"%s\"", reply);
+    CHECK(fake.n == sizeof(want) / sizeof(want[0]), "all mods: %u keys pressed, want %zu",
+          fake.n, sizeof(want) / sizeof(want[0]));
+    for (unsigned i = 0; i < fake.n && i < sizeof(want) / sizeof(want[0]); i++)
+        CHECK(fake.pressed[i] == want[i], "all mods: key %u is %u, want %u",
+              i, fake.pressed[i], want[i]);
+}
+
+/* Shift as planned from the server's modifiers: Caps Lock flips letters,
+ * a latched Shift is the Shift of the next key, or is used up by F24 when
+ * that key is unshifted */
+static void test_shift_plan(struct eitype *t, uint32_t locked, uint32_t latched,
+                            const char *text, const uint32_t *want, unsigned nwant) {
+    fake.base.mods_known = true;
+    fake.base.mods.locked = locked;
+    fake.base.mods.latched = latched;
+    fake.n = 0;
+    eitype_type_utf8(t, text, strlen(text));
+    fake.base.mods_known = false;
+    fake.base.mods.locked = fake.base.mods.latched = 0;
+
+    CHECK(fake.n == nwant, "shift plan \"%s\" (locked %#x, latched %#x): %u keys pressed, want %u",
+          text, locked, latched, fake.n, nwant);
+    for (unsigned i = 0; i < fake.n && i < nwant; i++)
+        CHECK(fake.pressed[i] == want[i], "shift plan \"%s\" (locked %#x, latched %#x): key %u is %u, want %u",
+              text, locked, latched, i, fake.pressed[i], want[i]);
+}
+
+#define SHIFT_PLAN(t, locked, latched, text, ...) do { \
+    static const uint32_t want_[] = { __VA_ARGS__ }; \
+    test_shift_plan(t, locked, latched, text, want_, sizeof(want_) / sizeof(want_[0])); \
+} while (0)
+
+int main(void) {
+    fake.base = (struct backend){
+        .name = "fake", .key = fake_key, .frame = fake_nop, .flush = fake_flush,
+        .destroy = fake_nop,
+    };
+    struct eitype *t = calloc(1, sizeof(*t));
+    if (!t) return 1;
+    t->b = &fake.base;
+    fake.base.user = t;       /* for the SYNC replies, as eitype_connect() sets it */
+
+    test_dropped(t, TOO_LARGE, "too large", "ERR 84 submission dropped: too large\n");
+    test_dropped(t, TOO_MANY_FDS, "too many fds", "ERR 21 submission dropped: too many fds\n");
+    test_dropped(t, LONG_LINE, "long line", "ERR 4 submission dropped: too large\n");
+    test_queue_bound(t);
+    test_slow_reader(t);
+    test_unpaced_cancel(t);
+    test_all_mods(t);
+    test_busy_backend(t, false);
+    test_busy_backend(t, true);
+
+    SHIFT_PLAN(t, XKB_MOD_LOCK, 0, "aB1!", KEY_LEFTSHIFT, KEY_A, KEY_B, KEY_1, KEY_LEFTSHIFT, KEY_1);
+    SHIFT_PLAN(t, 0, XKB_MOD_SHIFT, "ab", KEY_F24, KEY_A, KEY_B);
+    SHIFT_PLAN(t, 0, XKB_MOD_SHIFT, "Ab", KEY_A, KEY_B);
+    SHIFT_PLAN(t, XKB_MOD_LOCK, XKB_MOD_SHIFT, "aB", KEY_A, KEY_B);
+    SHIFT_PLAN(t, XKB_MOD_LOCK, XKB_MOD_SHIFT, "Ab", KEY_F24, KEY_A, KEY_LEFTSHIFT, KEY_B);
+    free(t);
+
+    printf("commands-test: %s\n", failures ? "FAIL" : "PASS");
+    return failures ? 1 : 0;
+}
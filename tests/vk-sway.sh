@@ -0,0 +1,87 @@
+#!/bin/sh
+# The vk backend end to end, without a GPU or a seat.
+#
+# Starts a headless sway whose only window is a foot terminal running
+# cat, types into it with --backend vk, ends cat's input with ctrl+d and
+# compares what cat received with what was sent. The default text is
+# long and typed with -d 0, so the requests outrun the compositor, and
+# has characters outside the US layout, so the keymap is re-uploaded
+# mid-text. Exits non-zero on a mismatch, or when ctrl+d does not end
+# cat (modifier state not reaching the client); make check-vk runs it.
+#
+# Usage: tests/vk-sway.sh [text]
+#   EI_TYPE=./ei-type tests/vk-sway.sh "naïve café ✓"
+
+set -eu
+
+EI_TYPE=${EI_TYPE:-./ei-type}
+if [ $# -gt 0 ]; then
+    TEXT=$1
+else
+    TEXT=$(head -c 4000 /dev/zero | tr '\0' 'x' | \
+           sed 's/x\{24\}/naïve café ✓ {~}, 9 Ωß /g' | fold -s -w 72)
+fi
+
+for cmd in sway foot; do
+    command -v "$cmd" >/dev/null || { echo "vk-sway: $cmd not found" >&2; exit 1; }
+done
+
+DIR=$(mktemp -d)
+SWAY=
+trap '[ -z "$SWAY" ] || kill "$SWAY" 2>/dev/null; rm -rf "$DIR"' EXIT
+chmod 700 "$DIR"
+
+# A runtime dir of our own, so the display and the files below are ours
+export XDG_RUNTIME_DIR="$DIR"
+unset WAYLAND_DISPLAY DISPLAY SWAYSOCK
+
+cat >"$DIR/config" <<EOF
+exec foot -e sh -c 'stty -echo; touch "$DIR/ready"; cat >"$DIR/got"; touch "$DIR/done"'
+EOF
+
+WLR_BACKENDS=headless WLR_RENDERER=pixman WLR_LIBINPUT_NO_DEVICES=1 \
+    sway -c "$DIR/config" >"$DIR/sway.log" 2>&1 &
+SWAY=$!
+
+# wait_for SECONDS WHAT COMMAND... — until COMMAND succeeds, or fail
+wait_for() {
+    n=$(($1 * 10))
+    what=$2
+    shift 2
+    until "$@"; do
+        n=$((n - 1))
+        if [ "$n" -le 0 ]; then
+            echo "vk-sway: $what" >&2
+            cat "$DIR/sway.log" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+# got_all — cat has written as many bytes as were sent
+got_all() {
+    [ -e "$DIR/got" ] && [ "$(wc -c <"$DIR/got")" -ge "$(wc -c <"$DIR/sent")" ]
+}
+
+wait_for 10 "foot did not start" test -e "$DIR/ready"
+# cat runs once the window is mapped; give sway a moment to focus it
+sleep 0.5
+WAYLAND_DISPLAY=$(cd "$DIR" && ls wayland-* | grep -v '\.lock$' | head -n 1)
+export WAYLAND_DISPLAY
+
+printf '%s\n' "$TEXT" >"$DIR/sent"
+"$EI_TYPE" --backend vk -d 0 <"$DIR/sent"
+wait_for 30 "text did not arrive in full" got_all
+
+# Only a real Ctrl+D ends cat: a plain d would be read as text
+"$EI_TYPE" --backend vk --key ctrl+d
+wait_for 5 "ctrl+d did not end cat; modifier keys are not getting through" \
+    test -e "$DIR/done"
+
+if ! cmp -s "$DIR/sent" "$DIR/got"; then
+    echo "vk-sway: received text differs from sent text" >&2
+    diff "$DIR/sent" "$DIR/got" >&2 || true
+    exit 1
+fi
+echo "vk-sway: $(wc -c <"$DIR/sent") bytes received as sent"
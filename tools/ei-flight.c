@@ -0,0 +1,140 @@
+/*
+ * ei-flight — print an ei-type flight recorder dump as a timeline
+ *
+ * ei-type (C or Rust) dumps its ring of recent injection events on
+ * SIGUSR2, on failure and, with --flight=PATH, at exit; see flight.h for
+ * the format. Times are relative to the first event, with the gap to
+ * the previous one alongside, so stalls and replays stand out.
+ *
+ * Build: make tools/ei-flight
+ * Usage: ei-flight DUMP
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "flight.h"
+#include "keymap.h"
+
+static const char *const names[] = {
+    [FL_KEY]        = "key",
+    [FL_FRAME]      = "frame",
+    [FL_FLUSH]      = "flush",
+    [FL_SYNC]       = "sync",
+    [FL_SYNC_DONE]  = "sync-done",
+    [FL_CANCEL]     = "cancel",
+    [FL_PING]       = "ping",
+    [FL_PONG]       = "pong",
+    [FL_PAUSE]      = "pause",
+    [FL_RESUME]     = "resume",
+    [FL_REPLAY]     = "replay",
+    [FL_DISCONNECT] = "disconnect",
+    [FL_RECONNECT]  = "reconnect",
+    [FL_MODS]       = "modifiers",
+    [FL_ERROR]      = "error",
+};
+
+static const char *key_name(uint32_t code) {
+    for (size_t i = 0; i < KEYTAB_NNAMES; i++)
+        if (keytab_names[i].code == code) return keytab_names[i].name;
+    return "?";
+}
+
+static void details(const struct flight_entry *e, char *out, size_t size) {
+    unsigned long long b = (unsigned long long)e->b;
+    switch (e->event) {
+    case FL_KEY:
+        snprintf(out, size, "%-4u %-10s %s", e->a, key_name(e->a), e->b ? "down" : "up");
+        break;
+    case FL_FLUSH:
+        if (e->b) snprintf(out, size, "first key waited %.1fus", (double)e->b / 1e3);
+        break;
+    case FL_SYNC:
+    case FL_SYNC_DONE:
+        snprintf(out, size, "cookie %llu", b);
+        break;
+    case FL_PING:
+        snprintf(out, size, "acks up to %llu, %u in flight", b, e->a);
+        break;
+    case FL_PONG:
+        snprintf(out, size, "up to %llu%s", b, e->a ? ", stale: replayed instead" : "");
+        break;
+    case FL_PAUSE:
+        snprintf(out, size, "%llu events unacknowledged", b);
+        break;
+    case FL_RESUME:
+        snprintf(out, size, "sequence %u", e->a);
+        break;
+    case FL_REPLAY:
+        snprintf(out, size, "%llu events sent again", b);
+        break;
+    case FL_RECONNECT:
+        snprintf(out, size, "%s", e->a ? "ok" : "failed");
+        break;
+    case FL_MODS:
+        snprintf(out, size, "depressed=%#x latched=%#x locked=%#x group=%llu",
+                 e->a & 0xff, (e->a >> 8) & 0xff, (e->a >> 16) & 0xff, b);
+        break;
+    case FL_ERROR:
+        snprintf(out, size, "%s", e->a ? strerror((int)e->a) : "failed");
+        break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s DUMP\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        fprintf(stderr, "ei-flight: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    struct flight_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, FLIGHT_MAGIC, 8) != 0) {
+        fprintf(stderr, "ei-flight: %s is not a flight recorder dump\n", argv[1]);
+        return 1;
+    }
+    if (hdr.version != FLIGHT_VERSION || hdr.entry_size != sizeof(struct flight_entry)) {
+        fprintf(stderr, "ei-flight: unsupported dump version %u (entry size %u)\n",
+                hdr.version, hdr.entry_size);
+        return 1;
+    }
+
+    struct flight_entry e, first = {0}, prev = {0};
+    uint64_t n = 0;
+    while (n < hdr.entries && fread(&e, sizeof(e), 1, f) == 1) {
+        if (n == 0) {
+            /* wall clock time of the first event, from the dump's pair */
+            time_t secs = (time_t)((hdr.real_ns - (hdr.mono_ns - e.ns)) / 1000000000ull);
+            char when[64];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+            printf("# %llu events from %s, %llu older ones overwritten\n",
+                   (unsigned long long)hdr.entries, when, (unsigned long long)hdr.lost);
+            printf("#      time ms     delta ms  event\n");
+            first = prev = e;
+        }
+        char info[128] = "";
+        details(&e, info, sizeof(info));
+        const char *name = e.event < sizeof(names) / sizeof(names[0]) && names[e.event]
+                         ? names[e.event] : "unknown";
+        printf("%14.3f %+12.3f  %s",
+               (double)(int64_t)(e.ns - first.ns) / 1e6,
+               (double)(int64_t)(e.ns - prev.ns) / 1e6, name);
+        if (info[0]) printf("%*s%s", 11 - (int)strlen(name), "", info);
+        printf("\n");
+        prev = e;
+        n++;
+    }
+    if (n < hdr.entries)
+        fprintf(stderr, "ei-flight: dump truncated after %llu of %llu events\n",
+                (unsigned long long)n, (unsigned long long)hdr.entries);
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,656 @@
+/*
+ * ei-soak — soak test: millions of keys through ei-type into a local EIS server
+ *
+ * Runs a libeis server on a private socket and ei-type (C or Rust)
+ * against it through LIBEI_SOCKET, feeds it random text (words, shifted
+ * runs, digits, symbols and, with --combos, key combos in between) and
+ * checks every key event that arrives against what was sent:
+ *
+ *   - the text rebuilt from the events (US layout, Shift tracked) is the
+ *     text sent, and each combo arrives as that combo
+ *   - no key is pressed while down or released while up, and none is
+ *     still down when ei-type disconnects
+ *   - ei-type's resident memory stays within --max-growth of what it was
+ *     at the first report
+ *
+ * Keys received per second and ei-type's RSS are printed every interval,
+ * so leaks and slow-downs show as trends over a long run. At most
+ * --window keys are in flight, so input buffered inside ei-type does not
+ * read as growth. --cpu and --mem run busy and memory-touching threads
+ * alongside for pressure.
+ *
+ * --keys N is the short, bounded form for `make check`: N keys, no
+ * reports, and it stops at the first mismatch, exiting non-zero.
+ *
+ * --pause N pauses the keyboard after every N key presses and resumes it
+ * PAUSE_NS later. The server drops what comes while paused and ei-type
+ * replays it, so the checks above then also say nothing was lost and
+ * nothing typed twice on the way.
+ *
+ * --idle S then checks that an idle ei-type sleeps: once every key has
+ * arrived its stdin stays open and empty, and after a settling second
+ * its threads must not be woken once (context switches, all threads) in
+ * S seconds. This server never pings, so nothing should wake it.
+ *
+ * Build: make tools/ei-soak (needs libeis-1.0); make soak runs it
+ * Usage: ei-soak [-n KEYS | --keys N] [--combos] [--window N] [--cpu N]
+ *                [--mem MB] [--interval S] [--stall S] [--max-growth KB]
+ *                [--pause N] [--idle S] [--seed N] [-- EI-TYPE [ARGS...]]
+ *   The command defaults to ./ei-type -d 0, plus --commands with --combos
+ *   (combos go in as KEY records, so they need the C binary).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <linux/input-event-codes.h>
+
+#include <libeis.h>
+
+#include "keymap.h"
+
+#define MAX_CODE  256
+#define GEN_MAX   16
+#define MAX_ERRORS 10
+#define IDLE_SETTLE_NS 1000000000ull
+#define PAUSE_NS       10000000ull
+
+/* Modifiers of a token, and of the keys held down at the receiver */
+#define MOD_SHIFT (1u << 0)
+#define MOD_CTRL  (1u << 1)
+#define MOD_ALT   (1u << 2)
+#define MOD_META  (1u << 3)
+
+/* One unit of input: a character, or with a modifier other than Shift,
+ * the combo of mods and c */
+struct token {
+    char    c;
+    uint8_t mods;
+};
+
+/* The input, from a seed: the writer and the checker each run one */
+struct gen {
+    uint64_t rng;
+    bool combos;
+    struct token buf[GEN_MAX];
+    unsigned n, pos;
+};
+
+static const char lower[]   = "abcdefghijklmnopqrstuvwxyz";
+static const char upper[]   = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+static const char digits[]  = "0123456789";
+static const char symbols[] = "-=[];',./\\`";
+static const char shifted[] = "!@#$%^&*()_+{}:\"<>?|~";
+
+static uint64_t rnd(struct gen *g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545f4914f6cdd1dull;
+}
+
+static char pick(struct gen *g, const char *set, size_t n) {
+    return set[rnd(g) % (n - 1)];
+}
+#define PICK(g, set) pick(g, set, sizeof(set))
+
+static void put(struct gen *g, char c, uint8_t mods) {
+    g->buf[g->n++] = (struct token){ c, mods };
+}
+
+/* Next run: a word, a shifted run, digits, symbols or a combo */
+static void fill(struct gen *g) {
+    static const uint8_t combo_mods[] = { MOD_CTRL, MOD_ALT, MOD_CTRL | MOD_SHIFT, MOD_META };
+    unsigned kind = (unsigned)(rnd(g) % 100), len = 1 + (unsigned)(rnd(g) % 10);
+    g->n = g->pos = 0;
+
+    if (g->combos && kind < 4) {
+        put(g, PICK(g, lower), combo_mods[rnd(g) % sizeof(combo_mods)]);
+        return;
+    }
+    if (kind >= 97) {
+        put(g, kind == 99 ? '\t' : '\n', 0);
+        return;
+    }
+    for (unsigned i = 0; i < len; i++) {
+        if (kind < 50)      put(g, PICK(g, lower), 0);
+        else if (kind < 60) put(g, i ? PICK(g, lower) : PICK(g, upper), 0);
+        else if (kind < 72) put(g, PICK(g, upper), 0);
+        else if (kind < 80) put(g, PICK(g, digits), 0);
+        else if (kind < 88) put(g, PICK(g, symbols), 0);
+        else                put(g, PICK(g, shifted), 0);
+    }
+    put(g, ' ', 0);
+}
+
+static struct token gen_next(struct gen *g) {
+    if (g->pos == g->n) fill(g);
+    return g->buf[g->pos++];
+}
+
+static void gen_init(struct gen *g, uint64_t seed, bool combos) {
+    memset(g, 0, sizeof(*g));
+    g->rng = seed ? seed : 1;
+    g->combos = combos;
+}
+
+/* "ctrl+shift+a", the --key spelling of a combo token */
+static int combo_name(struct token t, char *out, size_t size) {
+    return snprintf(out, size, "%s%s%s%s%c",
+                    t.mods & MOD_CTRL ? "ctrl+" : "",
+                    t.mods & MOD_ALT ? "alt+" : "",
+                    t.mods & MOD_META ? "super+" : "",
+                    t.mods & MOD_SHIFT ? "shift+" : "", t.c);
+}
+
+static void describe(struct token t, char *out, size_t size) {
+    if (t.mods & ~MOD_SHIFT) combo_name(t, out, size);
+    else if (t.c == '\n') snprintf(out, size, "\\n");
+    else if (t.c == '\t') snprintf(out, size, "\\t");
+    else if (t.c) snprintf(out, size, "'%c'", t.c);
+    else snprintf(out, size, "(unknown key)");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+struct soak {
+    /* options */
+    uint64_t total, window, seed;
+    bool combos;
+    bool check;                     /* --keys: quiet, stop at the first error */
+    unsigned cpu, mem_mb;
+    double interval, stall, idle;
+    long max_growth_kb;
+    uint64_t pause_every;           /* --pause: key presses between pauses */
+
+    pid_t child;
+    int   in_fd;                    /* ei-type's stdin */
+    atomic_uint_fast64_t checked;   /* tokens received and compared */
+    atomic_bool stop;
+
+    /* receiver */
+    struct eis_client *client;
+    struct eis_seat   *seat;
+    struct eis_device *kbd;
+    bool connected, disconnected;
+    bool pause_due, paused;
+    uint64_t resume_at;
+
+    /* checker */
+    struct gen expect;
+    bool     down[MAX_CODE];
+    char     rev[2][MAX_CODE];      /* code, Shift → character */
+    uint64_t presses;
+    unsigned errors;
+    bool     desync;                /* stopped comparing after a mismatch */
+};
+
+static void fail(struct soak *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void fail(struct soak *s, const char *fmt, ...) {
+    if (s->errors++ >= MAX_ERRORS) return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "ei-soak: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void build_rev(struct soak *s) {
+    static const char *const sets[] = { lower, upper, digits, symbols, shifted, " \n\t" };
+    for (size_t i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        for (const char *p = sets[i]; *p; p++) {
+            struct keyinfo k = char_to_key((unsigned char)*p);
+            if (k.code && k.code < MAX_CODE) s->rev[k.shift][k.code] = *p;
+        }
+    }
+}
+
+static unsigned mods_down(const struct soak *s) {
+    unsigned m = 0;
+    if (s->down[KEY_LEFTSHIFT] || s->down[KEY_RIGHTSHIFT]) m |= MOD_SHIFT;
+    if (s->down[KEY_LEFTCTRL] || s->down[KEY_RIGHTCTRL])   m |= MOD_CTRL;
+    if (s->down[KEY_LEFTALT] || s->down[KEY_RIGHTALT])     m |= MOD_ALT;
+    if (s->down[KEY_LEFTMETA] || s->down[KEY_RIGHTMETA])   m |= MOD_META;
+    return m;
+}
+
+static void on_key(struct soak *s, uint32_t code, bool press) {
+    if (code >= MAX_CODE) {
+        fail(s, "key %u out of range", code);
+        return;
+    }
+    if (!press) {
+        if (!s->down[code]) fail(s, "key %u released while up", code);
+        s->down[code] = false;
+        return;
+    }
+    if (s->down[code]) fail(s, "key %u pressed while down", code);
+    s->down[code] = true;
+    s->presses++;
+    if (s->pause_every && s->presses % s->pause_every == 0) s->pause_due = true;
+    if (is_modifier_key(code)) return;
+
+    unsigned mods = mods_down(s);
+    struct token got = { s->rev[!!(mods & MOD_SHIFT)][code], 0 };
+    if (mods & ~MOD_SHIFT) got = (struct token){ s->rev[0][code], (uint8_t)mods };
+
+    uint64_t n = atomic_load(&s->checked);
+    if (n >= s->total) {
+        fail(s, "key %u after all %llu tokens arrived", code, (unsigned long long)s->total);
+        return;
+    }
+    struct token want = gen_next(&s->expect);
+    atomic_store(&s->checked, n + 1);
+    if (s->desync || (got.c == want.c && got.mods == want.mods)) return;
+
+    char g[32], w[32];
+    describe(got, g, sizeof(g));
+    describe(want, w, sizeof(w));
+    fail(s, "token %llu: got %s, sent %s", (unsigned long long)n, g, w);
+    s->desync = true;
+}
+
+static void handle(struct soak *s, struct eis_event *e) {
+    switch (eis_event_get_type(e)) {
+    case EIS_EVENT_CLIENT_CONNECT: {
+        struct eis_client *client = eis_event_get_client(e);
+        if (s->client || !eis_client_is_sender(client)) {
+            eis_client_disconnect(client);
+            break;
+        }
+        eis_client_connect(client);
+        s->client = eis_client_ref(client);
+        s->seat = eis_client_new_seat(client, "soak");
+        eis_seat_configure_capability(s->seat, EIS_DEVICE_CAP_KEYBOARD);
+        eis_seat_add(s->seat);
+        s->connected = true;
+        break;
+    }
+    case EIS_EVENT_CLIENT_DISCONNECT:
+        if (eis_event_get_client(e) == s->client) s->disconnected = true;
+        eis_client_disconnect(eis_event_get_client(e));
+        break;
+    case EIS_EVENT_SEAT_BIND:
+        if (s->kbd || !eis_event_seat_has_capability(e, EIS_DEVICE_CAP_KEYBOARD)) break;
+        s->kbd = eis_seat_new_device(s->seat);
+        eis_device_configure_name(s->kbd, "soak keyboard");
+        eis_device_configure_capability(s->kbd, EIS_DEVICE_CAP_KEYBOARD);
+        eis_device_add(s->kbd);
+        eis_device_resume(s->kbd);
+        break;
+    case EIS_EVENT_KEYBOARD_KEY:
+        on_key(s, eis_event_keyboard_get_key(e), eis_event_keyboard_get_key_is_press(e));
+        break;
+    default:
+        break;
+    }
+}
+
+static bool write_all(int fd, const char *p, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= (size_t)w;
+    }
+    return true;
+}
+
+/* Generate the input into ei-type's stdin, keeping at most window keys
+ * ahead of what arrived. With --combos it goes as TEXT and KEY records,
+ * each line complete before waiting. */
+static void *writer_main(void *data) {
+    struct soak *s = data;
+    struct gen g;
+    gen_init(&g, s->seed, s->combos);
+    char buf[65536];
+    size_t len = 0;
+    bool in_text = false;
+
+    for (uint64_t i = 0; i < s->total && !atomic_load(&s->stop); i++) {
+        if (s->window && i - atomic_load(&s->checked) >= s->window) {
+            if (in_text) buf[len++] = '\n';
+            in_text = false;
+            if (!write_all(s->in_fd, buf, len)) break;
+            len = 0;
+            while (i - atomic_load(&s->checked) >= s->window && !atomic_load(&s->stop))
+                nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+        }
+
+        struct token t = gen_next(&g);
+        if (!s->combos) {
+            buf[len++] = t.c;
+        } else if (t.mods & ~MOD_SHIFT) {
+            if (in_text) buf[len++] = '\n';
+            in_text = false;
+            len += (size_t)snprintf(buf + len, 64, "KEY ");
+            len += (size_t)combo_name(t, buf + len, 32);
+            buf[len++] = '\n';
+        } else {
+            if (!in_text) len += (size_t)snprintf(buf + len, 8, "TEXT ");
+            in_text = true;
+            if (t.c == '\n')      len += (size_t)snprintf(buf + len, 4, "\\n");
+            else if (t.c == '\t') len += (size_t)snprintf(buf + len, 4, "\\t");
+            else if (t.c == '\\') len += (size_t)snprintf(buf + len, 4, "\\\\");
+            else buf[len++] = t.c;
+            if (t.c == '\n') {
+                buf[len++] = '\n';
+                in_text = false;
+            }
+        }
+        if (len > sizeof(buf) - 128) {
+            if (!write_all(s->in_fd, buf, len)) break;
+            len = 0;
+        }
+    }
+    if (in_text) buf[len++] = '\n';
+    write_all(s->in_fd, buf, len);
+    if (s->idle <= 0) close(s->in_fd);  /* --idle: main closes it after */
+    return NULL;
+}
+
+/* Pressure: spin, or keep touching every page of a large mapping */
+static void *cpu_hog(void *data) {
+    struct soak *s = data;
+    volatile uint64_t spin = 0;
+    while (!atomic_load(&s->stop)) spin++;
+    return NULL;
+}
+
+static void *mem_hog(void *data) {
+    struct soak *s = data;
+    size_t size = (size_t)s->mem_mb << 20;
+    unsigned char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "ei-soak: --mem: %s\n", strerror(errno));
+        return NULL;
+    }
+    for (unsigned char v = 1; !atomic_load(&s->stop); v++)
+        for (size_t i = 0; i < size && !atomic_load(&s->stop); i += 4096) p[i] = v;
+    munmap(p, size);
+    return NULL;
+}
+
+static long rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    fclose(f);
+    return kb;
+}
+
+/* Context switches of all of pid's threads: each is a wakeup */
+static long wakeups(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    long total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/status", (int)pid, de->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        long n;
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1 ||
+                sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1) total += n;
+        fclose(f);
+    }
+    closedir(d);
+    return total;
+}
+
+static pid_t spawn(char **argv, const char *socket, int *in_fd) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(p[0], STDIN_FILENO);
+        setenv("LIBEI_SOCKET", socket, 1);
+        execvp(argv[0], argv);
+        fprintf(stderr, "ei-soak: cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(p[0]);
+    if (pid < 0) close(p[1]);
+    *in_fd = p[1];
+    return pid;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] [-- EI-TYPE [ARGS...]]\n", prog);
+    fprintf(stderr, "  -n KEYS          characters and combos to send (default 1000000)\n");
+    fprintf(stderr, "  --keys N         check: send N, no reports, stop at the first error\n");
+    fprintf(stderr, "  --combos         mix in key combos as KEY records (C binary, --commands)\n");
+    fprintf(stderr, "  --window N       keys in flight at most, 0 for no limit (default 65536)\n");
+    fprintf(stderr, "  --cpu N          busy threads alongside (default 0)\n");
+    fprintf(stderr, "  --mem MB         a thread that keeps touching MB of memory (default 0)\n");
+    fprintf(stderr, "  --interval S     seconds between reports (default 5)\n");
+    fprintf(stderr, "  --stall S        fail after S seconds without a key (default 30)\n");
+    fprintf(stderr, "  --max-growth KB  RSS growth allowed after the first report (default 1024)\n");
+    fprintf(stderr, "  --pause N        pause the keyboard for a moment every N key presses\n");
+    fprintf(stderr, "  --idle S         then idle S seconds with stdin open, no wakeups allowed\n");
+    fprintf(stderr, "  --seed N         input seed (default 1)\n");
+    fprintf(stderr, "The command defaults to ./ei-type -d 0 [--commands].\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct soak s = {
+        .total = 1000000, .window = 65536, .seed = 1,
+        .interval = 5, .stall = 30, .max_growth_kb = 1024,
+    };
+    static struct option longopts[] = {
+        {"keys",       required_argument, NULL, 'k'},
+        {"combos",     no_argument,       NULL, 'c'},
+        {"window",     required_argument, NULL, 'w'},
+        {"cpu",        required_argument, NULL, 'C'},
+        {"mem",        required_argument, NULL, 'M'},
+        {"interval",   required_argument, NULL, 'i'},
+        {"stall",      required_argument, NULL, 's'},
+        {"max-growth", required_argument, NULL, 'g'},
+        {"pause",      required_argument, NULL, 'p'},
+        {"idle",       required_argument, NULL, 'I'},
+        {"seed",       required_argument, NULL, 'S'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:h", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'n': s.total = strtoull(optarg, NULL, 10); break;
+            case 'k': s.total = strtoull(optarg, NULL, 10); s.check = true; break;
+            case 'c': s.combos = true; break;
+            case 'w': s.window = strtoull(optarg, NULL, 10); break;
+            case 'C': s.cpu = (unsigned)atoi(optarg); break;
+            case 'M': s.mem_mb = (unsigned)atoi(optarg); break;
+            case 'i': s.interval = atof(optarg); break;
+            case 's': s.stall = atof(optarg); break;
+            case 'g': s.max_growth_kb = atol(optarg); break;
+            case 'p': s.pause_every = strtoull(optarg, NULL, 10); break;
+            case 'I': s.idle = atof(optarg); break;
+            case 'S': s.seed = strtoull(optarg, NULL, 10); break;
+            case 'h': usage(argv[0]); return 0;
+            default:  usage(argv[0]); return 1;
+        }
+    }
+    if (s.interval <= 0) s.interval = 5;
+
+    char *def[] = { "./ei-type", "-d", "0", s.combos ? "--commands" : NULL, NULL };
+    char **cmd = optind < argc ? argv + optind : def;
+
+    char dir[] = "/tmp/ei-soak.XXXXXX", sock[64];
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "ei-soak: mkdtemp: %s\n", strerror(errno));
+        return 1;
+    }
+    snprintf(sock, sizeof(sock), "%s/eis-0", dir);
+
+    struct eis *eis = eis_new(NULL);
+    int r = eis ? eis_setup_backend_socket(eis, sock) : -ENOMEM;
+    if (r < 0) {
+        fprintf(stderr, "ei-soak: cannot listen on %s: %s\n", sock, strerror(-r));
+        rmdir(dir);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    gen_init(&s.expect, s.seed, s.combos);
+    build_rev(&s);
+
+    unsigned nthreads = s.cpu + (s.mem_mb ? 1 : 0);
+    pthread_t *hogs = calloc(nthreads + 1, sizeof(*hogs)), writer;
+    for (unsigned i = 0; i < s.cpu; i++) pthread_create(&hogs[i], NULL, cpu_hog, &s);
+    if (s.mem_mb) pthread_create(&hogs[s.cpu], NULL, mem_hog, &s);
+
+    s.child = spawn(cmd, sock, &s.in_fd);
+    if (s.child < 0) {
+        fprintf(stderr, "ei-soak: cannot start %s: %s\n", cmd[0], strerror(errno));
+        return 1;
+    }
+    pthread_create(&writer, NULL, writer_main, &s);
+
+    printf("ei-soak: %llu keys%s through %s, seed %llu\n", (unsigned long long)s.total,
+           s.combos ? " and combos" : "", cmd[0], (unsigned long long)s.seed);
+    if (!s.check)
+        printf("%8s %12s %10s %10s %10s\n", "time", "keys", "keys/s", "rss KB", "growth KB");
+
+    uint64_t start = now_ns(), interval = (uint64_t)(s.interval * 1e9);
+    uint64_t next = start + interval, last_t = start, last_key = start;
+    uint64_t last_n = 0;
+    long base_rss = -1, rss = -1, max_growth = 0;
+    int status = 0;
+    bool exited = false, stalled = false;
+    /* --idle: settle until idle_at, then count wakeups until it again */
+    uint64_t idle_at = 0;
+    long idle_base = -1;
+    bool idle_counting = false, idle_done = s.idle <= 0;
+
+    while (!s.disconnected && !exited && !stalled && !(s.check && s.errors)) {
+        uint64_t now = now_ns(), wake = next;
+        if (idle_at && !idle_done && idle_at < wake) wake = idle_at;
+        if (s.paused && s.resume_at < wake) wake = s.resume_at;
+        struct pollfd pfd = { .fd = eis_get_fd(eis), .events = POLLIN };
+        int ms = wake > now ? (int)((wake - now) / 1000000) + 1 : 0;
+        if (poll(&pfd, 1, ms) > 0) {
+            eis_dispatch(eis);
+            struct eis_event *e;
+            while ((e = eis_get_event(eis)) != NULL) {
+                handle(&s, e);
+                eis_event_unref(e);
+            }
+        }
+
+        /* --pause: between dispatches, as a compositor would */
+        now = now_ns();
+        if (s.pause_due && !s.paused && s.kbd) {
+            eis_device_pause(s.kbd);
+            s.paused = true;
+            s.resume_at = now + PAUSE_NS;
+        } else if (s.paused && now >= s.resume_at) {
+            eis_device_resume(s.kbd);
+            s.paused = s.pause_due = false;
+        }
+
+        uint64_t n = atomic_load(&s.checked);
+        if (n != last_n || !s.connected || (n == s.total && !idle_done)) last_key = now;
+        if (!idle_done && n == s.total) {
+            if (!idle_at) {
+                idle_at = now + IDLE_SETTLE_NS;
+            } else if (now >= idle_at && !idle_counting) {
+                idle_base = wakeups(s.child);
+                idle_at = now + (uint64_t)(s.idle * 1e9);
+                idle_counting = true;
+            } else if (now >= idle_at) {
+                long w = wakeups(s.child);
+                if (idle_base < 0 || w < 0) fail(&s, "cannot read the wakeups of %s", cmd[0]);
+                else if (w != idle_base) fail(&s, "%ld wakeups idle for %.0fs, want 0", w - idle_base, s.idle);
+                else printf("ei-soak: idle %.0fs: 0 wakeups\n", s.idle);
+                close(s.in_fd);
+                idle_done = true;
+            }
+        }
+        if (now < next) continue;
+
+        /* report */
+        long kb = rss_kb(s.child);
+        if (kb >= 0) rss = kb;
+        if (base_rss < 0 && rss >= 0 && n) base_rss = rss;
+        long growth = base_rss >= 0 ? rss - base_rss : 0;
+        if (growth > max_growth) max_growth = growth;
+        if (!s.check) {
+            printf("%7.1fs %12llu %10.0f %10ld %+10ld\n", (double)(now - start) / 1e9,
+                   (unsigned long long)n, (double)(n - last_n) / ((double)(now - last_t) / 1e9),
+                   rss, growth);
+            fflush(stdout);
+        }
+        last_n = n;
+        last_t = now;
+        next = now + interval;
+
+        if (waitpid(s.child, &status, WNOHANG) == s.child) exited = true;
+        if (s.stall > 0 && (double)(now - last_key) / 1e9 > s.stall) stalled = true;
+    }
+
+    double secs = (double)(now_ns() - start) / 1e9;
+    uint64_t n = atomic_load(&s.checked);
+    if (stalled) fail(&s, "no key for %.0fs, stopping", s.stall);
+    if (((stalled || s.errors) && !s.disconnected) || !idle_done)
+        if (!exited) kill(s.child, SIGTERM);
+    atomic_store(&s.stop, true);
+    if (!exited) waitpid(s.child, &status, 0);
+    pthread_join(writer, NULL);
+    if (!idle_done) close(s.in_fd);
+    for (unsigned i = 0; i < nthreads; i++) pthread_join(hogs[i], NULL);
+    free(hogs);
+
+    if (!s.connected) fail(&s, "%s never connected", cmd[0]);
+    if (n < s.total) fail(&s, "received %llu of %llu tokens", (unsigned long long)n, (unsigned long long)s.total);
+    for (unsigned code = 0; code < MAX_CODE; code++)
+        if (s.down[code]) fail(&s, "key %u still down at the end", code);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fail(&s, "%s exited with status %d", cmd[0], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    if (max_growth > s.max_growth_kb)
+        fail(&s, "RSS grew by %ld KB (allowed %ld)", max_growth, s.max_growth_kb);
+
+    if (s.kbd) eis_device_unref(s.kbd);
+    if (s.seat) eis_seat_unref(s.seat);
+    if (s.client) eis_client_unref(s.client);
+    eis_unref(eis);
+    unlink(sock);
+    rmdir(dir);
+
+    printf("ei-soak: %s: %llu tokens, %llu key presses in %.1fs (%.0f presses/s), "
+           "RSS %ld KB, grew %ld KB, %u error%s\n",
+           s.errors ? "FAIL" : "PASS", (unsigned long long)n, (unsigned long long)s.presses,
+           secs, secs > 0 ? (double)s.presses / secs : 0.0, rss, max_growth,
+           s.errors, s.errors == 1 ? "" : "s");
+    return s.errors ? 1 : 0;
+}